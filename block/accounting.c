@@ -25,33 +25,88 @@
 #include "accounting.h"
 #include "block_int.h"
 #include "qemu/timer.h"
+#include "qemu/host-utils.h"
+
+/* Fold the time spent at the current depth into the running integral */
+static void block_acct_update_in_flight(BlockAcctStats *stats, int64_t now)
+{
+    if (!stats->first_access_time_ns) {
+        stats->first_access_time_ns = now;
+    } else {
+        stats->in_flight_integral +=
+            (double)stats->in_flight * (now - stats->in_flight_time_ns);
+    }
+    stats->in_flight_time_ns = now;
+}
+
+static void block_acct_finish(BlockAcctStats *stats, BlockAcctCookie *cookie,
+                              int64_t now)
+{
+    if (cookie->in_flight) {
+        block_acct_update_in_flight(stats, now);
+        stats->in_flight--;
+        cookie->in_flight = false;
+    }
+    stats->last_access_time_ns = now;
+}
 
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
 {
+    int64_t now = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+
     assert(type < BLOCK_MAX_IOTYPE);
 
     cookie->bytes = bytes;
-    cookie->start_time_ns = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+    cookie->start_time_ns = now;
     cookie->type = type;
+
+    /* A request restarted after a werror=stop is already counted */
+    if (!cookie->in_flight) {
+        block_acct_update_in_flight(stats, now);
+        stats->in_flight++;
+        stats->max_in_flight = MAX(stats->max_in_flight, stats->in_flight);
+        cookie->in_flight = true;
+    }
 }
 
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
 {
+    int64_t now = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t latency_ns = now - cookie->start_time_ns;
+    int bucket = 0;
+
     assert(cookie->type < BLOCK_MAX_IOTYPE);
 
     stats->nr_bytes[cookie->type] += cookie->bytes;
     stats->nr_ops[cookie->type]++;
-    stats->total_time_ns[cookie->type] +=
-        vmx_clock_get_ns(QEMU_CLOCK_REALTIME) - cookie->start_time_ns;
+    stats->total_time_ns[cookie->type] += latency_ns;
+
+    if (latency_ns >> BLOCK_ACCT_LATENCY_SHIFT) {
+        bucket = 64 - clz64(latency_ns >> BLOCK_ACCT_LATENCY_SHIFT);
+        bucket = MIN(bucket, BLOCK_ACCT_LATENCY_BUCKETS - 1);
+    }
+    stats->latency[cookie->type][bucket]++;
+
+    block_acct_finish(stats, cookie, now);
 }
 
+/* The request was issued but completed with an error */
 void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
 {
+    assert(cookie->type < BLOCK_MAX_IOTYPE);
+
+    stats->failed_ops[cookie->type]++;
+    block_acct_finish(stats, cookie, vmx_clock_get_ns(QEMU_CLOCK_REALTIME));
 }
 
+/* The request was rejected before being issued, e.g. out of range */
 void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type)
 {
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    stats->invalid_ops[type]++;
+    stats->last_access_time_ns = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
 }
 
 void block_acct_highest_sector(BlockAcctStats *stats, int64_t sector_num,
@@ -61,3 +116,35 @@ void block_acct_highest_sector(BlockAcctStats *stats, int64_t sector_num,
         stats->wr_highest_sector = sector_num + nb_sectors - 1;
     }
 }
+
+void block_acct_zero_detected(BlockAcctStats *stats, int64_t bytes)
+{
+    stats->zero_detected_ops++;
+    stats->zero_detected_bytes += bytes;
+}
+
+/* Average number of requests in flight since the first request */
+double block_acct_avg_in_flight(const BlockAcctStats *stats)
+{
+    int64_t now = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+    double integral;
+
+    if (!stats->first_access_time_ns || now <= stats->first_access_time_ns) {
+        return 0;
+    }
+
+    integral = stats->in_flight_integral +
+        (double)stats->in_flight * (now - stats->in_flight_time_ns);
+    return integral / (now - stats->first_access_time_ns);
+}
+
+/* Time since the last request completed or was rejected, or -1 if there
+ * was none yet
+ */
+int64_t block_acct_idle_time_ns(const BlockAcctStats *stats)
+{
+    if (!stats->last_access_time_ns) {
+        return -1;
+    }
+    return vmx_clock_get_ns(QEMU_CLOCK_REALTIME) - stats->last_access_time_ns;
+}
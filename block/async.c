@@ -27,6 +27,7 @@
 #include "thread-pool.h"
 #include "qemu/main-loop.h"
 #include "qemu/atomic.h"
+#include "qemu/error-report.h"
 
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
@@ -93,6 +94,12 @@ struct VeertuAioContext
     /* Thread pool for performing work and receiving completion callbacks */
     struct ThreadPool *thread_pool;
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* io_uring ring used by raw-posix, created on first use */
+    LuringState *linux_io_uring;
+    bool linux_io_uring_failed;
+#endif
+
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
 };
@@ -289,6 +296,9 @@ aio_ctx_finalize(GSource     *source)
     VeertuAioContext *ctx = (VeertuAioContext *) source;
 
     thread_pool_destroy(ctx->thread_pool);
+#ifdef CONFIG_LINUX_IO_URING
+    luring_cleanup(ctx->linux_io_uring);
+#endif
     aio_set_veertu_event_notifier(ctx, ctx->notifier, NULL);
     veertu_event_notifier_destroy(ctx->notifier);
     rfifolock_destroy(&ctx->lock);
@@ -313,11 +323,30 @@ GSource *aio_get_g_source(VeertuAioContext *ctx)
 ThreadPool *aio_get_thread_pool(VeertuAioContext *ctx)
 {
     if (!ctx->thread_pool) {
-        ctx->thread_pool = thread_pool_create(ctx, 10);
+        ctx->thread_pool = thread_pool_create(ctx, 0);
     }
     return ctx->thread_pool;
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+LuringState *aio_get_linux_io_uring(VeertuAioContext *ctx)
+{
+    Error *local_err = NULL;
+
+    if (!ctx->linux_io_uring && !ctx->linux_io_uring_failed) {
+        ctx->linux_io_uring = luring_init(ctx, &local_err);
+        if (!ctx->linux_io_uring) {
+            /* Don't retry on every request, stay on the thread pool */
+            error_report("%s, falling back to the thread pool",
+                         error_get_pretty(local_err));
+            error_free(local_err);
+            ctx->linux_io_uring_failed = true;
+        }
+    }
+    return ctx->linux_io_uring;
+}
+#endif
+
 void aio_set_dispatching(VeertuAioContext *ctx, bool dispatching)
 {
     ctx->dispatching = dispatching;
@@ -123,6 +123,118 @@ int is_windows_drive(const char *filename)
 }
 #endif
 
+/* throttling disk I/O limits */
+void bdrv_set_io_limits(BlockDriverState *bs,
+                        ThrottleConfig *cfg)
+{
+    int i;
+
+    throttle_config(&bs->throttle_state, cfg);
+
+    for (i = 0; i < 2; i++) {
+        vmx_co_enter_next(&bs->throttled_reqs[i]);
+    }
+}
+
+/* this function drains all the throttled IOs */
+static bool bdrv_start_throttled_reqs(BlockDriverState *bs)
+{
+    bool drained = false;
+    bool enabled = bs->io_limits_enabled;
+    int i;
+
+    bs->io_limits_enabled = false;
+
+    for (i = 0; i < 2; i++) {
+        while (vmx_co_enter_next(&bs->throttled_reqs[i])) {
+            drained = true;
+        }
+    }
+
+    bs->io_limits_enabled = enabled;
+
+    return drained;
+}
+
+void bdrv_io_limits_disable(BlockDriverState *bs)
+{
+    bs->io_limits_enabled = false;
+
+    bdrv_start_throttled_reqs(bs);
+
+    throttle_destroy(&bs->throttle_state);
+}
+
+static void bdrv_throttle_read_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    vmx_co_enter_next(&bs->throttled_reqs[0]);
+}
+
+static void bdrv_throttle_write_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    vmx_co_enter_next(&bs->throttled_reqs[1]);
+}
+
+/* should be called before bdrv_set_io_limits if a limit is set */
+void bdrv_io_limits_enable(BlockDriverState *bs)
+{
+    assert(!bs->io_limits_enabled);
+    throttle_init(&bs->throttle_state,
+                  bdrv_get_aio_context(bs),
+                  QEMU_CLOCK_VIRTUAL,
+                  bdrv_throttle_read_timer_cb,
+                  bdrv_throttle_write_timer_cb,
+                  bs);
+    bs->io_limits_enabled = true;
+}
+
+/* This function makes an IO wait if needed
+ *
+ * Requests wait in FIFO order on the per-direction CoQueue; the throttle
+ * timer wakes the head of the queue, which in turn wakes the next request
+ * once the buckets allow it.
+ *
+ * @bytes:    the number of bytes of the IO
+ * @is_write: is the IO a write
+ */
+static void coroutine_fn bdrv_io_limits_intercept(BlockDriverState *bs,
+                                                  unsigned int bytes,
+                                                  bool is_write)
+{
+    /* does this io have to wait */
+    bool must_wait = throttle_schedule_timer(&bs->throttle_state, is_write);
+
+    /* queue the IO if it must wait or requests of its type are queued */
+    if (must_wait ||
+        !vmx_co_queue_empty(&bs->throttled_reqs[is_write])) {
+        int64_t start = vmx_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+        bs->throttled_ops[is_write]++;
+        bs->throttled_depth[is_write]++;
+        bs->throttled_depth_max[is_write] =
+            MAX(bs->throttled_depth_max[is_write],
+                bs->throttled_depth[is_write]);
+
+        vmx_co_queue_wait(&bs->throttled_reqs[is_write]);
+
+        bs->throttled_depth[is_write]--;
+        bs->throttled_time_ns[is_write] +=
+            vmx_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    }
+
+    /* the IO will be executed, do the accounting */
+    throttle_account(&bs->throttle_state, is_write, bytes);
+
+    /* if the next request must wait -> do nothing */
+    if (throttle_schedule_timer(&bs->throttle_state, is_write)) {
+        return;
+    }
+
+    /* else queue next request for execution */
+    vmx_co_queue_next(&bs->throttled_reqs[is_write]);
+}
 
 size_t bdrv_opt_mem_align(BlockDriverState *bs)
 {
@@ -277,7 +389,8 @@ BlockDriverState *bdrv_new(void)
     veertu_notifiers_init(&bs->close_notifiers);
 
     veertu_notifiers_init(&bs->before_write_notifiers);
-
+    vmx_co_queue_init(&bs->throttled_reqs[0]);
+    vmx_co_queue_init(&bs->throttled_reqs[1]);
     bs->refcnt = 1;
     bs->aio_context = vmx_get_aio_context();
 
@@ -1761,7 +1874,10 @@ void bdrv_close(BlockDriverState *bs)
         blk_dev_change_media_cb(bs->blk, false);
     }
 
-
+    /*throttling disk I/O limits*/
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_disable(bs);
+    }
 
     QLIST_FOREACH_SAFE(ban, &bs->aio_notifiers, list, ban_next) {
         g_free(ban);
@@ -1788,7 +1904,12 @@ static bool bdrv_requests_pending(BlockDriverState *bs)
     if (!QLIST_EMPTY(&bs->tracked_requests)) {
         return true;
     }
-
+    if (!vmx_co_queue_empty(&bs->throttled_reqs[0])) {
+        return true;
+    }
+    if (!vmx_co_queue_empty(&bs->throttled_reqs[1])) {
+        return true;
+    }
     if (bs->file && bdrv_requests_pending(bs->file)) {
         return true;
     }
@@ -1803,6 +1924,7 @@ static bool bdrv_drain_one(BlockDriverState *bs)
     bool bs_busy;
 
     bdrv_flush_io_queue(bs);
+    bdrv_start_throttled_reqs(bs);
     bs_busy = bdrv_requests_pending(bs);
     bs_busy |= aio_poll(bdrv_get_aio_context(bs), bs_busy);
     return bs_busy;
@@ -1898,7 +2020,19 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
-
+    /* i/o throttled req */
+    memcpy(&bs_dest->throttle_state,
+           &bs_src->throttle_state,
+           sizeof(ThrottleState));
+    bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
+    memcpy(bs_dest->throttled_depth, bs_src->throttled_depth,
+           sizeof(bs_dest->throttled_depth));
+    memcpy(bs_dest->throttled_depth_max, bs_src->throttled_depth_max,
+           sizeof(bs_dest->throttled_depth_max));
+    memcpy(bs_dest->throttled_ops, bs_src->throttled_ops,
+           sizeof(bs_dest->throttled_ops));
+    memcpy(bs_dest->throttled_time_ns, bs_src->throttled_time_ns,
+           sizeof(bs_dest->throttled_time_ns));
 
     /* r/w error */
     bs_dest->on_read_error      = bs_src->on_read_error;
@@ -1940,6 +2074,7 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
 {
     BlockDriverState tmp;
+    int i;
 
     /* The code needs to swap the node_name but simply swapping node_list won't
      * work so first remove the nodes from the graph list, do the swap then
@@ -1956,6 +2091,16 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(!bs_new->blk);
     assert(QLIST_EMPTY(&bs_new->dirty_bitmaps));
     assert(bs_new->job == NULL);
+    assert(bs_new->io_limits_enabled == false);
+    assert(!throttle_have_timer(&bs_new->throttle_state));
+
+    /* The throttled request queues cannot be copied by value; callers
+     * drain before swapping, so they are empty and simply reinitialized.
+     */
+    for (i = 0; i < 2; i++) {
+        assert(vmx_co_queue_empty(&bs_old->throttled_reqs[i]));
+        assert(vmx_co_queue_empty(&bs_new->throttled_reqs[i]));
+    }
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -1971,6 +2116,13 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
 
     /* Check a few fields that should remain attached to the device */
     assert(bs_new->job == NULL);
+    assert(bs_new->io_limits_enabled == false);
+    assert(!throttle_have_timer(&bs_new->throttle_state));
+
+    for (i = 0; i < 2; i++) {
+        vmx_co_queue_init(&bs_old->throttled_reqs[i]);
+        vmx_co_queue_init(&bs_new->throttled_reqs[i]);
+    }
 
     /* insert the nodes back into the graph node list if needed */
     if (bs_new->node_name[0] != '\0') {
@@ -2939,6 +3091,10 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
         flags |= BDRV_REQ_COPY_ON_READ;
     }
 
+    /* throttling disk I/O */
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_intercept(bs, bytes, false);
+    }
 
     /* Align read if necessary by padding qiov */
     if (offset & (align - 1)) {
@@ -3120,6 +3276,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
         if (bs->detect_zeroes == BLOCKDEV_DETECT_ZEROES_OPTIONS_UNMAP) {
             flags |= BDRV_REQ_MAY_UNMAP;
         }
+        block_acct_zero_detected(&bs->stats, bytes);
     }
 
     if (ret < 0) {
@@ -3174,7 +3331,10 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
         return -EIO;
     }
 
-
+    /* throttling disk I/O */
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_intercept(bs, bytes, true);
+    }
 
     /*
      * Align write if necessary by performing a read-modify-write cycle.
@@ -5583,7 +5743,9 @@ void bdrv_detach_aio_context(BlockDriverState *bs)
         baf->detach_aio_context(baf->opaque);
     }
 
-
+    if (bs->io_limits_enabled) {
+        throttle_detach_aio_context(&bs->throttle_state);
+    }
     if (bs->drv->bdrv_detach_aio_context) {
         bs->drv->bdrv_detach_aio_context(bs);
     }
@@ -5618,6 +5780,10 @@ void bdrv_attach_aio_context(BlockDriverState *bs,
         bs->drv->bdrv_attach_aio_context(bs, new_context);
     }
 
+    if (bs->io_limits_enabled) {
+        throttle_attach_aio_context(&bs->throttle_state, new_context);
+    }
+
     QLIST_FOREACH(ban, &bs->aio_notifiers, list) {
         ban->attached_aio_context(new_context, ban->opaque);
     }
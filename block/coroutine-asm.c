@@ -0,0 +1,192 @@
+/*
+ * x86-64 assembly coroutine backend
+ *
+ * Switching coroutines only has to save the callee-saved registers, the
+ * x87 control word and MXCSR on the current stack and swap stack pointers,
+ * so the switch is a handful of instructions and never enters the kernel.
+ * New coroutines get a hand-built initial frame instead of being
+ * bootstrapped through a signal handler as in coroutine-sigaltstack.c.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "qemu-common.h"
+#include "coroutine_int.h"
+
+#ifdef CONFIG_COROUTINE_ASM
+
+#ifndef __x86_64__
+#error "the asm coroutine backend is only implemented for x86-64"
+#endif
+
+#ifdef __APPLE__
+#define ASM_SYMBOL(name) "_" #name
+#else
+#define ASM_SYMBOL(name) #name
+#endif
+
+#define COROUTINE_STACK_SIZE (1 << 20)
+
+/* Default x87 control word and MXCSR for a fresh coroutine */
+#define COROUTINE_INITIAL_FPUCW 0x037f
+#define COROUTINE_INITIAL_MXCSR 0x1f80
+
+typedef struct {
+    Coroutine base;
+    void *sp;           /* saved stack pointer while switched out */
+    void *stack;
+} CoroutineAsm;
+
+/*
+ * Saved frame, from the lowest address up, as left by coroutine_asm_swap:
+ *   mxcsr (4 bytes), x87 control word (4 bytes),
+ *   r15, r14, r13, r12, rbx, rbp, return address
+ */
+typedef struct {
+    uint32_t mxcsr;
+    uint32_t fpucw;
+    uint64_t r15;
+    uint64_t r14;
+    uint64_t r13;
+    uint64_t r12;
+    uint64_t rbx;
+    uint64_t rbp;
+    uint64_t rip;
+} CoroutineAsmFrame;
+
+/*
+ * CoroutineAction coroutine_asm_swap(void **from_sp, void *to_sp,
+ *                                    CoroutineAction action);
+ *
+ * Saves the current context on its stack, stores the stack pointer into
+ * *from_sp and resumes the context saved at to_sp.  The resumed side sees
+ * "action" as the return value of its own coroutine_asm_swap call.
+ */
+CoroutineAction coroutine_asm_swap(void **from_sp, void *to_sp,
+                                   CoroutineAction action);
+
+/*
+ * First code run on a new stack: r12 holds the Coroutine and r13 the C
+ * entry point.  The stack is 16-byte aligned here, as the ABI wants at
+ * a call instruction.
+ */
+void coroutine_asm_trampoline(void);
+
+asm(".text\n"
+    ".globl " ASM_SYMBOL(coroutine_asm_swap) "\n"
+    ".p2align 4\n"
+    ASM_SYMBOL(coroutine_asm_swap) ":\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    movl %edx, %eax\n"
+    "    ret\n"
+    "\n"
+    ".globl " ASM_SYMBOL(coroutine_asm_trampoline) "\n"
+    ".p2align 4\n"
+    ASM_SYMBOL(coroutine_asm_trampoline) ":\n"
+    "    movq %r12, %rdi\n"
+    "    callq *%r13\n"
+    "    ud2\n");
+
+/** Currently executing coroutine */
+static __thread Coroutine *current;
+
+/** The default coroutine */
+static __thread CoroutineAsm leader;
+
+static void __attribute__((noreturn)) coroutine_asm_entry(Coroutine *co)
+{
+    while (true) {
+        co->entry(co->entry_arg);
+        vmx_coroutine_switch(co, co->caller, COROUTINE_TERMINATE);
+    }
+}
+
+Coroutine *vmx_coroutine_new(void)
+{
+    CoroutineAsm *co;
+    CoroutineAsmFrame *frame;
+    uintptr_t top;
+
+    co = g_malloc0(sizeof(*co));
+    co->stack = g_malloc(COROUTINE_STACK_SIZE);
+
+    /* coroutine_asm_swap returns into the trampoline with the stack
+     * pointer just above the frame, which must be 16-byte aligned.
+     */
+    top = ((uintptr_t)co->stack + COROUTINE_STACK_SIZE) & ~(uintptr_t)15;
+    frame = (CoroutineAsmFrame *)top - 1;
+    memset(frame, 0, sizeof(*frame));
+    frame->mxcsr = COROUTINE_INITIAL_MXCSR;
+    frame->fpucw = COROUTINE_INITIAL_FPUCW;
+    frame->r12 = (uintptr_t)&co->base;
+    frame->r13 = (uintptr_t)coroutine_asm_entry;
+    frame->rip = (uintptr_t)coroutine_asm_trampoline;
+    co->sp = frame;
+
+    return &co->base;
+}
+
+void vmx_coroutine_delete(Coroutine *co_)
+{
+    CoroutineAsm *co = DO_UPCAST(CoroutineAsm, base, co_);
+
+    g_free(co->stack);
+    g_free(co);
+}
+
+CoroutineAction vmx_coroutine_switch(Coroutine *from_, Coroutine *to_,
+                                      CoroutineAction action)
+{
+    CoroutineAsm *from = DO_UPCAST(CoroutineAsm, base, from_);
+    CoroutineAsm *to = DO_UPCAST(CoroutineAsm, base, to_);
+
+    current = to_;
+    return coroutine_asm_swap(&from->sp, to->sp, action);
+}
+
+Coroutine *vmx_coroutine_self(void)
+{
+    if (!current) {
+        current = &leader.base;
+    }
+    return current;
+}
+
+bool vmx_in_coroutine(void)
+{
+    return current && current->caller;
+}
+
+#endif /* CONFIG_COROUTINE_ASM */
@@ -144,7 +144,9 @@ void vmx_co_rwlock_init(CoRwlock *lock)
 
 void vmx_co_rwlock_rdlock(CoRwlock *lock)
 {
-    while (lock->writer) {
+    /* Queued writers go first, so that a steady stream of readers cannot
+     * starve them */
+    while (lock->writer || lock->pending_writer) {
         vmx_co_queue_wait(&lock->queue);
     }
     lock->reader++;
@@ -159,17 +161,20 @@ void vmx_co_rwlock_unlock(CoRwlock *lock)
     } else {
         lock->reader--;
         assert(lock->reader >= 0);
-        /* Wakeup only one waiting writer */
+        /* Readers may be queued behind a pending writer, so wake up
+         * everybody and let the writer win */
         if (!lock->reader) {
-            vmx_co_queue_next(&lock->queue);
+            vmx_co_queue_restart_all(&lock->queue);
         }
     }
 }
 
 void vmx_co_rwlock_wrlock(CoRwlock *lock)
 {
+    lock->pending_writer++;
     while (lock->writer || lock->reader) {
         vmx_co_queue_wait(&lock->queue);
     }
+    lock->pending_writer--;
     lock->writer = true;
 }
@@ -33,6 +33,9 @@
 #include "qemu-common.h"
 #include "coroutine_int.h"
 
+/* Fallback for hosts without the assembly backend (coroutine-asm.c) */
+#ifndef CONFIG_COROUTINE_ASM
+
 typedef struct {
     Coroutine base;
     void *stack;
@@ -291,3 +294,4 @@ bool vmx_in_coroutine(void)
     return s && s->current->caller;
 }
 
+#endif /* !CONFIG_COROUTINE_ASM */
@@ -25,7 +25,9 @@
 #include "block_int.h"
 #include "qemu/bswap.h"
 #include "qemu/module.h"
+#include "thread-pool.h"
 #include <zlib.h>
+#include <bzlib.h>
 
 enum {
     /* Limit chunk sizes to prevent unreasonable amounts of memory being used
@@ -33,10 +35,26 @@ enum {
      */
     DMG_LENGTHS_MAX = 64 * 1024 * 1024, /* 64 MB */
     DMG_SECTORCOUNTS_MAX = DMG_LENGTHS_MAX / 512,
+
+    /* Memory used for decompressed chunks, and the limits on the number of
+     * cached chunks that follow from it */
+    DMG_CHUNK_CACHE_BYTES = 32 * 1024 * 1024, /* 32 MB */
+    DMG_CHUNK_CACHE_MIN = 2,
+    DMG_CHUNK_CACHE_MAX = 64,
+
+    /* Number of chunks decompressed ahead of a sequential reader */
+    DMG_READAHEAD_CHUNKS = 2,
 };
 
+typedef struct DMGCachedChunk {
+    uint32_t chunk;         /* s->n_chunks if the entry is unused */
+    uint8_t *data;
+    uint64_t lru_counter;
+    bool loading;
+    bool prefetched;        /* loaded by readahead, not read yet */
+} DMGCachedChunk;
+
 typedef struct BDRVDMGState {
-    CoMutex lock;
     /* each chunk contains a certain number of sectors,
      * offsets[i] is the offset in the .dmg file,
      * lengths[i] is the length of the compressed chunk,
@@ -51,12 +69,30 @@ typedef struct BDRVDMGState {
     uint64_t* lengths;
     uint64_t* sectors;
     uint64_t* sectorcounts;
-    uint32_t current_chunk;
-    uint8_t *compressed_chunk;
-    uint8_t *uncompressed_chunk;
-    z_stream zstream;
+
+    /* LRU of decompressed chunks. Entries are filled by the thread pool, so
+     * several chunks can be inflated at the same time. */
+    DMGCachedChunk *cache;
+    int cache_size;
+    uint64_t lru_counter;
+    int readahead_in_flight;
+    /* Requests waiting for a chunk that is being loaded or a free entry */
+    CoQueue cache_queue;
 } BDRVDMGState;
 
+typedef struct DMGDecompressData {
+    uint32_t type;
+    uint8_t *in;
+    size_t in_size;
+    uint8_t *out;
+    size_t out_size;
+} DMGDecompressData;
+
+typedef struct DMGReadaheadCo {
+    BlockDriverState *bs;
+    int index;
+} DMGReadaheadCo;
+
 static int dmg_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
     int len;
@@ -112,6 +148,7 @@ static void update_max_chunk_size(BDRVDMGState *s, uint32_t chunk,
 
     switch (s->types[chunk]) {
     case 0x80000005: /* zlib compressed */
+    case 0x80000006: /* bzip2 compressed */
         compressed_size = s->lengths[chunk];
         uncompressed_sectors = s->sectorcounts[chunk];
         break;
@@ -220,8 +257,8 @@ static int dmg_open(BlockDriverState *bs, QDict *options, int flags,
                     goto fail;
                 }
                 offset += 4;
-                if (s->types[i] != 0x80000005 && s->types[i] != 1 &&
-                    s->types[i] != 2) {
+                if (s->types[i] != 0x80000005 && s->types[i] != 0x80000006 &&
+                    s->types[i] != 1 && s->types[i] != 2) {
                     if (s->types[i] == 0xffffffff && i > 0) {
                         last_in_offset = s->offsets[i - 1] + s->lengths[i - 1];
                         last_out_offset = s->sectors[i - 1] +
@@ -283,24 +320,28 @@ static int dmg_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
-    /* initialize zlib engine */
-    s->compressed_chunk = vmx_try_blockalign(bs->file,
-                                              max_compressed_size + 1);
-    s->uncompressed_chunk = vmx_try_blockalign(bs->file,
-                                                512 * max_sectors_per_chunk);
-    if (s->compressed_chunk == NULL || s->uncompressed_chunk == NULL) {
-        ret = -ENOMEM;
-        goto fail;
+    /* the image ends with the last chunk, the sectors array is ordered */
+    if (s->n_chunks) {
+        bs->total_sectors = s->sectors[s->n_chunks - 1] +
+                            s->sectorcounts[s->n_chunks - 1];
     }
 
-    if (inflateInit(&s->zstream) != Z_OK) {
-        ret = -EINVAL;
-        goto fail;
+    /* set up the chunk cache */
+    s->cache_size = DMG_CHUNK_CACHE_BYTES / (512 * max_sectors_per_chunk);
+    s->cache_size = MAX(s->cache_size, DMG_CHUNK_CACHE_MIN);
+    s->cache_size = MIN(s->cache_size, DMG_CHUNK_CACHE_MAX);
+    s->cache = g_new0(DMGCachedChunk, s->cache_size);
+    for (i = 0; i < s->cache_size; i++) {
+        s->cache[i].chunk = s->n_chunks;
+        s->cache[i].data = vmx_try_blockalign(bs->file,
+                                              512 * max_sectors_per_chunk);
+        if (s->cache[i].data == NULL) {
+            ret = -ENOMEM;
+            goto fail;
+        }
     }
+    vmx_co_queue_init(&s->cache_queue);
 
-    s->current_chunk = s->n_chunks;
-
-    vmx_co_mutex_init(&s->lock);
     return 0;
 
 fail:
@@ -309,20 +350,13 @@ fail:
     g_free(s->lengths);
     g_free(s->sectors);
     g_free(s->sectorcounts);
-    vmx_vfree(s->compressed_chunk);
-    vmx_vfree(s->uncompressed_chunk);
-    return ret;
-}
-
-static inline int is_sector_in_chunk(BDRVDMGState* s,
-                uint32_t chunk_num, uint64_t sector_num)
-{
-    if (chunk_num >= s->n_chunks || s->sectors[chunk_num] > sector_num ||
-            s->sectors[chunk_num] + s->sectorcounts[chunk_num] <= sector_num) {
-        return 0;
-    } else {
-        return -1;
+    if (s->cache) {
+        for (i = 0; i < s->cache_size; i++) {
+            vmx_vfree(s->cache[i].data);
+        }
+        g_free(s->cache);
     }
+    return ret;
 }
 
 static inline uint32_t search_chunk(BDRVDMGState *s, uint64_t sector_num)
@@ -342,101 +376,285 @@ static inline uint32_t search_chunk(BDRVDMGState *s, uint64_t sector_num)
     return s->n_chunks; /* error */
 }
 
-static inline int dmg_read_chunk(BlockDriverState *bs, uint64_t sector_num)
+static int dmg_decompress_worker(void *opaque)
 {
-    BDRVDMGState *s = bs->opaque;
+    DMGDecompressData *d = opaque;
 
-    if (!is_sector_in_chunk(s, s->current_chunk, sector_num)) {
+    if (d->type == 0x80000005) {
+        z_stream zstream;
         int ret;
-        uint32_t chunk = search_chunk(s, sector_num);
 
-        if (chunk >= s->n_chunks) {
-            return -1;
+        memset(&zstream, 0, sizeof(zstream));
+        if (inflateInit(&zstream) != Z_OK) {
+            return -EIO;
         }
+        zstream.next_in = d->in;
+        zstream.avail_in = d->in_size;
+        zstream.next_out = d->out;
+        zstream.avail_out = d->out_size;
+        ret = inflate(&zstream, Z_FINISH);
+        inflateEnd(&zstream);
+        if (ret != Z_STREAM_END || zstream.total_out != d->out_size) {
+            return -EIO;
+        }
+    } else {
+        bz_stream bzstream;
+        int ret;
 
-        s->current_chunk = s->n_chunks;
-        switch (s->types[chunk]) {
-        case 0x80000005: { /* zlib compressed */
-            /* we need to buffer, because only the chunk as whole can be
-             * inflated. */
-            ret = bdrv_pread(bs->file, s->offsets[chunk],
-                             s->compressed_chunk, s->lengths[chunk]);
-            if (ret != s->lengths[chunk]) {
-                return -1;
-            }
+        memset(&bzstream, 0, sizeof(bzstream));
+        if (BZ2_bzDecompressInit(&bzstream, 0, 0) != BZ_OK) {
+            return -EIO;
+        }
+        bzstream.next_in = (char *)d->in;
+        bzstream.avail_in = d->in_size;
+        bzstream.next_out = (char *)d->out;
+        bzstream.avail_out = d->out_size;
+        ret = BZ2_bzDecompress(&bzstream);
+        BZ2_bzDecompressEnd(&bzstream);
+        if (ret != BZ_STREAM_END ||
+            bzstream.total_out_lo32 != d->out_size) {
+            return -EIO;
+        }
+    }
+    return 0;
+}
 
-            s->zstream.next_in = s->compressed_chunk;
-            s->zstream.avail_in = s->lengths[chunk];
-            s->zstream.next_out = s->uncompressed_chunk;
-            s->zstream.avail_out = 512 * s->sectorcounts[chunk];
-            ret = inflateReset(&s->zstream);
-            if (ret != Z_OK) {
-                return -1;
-            }
-            ret = inflate(&s->zstream, Z_FINISH);
-            if (ret != Z_STREAM_END ||
-                s->zstream.total_out != 512 * s->sectorcounts[chunk]) {
-                return -1;
-            }
-            break; }
-        case 1: /* copy */
-            ret = bdrv_pread(bs->file, s->offsets[chunk],
-                             s->uncompressed_chunk, s->lengths[chunk]);
-            if (ret != s->lengths[chunk]) {
-                return -1;
-            }
+/* Fills cache entry i, which the caller has marked as loading */
+static int coroutine_fn dmg_load_chunk(BlockDriverState *bs, int i)
+{
+    BDRVDMGState *s = bs->opaque;
+    DMGCachedChunk *e = &s->cache[i];
+    uint32_t chunk = e->chunk;
+    DMGDecompressData d;
+    uint8_t *buf;
+    int ret = 0;
+
+    assert(e->loading);
+
+    switch (s->types[chunk]) {
+    case 0x80000005: /* zlib compressed */
+    case 0x80000006: /* bzip2 compressed */
+        /* we need to buffer, because only the chunk as whole can be
+         * inflated. */
+        buf = g_try_malloc(s->lengths[chunk]);
+        if (buf == NULL) {
+            ret = -ENOMEM;
             break;
-        case 2: /* zero */
-            memset(s->uncompressed_chunk, 0, 512 * s->sectorcounts[chunk]);
+        }
+        ret = bdrv_pread(bs->file, s->offsets[chunk], buf, s->lengths[chunk]);
+        if (ret == s->lengths[chunk]) {
+            d = (DMGDecompressData) {
+                .type       = s->types[chunk],
+                .in         = buf,
+                .in_size    = s->lengths[chunk],
+                .out        = e->data,
+                .out_size   = 512 * s->sectorcounts[chunk],
+            };
+            ret = thread_pool_submit_co(
+                    aio_get_thread_pool(bdrv_get_aio_context(bs)),
+                    dmg_decompress_worker, &d);
+        } else if (ret >= 0) {
+            ret = -EIO;
+        }
+        g_free(buf);
+        break;
+    case 1: /* copy */
+        ret = bdrv_pread(bs->file, s->offsets[chunk],
+                         e->data, s->lengths[chunk]);
+        if (ret >= 0 && ret != s->lengths[chunk]) {
+            ret = -EIO;
+        }
+        break;
+    case 2: /* zero */
+        memset(e->data, 0, 512 * s->sectorcounts[chunk]);
+        break;
+    }
+
+    e->loading = false;
+    if (ret < 0) {
+        e->chunk = s->n_chunks;
+    } else {
+        e->lru_counter = ++s->lru_counter;
+    }
+    vmx_co_queue_restart_all(&s->cache_queue);
+
+    return ret < 0 ? ret : 0;
+}
+
+static int dmg_cache_lookup(BDRVDMGState *s, uint32_t chunk)
+{
+    int i;
+
+    for (i = 0; i < s->cache_size; i++) {
+        if (s->cache[i].chunk == chunk) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Returns the least recently used entry that isn't being loaded, or -1 */
+static int dmg_cache_find_victim(BDRVDMGState *s)
+{
+    uint64_t min_lru_counter = UINT64_MAX;
+    int min_lru_index = -1;
+    int i;
+
+    for (i = 0; i < s->cache_size; i++) {
+        if (s->cache[i].loading) {
+            continue;
+        }
+        if (s->cache[i].chunk == s->n_chunks) {
+            return i;
+        }
+        if (s->cache[i].lru_counter < min_lru_counter) {
+            min_lru_counter = s->cache[i].lru_counter;
+            min_lru_index = i;
+        }
+    }
+    return min_lru_index;
+}
+
+static void coroutine_fn dmg_readahead_entry(void *opaque)
+{
+    DMGReadaheadCo *rco = opaque;
+    BDRVDMGState *s = rco->bs->opaque;
+
+    /* Errors are reported when the guest reads the chunk */
+    dmg_load_chunk(rco->bs, rco->index);
+    s->readahead_in_flight--;
+    g_free(rco);
+}
+
+/* Starts loading the chunks that follow chunk in the background */
+static void dmg_readahead(BlockDriverState *bs, uint32_t chunk)
+{
+    BDRVDMGState *s = bs->opaque;
+    uint32_t next;
+
+    for (next = chunk + 1;
+         next < s->n_chunks && next <= chunk + DMG_READAHEAD_CHUNKS;
+         next++)
+    {
+        DMGReadaheadCo *rco;
+        Coroutine *co;
+        int i;
+
+        if (s->types[next] == 2 || dmg_cache_lookup(s, next) >= 0) {
+            continue;
+        }
+        i = dmg_cache_find_victim(s);
+        if (i < 0) {
             break;
         }
-        s->current_chunk = chunk;
+
+        s->cache[i].chunk = next;
+        s->cache[i].loading = true;
+        s->cache[i].prefetched = true;
+        s->readahead_in_flight++;
+
+        rco = g_new(DMGReadaheadCo, 1);
+        rco->bs = bs;
+        rco->index = i;
+        co = vmx_coroutine_create(dmg_readahead_entry);
+        vmx_coroutine_enter(co, rco);
     }
-    return 0;
 }
 
-static int dmg_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/*
+ * Returns the cache entry holding the given chunk, loading it if necessary.
+ * *first_use is set if this is the first read of the chunk, which is when
+ * readahead for the next chunks should start.
+ */
+static int coroutine_fn dmg_get_chunk(BlockDriverState *bs, uint32_t chunk,
+                                      bool *first_use)
 {
     BDRVDMGState *s = bs->opaque;
-    int i;
+    int i, ret;
+
+again:
+    i = dmg_cache_lookup(s, chunk);
+    if (i >= 0 && s->cache[i].loading) {
+        vmx_co_queue_wait(&s->cache_queue);
+        goto again;
+    } else if (i >= 0) {
+        *first_use = s->cache[i].prefetched;
+    } else {
+        i = dmg_cache_find_victim(s);
+        if (i < 0) {
+            vmx_co_queue_wait(&s->cache_queue);
+            goto again;
+        }
 
-    for (i = 0; i < nb_sectors; i++) {
-        uint32_t sector_offset_in_chunk;
-        if (dmg_read_chunk(bs, sector_num + i) != 0) {
-            return -1;
+        s->cache[i].chunk = chunk;
+        s->cache[i].loading = true;
+        ret = dmg_load_chunk(bs, i);
+        if (ret < 0) {
+            return ret;
         }
-        sector_offset_in_chunk = sector_num + i - s->sectors[s->current_chunk];
-        memcpy(buf + i * 512,
-               s->uncompressed_chunk + sector_offset_in_chunk * 512, 512);
+        *first_use = true;
     }
-    return 0;
+
+    s->cache[i].prefetched = false;
+    s->cache[i].lru_counter = ++s->lru_counter;
+    return i;
 }
 
 static coroutine_fn int dmg_co_read(BlockDriverState *bs, int64_t sector_num,
                                     uint8_t *buf, int nb_sectors)
 {
-    int ret;
     BDRVDMGState *s = bs->opaque;
-    vmx_co_mutex_lock(&s->lock);
-    ret = dmg_read(bs, sector_num, buf, nb_sectors);
-    vmx_co_mutex_unlock(&s->lock);
-    return ret;
+
+    while (nb_sectors > 0) {
+        uint32_t chunk = search_chunk(s, sector_num);
+        uint64_t sector_offset_in_chunk;
+        bool first_use;
+        int i, n;
+
+        if (chunk >= s->n_chunks) {
+            return -1;
+        }
+
+        i = dmg_get_chunk(bs, chunk, &first_use);
+        if (i < 0) {
+            return -1;
+        }
+
+        sector_offset_in_chunk = sector_num - s->sectors[chunk];
+        n = MIN(nb_sectors, s->sectorcounts[chunk] - sector_offset_in_chunk);
+        memcpy(buf, s->cache[i].data + sector_offset_in_chunk * 512, n * 512);
+
+        if (first_use) {
+            dmg_readahead(bs, chunk);
+        }
+
+        sector_num += n;
+        buf += n * 512;
+        nb_sectors -= n;
+    }
+    return 0;
 }
 
 static void dmg_close(BlockDriverState *bs)
 {
     BDRVDMGState *s = bs->opaque;
+    int i;
+
+    /* Readahead coroutines may still be running */
+    while (s->readahead_in_flight) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
 
     g_free(s->types);
     g_free(s->offsets);
     g_free(s->lengths);
     g_free(s->sectors);
     g_free(s->sectorcounts);
-    vmx_vfree(s->compressed_chunk);
-    vmx_vfree(s->uncompressed_chunk);
 
-    inflateEnd(&s->zstream);
+    for (i = 0; i < s->cache_size; i++) {
+        vmx_vfree(s->cache[i].data);
+    }
+    g_free(s->cache);
 }
 
 static BlockDriver bdrv_dmg = {
@@ -0,0 +1,351 @@
+/*
+ * Linux io_uring support for raw-posix
+ *
+ * One ring is kept per VeertuAioContext.  Requests are queued as SQEs and
+ * submitted right away, or when the outermost bdrv_io_unplug() runs while
+ * the queue is plugged.  Completions are reaped from the event loop through
+ * the ring fd.
+ *
+ * The rings are set up and driven with the raw system calls from
+ * <linux/io_uring.h>, so no liburing is needed.  config-host.h describes
+ * the Darwin build and leaves it off; tests/block/CMakeLists.txt shows how
+ * a Linux build enables it: define CONFIG_LINUX_IO_URING when the header
+ * is present and compile this file.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "qemu/iov.h"
+#include "qemu/veertu-aio.h"
+#include "aio.h"
+
+#ifdef CONFIG_LINUX_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define MAX_ENTRIES 128
+
+typedef struct LuringAIOCB {
+    BlockAIOCB common;
+    LuringState *s;
+    QEMUIOVector *qiov;
+    int fd;
+    int type;
+    uint64_t offset;
+    size_t nbytes;
+} LuringAIOCB;
+
+struct LuringState {
+    int ring_fd;
+    VeertuAioContext *ctx;
+
+    /* Submission ring, shared with the kernel */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    /* Next SQE to fill; *sq_tail lags behind it by in_queue entries */
+    unsigned sqe_tail;
+
+    /* Completion ring, shared with the kernel */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    unsigned cq_entries;
+    struct io_uring_cqe *cqes;
+
+    /* SQEs prepared but not yet passed to io_uring_enter() */
+    unsigned int in_queue;
+    unsigned int in_flight;
+    int plugged;
+};
+
+/* The kernel updates the other end of each ring concurrently */
+static inline unsigned luring_load_acquire(unsigned *p)
+{
+    unsigned val = atomic_read(p);
+
+    smp_rmb();
+    return val;
+}
+
+static inline void luring_store_release(unsigned *p, unsigned val)
+{
+    smp_wmb();
+    *(volatile unsigned *)p = val;
+}
+
+static VeertuAioContext *luring_get_aio_context(BlockAIOCB *acb)
+{
+    LuringAIOCB *laiocb = (LuringAIOCB *)acb;
+    return laiocb->s->ctx;
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+    .get_aio_context    = luring_get_aio_context,
+};
+
+static struct io_uring_sqe *luring_get_sqe(LuringState *s)
+{
+    struct io_uring_sqe *sqe;
+
+    /* Completions beyond the CQ size would go to the kernel's overflow
+     * list, which polling the ring fd does not report.
+     */
+    if (s->in_queue + s->in_flight >= s->cq_entries ||
+        s->sqe_tail - luring_load_acquire(s->sq_head) >= s->sq_entries) {
+        return NULL;
+    }
+    sqe = &s->sqes[s->sqe_tail & s->sq_mask];
+    s->sq_array[s->sqe_tail & s->sq_mask] = s->sqe_tail & s->sq_mask;
+    s->sqe_tail++;
+    return sqe;
+}
+
+static void luring_prep_sqe(struct io_uring_sqe *sqe, LuringAIOCB *laiocb)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    if ((laiocb->type & QEMU_AIO_TYPE_MASK) == QEMU_AIO_WRITE) {
+        sqe->opcode = IORING_OP_WRITEV;
+    } else {
+        sqe->opcode = IORING_OP_READV;
+    }
+    sqe->fd = laiocb->fd;
+    sqe->off = laiocb->offset;
+    sqe->addr = (uintptr_t)laiocb->qiov->iov;
+    sqe->len = laiocb->qiov->niov;
+    sqe->user_data = (uintptr_t)laiocb;
+}
+
+static int luring_flush_queue(LuringState *s)
+{
+    int ret;
+
+    if (!s->in_queue) {
+        return 0;
+    }
+    luring_store_release(s->sq_tail, s->sqe_tail);
+    do {
+        ret = syscall(__NR_io_uring_enter, s->ring_fd, s->in_queue, 0, 0,
+                      NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        /* EAGAIN/EBUSY: the entries stay in the SQ for the next flush */
+        return -errno;
+    }
+    s->in_queue -= ret;
+    s->in_flight += ret;
+    return ret;
+}
+
+/* Queue an SQE, submitting what is pending to make room if needed.  */
+static bool luring_queue(LuringState *s, LuringAIOCB *laiocb)
+{
+    struct io_uring_sqe *sqe = luring_get_sqe(s);
+
+    if (!sqe) {
+        luring_flush_queue(s);
+        sqe = luring_get_sqe(s);
+        if (!sqe) {
+            return false;
+        }
+    }
+    luring_prep_sqe(sqe, laiocb);
+    s->in_queue++;
+    if (!s->plugged) {
+        luring_flush_queue(s);
+    }
+    return true;
+}
+
+static int luring_result(LuringAIOCB *laiocb, int res)
+{
+    if (res < 0) {
+        return res;
+    }
+    if (res == laiocb->nbytes) {
+        return 0;
+    }
+    /* Same semantics as aio_worker: short reads past the end of a
+     * growable image read as zeroes, anything else is an error.
+     */
+    if ((laiocb->type & QEMU_AIO_TYPE_MASK) == QEMU_AIO_READ &&
+        laiocb->common.bs->growable) {
+        vmx_iovec_memset(laiocb->qiov, res, 0, laiocb->nbytes - res);
+        return 0;
+    }
+    return -EINVAL;
+}
+
+static void luring_completion_cb(void *opaque)
+{
+    LuringState *s = opaque;
+    unsigned head = *s->cq_head;
+
+    while (head != luring_load_acquire(s->cq_tail)) {
+        struct io_uring_cqe *cqe = &s->cqes[head & s->cq_mask];
+        LuringAIOCB *laiocb = (LuringAIOCB *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+
+        /* Hand the slot back before the callback can submit more */
+        luring_store_release(s->cq_head, ++head);
+        s->in_flight--;
+
+        if (res == -EAGAIN || res == -EINTR) {
+            if (luring_queue(s, laiocb)) {
+                continue;
+            }
+            res = -EAGAIN;
+        }
+
+        laiocb->common.cb(laiocb->common.opaque, luring_result(laiocb, res));
+        vmx_aio_unref(laiocb);
+        /* The callback may have run a nested aio_poll() that reaped more */
+        head = *s->cq_head;
+    }
+
+    /* Requeued requests may still sit in the SQ if we are plugged */
+    if (!s->plugged) {
+        luring_flush_queue(s);
+    }
+}
+
+BlockAIOCB *luring_submit(BlockDriverState *bs, LuringState *s, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    LuringAIOCB *laiocb;
+
+    laiocb = vmx_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    laiocb->s = s;
+    laiocb->qiov = qiov;
+    laiocb->fd = fd;
+    laiocb->type = type;
+    laiocb->offset = sector_num * BDRV_SECTOR_SIZE;
+    laiocb->nbytes = nb_sectors * BDRV_SECTOR_SIZE;
+    assert(qiov->size == laiocb->nbytes);
+
+    if (!luring_queue(s, laiocb)) {
+        /* Ring full: let the caller fall back to the thread pool */
+        vmx_aio_unref(laiocb);
+        return NULL;
+    }
+    return &laiocb->common;
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    s->plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s, bool unplug)
+{
+    assert(s->plugged || !unplug);
+    if (unplug && --s->plugged > 0) {
+        return;
+    }
+    luring_flush_queue(s);
+}
+
+static void luring_unmap(LuringState *s)
+{
+    if (s->sqes && s->sqes != MAP_FAILED) {
+        munmap(s->sqes, s->sqes_size);
+    }
+    if (s->cq_ring && s->cq_ring != MAP_FAILED) {
+        munmap(s->cq_ring, s->cq_ring_size);
+    }
+    if (s->sq_ring && s->sq_ring != MAP_FAILED) {
+        munmap(s->sq_ring, s->sq_ring_size);
+    }
+}
+
+LuringState *luring_init(VeertuAioContext *ctx, Error **errp)
+{
+    LuringState *s = g_new0(LuringState, 1);
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    s->ring_fd = syscall(__NR_io_uring_setup, MAX_ENTRIES, &p);
+    if (s->ring_fd < 0) {
+        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
+        g_free(s);
+        return NULL;
+    }
+
+    s->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    s->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    s->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    s->sq_ring = mmap(NULL, s->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, s->ring_fd, IORING_OFF_SQ_RING);
+    s->cq_ring = mmap(NULL, s->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, s->ring_fd, IORING_OFF_CQ_RING);
+    s->sqes = mmap(NULL, s->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, s->ring_fd, IORING_OFF_SQES);
+    if (s->sq_ring == MAP_FAILED || s->cq_ring == MAP_FAILED ||
+        s->sqes == MAP_FAILED) {
+        error_setg_errno(errp, errno, "failed to map linux io_uring ring");
+        luring_unmap(s);
+        close(s->ring_fd);
+        g_free(s);
+        return NULL;
+    }
+
+    s->sq_head = s->sq_ring + p.sq_off.head;
+    s->sq_tail = s->sq_ring + p.sq_off.tail;
+    s->sq_mask = *(unsigned *)(s->sq_ring + p.sq_off.ring_mask);
+    s->sq_entries = p.sq_entries;
+    s->sq_array = s->sq_ring + p.sq_off.array;
+    s->sqe_tail = *s->sq_tail;
+    s->cq_head = s->cq_ring + p.cq_off.head;
+    s->cq_tail = s->cq_ring + p.cq_off.tail;
+    s->cq_mask = *(unsigned *)(s->cq_ring + p.cq_off.ring_mask);
+    s->cq_entries = p.cq_entries;
+    s->cqes = s->cq_ring + p.cq_off.cqes;
+
+    s->ctx = ctx;
+    aio_set_fd_handler(ctx, s->ring_fd, luring_completion_cb, NULL, s);
+    return s;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    if (!s) {
+        return;
+    }
+    assert(!s->in_flight && !s->in_queue);
+    aio_set_fd_handler(s->ctx, s->ring_fd, NULL, NULL, NULL);
+    luring_unmap(s);
+    close(s->ring_fd);
+    g_free(s);
+}
+
+#endif /* CONFIG_LINUX_IO_URING */
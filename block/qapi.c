@@ -62,6 +62,35 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs)
     info->backing_file_depth = bdrv_get_backing_file_depth(bs);
     info->detect_zeroes = bs->detect_zeroes;
 
+    if (bs->io_limits_enabled) {
+        ThrottleConfig cfg;
+        throttle_get_config(&bs->throttle_state, &cfg);
+        info->bps     = cfg.buckets[THROTTLE_BPS_TOTAL].avg;
+        info->bps_rd  = cfg.buckets[THROTTLE_BPS_READ].avg;
+        info->bps_wr  = cfg.buckets[THROTTLE_BPS_WRITE].avg;
+
+        info->iops    = cfg.buckets[THROTTLE_OPS_TOTAL].avg;
+        info->iops_rd = cfg.buckets[THROTTLE_OPS_READ].avg;
+        info->iops_wr = cfg.buckets[THROTTLE_OPS_WRITE].avg;
+
+        info->has_bps_max     = cfg.buckets[THROTTLE_BPS_TOTAL].max;
+        info->bps_max         = cfg.buckets[THROTTLE_BPS_TOTAL].max;
+        info->has_bps_rd_max  = cfg.buckets[THROTTLE_BPS_READ].max;
+        info->bps_rd_max      = cfg.buckets[THROTTLE_BPS_READ].max;
+        info->has_bps_wr_max  = cfg.buckets[THROTTLE_BPS_WRITE].max;
+        info->bps_wr_max      = cfg.buckets[THROTTLE_BPS_WRITE].max;
+
+        info->has_iops_max    = cfg.buckets[THROTTLE_OPS_TOTAL].max;
+        info->iops_max        = cfg.buckets[THROTTLE_OPS_TOTAL].max;
+        info->has_iops_rd_max = cfg.buckets[THROTTLE_OPS_READ].max;
+        info->iops_rd_max     = cfg.buckets[THROTTLE_OPS_READ].max;
+        info->has_iops_wr_max = cfg.buckets[THROTTLE_OPS_WRITE].max;
+        info->iops_wr_max     = cfg.buckets[THROTTLE_OPS_WRITE].max;
+
+        info->has_iops_size = cfg.op_size;
+        info->iops_size = cfg.op_size;
+    }
+
     return info;
 }
 
@@ -285,6 +314,25 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
     qapi_free_BlockInfo(info);
 }
 
+/* Bucket i counts requests faster than 2^(i + BLOCK_ACCT_LATENCY_SHIFT) ns,
+ * the last one those that were slower
+ */
+static intList *bdrv_latency_histogram(const BlockAcctStats *stats,
+                                       enum BlockAcctType type)
+{
+    intList *list = NULL;
+    int i;
+
+    for (i = BLOCK_ACCT_LATENCY_BUCKETS - 1; i >= 0; i--) {
+        intList *entry = g_new0(intList, 1);
+        entry->value = stats->latency[type][i];
+        entry->next = list;
+        list = entry;
+    }
+
+    return list;
+}
+
 static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
                                     bool query_backing)
 {
@@ -314,6 +362,51 @@ static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
     s->stats->rd_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_READ];
     s->stats->flush_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_FLUSH];
 
+    s->stats->failed_rd_operations = bs->stats.failed_ops[BLOCK_ACCT_READ];
+    s->stats->failed_wr_operations = bs->stats.failed_ops[BLOCK_ACCT_WRITE];
+    s->stats->failed_flush_operations =
+        bs->stats.failed_ops[BLOCK_ACCT_FLUSH];
+    s->stats->invalid_rd_operations = bs->stats.invalid_ops[BLOCK_ACCT_READ];
+    s->stats->invalid_wr_operations = bs->stats.invalid_ops[BLOCK_ACCT_WRITE];
+    s->stats->invalid_flush_operations =
+        bs->stats.invalid_ops[BLOCK_ACCT_FLUSH];
+
+    s->stats->zero_detected_operations = bs->stats.zero_detected_ops;
+    s->stats->zero_detected_bytes = bs->stats.zero_detected_bytes;
+
+    s->stats->in_flight = bs->stats.in_flight;
+    s->stats->max_in_flight = bs->stats.max_in_flight;
+    s->stats->avg_in_flight = block_acct_avg_in_flight(&bs->stats);
+
+    s->stats->rd_latency_histogram =
+        bdrv_latency_histogram(&bs->stats, BLOCK_ACCT_READ);
+    s->stats->wr_latency_histogram =
+        bdrv_latency_histogram(&bs->stats, BLOCK_ACCT_WRITE);
+    s->stats->flush_latency_histogram =
+        bdrv_latency_histogram(&bs->stats, BLOCK_ACCT_FLUSH);
+
+    s->stats->idle_time_ns = block_acct_idle_time_ns(&bs->stats);
+    s->stats->has_idle_time_ns = s->stats->idle_time_ns >= 0;
+
+    if (bs->io_limits_enabled) {
+        s->stats->has_rd_throttled_operations = true;
+        s->stats->rd_throttled_operations = bs->throttled_ops[0];
+        s->stats->has_wr_throttled_operations = true;
+        s->stats->wr_throttled_operations = bs->throttled_ops[1];
+        s->stats->has_rd_throttled_time_ns = true;
+        s->stats->rd_throttled_time_ns = bs->throttled_time_ns[0];
+        s->stats->has_wr_throttled_time_ns = true;
+        s->stats->wr_throttled_time_ns = bs->throttled_time_ns[1];
+        s->stats->has_rd_throttled_queue_depth = true;
+        s->stats->rd_throttled_queue_depth = bs->throttled_depth[0];
+        s->stats->has_wr_throttled_queue_depth = true;
+        s->stats->wr_throttled_queue_depth = bs->throttled_depth[1];
+        s->stats->has_rd_throttled_queue_depth_max = true;
+        s->stats->rd_throttled_queue_depth_max = bs->throttled_depth_max[0];
+        s->stats->has_wr_throttled_queue_depth_max = true;
+        s->stats->wr_throttled_queue_depth_max = bs->throttled_depth_max[1];
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file, query_backing);
@@ -27,51 +27,122 @@
 #include "qcow2.h"
 
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    bool    referenced;
+    bool    loading;
     int     ref;
+    int     next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    void*                   table_array;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_size;
     bool                    depends_on_flush;
+
+    /* Hash chains on table offset, linked through entries[].next */
+    int*                    buckets;
+    unsigned int            hash_mask;
+
+    /* CLOCK replacement hand */
+    int                     clock_hand;
+
+    uint64_t                hits;
+    uint64_t                misses;
+
+    /* Requests waiting for a table that another request is reading in */
+    CoQueue                 load_queue;
 };
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int i)
+{
+    return (uint8_t *) c->table_array + (size_t) i * c->table_size;
+}
+
+static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
+    int idx = table_offset / c->table_size;
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
+    return idx;
+}
+
+static inline unsigned int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return ((offset / c->table_size) * 0x9e3779b97f4a7c15ULL >> 32)
+           & c->hash_mask;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    unsigned int bucket = qcow2_cache_hash(c, c->entries[i].offset);
+
+    c->entries[i].next = c->buckets[bucket];
+    c->buckets[bucket] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].next;
+    }
+    *p = c->entries[i].next;
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i = c->buckets[qcow2_cache_hash(c, offset)];
+
+    while (i >= 0 && c->entries[i].offset != offset) {
+        i = c->entries[i].next;
+    }
+    return i;
+}
+
+static void qcow2_cache_hash_reset(Qcow2Cache *c)
+{
+    memset(c->buckets, 0xff, (c->hash_mask + 1) * sizeof(int));
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size)
 {
-    BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
-    int i;
+    unsigned int nb_buckets = 1;
+
+    assert(num_tables > 0);
+    assert(is_power_of_2(table_size));
+
+    while (nb_buckets < num_tables) {
+        nb_buckets <<= 1;
+    }
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->table_size = table_size;
+    c->hash_mask = nb_buckets - 1;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
-    if (!c->entries) {
-        goto fail;
-    }
-
-    for (i = 0; i < c->size; i++) {
-        c->entries[i].table = vmx_try_blockalign(bs->file, s->cluster_size);
-        if (c->entries[i].table == NULL) {
-            goto fail;
-        }
+    c->buckets = g_try_new(int, nb_buckets);
+    c->table_array = vmx_try_blockalign(bs->file,
+                                        (size_t) num_tables * table_size);
+
+    if (!c->entries || !c->buckets || !c->table_array) {
+        vmx_vfree(c->table_array);
+        g_free(c->buckets);
+        g_free(c->entries);
+        g_free(c);
+        return NULL;
     }
 
+    qcow2_cache_hash_reset(c);
+    vmx_co_queue_init(&c->load_queue);
     return c;
-
-fail:
-    if (c->entries) {
-        for (i = 0; i < c->size; i++) {
-            vmx_vfree(c->entries[i].table);
-        }
-    }
-    g_free(c->entries);
-    g_free(c);
-    return NULL;
 }
 
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
@@ -80,15 +151,22 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        vmx_vfree(c->entries[i].table);
     }
 
+    vmx_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -128,13 +206,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -147,8 +225,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+                      qcow2_cache_get_table_addr(c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -222,42 +300,61 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
         c->entries[i].offset = 0;
-        c->entries[i].cache_hits = 0;
+        c->entries[i].referenced = false;
     }
+    qcow2_cache_hash_reset(c);
 
     return 0;
 }
 
+/*
+ * CLOCK (second chance) replacement: entries that were used since the hand
+ * last passed them get their referenced bit cleared and are skipped once.
+ */
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    int n;
 
+    for (n = 0; n < 2 * c->size; n++) {
+        int i = c->clock_hand;
 
-    for (i = 0; i < c->size; i++) {
+        if (++c->clock_hand == c->size) {
+            c->clock_hand = 0;
+        }
         if (c->entries[i].ref) {
             continue;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+        if (c->entries[i].referenced) {
+            c->entries[i].referenced = false;
+            continue;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
+        return i;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+    /* Every entry is in use. The caches are sized so that a single request
+     * never holds more than a few tables, so this would need an absurd
+     * number of concurrent requests holding s->lock shared. */
+    abort();
+}
+
+static void qcow2_cache_load_done(Qcow2Cache *c, int i)
+{
+    c->entries[i].loading = false;
+    if (vmx_in_coroutine()) {
+        vmx_co_queue_restart_all(&c->load_queue);
+    } else {
+        while (vmx_co_enter_next(&c->load_queue)) {
+            /* Loop */
+        }
     }
-    return min_index;
 }
 
+/*
+ * With s->lock held shared, several requests can be in here at the same time
+ * and yield while flushing a victim or reading a table.  Entries are claimed
+ * with a reference before yielding, and tables that are being read in are
+ * marked as loading so that concurrent lookups wait for them.
+ */
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
@@ -265,11 +362,18 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     int i;
     int ret;
 
+    assert(offset != 0 && offset % c->table_size == 0);
+
+again:
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        if (c->entries[i].loading) {
+            vmx_co_queue_wait(&c->load_queue);
+            goto again;
         }
+        c->hits++;
+        goto found;
     }
 
     /* If not, write a table back and replace it */
@@ -278,33 +382,57 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         return i;
     }
 
-    ret = qcow2_cache_entry_flush(bs, c, i);
-    if (ret < 0) {
-        return ret;
+    if (c->entries[i].dirty) {
+        c->entries[i].ref++;
+        ret = qcow2_cache_entry_flush(bs, c, i);
+        c->entries[i].ref--;
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* Somebody may have used the victim or loaded our table while we
+         * were writing it back */
+        if (c->entries[i].ref || c->entries[i].dirty ||
+            qcow2_cache_lookup(c, offset) >= 0) {
+            goto again;
+        }
+    }
+    c->misses++;
+
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
     }
+    c->entries[i].offset = offset;
+    c->entries[i].referenced = true;
+    c->entries[i].ref++;
+    qcow2_cache_hash_insert(c, i);
 
-    c->entries[i].offset = 0;
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        c->entries[i].loading = true;
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
+                         c->table_size);
         if (ret < 0) {
+            qcow2_cache_hash_remove(c, i);
+            c->entries[i].offset = 0;
+            c->entries[i].ref--;
+            qcow2_cache_load_done(c, i);
             return ret;
         }
+        qcow2_cache_load_done(c, i);
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
-    c->entries[i].offset = offset;
+    *table = qcow2_cache_get_table_addr(c, i);
+    return 0;
 
-    /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    /* Already cached, just return the right table */
+    c->entries[i].referenced = true;
     c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_get_table_addr(c, i);
 
     return 0;
 }
@@ -323,16 +451,8 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, *table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
-
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -342,15 +462,8 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
+    assert(c->entries[i].offset != 0);
     c->entries[i].dirty = true;
 }
@@ -27,6 +27,7 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "qcow2.h"
+#include "thread-pool.h"
 
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size)
@@ -137,20 +138,22 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
 /*
  * l2_load
  *
- * Loads a L2 table into memory. If the table is in the cache, the cache
- * is used; otherwise the L2 table is loaded from the image file.
+ * Loads the slice of the L2 table at l2_offset that maps the guest offset
+ * into memory. If the slice is in the cache, the cache is used; otherwise
+ * it is loaded from the image file.
  *
- * Returns a pointer to the L2 table on success, or NULL if the read from
- * the image file failed.
+ * Returns 0 on success, -errno if the read from the image file failed.
  */
 
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+static int l2_load(BlockDriverState *bs, uint64_t offset,
+    uint64_t l2_offset, uint64_t **l2_table)
 {
     BDRVQcowState *s = bs->opaque;
     int ret;
 
-    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset, (void**) l2_table);
+    ret = qcow2_cache_get(bs, s->l2_table_cache,
+                          l2_slice_offset(s, l2_offset, offset),
+                          (void**) l2_table);
 
     return ret;
 }
@@ -198,14 +201,18 @@ int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * The new table goes through the L2 cache one slice at a time and is
+ * written back before the L1 entry is updated.
+ *
  */
 
-static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
+static int l2_allocate(BlockDriverState *bs, int l1_index)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t old_l2_offset;
     uint64_t *l2_table = NULL;
     int64_t l2_offset;
+    int slice, n_slices = s->l2_size / s->l2_slice_size;
     int ret;
 
     old_l2_offset = s->l1_table[l1_index];
@@ -223,33 +230,43 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    /* allocate a new entry in the l2 cache */
-
-    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
-    if (ret < 0) {
-        goto fail;
-    }
-
-    l2_table = *table;
+    for (slice = 0; slice < n_slices; slice++) {
+        uint64_t slice_offset = (uint64_t) slice * l2_slice_bytes(s);
 
-    if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
-        /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
-    } else {
-        uint64_t* old_table;
+        /* allocate a new entry in the l2 cache */
 
-        /* if there was an old l2 table, read it from the disk */
-        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = qcow2_cache_get(bs, s->l2_table_cache,
-            old_l2_offset & L1E_OFFSET_MASK,
-            (void**) &old_table);
+        ret = qcow2_cache_get_empty(bs, s->l2_table_cache,
+                                    l2_offset + slice_offset,
+                                    (void**) &l2_table);
         if (ret < 0) {
             goto fail;
         }
 
-        memcpy(l2_table, old_table, s->cluster_size);
+        if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
+            /* if there was no old l2 table, clear the new table */
+            memset(l2_table, 0, l2_slice_bytes(s));
+        } else {
+            uint64_t* old_table;
+
+            /* if there was an old l2 table, read it from the disk */
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
+            ret = qcow2_cache_get(bs, s->l2_table_cache,
+                (old_l2_offset & L1E_OFFSET_MASK) + slice_offset,
+                (void**) &old_table);
+            if (ret < 0) {
+                goto fail;
+            }
+
+            memcpy(l2_table, old_table, l2_slice_bytes(s));
+
+            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &old_table);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
 
-        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &old_table);
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         if (ret < 0) {
             goto fail;
         }
@@ -258,7 +275,6 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
     /* write the l2 table to the file */
     BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
-    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -271,12 +287,11 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    *table = l2_table;
     return 0;
 
 fail:
     if (l2_table != NULL) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
@@ -442,19 +457,20 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     uint64_t l1_index, l2_offset, *l2_table;
     int l1_bits, c;
     unsigned int index_in_cluster, nb_clusters;
-    uint64_t nb_available, nb_needed;
+    uint64_t nb_available, nb_needed, slice_coverage;
     int ret;
 
     index_in_cluster = (offset >> 9) & (s->cluster_sectors - 1);
     nb_needed = *num + index_in_cluster;
 
     l1_bits = s->l2_bits + s->cluster_bits;
+    slice_coverage = (uint64_t) s->l2_slice_size << s->cluster_bits;
 
     /* compute how many bytes there are between the offset and
-     * the end of the l1 entry
+     * the end of the l2 slice
      */
 
-    nb_available = (1ULL << l1_bits) - (offset & ((1ULL << l1_bits) - 1));
+    nb_available = slice_coverage - (offset & (slice_coverage - 1));
 
     /* compute the number of available sectors */
 
@@ -487,16 +503,16 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         return -EIO;
     }
 
-    /* load the l2 table in memory */
+    /* load the l2 slice in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
     if (ret < 0) {
         return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
     *cluster_offset = be64_to_cpu(l2_table[l2_index]);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
@@ -563,10 +579,10 @@ fail:
  * get_cluster_table
  *
  * for a given disk offset, load (and allocate if needed)
- * the l2 table.
+ * the l2 slice that maps it.
  *
- * the l2 table offset in the qcow2 file and the cluster index
- * in the l2 table are given to the caller.
+ * the l2 slice and the cluster index in the slice are given to
+ * the caller.
  *
  * Returns 0 on success, -errno in failure case
  */
@@ -601,15 +617,9 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
     /* seek the l2 table of the given l2 offset */
 
-    if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
-        /* load the l2 table in memory */
-        ret = l2_load(bs, l2_offset, &l2_table);
-        if (ret < 0) {
-            return ret;
-        }
-    } else {
+    if (!(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
         /* First allocate a new L2 table (and do COW if needed) */
-        ret = l2_allocate(bs, l1_index, &l2_table);
+        ret = l2_allocate(bs, l1_index);
         if (ret < 0) {
             return ret;
         }
@@ -619,11 +629,19 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
             qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
                                 QCOW2_DISCARD_OTHER);
         }
+
+        l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    }
+
+    /* load the l2 slice in memory */
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
+    if (ret < 0) {
+        return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
 
     *new_l2_table = l2_table;
     *new_l2_index = l2_index;
@@ -703,11 +721,11 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
         return 0;
     }
 
-    vmx_co_mutex_unlock(&s->lock);
+    vmx_co_rwlock_unlock(&s->lock);
     ret = copy_sectors(bs, m->offset / BDRV_SECTOR_SIZE, m->alloc_offset,
                        r->offset / BDRV_SECTOR_SIZE,
                        r->offset / BDRV_SECTOR_SIZE + r->nb_sectors);
-    vmx_co_mutex_lock(&s->lock);
+    vmx_co_rwlock_wrlock(&s->lock);
 
     if (ret < 0) {
         return ret;
@@ -764,7 +782,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     }
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
 
-    assert(l2_index + m->nb_clusters <= s->l2_size);
+    assert(l2_index + m->nb_clusters <= s->l2_slice_size);
     for (i = 0; i < m->nb_clusters; i++) {
         /* if two concurrent writes happen to the same unallocated cluster
 	 * each write allocates separate cluster and writes data concurrently.
@@ -889,9 +907,9 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
             if (bytes == 0) {
                 /* Wait for the dependency to complete. We need to recheck
                  * the free/allocated clusters when we continue. */
-                vmx_co_mutex_unlock(&s->lock);
+                vmx_co_rwlock_unlock(&s->lock);
                 vmx_co_queue_wait(&old_alloc->dependent_requests);
-                vmx_co_mutex_lock(&s->lock);
+                vmx_co_rwlock_wrlock(&s->lock);
                 return -EAGAIN;
             }
         }
@@ -941,14 +959,14 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                                 == offset_into_cluster(s, *host_offset));
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     /* Find L2 entry for the first involved cluster */
     ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
@@ -1092,14 +1110,14 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     assert(*bytes > 0);
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     /* Find L2 entry for the first involved cluster */
     ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
@@ -1336,6 +1354,93 @@ again:
     return 0;
 }
 
+/*
+ * Checks whether a write request at the given guest offset can go straight
+ * to already allocated clusters, without allocating or touching any metadata.
+ * This is the case for clusters with QCOW_OFLAG_COPIED set in an L2 table
+ * that is itself not shared, as long as no allocation is in flight for the
+ * same range.
+ *
+ * Only the L2 cache is used, so this may be called with s->lock held shared.
+ *
+ * on entry, *num is the number of contiguous sectors we'd like to write.
+ *
+ * Returns 1 if the first *num sectors (which may have been decreased) can be
+ * written at *host_offset, the start of the first host cluster. Returns 0 if
+ * the request must go through qcow2_alloc_cluster_offset(), -errno in error
+ * cases.
+ */
+int qcow2_get_allocated_range(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *host_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowL2Meta *old_alloc;
+    uint64_t l1_index, l2_offset, l2_entry, *l2_table;
+    uint64_t bytes, end;
+    unsigned int l2_index, nb_clusters, keep_clusters;
+    int ret;
+
+    bytes = (uint64_t) *num << BDRV_SECTOR_BITS;
+    end = offset + bytes;
+
+    /* Anything that touches a running allocation is left to
+     * handle_dependencies() */
+    QLIST_FOREACH(old_alloc, &s->cluster_allocs, next_in_flight) {
+        if (end > l2meta_cow_start(old_alloc) &&
+            offset < l2meta_cow_end(old_alloc)) {
+            return 0;
+        }
+    }
+
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size) {
+        return 0;
+    }
+
+    l2_offset = s->l1_table[l1_index];
+    if (!(l2_offset & QCOW_OFLAG_COPIED)) {
+        return 0;
+    }
+    l2_offset &= L1E_OFFSET_MASK;
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        return 0;
+    }
+
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    l2_index = offset_to_l2_slice_index(s, offset);
+    nb_clusters = size_to_clusters(s, offset_into_cluster(s, offset) + bytes);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
+
+    l2_entry = be64_to_cpu(l2_table[l2_index]);
+    if (qcow2_get_cluster_type(l2_entry) != QCOW2_CLUSTER_NORMAL ||
+        !(l2_entry & QCOW_OFLAG_COPIED) ||
+        offset_into_cluster(s, l2_entry & L2E_OFFSET_MASK))
+    {
+        ret = 0;
+        goto out;
+    }
+
+    keep_clusters = count_contiguous_clusters(nb_clusters, s->cluster_size,
+                                              &l2_table[l2_index],
+                                              QCOW_OFLAG_COPIED |
+                                              QCOW_OFLAG_ZERO);
+    assert(keep_clusters > 0 && keep_clusters <= nb_clusters);
+
+    bytes = MIN(bytes, keep_clusters * s->cluster_size
+                       - offset_into_cluster(s, offset));
+    *num = bytes >> BDRV_SECTOR_BITS;
+    *host_offset = l2_entry & L2E_OFFSET_MASK;
+    ret = 1;
+
+out:
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    return ret;
+}
+
 static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
                              const uint8_t *buf, int buf_size)
 {
@@ -1363,34 +1468,348 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+/*
+ * Decompressed clusters are kept in a small LRU cache, keyed by the offset of
+ * the compressed data in the image file. Inflating happens in the thread
+ * pool, so several clusters can be decompressed in parallel, and a miss in
+ * the cluster after a cached one starts background loads for the compressed
+ * clusters that follow it.
+ */
+typedef struct Qcow2CompressedCluster {
+    uint64_t    offset;         /* 0 if the entry is unused */
+    uint8_t     *data;
+    uint64_t    lru_counter;
+    bool        loading;
+    bool        stale;          /* freed while loading, drop when done */
+} Qcow2CompressedCluster;
+
+struct Qcow2CompressedCache {
+    Qcow2CompressedCluster  *entries;
+    int                     size;
+    uint64_t                lru_counter;
+
+    /* Loads that don't belong to a guest request */
+    int                     readahead_in_flight;
+
+    /* Requests waiting for a cluster that is being loaded or for a free
+     * entry */
+    CoQueue                 queue;
+};
+
+typedef struct Qcow2DecompressData {
+    uint8_t         *dest;
+    int             dest_size;
+    const uint8_t   *src;
+    int             src_size;
+} Qcow2DecompressData;
+
+typedef struct Qcow2ReadaheadCo {
+    BlockDriverState    *bs;
+    int                 index;
+    uint64_t            cluster_offset;
+} Qcow2ReadaheadCo;
+
+Qcow2CompressedCache *qcow2_compressed_cache_create(int num_clusters,
+                                                    int cluster_size)
+{
+    Qcow2CompressedCache *c;
+    int i;
+
+    assert(num_clusters > 0);
+
+    c = g_new0(Qcow2CompressedCache, 1);
+    c->size = num_clusters;
+    c->entries = g_new0(Qcow2CompressedCluster, num_clusters);
+    for (i = 0; i < num_clusters; i++) {
+        c->entries[i].data = g_malloc(cluster_size);
+    }
+    vmx_co_queue_init(&c->queue);
+
+    return c;
+}
+
+void qcow2_compressed_cache_destroy(BlockDriverState *bs,
+                                    Qcow2CompressedCache *c)
+{
+    int i;
+
+    /* Readahead coroutines still use the entries */
+    while (c->readahead_in_flight) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+
+    for (i = 0; i < c->size; i++) {
+        assert(!c->entries[i].loading);
+        g_free(c->entries[i].data);
+    }
+    g_free(c->entries);
+    g_free(c);
+}
+
+/*
+ * Forgets all decompressed clusters whose compressed data starts in the given
+ * range of the image file. Must be called when that space is freed.
+ */
+void qcow2_compressed_cache_discard(Qcow2CompressedCache *c, uint64_t offset,
+                                    uint64_t length)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CompressedCluster *e = &c->entries[i];
+
+        if (e->offset && e->offset - offset < length) {
+            if (e->loading) {
+                e->stale = true;
+            } else {
+                e->offset = 0;
+            }
+        }
+    }
+}
+
+static int compressed_cache_lookup(Qcow2CompressedCache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Returns the least recently used entry that isn't being loaded, or -1 */
+static int compressed_cache_find_victim(Qcow2CompressedCache *c)
+{
+    uint64_t min_lru_counter = UINT64_MAX;
+    int min_lru_index = -1;
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CompressedCluster *e = &c->entries[i];
+
+        if (e->loading) {
+            continue;
+        }
+        if (!e->offset) {
+            return i;
+        }
+        if (e->lru_counter < min_lru_counter) {
+            min_lru_counter = e->lru_counter;
+            min_lru_index = i;
+        }
+    }
+    return min_lru_index;
+}
+
+static int decompress_worker(void *opaque)
+{
+    Qcow2DecompressData *d = opaque;
+
+    if (decompress_buffer(d->dest, d->dest_size, d->src, d->src_size) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Reads the compressed cluster described by the L2 entry cluster_offset and
+ * inflates it into entry i, which the caller has marked as loading.
+ */
+static int coroutine_fn compressed_cluster_load(BlockDriverState *bs, int i,
+                                                uint64_t cluster_offset)
 {
     BDRVQcowState *s = bs->opaque;
-    int ret, csize, nb_csectors, sector_offset;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    Qcow2CompressedCluster *e = &c->entries[i];
+    Qcow2DecompressData d;
+    ThreadPool *pool;
+    int ret, nb_csectors, sector_offset;
     uint64_t coffset;
+    uint8_t *buf;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
+    assert(e->loading && e->offset == coffset);
+
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+
+    buf = vmx_try_blockalign(bs->file, nb_csectors * 512);
+    if (buf == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_read(bs->file, coffset >> 9, buf, nb_csectors);
+    if (ret < 0) {
+        goto out;
+    }
+
+    d = (Qcow2DecompressData) {
+        .dest       = e->data,
+        .dest_size  = s->cluster_size,
+        .src        = buf + sector_offset,
+        .src_size   = nb_csectors * 512 - sector_offset,
+    };
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ret = thread_pool_submit_co(pool, decompress_worker, &d);
+
+out:
+    vmx_vfree(buf);
+
+    e->loading = false;
+    if (ret < 0 || e->stale) {
+        e->offset = 0;
+        e->stale = false;
+    } else {
+        e->lru_counter = ++c->lru_counter;
+    }
+    vmx_co_queue_restart_all(&c->queue);
+
+    return ret;
+}
+
+/* Whether the guest cluster at offset is compressed and in the cache */
+static bool coroutine_fn compressed_cache_has(BlockDriverState *bs,
+                                              uint64_t offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+    int n = s->cluster_sectors;
+
+    if (qcow2_get_cluster_offset(bs, offset, &n, &cluster_offset) !=
+        QCOW2_CLUSTER_COMPRESSED) {
+        return false;
+    }
+    return compressed_cache_lookup(s->compressed_cache, cluster_offset &
+                                   s->cluster_offset_mask) >= 0;
+}
+
+static void coroutine_fn compressed_readahead_entry(void *opaque)
+{
+    Qcow2ReadaheadCo *rco = opaque;
+    BDRVQcowState *s = rco->bs->opaque;
+
+    /* Errors are reported when a guest request reads the cluster */
+    compressed_cluster_load(rco->bs, rco->index, rco->cluster_offset);
+    s->compressed_cache->readahead_in_flight--;
+    g_free(rco);
+}
+
+/*
+ * Starts loading the compressed clusters that follow the given guest cluster
+ * in the background, up to the first cluster that isn't compressed. Each
+ * readahead takes at most an eighth of the cache, so that the readahead for
+ * several sequential streams doesn't push out the clusters they are reading.
+ */
+static void coroutine_fn compressed_readahead(BlockDriverState *bs,
+                                              uint64_t guest_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    uint64_t cluster_offset, offset;
+    int k, n, i, ret;
+    int max = MIN(QCOW2_COMPRESSED_READAHEAD, c->size / 8);
+
+    for (k = 1; k <= max; k++) {
+        Qcow2ReadaheadCo *rco;
+        Coroutine *co;
+
+        offset = start_of_cluster(s, guest_offset) +
+                 ((uint64_t) k << s->cluster_bits);
+        if (offset >= bs->total_sectors * BDRV_SECTOR_SIZE) {
+            break;
+        }
+
+        n = s->cluster_sectors;
+        ret = qcow2_get_cluster_offset(bs, offset, &n, &cluster_offset);
+        if (ret != QCOW2_CLUSTER_COMPRESSED) {
+            break;
+        }
+
+        if (compressed_cache_lookup(c, cluster_offset &
+                                       s->cluster_offset_mask) >= 0) {
+            continue;
+        }
+        i = compressed_cache_find_victim(c);
+        if (i < 0) {
+            break;
+        }
+
+        c->entries[i].offset = cluster_offset & s->cluster_offset_mask;
+        c->entries[i].loading = true;
+        c->readahead_in_flight++;
+
+        rco = g_new(Qcow2ReadaheadCo, 1);
+        *rco = (Qcow2ReadaheadCo) {
+            .bs             = bs,
+            .index          = i,
+            .cluster_offset = cluster_offset,
+        };
+        co = vmx_coroutine_create(compressed_readahead_entry);
+        vmx_coroutine_enter(co, rco);
+    }
+}
+
+/*
+ * Reads qiov->size bytes at guest_offset, which lies in the compressed
+ * cluster described by the L2 entry cluster_offset.
+ *
+ * Must be called with s->lock held shared or exclusively.
+ */
+int coroutine_fn qcow2_co_read_compressed(BlockDriverState *bs,
+    uint64_t guest_offset, uint64_t cluster_offset, QEMUIOVector *qiov)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    uint64_t coffset = cluster_offset & s->cluster_offset_mask;
+    bool miss = false;
+    int i, ret;
+
+    assert(offset_into_cluster(s, guest_offset) + qiov->size
+           <= s->cluster_size);
+
+again:
+    i = compressed_cache_lookup(c, coffset);
+    if (i >= 0 && c->entries[i].loading) {
+        vmx_co_queue_wait(&c->queue);
+        goto again;
+    } else if (i < 0) {
+        i = compressed_cache_find_victim(c);
+        if (i < 0) {
+            vmx_co_queue_wait(&c->queue);
+            goto again;
+        }
+
+        c->entries[i].offset = coffset;
+        c->entries[i].loading = true;
+        ret = compressed_cluster_load(bs, i, cluster_offset);
         if (ret < 0) {
             return ret;
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
-        }
-        s->cluster_cache_offset = coffset;
+        miss = true;
     }
+
+    c->entries[i].lru_counter = ++c->lru_counter;
+    vmx_iovec_from_buf(qiov, 0, c->entries[i].data +
+                       offset_into_cluster(s, guest_offset), qiov->size);
+
+    /* Only sequential reads are worth reading ahead for */
+    if (miss && guest_offset >= s->cluster_size &&
+        compressed_cache_has(bs, start_of_cluster(s, guest_offset) -
+                                 s->cluster_size)) {
+        compressed_readahead(bs, guest_offset);
+    }
+
     return 0;
 }
 
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of discarded
+ * all clusters in the same L2 slice) and returns the number of discarded
  * clusters.
  */
 static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
@@ -1407,8 +1826,8 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_l2_entry;
@@ -1491,7 +1910,7 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
 
     s->cache_discards = true;
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     while (nb_clusters > 0) {
         ret = discard_single_l2(bs, offset, nb_clusters, type, full_discard);
         if (ret < 0) {
@@ -1512,7 +1931,7 @@ fail:
 
 /*
  * This zeroes as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of zeroed
+ * all clusters in the same L2 slice) and returns the number of zeroed
  * clusters.
  */
 static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
@@ -1529,8 +1948,8 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
@@ -1566,7 +1985,7 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
         return -ENOTSUP;
     }
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     nb_clusters = size_to_clusters(s, nb_sectors << BDRV_SECTOR_BITS);
 
     s->cache_discards = true;
@@ -1605,8 +2024,12 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
     BDRVQcowState *s = bs->opaque;
     bool is_active_l1 = (l1_table == s->l1_table);
     uint64_t *l2_table = NULL;
+    /* active tables go through the cache slice by slice, inactive ones
+     * are read from disk as a whole */
+    int slice_size = is_active_l1 ? s->l2_slice_size : s->l2_size;
+    int n_slices = s->l2_size / slice_size;
     int ret;
-    int i, j;
+    int i, j, slice;
 
     if (!is_active_l1) {
         /* inactive L2 tables require a buffer to be stored in when loading
@@ -1619,7 +2042,6 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
 
     for (i = 0; i < l1_size; i++) {
         uint64_t l2_offset = l1_table[i] & L1E_OFFSET_MASK;
-        bool l2_dirty = false;
         int l2_refcount;
 
         if (!l2_offset) {
@@ -1631,114 +2053,123 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             continue;
         }
 
-        if (is_active_l1) {
-            /* get active L2 tables from cache */
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                    (void **)&l2_table);
-        } else {
-            /* load inactive L2 tables from disk */
-            ret = bdrv_read(bs->file, l2_offset / BDRV_SECTOR_SIZE,
-                    (void *)l2_table, s->cluster_sectors);
-        }
-        if (ret < 0) {
-            goto fail;
-        }
-
         l2_refcount = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits);
         if (l2_refcount < 0) {
             ret = l2_refcount;
             goto fail;
         }
 
-        for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
-            int64_t offset = l2_entry & L2E_OFFSET_MASK;
-            int cluster_type = qcow2_get_cluster_type(l2_entry);
-            bool preallocated = offset != 0;
+        for (slice = 0; slice < n_slices; slice++) {
+            uint64_t slice_offset = l2_offset + (uint64_t) slice *
+                                    slice_size * sizeof(uint64_t);
+            bool l2_dirty = false;
 
-            if (cluster_type != QCOW2_CLUSTER_ZERO) {
-                continue;
+            if (is_active_l1) {
+                /* get active L2 tables from cache */
+                ret = qcow2_cache_get(bs, s->l2_table_cache, slice_offset,
+                        (void **)&l2_table);
+            } else {
+                /* load inactive L2 tables from disk */
+                ret = bdrv_read(bs->file, l2_offset / BDRV_SECTOR_SIZE,
+                        (void *)l2_table, s->cluster_sectors);
+            }
+            if (ret < 0) {
+                goto fail;
             }
 
-            if (!preallocated) {
-                if (!bs->backing_hd) {
-                    /* not backed; therefore we can simply deallocate the
-                     * cluster */
-                    l2_table[j] = 0;
-                    l2_dirty = true;
+            for (j = 0; j < slice_size; j++) {
+                uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+                int64_t offset = l2_entry & L2E_OFFSET_MASK;
+                int cluster_type = qcow2_get_cluster_type(l2_entry);
+                bool preallocated = offset != 0;
+
+                if (cluster_type != QCOW2_CLUSTER_ZERO) {
                     continue;
                 }
 
-                offset = qcow2_alloc_clusters(bs, s->cluster_size);
-                if (offset < 0) {
-                    ret = offset;
-                    goto fail;
-                }
+                if (!preallocated) {
+                    if (!bs->backing_hd) {
+                        /* not backed; therefore we can simply deallocate the
+                         * cluster */
+                        l2_table[j] = 0;
+                        l2_dirty = true;
+                        continue;
+                    }
 
-                if (l2_refcount > 1) {
-                    /* For shared L2 tables, set the refcount accordingly (it is
-                     * already 1 and needs to be l2_refcount) */
-                    ret = qcow2_update_cluster_refcount(bs,
-                            offset >> s->cluster_bits, l2_refcount - 1,
-                            QCOW2_DISCARD_OTHER);
-                    if (ret < 0) {
-                        qcow2_free_clusters(bs, offset, s->cluster_size,
-                                            QCOW2_DISCARD_OTHER);
+                    offset = qcow2_alloc_clusters(bs, s->cluster_size);
+                    if (offset < 0) {
+                        ret = offset;
                         goto fail;
                     }
+
+                    if (l2_refcount > 1) {
+                        /* For shared L2 tables, set the refcount
+                         * accordingly (it is already 1 and needs to be
+                         * l2_refcount) */
+                        ret = qcow2_update_cluster_refcount(bs,
+                                offset >> s->cluster_bits, l2_refcount - 1,
+                                QCOW2_DISCARD_OTHER);
+                        if (ret < 0) {
+                            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                                QCOW2_DISCARD_OTHER);
+                            goto fail;
+                        }
+                    }
                 }
-            }
 
-            ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
-            if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = qcow2_pre_write_overlap_check(bs, 0, offset,
+                                                    s->cluster_size);
+                if (ret < 0) {
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            ret = bdrv_write_zeroes(bs->file, offset / BDRV_SECTOR_SIZE,
-                                    s->cluster_sectors, 0);
-            if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = bdrv_write_zeroes(bs->file, offset / BDRV_SECTOR_SIZE,
+                                        s->cluster_sectors, 0);
+                if (ret < 0) {
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            if (l2_refcount == 1) {
-                l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
-            } else {
-                l2_table[j] = cpu_to_be64(offset);
+                if (l2_refcount == 1) {
+                    l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+                } else {
+                    l2_table[j] = cpu_to_be64(offset);
+                }
+                l2_dirty = true;
             }
-            l2_dirty = true;
-        }
 
-        if (is_active_l1) {
-            if (l2_dirty) {
-                qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-                qcow2_cache_depends_on_flush(s->l2_table_cache);
-            }
-            ret = qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
-            if (ret < 0) {
-                l2_table = NULL;
-                goto fail;
-            }
-        } else {
-            if (l2_dirty) {
-                ret = qcow2_pre_write_overlap_check(bs,
-                        QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2, l2_offset,
-                        s->cluster_size);
+            if (is_active_l1) {
+                if (l2_dirty) {
+                    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+                    qcow2_cache_depends_on_flush(s->l2_table_cache);
+                }
+                ret = qcow2_cache_put(bs, s->l2_table_cache,
+                                      (void **)&l2_table);
                 if (ret < 0) {
+                    l2_table = NULL;
                     goto fail;
                 }
+            } else {
+                if (l2_dirty) {
+                    ret = qcow2_pre_write_overlap_check(bs,
+                            QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2,
+                            l2_offset, s->cluster_size);
+                    if (ret < 0) {
+                        goto fail;
+                    }
 
-                ret = bdrv_write(bs->file, l2_offset / BDRV_SECTOR_SIZE,
-                        (void *)l2_table, s->cluster_sectors);
-                if (ret < 0) {
-                    goto fail;
+                    ret = bdrv_write(bs->file, l2_offset / BDRV_SECTOR_SIZE,
+                            (void *)l2_table, s->cluster_sectors);
+                    if (ret < 0) {
+                        goto fail;
+                    }
                 }
             }
         }
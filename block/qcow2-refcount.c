@@ -68,6 +68,7 @@ int qcow2_refcount_init(BlockDriverState *bs)
 void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    qcow2_drop_cluster_map(s);
     g_free(s->refcount_table);
 }
 
@@ -133,6 +134,161 @@ int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index)
     return refcount;
 }
 
+/*********************************************************/
+/* in-memory map of used clusters */
+
+/*
+ * s->cluster_map has a bit set for every cluster that has a non-zero refcount
+ * or has been handed out by alloc_clusters_noref(). Clusters past the end of
+ * the map are free. It is built from the refcount blocks on the first
+ * allocation and kept up to date by update_refcount(), so that allocations
+ * don't need to go through the refcount block cache cluster by cluster.
+ *
+ * s->free_run_hint[n - 1] is a cluster index below which no run of n or more
+ * free clusters starts, so that allocations of n clusters don't rescan the
+ * same too small holes every time. Freeing a cluster lowers the hints to it.
+ */
+
+void qcow2_drop_cluster_map(BDRVQcowState *s)
+{
+    g_free(s->cluster_map);
+    s->cluster_map = NULL;
+    s->cluster_map_size = 0;
+    memset(s->free_run_hint, 0, sizeof(s->free_run_hint));
+}
+
+static void cluster_map_grow(BDRVQcowState *s, uint64_t nb_clusters)
+{
+    uint64_t old_words = s->cluster_map_size / 64;
+    uint64_t new_words;
+
+    if (nb_clusters <= s->cluster_map_size) {
+        return;
+    }
+
+    new_words = MAX(DIV_ROUND_UP(nb_clusters, 64), 2 * old_words);
+    s->cluster_map = g_renew(uint64_t, s->cluster_map, new_words);
+    memset(s->cluster_map + old_words, 0,
+           (new_words - old_words) * sizeof(uint64_t));
+    s->cluster_map_size = new_words * 64;
+}
+
+static void cluster_map_update(BDRVQcowState *s, uint64_t cluster_index,
+                               uint64_t nb_clusters, bool used)
+{
+    uint64_t i;
+
+    if (!s->cluster_map) {
+        return;
+    }
+    if (used) {
+        cluster_map_grow(s, cluster_index + nb_clusters);
+    } else if (cluster_index >= s->cluster_map_size) {
+        return;
+    } else {
+        nb_clusters = MIN(nb_clusters, s->cluster_map_size - cluster_index);
+        for (i = 0; i < QCOW2_FREE_RUN_HINTS; i++) {
+            s->free_run_hint[i] = MIN(s->free_run_hint[i], cluster_index);
+        }
+    }
+
+    for (i = cluster_index; i < cluster_index + nb_clusters; i++) {
+        if (used) {
+            s->cluster_map[i / 64] |= 1ULL << (i % 64);
+        } else {
+            s->cluster_map[i / 64] &= ~(1ULL << (i % 64));
+        }
+    }
+}
+
+static bool cluster_map_test(BDRVQcowState *s, uint64_t cluster_index)
+{
+    return cluster_index < s->cluster_map_size &&
+           (s->cluster_map[cluster_index / 64] >> (cluster_index % 64)) & 1;
+}
+
+/*
+ * Returns the index of the first cluster at or after start whose bit equals
+ * used, or s->cluster_map_size if there is none inside the map.
+ */
+static uint64_t cluster_map_find(BDRVQcowState *s, uint64_t start, bool used)
+{
+    while (start < s->cluster_map_size) {
+        uint64_t word = s->cluster_map[start / 64];
+
+        if (!used) {
+            word = ~word;
+        }
+        word &= ~0ULL << (start % 64);
+        if (word) {
+            return (start & ~63ULL) + ctz64(word);
+        }
+        start = (start | 63) + 1;
+    }
+    return s->cluster_map_size;
+}
+
+static int cluster_map_build(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t refcount_table_index, block_index;
+    int64_t refcount_block_offset;
+    uint16_t *refcount_block;
+    int ret;
+
+    assert(!s->cluster_map);
+    s->cluster_map = g_new0(uint64_t, 1);
+    s->cluster_map_size = 64;
+
+    for (refcount_table_index = 0;
+         refcount_table_index < s->refcount_table_size;
+         refcount_table_index++)
+    {
+        refcount_block_offset =
+            s->refcount_table[refcount_table_index] & REFT_OFFSET_MASK;
+        if (!refcount_block_offset) {
+            continue;
+        }
+
+        if (offset_into_cluster(s, refcount_block_offset)) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#"
+                                    PRIx64 " unaligned (reftable index: %#"
+                                    PRIx64 ")", refcount_block_offset,
+                                    refcount_table_index);
+            ret = -EIO;
+            goto fail;
+        }
+
+        ret = load_refcount_block(bs, refcount_block_offset,
+                                  (void **) &refcount_block);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        for (block_index = 0; block_index < s->refcount_block_size;
+             block_index++)
+        {
+            if (refcount_block[block_index]) {
+                cluster_map_update(s, (refcount_table_index <<
+                                       s->refcount_block_bits) + block_index,
+                                   1, true);
+            }
+        }
+
+        ret = qcow2_cache_put(bs, s->refcount_block_cache,
+                              (void **) &refcount_block);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    qcow2_drop_cluster_map(s);
+    return ret;
+}
+
 /*
  * Rounds the refcount table size up to avoid growing the table for each single
  * refcount block that is allocated.
@@ -433,6 +589,13 @@ static int alloc_refcount_block(BlockDriverState *bs,
     s->refcount_table_size = table_size;
     s->refcount_table_offset = table_offset;
 
+    /* The new blocks and table got their refcounts written directly above,
+     * without update_refcount(), so mark them in the cluster map too.
+     * Otherwise the allocation retried after -EAGAIN could be handed the
+     * same clusters again. */
+    cluster_map_update(s, meta_offset >> s->cluster_bits,
+                       blocks_clusters + table_clusters, true);
+
     /* Free old table. */
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t),
                         QCOW2_DISCARD_OTHER);
@@ -592,7 +755,12 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             s->free_cluster_index = cluster_index;
         }
         refcount_block[block_index] = cpu_to_be16(refcount);
+        cluster_map_update(s, cluster_index, 1, refcount != 0);
 
+        if (refcount == 0 && s->compressed_cache) {
+            qcow2_compressed_cache_discard(s->compressed_cache,
+                                           cluster_offset, s->cluster_size);
+        }
         if (refcount == 0 && s->discard_passthrough[type]) {
             update_refcount_discard(bs, cluster_offset, s->cluster_size);
         }
@@ -662,40 +830,63 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs,
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t i, nb_clusters;
-    int refcount;
+    uint64_t start, end, first_free, nb_clusters;
+    int ret, i;
+
+    if (!s->cluster_map) {
+        ret = cluster_map_build(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
 
     nb_clusters = size_to_clusters(s, size);
-retry:
-    for(i = 0; i < nb_clusters; i++) {
-        uint64_t next_cluster_index = s->free_cluster_index++;
-        refcount = qcow2_get_refcount(bs, next_cluster_index);
 
-        if (refcount < 0) {
-            return refcount;
-        } else if (refcount != 0) {
-            goto retry;
+    /* Find the first run of nb_clusters free clusters. Everything past the
+     * end of the map is free. */
+    first_free = cluster_map_find(s, s->free_cluster_index, false);
+    start = first_free;
+    if (nb_clusters && nb_clusters <= QCOW2_FREE_RUN_HINTS) {
+        start = cluster_map_find(s, MAX(start,
+                                        s->free_run_hint[nb_clusters - 1]),
+                                 false);
+    }
+    while (start < s->cluster_map_size) {
+        end = cluster_map_find(s, start, true);
+        if (end - start >= nb_clusters || end == s->cluster_map_size) {
+            break;
         }
+        start = cluster_map_find(s, end, false);
     }
 
     /* Make sure that all offsets in the "allocated" range are representable
      * in an int64_t */
-    if (s->free_cluster_index > 0 &&
-        s->free_cluster_index - 1 > (INT64_MAX >> s->cluster_bits))
-    {
+    if (start + nb_clusters - 1 > (INT64_MAX >> s->cluster_bits)) {
         return -EFBIG;
     }
 
+    /* Holes that were too small for this request stay below
+     * free_cluster_index for later, smaller allocations */
+    s->free_cluster_index = (start == first_free) ? start + nb_clusters
+                                                  : first_free;
+    /* No run of nb_clusters or more starts below start */
+    if (nb_clusters && nb_clusters <= QCOW2_FREE_RUN_HINTS) {
+        for (i = nb_clusters - 1; i < QCOW2_FREE_RUN_HINTS; i++) {
+            s->free_run_hint[i] = MAX(s->free_run_hint[i], start);
+        }
+    }
+    cluster_map_update(s, start, nb_clusters, true);
+
 #ifdef DEBUG_ALLOC2
     fprintf(stderr, "alloc_clusters: size=%" PRId64 " -> %" PRId64 "\n",
-            size,
-            (s->free_cluster_index - nb_clusters) << s->cluster_bits);
+            size, start << s->cluster_bits);
 #endif
-    return (s->free_cluster_index - nb_clusters) << s->cluster_bits;
+    return start << s->cluster_bits;
 }
 
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size)
 {
+    BDRVQcowState *s = bs->opaque;
     int64_t offset;
     int ret;
 
@@ -707,6 +898,12 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size)
         }
 
         ret = update_refcount(bs, offset, size, 1, QCOW2_DISCARD_NEVER);
+        if (ret < 0) {
+            /* update_refcount() has undone its changes, so the range is
+             * free again */
+            cluster_map_update(s, offset >> s->cluster_bits,
+                               size_to_clusters(s, size), false);
+        }
     } while (ret == -EAGAIN);
 
     if (ret < 0) {
@@ -785,11 +982,24 @@ int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
             qcow2_update_cluster_refcount(bs, offset >> s->cluster_bits, 1,
                                           QCOW2_DISCARD_NEVER);
     } else {
-        offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        /* Try to keep compressed data contiguous by taking the cluster
+         * right after the current one if it is free */
+        cluster_offset = start_of_cluster(s, s->free_byte_offset);
+        offset = -1;
+        if (s->cluster_map &&
+            !cluster_map_test(s, (cluster_offset >> s->cluster_bits) + 1))
+        {
+            offset = cluster_offset + s->cluster_size;
+            if (qcow2_alloc_clusters_at(bs, offset, 1) != 1) {
+                offset = -1;
+            }
+        }
+        if (offset < 0) {
+            offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        }
         if (offset < 0) {
             return offset;
         }
-        cluster_offset = start_of_cluster(s, s->free_byte_offset);
         if ((cluster_offset + s->cluster_size) == offset) {
             /* we are lucky: contiguous data */
             offset = s->free_byte_offset;
@@ -926,16 +1136,28 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
-
             for(j = 0; j < s->l2_size; j++) {
                 uint64_t cluster_index;
+                int k = j & (s->l2_slice_size - 1);
+
+                /* The L2 cache holds slices, switch at slice boundaries */
+                if (k == 0) {
+                    if (l2_table) {
+                        ret = qcow2_cache_put(bs, s->l2_table_cache,
+                                              (void**) &l2_table);
+                        if (ret < 0) {
+                            goto fail;
+                        }
+                    }
+                    ret = qcow2_cache_get(bs, s->l2_table_cache,
+                        l2_offset + (uint64_t) j * sizeof(uint64_t),
+                        (void**) &l2_table);
+                    if (ret < 0) {
+                        goto fail;
+                    }
+                }
 
-                offset = be64_to_cpu(l2_table[j]);
+                offset = be64_to_cpu(l2_table[k]);
                 old_offset = offset;
                 offset &= ~QCOW_OFLAG_COPIED;
 
@@ -1005,7 +1227,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                         qcow2_cache_set_dependency(bs, s->l2_table_cache,
                             s->refcount_block_cache);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
+                    l2_table[k] = cpu_to_be64(offset);
                     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
                 }
             }
@@ -2083,6 +2305,10 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     ret = 0;
 
 fail:
+    if (fix) {
+        /* Repairs may have changed refcounts behind update_refcount() */
+        qcow2_drop_cluster_map(s);
+    }
     g_free(refcount_table);
 
     return ret;
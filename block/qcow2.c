@@ -27,6 +27,7 @@
 #include <zlib.h>
 #include "qemu/aes.h"
 #include "qcow2.h"
+#include "thread-pool.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qbool.h"
@@ -466,6 +467,22 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum refcount block cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum cache size for decompressed clusters",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSION_LEVEL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "zlib compression level for compressed writes (0-9, "
+                    "-1 for the zlib default)",
+        },
         { /* end of list */ }
     },
 };
@@ -549,7 +566,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     uint64_t l1_vm_state_index;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, refcount_cache_size, l2_cache_entry_size;
+    uint64_t compressed_cache_size;
+    uint64_t min_l2_cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -805,9 +824,27 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
-    if (l2_cache_size < MIN_L2_CACHE_SIZE) {
-        l2_cache_size = MIN_L2_CACHE_SIZE;
+    l2_cache_entry_size = vmx_opt_get_size(opts, QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+                                           DEFAULT_L2_CACHE_ENTRY_SIZE);
+    if (l2_cache_entry_size > s->cluster_size) {
+        l2_cache_entry_size = s->cluster_size;
+    }
+    if (l2_cache_entry_size < MIN_L2_CACHE_ENTRY_SIZE ||
+        !is_power_of_2(l2_cache_entry_size)) {
+        error_setg(errp, QCOW2_OPT_L2_CACHE_ENTRY_SIZE " must be a power of "
+                   "two between %d and the cluster size (%d)",
+                   MIN_L2_CACHE_ENTRY_SIZE, s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+
+    /* l2_allocate() needs the old and the new slice at the same time */
+    min_l2_cache_size = MAX(MIN_L2_CACHE_SIZE * s->l2_size / s->l2_slice_size,
+                            2);
+    l2_cache_size /= l2_cache_entry_size;
+    if (l2_cache_size < min_l2_cache_size) {
+        l2_cache_size = min_l2_cache_size;
     }
     if (l2_cache_size > INT_MAX) {
         error_setg(errp, "L2 cache size too big");
@@ -826,25 +863,31 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (s->l2_table_cache == NULL || s->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
         goto fail;
     }
 
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = vmx_try_blockalign(bs->file, QCOW_MAX_CRYPT_CLUSTERS
-                                                    * s->cluster_size + 512);
-    if (s->cluster_data == NULL) {
-        error_setg(errp, "Could not allocate temporary cluster buffer");
-        ret = -ENOMEM;
+    compressed_cache_size = vmx_opt_get_size(opts,
+                                             QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+                                             DEFAULT_COMPRESSED_CACHE_SIZE);
+    compressed_cache_size /= s->cluster_size;
+    if (compressed_cache_size < MIN_COMPRESSED_CACHE_SIZE) {
+        compressed_cache_size = MIN_COMPRESSED_CACHE_SIZE;
+    }
+    if (compressed_cache_size > INT_MAX) {
+        error_setg(errp, "Compressed cluster cache size too big");
+        ret = -EINVAL;
         goto fail;
     }
+    s->compressed_cache = qcow2_compressed_cache_create(compressed_cache_size,
+                                                        s->cluster_size);
 
-    s->cluster_cache_offset = -1;
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -902,7 +945,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Initialise locks */
-    vmx_co_mutex_init(&s->lock);
+    vmx_co_rwlock_init(&s->lock);
 
     /* Repair image if dirty */
     if (!(flags & (BDRV_O_CHECK | BDRV_O_INCOMING)) && !bs->read_only &&
@@ -930,6 +973,16 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     s->discard_passthrough[QCOW2_DISCARD_OTHER] =
         vmx_opt_get_bool(opts, QCOW2_OPT_DISCARD_OTHER, false);
 
+    s->compression_level = vmx_opt_get_number(opts, QCOW2_OPT_COMPRESSION_LEVEL,
+                                              Z_DEFAULT_COMPRESSION);
+    if (s->compression_level < Z_DEFAULT_COMPRESSION ||
+        s->compression_level > Z_BEST_COMPRESSION) {
+        error_setg(errp, QCOW2_OPT_COMPRESSION_LEVEL " must be between %d "
+                   "and %d", Z_DEFAULT_COMPRESSION, Z_BEST_COMPRESSION);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     opt_overlap_check = vmx_opt_get(opts, QCOW2_OPT_OVERLAP);
     opt_overlap_check_template = vmx_opt_get(opts, QCOW2_OPT_OVERLAP_TEMPLATE);
     if (opt_overlap_check_template && opt_overlap_check &&
@@ -1002,8 +1055,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
-    g_free(s->cluster_cache);
-    vmx_vfree(s->cluster_data);
+    if (s->compressed_cache) {
+        qcow2_compressed_cache_destroy(bs, s->compressed_cache);
+    }
     return ret;
 }
 
@@ -1087,9 +1141,9 @@ static int64_t coroutine_fn qcow2_co_get_block_status(BlockDriverState *bs,
     int64_t status = 0;
 
     *pnum = nb_sectors;
-    vmx_co_mutex_lock(&s->lock);
+    vmx_co_rwlock_rdlock(&s->lock);
     ret = qcow2_get_cluster_offset(bs, sector_num << 9, pnum, &cluster_offset);
-    vmx_co_mutex_unlock(&s->lock);
+    vmx_co_rwlock_unlock(&s->lock);
     if (ret < 0) {
         return ret;
     }
@@ -1139,7 +1193,7 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
 
     vmx_iovec_init(&hd_qiov, qiov->niov);
 
-    vmx_co_mutex_lock(&s->lock);
+    vmx_co_rwlock_rdlock(&s->lock);
 
     while (remaining_sectors != 0) {
 
@@ -1177,10 +1231,10 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                                       n1 * BDRV_SECTOR_SIZE);
 
                     BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-                    vmx_co_mutex_unlock(&s->lock);
+                    vmx_co_rwlock_unlock(&s->lock);
                     ret = bdrv_co_readv(bs->backing_hd, sector_num,
                                         n1, &local_qiov);
-                    vmx_co_mutex_lock(&s->lock);
+                    vmx_co_rwlock_rdlock(&s->lock);
 
                     vmx_iovec_destroy(&local_qiov);
 
@@ -1199,15 +1253,11 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            ret = qcow2_co_read_compressed(bs, sector_num << 9,
+                                           cluster_offset, &hd_qiov);
             if (ret < 0) {
                 goto fail;
             }
-
-            vmx_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
-                512 * cur_nr_sectors);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -1239,11 +1289,11 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             }
 
             BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
-            vmx_co_mutex_unlock(&s->lock);
+            vmx_co_rwlock_unlock(&s->lock);
             ret = bdrv_co_readv(bs->file,
                                 (cluster_offset >> 9) + index_in_cluster,
                                 cur_nr_sectors, &hd_qiov);
-            vmx_co_mutex_lock(&s->lock);
+            vmx_co_rwlock_rdlock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
@@ -1268,7 +1318,7 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     ret = 0;
 
 fail:
-    vmx_co_mutex_unlock(&s->lock);
+    vmx_co_rwlock_unlock(&s->lock);
 
     vmx_iovec_destroy(&hd_qiov);
     vmx_vfree(cluster_data);
@@ -1290,12 +1340,11 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     uint64_t bytes_done = 0;
     uint8_t *cluster_data = NULL;
     QCowL2Meta *l2meta = NULL;
+    bool exclusive = false;
 
     vmx_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
-    vmx_co_mutex_lock(&s->lock);
+    vmx_co_rwlock_rdlock(&s->lock);
 
     while (remaining_sectors != 0) {
 
@@ -1310,10 +1359,26 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                 QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors - index_in_cluster;
         }
 
-        ret = qcow2_alloc_cluster_offset(bs, sector_num << 9,
-            &cur_nr_sectors, &cluster_offset, &l2meta);
-        if (ret < 0) {
-            goto fail;
+        /* Rewrites of allocated clusters only need the lock shared; take
+         * it exclusively if clusters have to be allocated */
+        if (!exclusive) {
+            ret = qcow2_get_allocated_range(bs, sector_num << 9,
+                &cur_nr_sectors, &cluster_offset);
+            if (ret < 0) {
+                goto fail;
+            } else if (ret == 0) {
+                vmx_co_rwlock_unlock(&s->lock);
+                vmx_co_rwlock_wrlock(&s->lock);
+                exclusive = true;
+            }
+        }
+
+        if (exclusive) {
+            ret = qcow2_alloc_cluster_offset(bs, sector_num << 9,
+                &cur_nr_sectors, &cluster_offset, &l2meta);
+            if (ret < 0) {
+                goto fail;
+            }
         }
 
         assert((cluster_offset & 511) == 0);
@@ -1352,13 +1417,20 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             goto fail;
         }
 
-        vmx_co_mutex_unlock(&s->lock);
+        vmx_co_rwlock_unlock(&s->lock);
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
 
         ret = bdrv_co_writev(bs->file,
                              (cluster_offset >> 9) + index_in_cluster,
                              cur_nr_sectors, &hd_qiov);
-        vmx_co_mutex_lock(&s->lock);
+
+        /* Linking new clusters into the L2 table is a metadata update */
+        exclusive = l2meta != NULL;
+        if (exclusive) {
+            vmx_co_rwlock_wrlock(&s->lock);
+        } else {
+            vmx_co_rwlock_rdlock(&s->lock);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -1390,7 +1462,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     ret = 0;
 
 fail:
-    vmx_co_mutex_unlock(&s->lock);
+    vmx_co_rwlock_unlock(&s->lock);
 
     while (l2meta != NULL) {
         QCowL2Meta *next;
@@ -1444,8 +1516,7 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
-    g_free(s->cluster_cache);
-    vmx_vfree(s->cluster_data);
+    qcow2_compressed_cache_destroy(bs, s->compressed_cache);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -1958,9 +2029,9 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     /* And if we're supposed to preallocate metadata, do that now */
     if (prealloc != PREALLOC_MODE_OFF) {
         BDRVQcowState *s = bs->opaque;
-        vmx_co_mutex_lock(&s->lock);
+        vmx_co_rwlock_wrlock(&s->lock);
         ret = preallocate(bs);
-        vmx_co_mutex_unlock(&s->lock);
+        vmx_co_rwlock_unlock(&s->lock);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not preallocate metadata");
             goto out;
@@ -2076,10 +2147,10 @@ static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
     }
 
     /* Whatever is left can use real zero clusters */
-    vmx_co_mutex_lock(&s->lock);
+    vmx_co_rwlock_wrlock(&s->lock);
     ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
         nb_sectors);
-    vmx_co_mutex_unlock(&s->lock);
+    vmx_co_rwlock_unlock(&s->lock);
 
     return ret;
 }
@@ -2090,10 +2161,10 @@ static coroutine_fn int qcow2_co_discard(BlockDriverState *bs,
     int ret;
     BDRVQcowState *s = bs->opaque;
 
-    vmx_co_mutex_lock(&s->lock);
+    vmx_co_rwlock_wrlock(&s->lock);
     ret = qcow2_discard_clusters(bs, sector_num << BDRV_SECTOR_BITS,
         nb_sectors, QCOW2_DISCARD_REQUEST, false);
-    vmx_co_mutex_unlock(&s->lock);
+    vmx_co_rwlock_unlock(&s->lock);
     return ret;
 }
 
@@ -2138,15 +2209,153 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+typedef struct Qcow2CompressJob {
+    BlockDriverState *bs;
+    CoQueue *waiters;   /* coroutine callers wait here for done */
+    const uint8_t *in;
+    uint8_t *out;
+    int cluster_size;
+    int level;
+    int out_len;    /* compressed size, or -1 if the cluster doesn't shrink */
+    int ret;
+    bool done;
+} Qcow2CompressJob;
+
+static int qcow2_compress_worker(void *opaque)
+{
+    Qcow2CompressJob *job = opaque;
+    z_stream strm;
+    int ret;
+
+    /* small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, job->level,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = job->cluster_size;
+    strm.next_in = (uint8_t *)job->in;
+    strm.avail_out = job->cluster_size;
+    strm.next_out = job->out;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        deflateEnd(&strm);
+        return -EINVAL;
+    }
+    job->out_len = strm.next_out - job->out;
+
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || job->out_len >= job->cluster_size) {
+        job->out_len = -1;
+    }
+    return 0;
+}
+
+static void qcow2_compress_complete(void *opaque, int ret)
+{
+    Qcow2CompressJob *job = opaque;
+
+    job->ret = ret;
+    job->done = true;
+}
+
+static void coroutine_fn qcow2_compress_co_entry(void *opaque)
+{
+    Qcow2CompressJob *job = opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(job->bs));
+
+    qcow2_compress_complete(job,
+        thread_pool_submit_co(pool, qcow2_compress_worker, job));
+    vmx_co_queue_restart_all(job->waiters);
+}
+
+/*
+ * Starts deflating job->in in the thread pool. In coroutine context every
+ * job gets its own coroutine that waits for the worker, so that the caller
+ * can keep several jobs in flight.
+ */
+static void qcow2_compress_submit(BlockDriverState *bs, Qcow2CompressJob *job)
+{
+    job->done = false;
+    if (vmx_in_coroutine()) {
+        Coroutine *co = vmx_coroutine_create(qcow2_compress_co_entry);
+        vmx_coroutine_enter(co, job);
+    } else {
+        thread_pool_submit_aio(aio_get_thread_pool(bdrv_get_aio_context(bs)),
+                               qcow2_compress_worker, job,
+                               qcow2_compress_complete, job);
+    }
+}
+
+static void qcow2_compress_wait(BlockDriverState *bs, Qcow2CompressJob *job)
+{
+    if (vmx_in_coroutine()) {
+        while (!job->done) {
+            vmx_co_queue_wait(job->waiters);
+        }
+        return;
+    }
+    while (!job->done) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+}
+
+/* Writes out one deflated cluster, or the raw data if it didn't shrink */
+static int qcow2_write_compressed_cluster(BlockDriverState *bs,
+                                          int64_t sector_num,
+                                          Qcow2CompressJob *job)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+    int ret;
+
+    if (job->out_len < 0) {
+        /* could not compress: write normal cluster */
+        return bdrv_write(bs, sector_num, job->in, s->cluster_sectors);
+    }
+
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, job->out_len);
+    if (!cluster_offset) {
+        return -EIO;
+    }
+    cluster_offset &= s->cluster_offset_mask;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, job->out_len);
+    if (ret < 0) {
+        return ret;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    return bdrv_pwrite(bs->file, cluster_offset, job->out, job->out_len);
+}
+
+static int qcow2_compress_max_jobs(void)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return MAX(1, MIN(2 * ncpus, QCOW2_MAX_COMPRESS_JOBS));
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
-   tables to avoid losing bytes in alignment */
+   tables to avoid losing bytes in alignment
+
+   Requests may span several clusters. These are deflated in parallel in
+   the thread pool and written out in order as they complete, so that the
+   compressed data stays sequential in the image file. */
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
-    uint8_t *out_buf;
+    Qcow2CompressJob *jobs;
+    CoQueue waiters;
+    int nb_clusters, nb_jobs, submitted, committed, tail, i;
+    int ret;
     uint64_t cluster_offset;
 
     if (nb_sectors == 0) {
@@ -2156,80 +2365,86 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return bdrv_truncate(bs->file, cluster_offset);
     }
 
-    if (nb_sectors != s->cluster_sectors) {
-        ret = -EINVAL;
+    if (sector_num & (s->cluster_sectors - 1)) {
+        return -EINVAL;
+    }
+
+    nb_clusters = nb_sectors / s->cluster_sectors;
+    tail = nb_sectors & (s->cluster_sectors - 1);
+
+    if (tail) {
+        uint8_t *pad_buf;
 
         /* Zero-pad last write if image size is not cluster aligned */
-        if (sector_num + nb_sectors == bs->total_sectors &&
-            nb_sectors < s->cluster_sectors) {
-            uint8_t *pad_buf = vmx_blockalign(bs, s->cluster_size);
-            memset(pad_buf, 0, s->cluster_size);
-            memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
-            vmx_vfree(pad_buf);
+        if (sector_num + nb_sectors != bs->total_sectors) {
+            return -EINVAL;
         }
+        if (nb_clusters) {
+            ret = qcow2_write_compressed(bs, sector_num, buf,
+                                         nb_clusters * s->cluster_sectors);
+            if (ret < 0) {
+                return ret;
+            }
+            sector_num += nb_clusters * s->cluster_sectors;
+            buf += nb_clusters * s->cluster_size;
+        }
+
+        pad_buf = vmx_blockalign(bs, s->cluster_size);
+        memset(pad_buf, 0, s->cluster_size);
+        memcpy(pad_buf, buf, tail * BDRV_SECTOR_SIZE);
+        ret = qcow2_write_compressed(bs, sector_num,
+                                     pad_buf, s->cluster_sectors);
+        vmx_vfree(pad_buf);
         return ret;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
+    nb_jobs = MIN(nb_clusters, qcow2_compress_max_jobs());
+    jobs = g_new0(Qcow2CompressJob, nb_jobs);
+    vmx_co_queue_init(&waiters);
+    for (i = 0; i < nb_jobs; i++) {
+        jobs[i].bs = bs;
+        jobs[i].waiters = &waiters;
+        jobs[i].out = g_malloc(s->cluster_size);
+        jobs[i].cluster_size = s->cluster_size;
+        jobs[i].level = s->compression_level;
     }
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    ret = 0;
+    submitted = 0;
+    for (committed = 0; committed < nb_clusters; committed++) {
+        Qcow2CompressJob *job = &jobs[committed % nb_jobs];
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
+        while (submitted < nb_clusters && submitted - committed < nb_jobs) {
+            Qcow2CompressJob *next = &jobs[submitted % nb_jobs];
 
-    deflateEnd(&strm);
+            next->in = buf + (size_t) submitted * s->cluster_size;
+            qcow2_compress_submit(bs, next);
+            submitted++;
+        }
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
+        qcow2_compress_wait(bs, job);
+        ret = job->ret;
         if (ret < 0) {
-            goto fail;
-        }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
+            break;
         }
-        cluster_offset &= s->cluster_offset_mask;
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
+        ret = qcow2_write_compressed_cluster(bs,
+            sector_num + (int64_t) committed * s->cluster_sectors, job);
         if (ret < 0) {
-            goto fail;
+            break;
         }
+    }
 
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
+    /* On error, jobs that are still running use the buffers */
+    for (i = 0; i < nb_jobs; i++) {
+        if (jobs[i].in) {
+            qcow2_compress_wait(bs, &jobs[i]);
         }
+        g_free(jobs[i].out);
     }
+    g_free(jobs);
 
-    ret = 0;
-fail:
-    g_free(out_buf);
-    return ret;
+    return ret < 0 ? ret : 0;
 }
 
 static int make_completely_empty(BlockDriverState *bs)
@@ -2342,6 +2557,8 @@ static int make_completely_empty(BlockDriverState *bs)
     s->refcount_table[0] = 2 * s->cluster_size;
 
     s->free_cluster_index = 0;
+    qcow2_drop_cluster_map(s);
+    qcow2_compressed_cache_discard(s->compressed_cache, 0, UINT64_MAX);
     assert(3 + l1_clusters <= s->refcount_block_size);
     offset = qcow2_alloc_clusters(bs, 3 * s->cluster_size + l1_size2);
     if (offset < 0) {
@@ -2426,21 +2643,21 @@ static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     int ret;
 
-    vmx_co_mutex_lock(&s->lock);
+    vmx_co_rwlock_wrlock(&s->lock);
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
-        vmx_co_mutex_unlock(&s->lock);
+        vmx_co_rwlock_unlock(&s->lock);
         return ret;
     }
 
     if (qcow2_need_accurate_refcounts(s)) {
         ret = qcow2_cache_flush(bs, s->refcount_block_cache);
         if (ret < 0) {
-            vmx_co_mutex_unlock(&s->lock);
+            vmx_co_rwlock_unlock(&s->lock);
             return ret;
         }
     }
-    vmx_co_mutex_unlock(&s->lock);
+    vmx_co_rwlock_unlock(&s->lock);
 
     return 0;
 }
@@ -2459,6 +2676,7 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
     ImageInfoSpecific *spec_info = g_new(ImageInfoSpecific, 1);
+    uint64_t hits, misses;
 
     *spec_info = (ImageInfoSpecific){
         .kind  = IMAGE_INFO_SPECIFIC_KIND_QCOW2,
@@ -2482,6 +2700,18 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
         };
     }
 
+    qcow2_cache_get_stats(s->l2_table_cache, &hits, &misses);
+    spec_info->qcow2->l2_cache_hits = hits;
+    spec_info->qcow2->has_l2_cache_hits = true;
+    spec_info->qcow2->l2_cache_misses = misses;
+    spec_info->qcow2->has_l2_cache_misses = true;
+
+    qcow2_cache_get_stats(s->refcount_block_cache, &hits, &misses);
+    spec_info->qcow2->refcount_cache_hits = hits;
+    spec_info->qcow2->has_refcount_cache_hits = true;
+    spec_info->qcow2->refcount_cache_misses = misses;
+    spec_info->qcow2->has_refcount_cache_misses = true;
+
     return spec_info;
 }
 
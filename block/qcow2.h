@@ -69,6 +69,27 @@
 
 #define DEFAULT_L2_CACHE_BYTE_SIZE 1048576 /* bytes */
 
+/* L2 tables are cached in slices of this size (or whole clusters if they are
+ * smaller), so that sparse access doesn't pull in full tables */
+#define DEFAULT_L2_CACHE_ENTRY_SIZE 4096 /* bytes */
+#define MIN_L2_CACHE_ENTRY_SIZE 512 /* bytes */
+
+/* Decompressed clusters of compressed images are cached in this much memory */
+#define DEFAULT_COMPRESSED_CACHE_SIZE 1048576 /* bytes */
+#define MIN_COMPRESSED_CACHE_SIZE 2 /* clusters */
+
+/* Number of compressed clusters that a miss in the decompressed cache reads
+ * ahead */
+#define QCOW2_COMPRESSED_READAHEAD 4
+
+/* Upper bound for clusters being deflated at the same time by a single
+ * multi-cluster compressed write */
+#define QCOW2_MAX_COMPRESS_JOBS 64
+
+/* Allocations of up to this many clusters remember where their scan of the
+ * cluster map ended */
+#define QCOW2_FREE_RUN_HINTS 16
+
 /* The refblock cache needs only a fourth of the L2 cache size to cover as many
  * clusters */
 #define DEFAULT_L2_REFCOUNT_SIZE_RATIO 4
@@ -93,6 +114,9 @@
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
+#define QCOW2_OPT_COMPRESSED_CACHE_SIZE "compressed-cache-size"
+#define QCOW2_OPT_COMPRESSION_LEVEL "compression-level"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -159,6 +183,9 @@ typedef struct QCowSnapshot {
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+struct Qcow2CompressedCache;
+typedef struct Qcow2CompressedCache Qcow2CompressedCache;
+
 typedef struct Qcow2UnknownHeaderExtension {
     uint32_t magic;
     uint32_t len;
@@ -219,6 +246,7 @@ typedef struct BDRVQcowState {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_size;
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -232,9 +260,7 @@ typedef struct BDRVQcowState {
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    Qcow2CompressedCache *compressed_cache;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -243,7 +269,14 @@ typedef struct BDRVQcowState {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
-    CoMutex lock;
+    /* Bitmap of used clusters, see qcow2-refcount.c */
+    uint64_t *cluster_map;
+    uint64_t cluster_map_size;
+    uint64_t free_run_hint[QCOW2_FREE_RUN_HINTS];
+
+    /* Held shared for cluster lookups and guest I/O to clusters that are
+     * already allocated, exclusive for allocation and metadata updates */
+    CoRwlock lock;
 
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
@@ -261,6 +294,8 @@ typedef struct BDRVQcowState {
 
     bool discard_passthrough[QCOW2_DISCARD_MAX];
 
+    int compression_level; /* zlib level for compressed writes */
+
     int overlap_check; /* bitmask of Qcow2MetadataOverlap values */
     bool signaled_corruption;
 
@@ -422,6 +457,25 @@ static inline int offset_to_l2_index(BDRVQcowState *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline int offset_to_l2_slice_index(BDRVQcowState *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
+/* Image file offset of the L2 slice that maps the guest offset */
+static inline uint64_t l2_slice_offset(BDRVQcowState *s, uint64_t l2_offset,
+                                       int64_t offset)
+{
+    int l2_index = offset_to_l2_index(s, offset);
+
+    return l2_offset + (l2_index & ~(s->l2_slice_size - 1)) * sizeof(uint64_t);
+}
+
+static inline int l2_slice_bytes(BDRVQcowState *s)
+{
+    return s->l2_slice_size * sizeof(uint64_t);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -486,6 +540,7 @@ void qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
+void qcow2_drop_cluster_map(BDRVQcowState *s);
 
 int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index);
 
@@ -520,7 +575,14 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+Qcow2CompressedCache *qcow2_compressed_cache_create(int num_clusters,
+                                                    int cluster_size);
+void qcow2_compressed_cache_destroy(BlockDriverState *bs,
+                                    Qcow2CompressedCache *c);
+void qcow2_compressed_cache_discard(Qcow2CompressedCache *c, uint64_t offset,
+                                    uint64_t length);
+int coroutine_fn qcow2_co_read_compressed(BlockDriverState *bs,
+    uint64_t guest_offset, uint64_t cluster_offset, QEMUIOVector *qiov);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
@@ -528,6 +590,8 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
 
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
+int qcow2_get_allocated_range(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *host_offset);
 int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *host_offset, QCowL2Meta **m);
 uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
@@ -559,8 +623,10 @@ void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
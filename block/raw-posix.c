@@ -140,6 +140,9 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_io_uring;
+#endif
 #ifdef CONFIG_XFS
     bool is_xfs:1;
 #endif
@@ -155,6 +158,9 @@ typedef struct BDRVRawReopenState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_io_uring;
+#endif
 } BDRVRawReopenState;
 
 static int fd_open(BlockDriverState *bs);
@@ -439,6 +445,9 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_io_uring = !!(bdrv_flags & BDRV_O_IO_URING);
+#endif
 
     s->has_discard = true;
     s->has_write_zeroes = true;
@@ -543,6 +552,9 @@ static int raw_reopen_prepare(BDRVReopenState *state,
         return -1;
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    raw_s->use_io_uring = !!(state->flags & BDRV_O_IO_URING);
+#endif
 
     if (s->type == FTYPE_FD || s->type == FTYPE_CD) {
         raw_s->open_flags |= O_NONBLOCK;
@@ -623,6 +635,9 @@ static void raw_reopen_commit(BDRVReopenState *state)
 #ifdef CONFIG_LINUX_AIO
     s->use_aio = raw_s->use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_io_uring = raw_s->use_io_uring;
+#endif
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -1101,6 +1116,22 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* Misaligned requests need the bounce buffer of the thread pool path */
+    if (s->use_io_uring && !(type & QEMU_AIO_MISALIGNED)) {
+        LuringState *ring = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        BlockAIOCB *acb = NULL;
+
+        if (ring) {
+            acb = luring_submit(bs, ring, s->fd, sector_num, qiov,
+                                nb_sectors, cb, opaque, type);
+        }
+        if (acb) {
+            return acb;
+        }
+    }
+#endif
+
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
 }
@@ -1113,6 +1144,15 @@ static void raw_aio_plug(BlockDriverState *bs)
         laio_io_plug(bs, s->aio_ctx);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *rs = bs->opaque;
+    if (rs->use_io_uring) {
+        LuringState *ring = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        if (ring) {
+            luring_io_plug(bs, ring);
+        }
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
@@ -1123,6 +1163,15 @@ static void raw_aio_unplug(BlockDriverState *bs)
         laio_io_unplug(bs, s->aio_ctx, true);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *rs = bs->opaque;
+    if (rs->use_io_uring) {
+        LuringState *ring = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        if (ring) {
+            luring_io_unplug(bs, ring, true);
+        }
+    }
+#endif
 }
 
 static void raw_aio_flush_io_queue(BlockDriverState *bs)
@@ -1133,6 +1182,15 @@ static void raw_aio_flush_io_queue(BlockDriverState *bs)
         laio_io_unplug(bs, s->aio_ctx, false);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *rs = bs->opaque;
+    if (rs->use_io_uring) {
+        LuringState *ring = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        if (ring) {
+            luring_io_unplug(bs, ring, false);
+        }
+    }
+#endif
 }
 
 static BlockAIOCB *raw_aio_readv(BlockDriverState *bs,
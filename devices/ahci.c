@@ -108,7 +108,7 @@ static uint32_t  ahci_port_read(AHCIState *s, int port, int offset)
         val = pr->scr_act;
         break;
     case PORT_CMD_ISSUE:
-        val = pr->cmd_issue;
+        val = atomic_read(&pr->cmd_issue);
         break;
     case PORT_RESERVED:
     default:
@@ -223,6 +223,20 @@ static int ahci_cond_start_engines(AHCIDevice *ad)
     return 0;
 }
 
+static void ahci_cmd_issue_set(AHCIDevice *ad, uint32_t mask)
+{
+    vmx_mutex_lock(&ad->lock);
+    ad->port_regs.cmd_issue |= mask;
+    vmx_mutex_unlock(&ad->lock);
+}
+
+static void ahci_cmd_issue_clear(AHCIDevice *ad, uint32_t mask)
+{
+    vmx_mutex_lock(&ad->lock);
+    ad->port_regs.cmd_issue &= ~mask;
+    vmx_mutex_unlock(&ad->lock);
+}
+
 static void  ahci_port_write(AHCIState *s, int port, int offset, uint32_t val)
 {
     AHCIPortRegs *pr = &s->dev[port].port_regs;
@@ -297,8 +311,9 @@ static void  ahci_port_write(AHCIState *s, int port, int offset, uint32_t val)
             pr->scr_act |= val;
             break;
         case PORT_CMD_ISSUE:
-            pr->cmd_issue |= val;
-            check_cmd(s, port);
+            /* may run on a vcpu thread without the BQL */
+            ahci_cmd_issue_set(&s->dev[port], val);
+            vmx_bh_schedule(s->dev[port].issue_bh);
             break;
         default:
             break;
@@ -422,8 +437,28 @@ static void ahci_mem_write(void *opaque, hwaddr addr,
 
 }
 
+/*
+ * HBA register reads have no side effects and may run without the BQL. So
+ * can PxCI doorbell writes: they only set bits under the port lock and
+ * leave the commands to issue_bh.
+ */
+static bool ahci_mem_unlocked(void *opaque, uint64_t addr, unsigned size,
+                              bool is_write)
+{
+    AHCIState *s = opaque;
+
+    if (!is_write) {
+        return true;
+    }
+    return addr >= AHCI_PORT_REGS_START_ADDR &&
+           addr < AHCI_PORT_REGS_START_ADDR +
+                  s->ports * AHCI_PORT_ADDR_OFFSET_LEN &&
+           (addr & AHCI_PORT_ADDR_OFFSET_MASK) == PORT_CMD_ISSUE;
+}
+
 static const MemAreaOps ahci_mem_ops = {
     .read = ahci_mem_read,
+    .unlocked = ahci_mem_unlocked,
     .write = ahci_mem_write,
     .endianness = DEVICE_LITTLE_ENDIAN,
 };
@@ -485,19 +520,27 @@ static void ahci_reg_init(AHCIState *s)
 
 static void check_cmd(AHCIState *s, int port)
 {
-    AHCIPortRegs *pr = &s->dev[port].port_regs;
+    AHCIDevice *ad = &s->dev[port];
+    AHCIPortRegs *pr = &ad->port_regs;
     uint8_t slot;
 
-    if ((pr->cmd & PORT_CMD_START) && pr->cmd_issue) {
-        for (slot = 0; (slot < 32) && pr->cmd_issue; slot++) {
-            if ((pr->cmd_issue & (1U << slot)) &&
+    if ((pr->cmd & PORT_CMD_START) && atomic_read(&pr->cmd_issue)) {
+        for (slot = 0; (slot < 32) && atomic_read(&pr->cmd_issue); slot++) {
+            if ((atomic_read(&pr->cmd_issue) & (1U << slot)) &&
                 !handle_cmd(s, port, slot)) {
-                pr->cmd_issue &= ~(1U << slot);
+                ahci_cmd_issue_clear(ad, 1U << slot);
             }
         }
     }
 }
 
+static void ahci_issue_bh(void *opaque)
+{
+    AHCIDevice *ad = opaque;
+
+    check_cmd(ad->hba, ad->port_no);
+}
+
 static void ahci_check_cmd_bh(void *opaque)
 {
     AHCIDevice *ad = opaque;
@@ -508,7 +551,7 @@ static void ahci_check_cmd_bh(void *opaque)
     if ((ad->busy_slot != -1) &&
         !(ad->port.ifs[0].status & (BUSY_STAT|DRQ_STAT))) {
         /* no longer busy */
-        ad->port_regs.cmd_issue &= ~(1 << ad->busy_slot);
+        ahci_cmd_issue_clear(ad, 1U << ad->busy_slot);
         ad->busy_slot = -1;
     }
 
@@ -895,11 +938,16 @@ static void ncq_err(NCQTransferState *ncq_tfs)
 
 static void ncq_finish(NCQTransferState *ncq_tfs)
 {
+    BlockAcctStats *stats = blk_get_stats(ncq_tfs->drive->port.ifs[0].blk);
+
     /* If we didn't error out, set our finished bit. Errored commands
      * do not get a bit set for the SDB FIS ACT register, nor do they
      * clear the outstanding bit in scr_act (PxSACT). */
     if (!(ncq_tfs->drive->port_regs.scr_err & (1 << ncq_tfs->tag))) {
         ncq_tfs->drive->finished |= (1 << ncq_tfs->tag);
+        block_acct_done(stats, &ncq_tfs->acct);
+    } else {
+        block_acct_failed(stats, &ncq_tfs->acct);
     }
 
     ahci_write_fis_sdb(ncq_tfs->drive->hba, ncq_tfs);
@@ -907,8 +955,6 @@ static void ncq_finish(NCQTransferState *ncq_tfs)
     DPRINTF(ncq_tfs->drive->port_no, "NCQ transfer tag %d finished\n",
             ncq_tfs->tag);
 
-    block_acct_done(blk_get_stats(ncq_tfs->drive->port.ifs[0].blk),
-                    &ncq_tfs->acct);
     veertu_sglist_destroy(&ncq_tfs->sglist);
     ncq_tfs->used = 0;
 }
@@ -974,8 +1020,8 @@ static void execute_ncq_command(NCQTransferState *ncq_tfs)
         DPRINTF(port, "tag %d aio read %"PRId64"\n",
                 ncq_tfs->tag, ncq_tfs->lba);
 
-        block_acct_start(ide_state->blk, &ncq_tfs->acct,
-                       &ncq_tfs->sglist, BLOCK_ACCT_READ);
+        block_acct_start(blk_get_stats(ide_state->blk), &ncq_tfs->acct,
+                         ncq_tfs->sglist.size, BLOCK_ACCT_READ);
         ncq_tfs->aiocb = dma_blk_read(ide_state->blk, &ncq_tfs->sglist,
                                       ncq_tfs->lba, ncq_cb, ncq_tfs);
         break;
@@ -986,8 +1032,8 @@ static void execute_ncq_command(NCQTransferState *ncq_tfs)
         DPRINTF(port, "tag %d aio write %"PRId64"\n",
                 ncq_tfs->tag, ncq_tfs->lba);
 
-        block_acct_start(ide_state->blk, &ncq_tfs->acct,
-                       &ncq_tfs->sglist, BLOCK_ACCT_WRITE);
+        block_acct_start(blk_get_stats(ide_state->blk), &ncq_tfs->acct,
+                         ncq_tfs->sglist.size, BLOCK_ACCT_WRITE);
         ncq_tfs->aiocb = dma_blk_write(ide_state->blk, &ncq_tfs->sglist,
                                        ncq_tfs->lba, ncq_cb, ncq_tfs);
         break;
@@ -1428,6 +1474,7 @@ void ahci_init(AHCIState *s, DeviceState *qdev, VeertuAddressSpace *as, int port
     /* XXX BAR size should be 1k, but that breaks, so bump it to 4k for now */
     memory_area_init_io(&s->mem, VeertuTypeHold(qdev), &ahci_mem_ops, s,
                           "ahci", AHCI_MEM_BAR_SIZE);
+    memory_area_clear_global_locking(&s->mem);
     memory_area_init_io(&s->idp, VeertuTypeHold(qdev), &ahci_idp_ops, s,
                           "ahci-idp", 32);
 
@@ -1444,12 +1491,20 @@ void ahci_init(AHCIState *s, DeviceState *qdev, VeertuAddressSpace *as, int port
         ad->port.dma = &ad->dma;
         ad->port.dma->ops = &ahci_dma_ops;
         ide_register_restart_cb(&ad->port);
+        ad->issue_bh = vmx_bh_new(ahci_issue_bh, ad);
+        vmx_mutex_init(&ad->lock);
     }
 }
 
 
 void ahci_uninit(AHCIState *s)
 {
+    int i;
+
+    for (i = 0; i < s->ports; i++) {
+        vmx_bh_delete(s->dev[i].issue_bh);
+        vmx_mutex_destroy(&s->dev[i].lock);
+    }
     g_free(s->dev);
 }
 
@@ -277,6 +277,10 @@ struct AHCIDevice {
     AHCIPortRegs port_regs;
     struct AHCIState *hba;
     QEMUBH *check_bh;
+    /* runs the commands a PxCI doorbell write issued, under the BQL */
+    QEMUBH *issue_bh;
+    /* protects port_regs.cmd_issue, doorbell writes don't take the BQL */
+    QemuMutex lock;
     uint8_t *lst;
     uint8_t *res_fis;
     bool done_atapi_packet;
@@ -869,7 +869,39 @@ static void apic_post_load(APICCommonState *s)
     }
 }
 
+/*
+ * Register reads only load from the current vcpu's APIC, except the TPR
+ * (vapic sync), the timer count and invalid offsets (which latch ESR).
+ *
+ * The unlocked path skips update_apic_tpr(), so s->tpr may be older than
+ * the TPR the guest last wrote through CR8; APR and PPR are computed from
+ * it and stay under the iothread mutex.  The remaining registers don't
+ * depend on the TPR.  Other vcpus and devices update IRR/ISR/TMR/ESR under
+ * the iothread mutex, a racing read sees each 32-bit word either before or
+ * after the update, as a read racing interrupt delivery does on hardware.
+ */
+static bool apic_mem_unlocked(void *opaque, uint64_t addr, unsigned size,
+                              bool is_write)
+{
+    int index = (addr >> 4) & 0xff;
+
+    if (is_write) {
+        return false;
+    }
+    switch (index) {
+    case 0x02 ... 0x03:
+    case 0x0b:
+    case 0x0d ... 0x28:
+    case 0x30 ... 0x38:
+    case 0x3e:
+        return true;
+    default:
+        return false;
+    }
+}
+
 static const MemAreaOps apic_io_ops = {
+    .unlocked = apic_mem_unlocked,
     .old_mmio = {
         .read = { apic_mem_readb, apic_mem_readw, apic_mem_readl, },
         .write = { apic_mem_writeb, apic_mem_writew, apic_mem_writel, },
@@ -883,6 +915,7 @@ static void apic_realize(DeviceState *dev, Error **errp)
 
     memory_area_init_io(&s->io_memory, VeertuTypeHold(s), &apic_io_ops, s, "apic-msi",
                           APIC_SPACE_SIZE);
+    memory_area_clear_global_locking(&s->io_memory);
 
     s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, apic_timer, s);
     local_apics[s->idx] = s;
@@ -34,6 +34,7 @@
 #include "emudma.h"
 #include "qemu/iov.h"
 #include "qemu/range.h"
+#include "qemu/main-loop.h"
 
 #include "e1000_regs.h"
 
@@ -68,6 +69,13 @@ static int debugflags = DBGBIT(TXERR) | DBGBIT(GENERAL);
 
 #define MAXIMUM_ETHERNET_HDR_LEN (14+4)
 
+/* Descriptors fetched from the TX ring per DMA */
+#define E1000_TX_BATCH    64
+/* Guest buffers one TSO segment's payload may be spread over */
+#define E1000_TX_MAX_IOV  64
+/* Descriptors fetched from the RX ring per DMA during a burst */
+#define E1000_RX_BATCH    64
+
 /*
  * HW models:
  *  E1000_DEV_ID_82540EM works with Windows, Linux, and OS X <= 10.8
@@ -115,7 +123,25 @@ typedef struct E1000State_st {
         int8_t ip;
         int8_t tcp;
         char cptse;     // current packet tse bit
+        /* TSO payload left in guest memory, following the first
+         * size - iov_bytes bytes of data.
+         */
+        struct iovec iov[E1000_TX_MAX_IOV];
+        int iovcnt;
+        uint32_t iov_bytes;
     } tx;
+    QEMUBH *tx_bh;
+
+    /* RX descriptors prefetched from the ring starting at rx_desc_head.
+     * The first rx_desc_used have been filled and are written back at the
+     * end of the packet, or of the burst when rx_batch is non-zero.
+     */
+    struct e1000_rx_desc rx_desc[E1000_RX_BATCH];
+    uint32_t rx_desc_head;
+    int rx_desc_count;
+    int rx_desc_used;
+    uint32_t rx_ics;    /* causes to raise once the descriptors are out */
+    int rx_batch;
 
     struct {
         uint32_t val_in;	// shifted in from guest driver
@@ -395,6 +421,20 @@ rxbufsize(uint32_t v)
     return 2048;
 }
 
+static void
+e1000_tx_unmap(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+    int i;
+
+    for (i = 0; i < tp->iovcnt; i++) {
+        pci_dma_unmap(PCI_DEVICE(s), tp->iov[i].iov_base, tp->iov[i].iov_len,
+                      0, tp->iov[i].iov_len);
+    }
+    tp->iovcnt = 0;
+    tp->iov_bytes = 0;
+}
+
 static void e1000_reset(void *opaque)
 {
     E1000State *d = opaque;
@@ -413,7 +453,11 @@ static void e1000_reset(void *opaque)
     memset(d->mac_reg, 0, sizeof d->mac_reg);
     memmove(d->mac_reg, mac_reg_init, sizeof mac_reg_init);
     d->rxbuf_min_shift = 1;
+    e1000_tx_unmap(d);
     memset(&d->tx, 0, sizeof d->tx);
+    d->rx_desc_count = 0;
+    d->rx_desc_used = 0;
+    d->rx_ics = 0;
 
     if (vmx_get_queue(d->nic)->link_down) {
         e1000_link_down(d);
@@ -603,6 +647,121 @@ e1000_send_packet(E1000State *s, const uint8_t *buf, int size)
     }
 }
 
+static void
+e1000_send_packet_iov(E1000State *s, const uint8_t *buf, int size)
+{
+    NetClientState *nc = vmx_get_queue(s->nic);
+    struct e1000_tx *tp = &s->tx;
+    struct iovec iov[E1000_TX_MAX_IOV + 1];
+
+    iov[0].iov_base = (uint8_t *)buf;
+    iov[0].iov_len = size;
+    memcpy(iov + 1, tp->iov, sizeof(tp->iov[0]) * tp->iovcnt);
+    if (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) {
+        nc->info->receive_iov(nc, iov, tp->iovcnt + 1);
+    } else {
+        vmx_sendv_packet(nc, iov, tp->iovcnt + 1);
+    }
+}
+
+/* Pull payload still in guest memory into tx.data */
+static void
+e1000_tx_flatten(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+
+    if (!tp->iov_bytes) {
+        return;
+    }
+    iov_to_buf(tp->iov, tp->iovcnt, 0, tp->data + tp->size - tp->iov_bytes,
+               tp->iov_bytes);
+    e1000_tx_unmap(s);
+}
+
+/* Append guest memory to the current segment's payload without copying.
+ * All or nothing: on failure the caller has to read it into tx.data.
+ */
+static bool
+e1000_tx_map(E1000State *s, uint64_t addr, unsigned int bytes)
+{
+    struct e1000_tx *tp = &s->tx;
+    int iovcnt = tp->iovcnt;
+    unsigned int left = bytes;
+
+    while (left) {
+        uint64_t len = left;
+        void *p;
+
+        if (tp->iovcnt == E1000_TX_MAX_IOV) {
+            goto fail;
+        }
+        p = pci_dma_map(PCI_DEVICE(s), addr, &len, 0);
+        if (!p) {
+            goto fail;
+        }
+        tp->iov[tp->iovcnt].iov_base = p;
+        tp->iov[tp->iovcnt].iov_len = len;
+        tp->iovcnt++;
+        addr += len;
+        left -= len;
+    }
+    tp->iov_bytes += bytes;
+    return true;
+
+fail:
+    while (tp->iovcnt > iovcnt) {
+        tp->iovcnt--;
+        pci_dma_unmap(PCI_DEVICE(s), tp->iov[tp->iovcnt].iov_base,
+                      tp->iov[tp->iovcnt].iov_len, 0, 0);
+    }
+    return false;
+}
+
+/* Whether xmit_seg can patch headers and checksum a segment whose payload
+ * is still in guest memory: every field it writes must be in tx.data and
+ * each piece of the TCP/UDP checksum must start on an even offset.
+ */
+static bool
+e1000_tx_iov_ok(struct e1000_tx *tp)
+{
+    unsigned int linear = tp->size - tp->iov_bytes;
+    int i;
+
+    if (tp->ipcss + 6 > linear || tp->tucss + 14 > linear) {
+        return false;
+    }
+    if (tp->sum_needed & E1000_TXD_POPTS_TXSM) {
+        if (tp->tucso + 2 > linear || (tp->tucse && tp->tucse < tp->size) ||
+            ((linear - tp->tucss) & 1)) {
+            return false;
+        }
+        for (i = 0; i < tp->iovcnt - 1; i++) {
+            if (tp->iov[i].iov_len & 1) {
+                return false;
+            }
+        }
+    }
+    if ((tp->sum_needed & E1000_TXD_POPTS_IXSM) &&
+        (tp->ipcso + 2 > linear || !tp->ipcse || tp->ipcse >= linear)) {
+        return false;
+    }
+    return true;
+}
+
+static void
+putsum_iov(struct e1000_tx *tp, uint32_t sloc, uint32_t css)
+{
+    unsigned int linear = tp->size - tp->iov_bytes;
+    uint32_t sum;
+    int i;
+
+    sum = ip_checksum_add(0, tp->data + css, linear - css);
+    for (i = 0; i < tp->iovcnt; i++) {
+        sum = ip_checksum_add(sum, tp->iov[i].iov_base, tp->iov[i].iov_len);
+    }
+    stw_be_p(tp->data + sloc, ip_checksum_finish(sum));
+}
+
 static void
 xmit_seg(E1000State *s)
 {
@@ -610,6 +769,10 @@ xmit_seg(E1000State *s)
     unsigned int frames = s->tx.tso_frames, css, sofar, n;
     struct e1000_tx *tp = &s->tx;
 
+    if (tp->iov_bytes && !e1000_tx_iov_ok(tp)) {
+        e1000_tx_flatten(s);
+    }
+
     if (tp->tse && tp->cptse) {
         css = tp->ipcss;
         DBGOUT(TXSUM, "frames %d size %d ipcss %d\n",
@@ -641,14 +804,26 @@ xmit_seg(E1000State *s)
         tp->tso_frames++;
     }
 
-    if (tp->sum_needed & E1000_TXD_POPTS_TXSM)
-        putsum(tp->data, tp->size, tp->tucso, tp->tucss, tp->tucse);
+    if (tp->sum_needed & E1000_TXD_POPTS_TXSM) {
+        if (tp->iov_bytes) {
+            putsum_iov(tp, tp->tucso, tp->tucss);
+        } else {
+            putsum(tp->data, tp->size, tp->tucso, tp->tucss, tp->tucse);
+        }
+    }
     if (tp->sum_needed & E1000_TXD_POPTS_IXSM)
         putsum(tp->data, tp->size, tp->ipcso, tp->ipcss, tp->ipcse);
     if (tp->vlan_needed) {
         memmove(tp->vlan, tp->data, 4);
         memmove(tp->data, tp->data + 4, 8);
         memcpy(tp->data + 8, tp->vlan_header, 4);
+    }
+    if (tp->iov_bytes) {
+        e1000_send_packet_iov(s, tp->vlan_needed ? tp->vlan : tp->data,
+                              tp->size - tp->iov_bytes +
+                              (tp->vlan_needed ? 4 : 0));
+        e1000_tx_unmap(s);
+    } else if (tp->vlan_needed) {
         e1000_send_packet(s, tp->vlan, tp->size + 4);
     } else
         e1000_send_packet(s, tp->data, tp->size);
@@ -721,7 +896,13 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
                 bytes = msh - tp->size;
 
             bytes = MIN(sizeof(tp->data) - tp->size, bytes);
-            pci_dma_read(d, addr, tp->data + tp->size, bytes);
+            /* Payload is sent straight from guest memory when possible,
+             * only the headers are rebuilt in tx.data for each segment.
+             */
+            if (tp->size < tp->hdr_len || !e1000_tx_map(s, addr, bytes)) {
+                e1000_tx_flatten(s);
+                pci_dma_read(d, addr, tp->data + tp->size, bytes);
+            }
             sz = tp->size + bytes;
             if (sz >= tp->hdr_len && tp->size < tp->hdr_len) {
                 memmove(tp->header, tp->data, tp->hdr_len);
@@ -755,10 +936,12 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     tp->cptse = 0;
 }
 
+/* Sets the status of a descriptor that wants it reported; the caller
+ * writes the descriptor back.
+ */
 static uint32_t
-txdesc_writeback(E1000State *s, uint64_t base, struct e1000_tx_desc *dp)
+txdesc_writeback(E1000State *s, struct e1000_tx_desc *dp)
 {
-    PCIDevice *d = PCI_DEVICE(s);
     uint32_t txd_upper, txd_lower = le32_to_cpu(dp->lower.data);
 
     if (!(txd_lower & (E1000_TXD_CMD_RS|E1000_TXD_CMD_RPS)))
@@ -766,8 +949,6 @@ txdesc_writeback(E1000State *s, uint64_t base, struct e1000_tx_desc *dp)
     txd_upper = (le32_to_cpu(dp->upper.data) | E1000_TXD_STAT_DD) &
                 ~(E1000_TXD_STAT_EC | E1000_TXD_STAT_LC | E1000_TXD_STAT_TU);
     dp->upper.data = cpu_to_le32(txd_upper);
-    pci_dma_write(d, base + ((char *)&dp->upper - (char *)dp),
-                  &dp->upper, sizeof(dp->upper));
     return E1000_ICR_TXDW;
 }
 
@@ -779,47 +960,98 @@ static uint64_t tx_desc_base(E1000State *s)
     return (bah << 32) + bal;
 }
 
+/*
+ * Runs from a bottom half, so TDT writes return to the guest right away.
+ * Descriptors are read a ring segment at a time and the ones whose status
+ * changed are written back with one DMA per segment.
+ */
 static void
 start_xmit(E1000State *s)
 {
     PCIDevice *d = PCI_DEVICE(s);
     uint64_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc desc[E1000_TX_BATCH];
     uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE;
+    uint32_t ndesc = s->mac_reg[TDLEN] / sizeof(desc[0]);
+    bool wrapped = false;
 
     if (!(s->mac_reg[TCTL] & E1000_TCTL_EN)) {
         DBGOUT(TX, "tx disabled\n");
         return;
     }
 
-    while (s->mac_reg[TDH] != s->mac_reg[TDT]) {
-        base = tx_desc_base(s) +
-               sizeof(struct e1000_tx_desc) * s->mac_reg[TDH];
-        pci_dma_read(d, base, &desc, sizeof(desc));
+    while (s->mac_reg[TDH] != s->mac_reg[TDT] && !wrapped) {
+        uint32_t head = s->mac_reg[TDH], tail = s->mac_reg[TDT];
+        int i, n, wb_first = -1, wb_last = -1;
 
-        DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
-               (void *)(intptr_t)desc.buffer_addr, desc.lower.data,
-               desc.upper.data);
+        /* Up to the tail or the end of the ring, whichever comes first;
+         * a bogus TDT past the ring is treated as the end of the ring.
+         */
+        tail = MIN(tail, ndesc);
+        if (head >= ndesc) {
+            n = 1;
+        } else {
+            n = MIN((tail > head ? tail : ndesc) - head, E1000_TX_BATCH);
+        }
+        base = tx_desc_base(s) + sizeof(desc[0]) * head;
+        pci_dma_read(d, base, desc, sizeof(desc[0]) * n);
+
+        for (i = 0; i < n; i++) {
+            uint32_t c;
+
+            DBGOUT(TX, "index %d: %p : %x %x\n", head,
+                   (void *)(intptr_t)desc[i].buffer_addr, desc[i].lower.data,
+                   desc[i].upper.data);
+
+            process_tx_desc(s, &desc[i]);
+            c = txdesc_writeback(s, &desc[i]);
+            if (c) {
+                cause |= c;
+                if (wb_first < 0) {
+                    wb_first = i;
+                }
+                wb_last = i;
+            }
 
-        process_tx_desc(s, &desc);
-        cause |= txdesc_writeback(s, base, &desc);
+            if (++head * sizeof(desc[0]) >= s->mac_reg[TDLEN])
+                head = 0;
+            /*
+             * the following could happen only if guest sw assigns
+             * bogus values to TDT/TDLEN.
+             * there's nothing too intelligent we could do about this.
+             */
+            if (head == tdh_start) {
+                DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
+                       tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
+                wrapped = true;
+                break;
+            }
+            /* The rest of desc[] is not contiguous with slot 0; re-fetch */
+            if (head == 0) {
+                break;
+            }
+        }
 
-        if (++s->mac_reg[TDH] * sizeof(desc) >= s->mac_reg[TDLEN])
-            s->mac_reg[TDH] = 0;
-        /*
-         * the following could happen only if guest sw assigns
-         * bogus values to TDT/TDLEN.
-         * there's nothing too intelligent we could do about this.
+        /* Descriptors reported done must not reference guest memory any
+         * more: a TSO segment continuing into the next batch is copied.
          */
-        if (s->mac_reg[TDH] == tdh_start) {
-            DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
-                   tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
-            break;
+        e1000_tx_flatten(s);
+        if (wb_first >= 0) {
+            pci_dma_write(d, base + sizeof(desc[0]) * wb_first,
+                          &desc[wb_first],
+                          sizeof(desc[0]) * (wb_last - wb_first + 1));
         }
+        s->mac_reg[TDH] = head;
     }
     set_ics(s, 0, cause);
 }
 
+static void
+e1000_tx_bh(void *opaque)
+{
+    start_xmit(opaque);
+}
+
 static int
 receive_filter(E1000State *s, const uint8_t *buf, int size)
 {
@@ -933,14 +1165,96 @@ static uint64_t rx_desc_base(E1000State *s)
     return (bah << 32) + bal;
 }
 
+/* Write the filled RX descriptors back to the ring with a single DMA */
+static void e1000_rx_desc_writeback(E1000State *s)
+{
+    if (s->rx_desc_used) {
+        pci_dma_write(PCI_DEVICE(s), rx_desc_base(s) +
+                      sizeof(struct e1000_rx_desc) * s->rx_desc_head,
+                      s->rx_desc,
+                      sizeof(struct e1000_rx_desc) * s->rx_desc_used);
+    }
+    s->rx_desc_count = 0;
+    s->rx_desc_used = 0;
+}
+
+/* Return the descriptor at RDH.  When the prefetched ones are used up,
+ * write them back and read up to "want" more, stopping at RDT or at the
+ * end of the ring.
+ */
+static struct e1000_rx_desc *
+e1000_rx_desc_next(E1000State *s, unsigned int want)
+{
+    uint32_t ndesc = s->mac_reg[RDLEN] / sizeof(struct e1000_rx_desc);
+    uint32_t head = s->mac_reg[RDH];
+    uint32_t tail = MIN(s->mac_reg[RDT], ndesc);
+    unsigned int n = 1;
+
+    if (s->rx_desc_used < s->rx_desc_count &&
+        s->rx_desc_head + s->rx_desc_used == head) {
+        return &s->rx_desc[s->rx_desc_used++];
+    }
+
+    e1000_rx_desc_writeback(s);
+
+    if (head < ndesc) {
+        n = MIN((tail > head ? tail : ndesc) - head, want);
+        n = MAX(MIN(n, E1000_RX_BATCH), 1);
+    }
+    pci_dma_read(PCI_DEVICE(s),
+                 rx_desc_base(s) + sizeof(struct e1000_rx_desc) * head,
+                 s->rx_desc, sizeof(struct e1000_rx_desc) * n);
+    s->rx_desc_head = head;
+    s->rx_desc_count = n;
+    s->rx_desc_used = 1;
+    return &s->rx_desc[0];
+}
+
+/* Publish the received descriptors, then raise the pending causes.  Going
+ * through set_ics() keeps the interrupt moderation timers in charge.
+ */
+static void e1000_rx_flush(E1000State *s)
+{
+    uint32_t cause = s->rx_ics;
+
+    e1000_rx_desc_writeback(s);
+    s->rx_ics = 0;
+    if (cause) {
+        set_ics(s, 0, cause);
+    }
+}
+
+static void e1000_rx_done(E1000State *s, uint32_t cause)
+{
+    s->rx_ics |= cause;
+    if (!s->rx_batch) {
+        e1000_rx_flush(s);
+    }
+}
+
+static void e1000_batch_begin(NetClientState *nc)
+{
+    E1000State *s = vmx_get_nic_opaque(nc);
+
+    s->rx_batch++;
+}
+
+static void e1000_batch_end(NetClientState *nc)
+{
+    E1000State *s = vmx_get_nic_opaque(nc);
+
+    if (--s->rx_batch == 0) {
+        e1000_rx_flush(s);
+    }
+}
+
 static ssize_t
 e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
     E1000State *s = vmx_get_nic_opaque(nc);
     PCIDevice *d = PCI_DEVICE(s);
-    struct e1000_rx_desc desc;
-    uint64_t base;
-    unsigned int n, rdt;
+    struct e1000_rx_desc *desc;
+    unsigned int n, rdt, want;
     uint32_t rdh_start;
     uint16_t vlan_special = 0;
     uint8_t vlan_status = 0;
@@ -1008,7 +1322,7 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
     desc_offset = 0;
     total_size = size + fcs_len(s);
     if (!e1000_has_rxbufs(s, total_size)) {
-            set_ics(s, 0, E1000_ICS_RXO);
+            e1000_rx_done(s, E1000_ICS_RXO);
             return -1;
     }
     do {
@@ -1016,14 +1330,16 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
         if (desc_size > s->rxbuf_size) {
             desc_size = s->rxbuf_size;
         }
-        base = rx_desc_base(s) + sizeof(desc) * s->mac_reg[RDH];
-        pci_dma_read(d, base, &desc, sizeof(desc));
-        desc.special = vlan_special;
-        desc.status |= (vlan_status | E1000_RXD_STAT_DD);
-        if (desc.buffer_addr) {
+        /* Outside a burst only fetch what this packet needs */
+        want = s->rx_batch ? E1000_RX_BATCH :
+               DIV_ROUND_UP(total_size - desc_offset, s->rxbuf_size);
+        desc = e1000_rx_desc_next(s, want);
+        desc->special = vlan_special;
+        desc->status |= (vlan_status | E1000_RXD_STAT_DD);
+        if (desc->buffer_addr) {
             if (desc_offset < size) {
                 size_t iov_copy;
-                hwaddr ba = le64_to_cpu(desc.buffer_addr);
+                hwaddr ba = le64_to_cpu(desc->buffer_addr);
                 size_t copy_size = size - desc_offset;
                 if (copy_size > s->rxbuf_size) {
                     copy_size = s->rxbuf_size;
@@ -1041,26 +1357,25 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
                 } while (copy_size);
             }
             desc_offset += desc_size;
-            desc.length = cpu_to_le16(desc_size);
+            desc->length = cpu_to_le16(desc_size);
             if (desc_offset >= total_size) {
-                desc.status |= E1000_RXD_STAT_EOP | E1000_RXD_STAT_IXSM;
+                desc->status |= E1000_RXD_STAT_EOP | E1000_RXD_STAT_IXSM;
             } else {
                 /* Guest zeroing out status is not a hardware requirement.
                    Clear EOP in case guest didn't do it. */
-                desc.status &= ~E1000_RXD_STAT_EOP;
+                desc->status &= ~E1000_RXD_STAT_EOP;
             }
         } else { // as per intel docs; skip descriptors with null buf addr
             DBGOUT(RX, "Null RX descriptor!!\n");
         }
-        pci_dma_write(d, base, &desc, sizeof(desc));
 
-        if (++s->mac_reg[RDH] * sizeof(desc) >= s->mac_reg[RDLEN])
+        if (++s->mac_reg[RDH] * sizeof(*desc) >= s->mac_reg[RDLEN])
             s->mac_reg[RDH] = 0;
         /* see comment in start_xmit; same here */
         if (s->mac_reg[RDH] == rdh_start) {
             DBGOUT(RXERR, "RDH wraparound @%x, RDT %x, RDLEN %x\n",
                    rdh_start, s->mac_reg[RDT], s->mac_reg[RDLEN]);
-            set_ics(s, 0, E1000_ICS_RXO);
+            e1000_rx_done(s, E1000_ICS_RXO);
             return -1;
         }
     } while (desc_offset < total_size);
@@ -1078,12 +1393,12 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
 
     n = E1000_ICS_RXT0;
     if ((rdt = s->mac_reg[RDT]) < s->mac_reg[RDH])
-        rdt += s->mac_reg[RDLEN] / sizeof(desc);
-    if (((rdt - s->mac_reg[RDH]) * sizeof(desc)) <= s->mac_reg[RDLEN] >>
+        rdt += s->mac_reg[RDLEN] / sizeof(*desc);
+    if (((rdt - s->mac_reg[RDH]) * sizeof(*desc)) <= s->mac_reg[RDLEN] >>
         s->rxbuf_min_shift)
         n |= E1000_ICS_RXDMT0;
 
-    set_ics(s, 0, n);
+    e1000_rx_done(s, n);
 
     return size;
 }
@@ -1174,7 +1489,7 @@ set_tctl(E1000State *s, int index, uint32_t val)
 {
     s->mac_reg[index] = val;
     s->mac_reg[TDT] &= 0xffff;
-    start_xmit(s);
+    vmx_bh_schedule(s->tx_bh);
 }
 
 static void
@@ -1269,8 +1584,18 @@ e1000_mmio_read(void *opaque, hwaddr addr, unsigned size)
     return 0;
 }
 
+/* Plain register reads don't touch device state, let them skip the BQL */
+static bool
+e1000_mmio_unlocked(void *opaque, uint64_t addr, unsigned size, bool is_write)
+{
+    unsigned int index = (addr & 0x1ffff) >> 2;
+
+    return !is_write && index < NREADOPS && macreg_readops[index] == mac_readreg;
+}
+
 static const MemAreaOps e1000_mmio_ops = {
     .read = e1000_mmio_read,
+    .unlocked = e1000_mmio_unlocked,
     .write = e1000_mmio_write,
     .endianness = DEVICE_LITTLE_ENDIAN,
     .impl = {
@@ -1317,6 +1642,9 @@ static void e1000_pre_save(void *opaque)
         e1000_mit_timer(s);
     }
 
+    /* Only tx.data is migrated */
+    e1000_tx_flatten(s);
+
     /*
      * If link is down and auto-negotiation is supported and ongoing,
      * complete auto-negotiation immediately. This allows us to look
@@ -1352,6 +1680,11 @@ static int e1000_post_load(void *opaque, int version_id)
                   vmx_clock_get_ms(QEMU_CLOCK_VIRTUAL) + 500);
     }
 
+    /* A TDT write may still have been waiting for the bottom half */
+    if (s->mac_reg[TDH] != s->mac_reg[TDT]) {
+        vmx_bh_schedule(s->tx_bh);
+    }
+
     return 0;
 }
 
@@ -1491,6 +1824,7 @@ e1000_mmio_setup(E1000State *d)
 
     memory_area_init_io(&d->mmio, VeertuTypeHold(d), &e1000_mmio_ops, d,
                           "e1000-mmio", PNPMMIO_SIZE);
+    memory_area_clear_global_locking(&d->mmio);
     memory_area_init_io(&d->io, VeertuTypeHold(d), &e1000_io_ops, d, "e1000-io", IOPORT_SIZE);
 }
 
@@ -1503,6 +1837,8 @@ pci_e1000_uninit(PCIDevice *dev)
     timer_free(d->autoneg_timer);
     timer_del(d->mit_timer);
     timer_free(d->mit_timer);
+    vmx_bh_delete(d->tx_bh);
+    e1000_tx_unmap(d);
     vmx_del_nic(d->nic);
 }
 
@@ -1513,6 +1849,8 @@ static NetClientInfo net_e1000_info = {
     .receive = e1000_receive,
     .receive_iov = e1000_receive_iov,
     .link_status_changed = e1000_set_link_status,
+    .batch_begin = e1000_batch_begin,
+    .batch_end = e1000_batch_end,
 };
 
 static void e1000_write_config(PCIDevice *pci_dev, uint32_t address,
@@ -1583,6 +1921,7 @@ static int pci_e1000_init(PCIDevice *pci_dev)
 
     d->autoneg_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, e1000_autoneg_timer, d);
     d->mit_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, e1000_mit_timer, d);
+    d->tx_bh = vmx_bh_new(e1000_tx_bh, d);
 
     return 0;
 }
@@ -2293,6 +2293,83 @@ uint32_t ide_data_readl(void *opaque, uint32_t addr)
     return ret;
 }
 
+/*
+ * String PIO: move as much of the transfer as the current buffer holds in
+ * one go. Runs end_transfer_func at the same points the single accesses
+ * would, and once no more data is available behaves like them too (reads
+ * return 0, writes are dropped).
+ */
+static void ide_data_read_rep(void *opaque, uint8_t *buf, unsigned size, uint32_t count)
+{
+    IDEBus *bus = opaque;
+
+    while (count) {
+        IDEState *s = idebus_active_if(bus);
+        uint32_t n;
+
+        if (!(s->status & DRQ_STAT) || !ide_is_pio_out(s) ||
+            s->data_ptr + size > s->data_end) {
+            memset(buf, 0, count * size);
+            return;
+        }
+
+        n = MIN(count, (s->data_end - s->data_ptr) / size);
+        memcpy(buf, s->data_ptr, n * size);
+        s->data_ptr += n * size;
+        buf += n * size;
+        count -= n;
+        if (s->data_ptr >= s->data_end) {
+            s->status &= ~DRQ_STAT;
+            s->end_transfer_func(s);
+        }
+    }
+}
+
+static void ide_data_write_rep(void *opaque, const uint8_t *buf, unsigned size, uint32_t count)
+{
+    IDEBus *bus = opaque;
+
+    while (count) {
+        IDEState *s = idebus_active_if(bus);
+        uint32_t n;
+
+        if (!(s->status & DRQ_STAT) || ide_is_pio_out(s) ||
+            s->data_ptr + size > s->data_end) {
+            return;
+        }
+
+        n = MIN(count, (s->data_end - s->data_ptr) / size);
+        memcpy(s->data_ptr, buf, n * size);
+        s->data_ptr += n * size;
+        buf += n * size;
+        count -= n;
+        if (s->data_ptr >= s->data_end) {
+            s->status &= ~DRQ_STAT;
+            s->end_transfer_func(s);
+        }
+    }
+}
+
+static void ide_data_readw_rep(void *opaque, uint32_t addr, void *buf, uint32_t count)
+{
+    ide_data_read_rep(opaque, buf, 2, count);
+}
+
+static void ide_data_writew_rep(void *opaque, uint32_t addr, const void *buf, uint32_t count)
+{
+    ide_data_write_rep(opaque, buf, 2, count);
+}
+
+static void ide_data_readl_rep(void *opaque, uint32_t addr, void *buf, uint32_t count)
+{
+    ide_data_read_rep(opaque, buf, 4, count);
+}
+
+static void ide_data_writel_rep(void *opaque, uint32_t addr, const void *buf, uint32_t count)
+{
+    ide_data_write_rep(opaque, buf, 4, count);
+}
+
 static void ide_dummy_transfer_stop(IDEState *s)
 {
     s->data_ptr = s->io_buffer;
@@ -2586,8 +2663,10 @@ void ide_init2(IDEBus *bus, vmx_irq irq)
 
 static const MemoryRegionPortio ide_portio_list[] = {
     { 0, 8, 1, .read = ide_ioport_read, .write = ide_ioport_write },
-    { 0, 1, 2, .read = ide_data_readw, .write = ide_data_writew },
-    { 0, 1, 4, .read = ide_data_readl, .write = ide_data_writel },
+    { 0, 1, 2, .read = ide_data_readw, .write = ide_data_writew,
+      .read_rep = ide_data_readw_rep, .write_rep = ide_data_writew_rep },
+    { 0, 1, 4, .read = ide_data_readl, .write = ide_data_writel,
+      .read_rep = ide_data_readl_rep, .write_rep = ide_data_writel_rep },
     PORTIO_END_OF_LIST(),
 };
 
@@ -74,6 +74,18 @@ static int scsi_handle_rw_error(SCSIDiskReq *r, int error);
 static int disk_num = 0;
 extern char *get_current_conf_name();
 
+/* Account a finished block request as done or failed depending on ret */
+static void scsi_disk_acct_complete(SCSIDiskReq *r, int ret)
+{
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+
+    if (ret < 0) {
+        block_acct_failed(blk_get_stats(s->qdev.conf.blk), &r->acct);
+    } else {
+        block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+    }
+}
+
 static void scsi_free_request(SCSIRequest *req)
 {
     SCSIDiskReq *r = DO_UPCAST(SCSIDiskReq, req, req);
@@ -147,11 +159,10 @@ static void scsi_disk_load_request(QEMUFile *f, SCSIRequest *req)
 static void scsi_aio_complete(void *opaque, int ret)
 {
     SCSIDiskReq *r = (SCSIDiskReq *)opaque;
-    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
 
     assert(r->req.aiocb != NULL);
     r->req.aiocb = NULL;
-    block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+    scsi_disk_acct_complete(r, ret);
     if (r->req.io_canceled) {
         scsi_req_cancel_complete(&r->req);
         goto done;
@@ -220,11 +231,10 @@ done:
 static void scsi_dma_complete_noio(void *opaque, int ret)
 {
     SCSIDiskReq *r = (SCSIDiskReq *)opaque;
-    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
 
     if (r->req.aiocb != NULL) {
         r->req.aiocb = NULL;
-        block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+        scsi_disk_acct_complete(r, ret);
     }
     if (r->req.io_canceled) {
         scsi_req_cancel_complete(&r->req);
@@ -261,12 +271,11 @@ static void scsi_dma_complete(void *opaque, int ret)
 static void scsi_read_complete(void * opaque, int ret)
 {
     SCSIDiskReq *r = (SCSIDiskReq *)opaque;
-    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
     int n;
 
     assert(r->req.aiocb != NULL);
     r->req.aiocb = NULL;
-    block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+    scsi_disk_acct_complete(r, ret);
     if (r->req.io_canceled) {
         scsi_req_cancel_complete(&r->req);
         goto done;
@@ -298,7 +307,7 @@ static void scsi_do_read(void *opaque, int ret)
 
     if (r->req.aiocb != NULL) {
         r->req.aiocb = NULL;
-        block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+        scsi_disk_acct_complete(r, ret);
     }
     if (r->req.io_canceled) {
         scsi_req_cancel_complete(&r->req);
@@ -416,12 +425,11 @@ static int scsi_handle_rw_error(SCSIDiskReq *r, int error)
 static void scsi_write_complete(void * opaque, int ret)
 {
     SCSIDiskReq *r = (SCSIDiskReq *)opaque;
-    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
     uint32_t n;
 
     if (r->req.aiocb != NULL) {
         r->req.aiocb = NULL;
-        block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+        scsi_disk_acct_complete(r, ret);
     }
     if (r->req.io_canceled) {
         scsi_req_cancel_complete(&r->req);
@@ -1634,7 +1642,7 @@ static void scsi_write_same_complete(void *opaque, int ret)
 
     assert(r->req.aiocb != NULL);
     r->req.aiocb = NULL;
-    block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+    scsi_disk_acct_complete(r, ret);
     if (r->req.io_canceled) {
         scsi_req_cancel_complete(&r->req);
         goto done;
@@ -0,0 +1,982 @@
+/*
+ * Virtio network device
+ *
+ * Queue pairs map one to one onto the queues of the backend, so a
+ * multiqueue tap gets a receive and a transmit virtqueue per tap queue.
+ * When the backend understands the virtio-net header, offloaded frames
+ * are passed through untouched; otherwise checksums and TCP segmentation
+ * requested by the guest are done here before the frame is sent.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "hw.h"
+#include "pci.h"
+#include "net/net.h"
+#include "net/tap.h"
+#include "net/checksum.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/error-report.h"
+#include "virtio.h"
+
+/* Feature bits */
+#define VIRTIO_NET_F_CSUM               0
+#define VIRTIO_NET_F_GUEST_CSUM         1
+#define VIRTIO_NET_F_MAC                5
+#define VIRTIO_NET_F_GUEST_TSO4         7
+#define VIRTIO_NET_F_GUEST_TSO6         8
+#define VIRTIO_NET_F_GUEST_ECN          9
+#define VIRTIO_NET_F_GUEST_UFO          10
+#define VIRTIO_NET_F_HOST_TSO4          11
+#define VIRTIO_NET_F_HOST_TSO6          12
+#define VIRTIO_NET_F_HOST_ECN           13
+#define VIRTIO_NET_F_HOST_UFO           14
+#define VIRTIO_NET_F_MRG_RXBUF          15
+#define VIRTIO_NET_F_STATUS             16
+#define VIRTIO_NET_F_CTRL_VQ            17
+#define VIRTIO_NET_F_MQ                 22
+
+#define VIRTIO_NET_S_LINK_UP            1
+
+/* Control virtqueue */
+#define VIRTIO_NET_OK                   0
+#define VIRTIO_NET_ERR                  1
+#define VIRTIO_NET_CTRL_MQ              4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+
+#define VIRTIO_NET_QUEUE_SIZE           256
+#define VIRTIO_NET_CTRL_QUEUE_SIZE      64
+
+/* Frames sent per bottom half run before yielding to the main loop */
+#define VIRTIO_NET_TX_BURST             256
+
+/* Under VIRTIO_F_VERSION_1 the header always carries num_buffers */
+#define VIRTIO_NET_HDR_LEN      sizeof(struct virtio_net_hdr_mrg_rxbuf)
+
+#define ETH_HLEN                14
+#define ETH_P_IPV4              0x0800
+#define ETH_P_IPV6              0x86dd
+#define ETH_P_VLAN              0x8100
+#define IP_PROTO_TCP            6
+
+#define TCP_FLAG_FIN            0x01
+#define TCP_FLAG_PSH            0x08
+#define TCP_FLAG_CWR            0x80
+
+#define TYPE_VIRTIO_NET "virtio-net-pci"
+#define VIRTIO_NET(obj) ((VirtIONet *)(obj))
+
+typedef struct VirtIONetConfig {
+    uint8_t mac[6];
+    uint16_t status;
+    uint16_t max_virtqueue_pairs;
+} QEMU_PACKED VirtIONetConfig;
+
+struct VirtIONet;
+
+typedef struct VirtIONetQueue {
+    VirtQueue *rx_vq;
+    VirtQueue *tx_vq;
+    QEMUBH *tx_bh;
+    int tx_waiting;
+    /* frame handed to the backend that has not completed yet */
+    VirtQueueElement *async_tx;
+    struct VirtIONet *n;
+} VirtIONetQueue;
+
+typedef struct VirtIONet {
+    PCIDevice parent_obj;
+    VirtIOPCI vdev;
+    NICState *nic;
+    NICConf conf;
+    VirtIONetQueue *vqs;
+    uint16_t max_queues;
+    uint16_t curr_queues;
+    uint16_t status;
+    bool has_vnet_hdr;
+    bool mergeable_rx_bufs;
+    /* scratch buffers for frames that need offloads done in software */
+    uint8_t *tx_buf;
+    uint8_t *seg_buf;
+} VirtIONet;
+
+static VirtIONetQueue *virtio_net_get_subqueue(NetClientState *nc)
+{
+    VirtIONet *n = vmx_get_nic_opaque(nc);
+
+    return &n->vqs[nc->queue_index];
+}
+
+/* Without VIRTIO_NET_F_MQ the control queue follows the first pair */
+static int virtio_net_ctrl_vq_index(VirtIONet *n)
+{
+    if (virtio_vdev_has_feature(&n->vdev, VIRTIO_NET_F_MQ)) {
+        return n->max_queues * 2;
+    }
+    return 2;
+}
+
+static void virtio_net_set_queues(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        NetClientState *peer = vmx_get_subqueue(n->nic, i)->peer;
+
+        if (!peer || peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+            continue;
+        }
+        if (i < n->curr_queues) {
+            tap_enable(peer);
+        } else {
+            tap_disable(peer);
+        }
+    }
+}
+
+static void virtio_net_apply_offloads(VirtIONet *n)
+{
+    VirtIOPCI *vdev = &n->vdev;
+    int i;
+
+    if (!n->has_vnet_hdr) {
+        return;
+    }
+    for (i = 0; i < n->max_queues; i++) {
+        vmx_set_offload(vmx_get_subqueue(n->nic, i)->peer,
+                        virtio_vdev_has_feature(vdev, VIRTIO_NET_F_GUEST_CSUM),
+                        virtio_vdev_has_feature(vdev, VIRTIO_NET_F_GUEST_TSO4),
+                        virtio_vdev_has_feature(vdev, VIRTIO_NET_F_GUEST_TSO6),
+                        virtio_vdev_has_feature(vdev, VIRTIO_NET_F_GUEST_ECN),
+                        virtio_vdev_has_feature(vdev, VIRTIO_NET_F_GUEST_UFO));
+    }
+}
+
+/* Receive */
+
+static int virtio_net_can_receive(NetClientState *nc)
+{
+    VirtIONet *n = vmx_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (!virtio_driver_ok(&n->vdev) || nc->queue_index >= n->curr_queues) {
+        return 0;
+    }
+    return virtio_queue_ready(q->rx_vq);
+}
+
+static int virtio_net_rx_has_buffers(VirtIONetQueue *q, int bufsize)
+{
+    VirtIONet *n = q->n;
+
+    if (virtio_queue_empty(q->rx_vq) ||
+        (!n->mergeable_rx_bufs &&
+         !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
+        /* Ask for a kick, then look again in case we raced with one */
+        virtio_queue_set_notification(q->rx_vq, 1);
+        if (virtio_queue_empty(q->rx_vq) ||
+            (!n->mergeable_rx_bufs &&
+             !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
+            return 0;
+        }
+    }
+    virtio_queue_set_notification(q->rx_vq, 0);
+    return 1;
+}
+
+/* Copy up to len bytes from iov at offset into sg at sg_offset */
+static size_t virtio_net_copy_iov(const struct iovec *sg, unsigned int sg_num,
+                                  size_t sg_offset, const struct iovec *iov,
+                                  int iovcnt, size_t offset, size_t len)
+{
+    size_t done = 0;
+    int i;
+
+    for (i = 0; i < iovcnt && done < len; i++) {
+        size_t chunk, copied;
+
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        chunk = MIN(iov[i].iov_len - offset, len - done);
+        copied = iov_from_buf(sg, sg_num, sg_offset + done,
+                              (uint8_t *)iov[i].iov_base + offset, chunk);
+        done += copied;
+        if (copied < chunk) {
+            break;
+        }
+        offset = 0;
+    }
+    return done;
+}
+
+static ssize_t virtio_net_receive_iov(NetClientState *nc,
+                                      const struct iovec *iov, int iovcnt)
+{
+    VirtIONet *n = vmx_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtQueueElement *elems[VIRTQUEUE_MAX_SIZE];
+    unsigned int lens[VIRTQUEUE_MAX_SIZE];
+    struct virtio_net_hdr_mrg_rxbuf mhdr = { };
+    size_t size = iov_size(iov, iovcnt);
+    size_t offset = 0;
+    int i = 0, j;
+
+    if (!virtio_net_can_receive(nc)) {
+        return -1;
+    }
+
+    /* The backend's header is passed on, only num_buffers is ours */
+    if (n->has_vnet_hdr) {
+        if (size < VIRTIO_NET_HDR_LEN) {
+            return size;
+        }
+        iov_to_buf(iov, iovcnt, 0, &mhdr, VIRTIO_NET_HDR_LEN);
+        offset = VIRTIO_NET_HDR_LEN;
+    }
+
+    if (!virtio_net_rx_has_buffers(q, size - offset + VIRTIO_NET_HDR_LEN)) {
+        return 0;
+    }
+
+    do {
+        VirtQueueElement *elem;
+        size_t guest_offset = i ? 0 : VIRTIO_NET_HDR_LEN;
+        size_t len;
+
+        if (i == VIRTQUEUE_MAX_SIZE || !(elem = virtqueue_pop(q->rx_vq))) {
+            /* Out of buffers mid-frame: wait for the guest to post more */
+            goto unpop;
+        }
+        if (iov_size(elem->in_sg, elem->in_num) < guest_offset) {
+            error_report("virtio-net: receive buffer too small for header");
+            virtqueue_discard(q->rx_vq, elem);
+            g_free(elem);
+            goto drop;
+        }
+
+        len = virtio_net_copy_iov(elem->in_sg, elem->in_num, guest_offset,
+                                  iov, iovcnt, offset, size - offset);
+        offset += len;
+        elems[i] = elem;
+        lens[i] = guest_offset + len;
+        i++;
+
+        if (!n->mergeable_rx_bufs && offset < size) {
+            /* The frame does not fit a single buffer chain */
+            goto drop;
+        }
+    } while (offset < size);
+
+    mhdr.num_buffers = cpu_to_le16(i);
+    iov_from_buf(elems[0]->in_sg, elems[0]->in_num, 0, &mhdr,
+                 VIRTIO_NET_HDR_LEN);
+
+    for (j = 0; j < i; j++) {
+        virtqueue_fill(q->rx_vq, elems[j], lens[j], j);
+        g_free(elems[j]);
+    }
+    virtqueue_flush(q->rx_vq, i);
+    virtio_notify(&n->vdev, q->rx_vq);
+    return size;
+
+unpop:
+    while (i--) {
+        virtqueue_unpop(q->rx_vq, elems[i]);
+        g_free(elems[i]);
+    }
+    virtio_queue_set_notification(q->rx_vq, 1);
+    return 0;
+
+drop:
+    while (i--) {
+        virtqueue_unpop(q->rx_vq, elems[i]);
+        g_free(elems[i]);
+    }
+    return size;
+}
+
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    const struct iovec iov = {
+        .iov_base = (uint8_t *)buf,
+        .iov_len = size
+    };
+
+    return virtio_net_receive_iov(nc, &iov, 1);
+}
+
+static void virtio_net_handle_rx(VirtIONet *n, VirtQueue *vq)
+{
+    int queue_index = virtio_get_queue_index(vq) / 2;
+
+    vmx_flush_queued_packets(vmx_get_subqueue(n->nic, queue_index));
+}
+
+/* Transmit */
+
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
+
+static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
+{
+    VirtIONet *n = vmx_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (!q->async_tx) {
+        return;
+    }
+    virtqueue_push(q->tx_vq, q->async_tx, 0);
+    virtio_notify(&n->vdev, q->tx_vq);
+    g_free(q->async_tx);
+    q->async_tx = NULL;
+
+    virtio_queue_set_notification(q->tx_vq, 1);
+    if (virtio_net_flush_tx(q) >= VIRTIO_NET_TX_BURST) {
+        virtio_queue_set_notification(q->tx_vq, 0);
+        q->tx_waiting = 1;
+        vmx_bh_schedule(q->tx_bh);
+    }
+}
+
+/* Complete a partial checksum as requested by VIRTIO_NET_HDR_F_NEEDS_CSUM */
+static void virtio_net_do_csum(struct virtio_net_hdr *hdr, uint8_t *buf,
+                               size_t len)
+{
+    size_t start = le16_to_cpu(hdr->csum_start);
+    size_t field = start + le16_to_cpu(hdr->csum_offset);
+
+    if (field + 2 > len) {
+        return;
+    }
+    /* The field holds the pseudo header sum, which is folded in here */
+    stw_be_p(buf + field,
+             ip_checksum_finish(ip_checksum_add(0, buf + start, len - start)));
+}
+
+/*
+ * Split a TSO frame into MSS sized segments.  Each segment gets a copy of
+ * the headers with lengths, sequence number, IP ID and checksums fixed up.
+ * Only the last segment completes asynchronously.
+ */
+static ssize_t virtio_net_send_tso(VirtIONetQueue *q, NetClientState *nc,
+                                   struct virtio_net_hdr *hdr, uint8_t *buf,
+                                   size_t len)
+{
+    VirtIONet *n = q->n;
+    uint8_t gso_type = hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    size_t mss = le16_to_cpu(hdr->gso_size);
+    size_t l3 = ETH_HLEN, l4, hlen, off;
+    uint16_t proto, ip_id = 0;
+    uint32_t seq;
+    uint8_t flags, *seg = n->seg_buf;
+    ssize_t ret = len;
+    int i;
+
+    if (len < l3 + 4 || !mss) {
+        return len;
+    }
+    proto = lduw_be_p(buf + 12);
+    if (proto == ETH_P_VLAN) {
+        l3 += 4;
+        proto = lduw_be_p(buf + 16);
+    }
+
+    if (gso_type == VIRTIO_NET_HDR_GSO_TCPV4) {
+        if (proto != ETH_P_IPV4 || len < l3 + 20 ||
+            buf[l3 + 9] != IP_PROTO_TCP || (buf[l3] & 0xf) < 5) {
+            return len;
+        }
+        l4 = l3 + (buf[l3] & 0xf) * 4;
+        ip_id = lduw_be_p(buf + l3 + 4);
+    } else if (gso_type == VIRTIO_NET_HDR_GSO_TCPV6) {
+        /* IPv6 extension headers are not expected in TSO frames */
+        if (proto != ETH_P_IPV6 || len < l3 + 40 ||
+            buf[l3 + 6] != IP_PROTO_TCP) {
+            return len;
+        }
+        l4 = l3 + 40;
+    } else {
+        return len;
+    }
+    if (len < l4 + 20) {
+        return len;
+    }
+    hlen = l4 + (buf[l4 + 12] >> 4) * 4;
+    if (hlen > len || hlen + mss > NET_BUFSIZE) {
+        return len;
+    }
+    seq = ldl_be_p(buf + l4 + 4);
+    flags = buf[l4 + 13];
+
+    for (off = hlen, i = 0; off < len; off += mss, i++) {
+        size_t plen = MIN(mss, len - off);
+        size_t tcp_len = hlen - l4 + plen;
+        bool last = off + plen >= len;
+        uint8_t *ip = seg + l3, *tcp = seg + l4;
+
+        memcpy(seg, buf, hlen);
+        memcpy(seg + hlen, buf + off, plen);
+
+        stl_be_p(tcp + 4, seq + (off - hlen));
+        tcp[13] = flags;
+        if (!last) {
+            tcp[13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+        }
+        if (i) {
+            tcp[13] &= ~TCP_FLAG_CWR;
+        }
+        stw_be_p(tcp + 16, 0);
+
+        if (gso_type == VIRTIO_NET_HDR_GSO_TCPV4) {
+            stw_be_p(ip + 2, l4 - l3 + tcp_len);
+            stw_be_p(ip + 4, ip_id + i);
+            stw_be_p(ip + 10, 0);
+            stw_be_p(ip + 10, ip_checksum(ip, l4 - l3));
+            stw_be_p(tcp + 16, net_checksum_tcpudp(tcp_len, IP_PROTO_TCP,
+                                                   ip + 12, tcp));
+        } else {
+            uint32_t sum;
+
+            stw_be_p(ip + 4, tcp_len);
+            sum = ip_checksum_add(0, tcp, tcp_len);
+            sum = ip_checksum_add(sum, ip + 8, 32);
+            sum += IP_PROTO_TCP + tcp_len;
+            stw_be_p(tcp + 16, ip_checksum_finish(sum));
+        }
+
+        ret = vmx_send_packet_async(nc, seg, l4 + tcp_len,
+                                    last ? virtio_net_tx_complete : NULL);
+    }
+    return ret;
+}
+
+/* Returns 0 if the frame was queued and will complete asynchronously */
+static ssize_t virtio_net_send(VirtIONetQueue *q, VirtQueueElement *elem)
+{
+    VirtIONet *n = q->n;
+    NetClientState *nc = vmx_get_subqueue(n->nic, q - n->vqs);
+    struct iovec sg[VIRTQUEUE_MAX_SIZE];
+    struct virtio_net_hdr hdr;
+    size_t skip = VIRTIO_NET_HDR_LEN;
+    unsigned int i, sg_num = 0;
+    size_t len;
+
+    if (iov_size(elem->out_sg, elem->out_num) < VIRTIO_NET_HDR_LEN) {
+        error_report("virtio-net: transmit header missing");
+        return -1;
+    }
+
+    if (n->has_vnet_hdr) {
+        return vmx_sendv_packet_async(nc, elem->out_sg, elem->out_num,
+                                      virtio_net_tx_complete);
+    }
+
+    iov_to_buf(elem->out_sg, elem->out_num, 0, &hdr, sizeof(hdr));
+    if (hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE ||
+        (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        len = iov_to_buf(elem->out_sg, elem->out_num, VIRTIO_NET_HDR_LEN,
+                         n->tx_buf, NET_BUFSIZE);
+        if (hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+            return virtio_net_send_tso(q, nc, &hdr, n->tx_buf, len);
+        }
+        virtio_net_do_csum(&hdr, n->tx_buf, len);
+        return vmx_send_packet_async(nc, n->tx_buf, len,
+                                     virtio_net_tx_complete);
+    }
+
+    /* Plain frame: send the guest buffers past the header as they are */
+    for (i = 0; i < elem->out_num; i++) {
+        if (skip >= elem->out_sg[i].iov_len) {
+            skip -= elem->out_sg[i].iov_len;
+            continue;
+        }
+        sg[sg_num].iov_base = (uint8_t *)elem->out_sg[i].iov_base + skip;
+        sg[sg_num].iov_len = elem->out_sg[i].iov_len - skip;
+        sg_num++;
+        skip = 0;
+    }
+    return vmx_sendv_packet_async(nc, sg, sg_num, virtio_net_tx_complete);
+}
+
+/* Send up to a burst of frames; -EBUSY if the backend stopped us */
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    int32_t num_packets = 0;
+
+    if (!virtio_driver_ok(&n->vdev)) {
+        return 0;
+    }
+    if (q->async_tx) {
+        return -EBUSY;
+    }
+
+    while (num_packets < VIRTIO_NET_TX_BURST) {
+        VirtQueueElement *elem = virtqueue_pop(q->tx_vq);
+
+        if (!elem) {
+            break;
+        }
+        if (virtio_net_send(q, elem) == 0) {
+            virtio_queue_set_notification(q->tx_vq, 0);
+            q->async_tx = elem;
+            num_packets = -EBUSY;
+            break;
+        }
+        virtqueue_push(q->tx_vq, elem, 0);
+        g_free(elem);
+        num_packets++;
+    }
+
+    /* One interrupt for the whole burst */
+    virtio_notify(&n->vdev, q->tx_vq);
+    return num_packets;
+}
+
+static void virtio_net_handle_tx(VirtIONet *n, VirtQueue *vq)
+{
+    VirtIONetQueue *q = &n->vqs[virtio_get_queue_index(vq) / 2];
+
+    if (q->tx_waiting || !virtio_driver_ok(&n->vdev)) {
+        return;
+    }
+    q->tx_waiting = 1;
+    virtio_queue_set_notification(vq, 0);
+    vmx_bh_schedule(q->tx_bh);
+}
+
+static void virtio_net_tx_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    int32_t ret;
+
+    q->tx_waiting = 0;
+    if (!virtio_driver_ok(&q->n->vdev)) {
+        return;
+    }
+
+    ret = virtio_net_flush_tx(q);
+    if (ret == -EBUSY) {
+        return;
+    }
+    if (ret >= VIRTIO_NET_TX_BURST) {
+        /* More may be pending, keep kicks off and come back later */
+        q->tx_waiting = 1;
+        vmx_bh_schedule(q->tx_bh);
+        return;
+    }
+
+    /* The queue looked empty: re-enable kicks and check once more */
+    virtio_queue_set_notification(q->tx_vq, 1);
+    ret = virtio_net_flush_tx(q);
+    if (ret > 0) {
+        virtio_queue_set_notification(q->tx_vq, 0);
+        q->tx_waiting = 1;
+        vmx_bh_schedule(q->tx_bh);
+    }
+}
+
+/* Control queue */
+
+static uint8_t virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
+                                    const struct iovec *iov,
+                                    unsigned int iov_cnt)
+{
+    uint16_t pairs;
+
+    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET ||
+        !virtio_vdev_has_feature(&n->vdev, VIRTIO_NET_F_MQ) ||
+        iov_to_buf(iov, iov_cnt, 0, &pairs, sizeof(pairs)) != sizeof(pairs)) {
+        return VIRTIO_NET_ERR;
+    }
+    pairs = le16_to_cpu(pairs);
+    if (pairs < 1 || pairs > n->max_queues) {
+        return VIRTIO_NET_ERR;
+    }
+    n->curr_queues = pairs;
+    virtio_net_set_queues(n);
+    return VIRTIO_NET_OK;
+}
+
+static void virtio_net_handle_ctrl(VirtIONet *n, VirtQueue *vq)
+{
+    VirtQueueElement *elem;
+
+    while ((elem = virtqueue_pop(vq))) {
+        uint8_t ctrl[2], status = VIRTIO_NET_ERR;
+
+        if (iov_size(elem->in_sg, elem->in_num) < sizeof(status) ||
+            iov_to_buf(elem->out_sg, elem->out_num, 0, ctrl, sizeof(ctrl)) <
+            sizeof(ctrl)) {
+            error_report("virtio-net: malformed control request");
+            virtqueue_discard(vq, elem);
+            g_free(elem);
+            break;
+        }
+
+        if (ctrl[0] == VIRTIO_NET_CTRL_MQ) {
+            struct iovec data[VIRTQUEUE_MAX_SIZE];
+            unsigned int i, data_num = 0;
+            size_t skip = sizeof(ctrl);
+
+            for (i = 0; i < elem->out_num; i++) {
+                if (skip >= elem->out_sg[i].iov_len) {
+                    skip -= elem->out_sg[i].iov_len;
+                    continue;
+                }
+                data[data_num].iov_base =
+                    (uint8_t *)elem->out_sg[i].iov_base + skip;
+                data[data_num].iov_len = elem->out_sg[i].iov_len - skip;
+                data_num++;
+                skip = 0;
+            }
+            status = virtio_net_handle_mq(n, ctrl[1], data, data_num);
+        }
+
+        iov_from_buf(elem->in_sg, elem->in_num, 0, &status, sizeof(status));
+        virtqueue_push(vq, elem, sizeof(status));
+        g_free(elem);
+        virtio_notify(&n->vdev, vq);
+    }
+}
+
+static void virtio_net_handle_output(VirtIOPCI *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = vdev->opaque;
+    int index = virtio_get_queue_index(vq);
+
+    if (index == virtio_net_ctrl_vq_index(n)) {
+        virtio_net_handle_ctrl(n, vq);
+    } else if (index % 2) {
+        virtio_net_handle_tx(n, vq);
+    } else {
+        virtio_net_handle_rx(n, vq);
+    }
+}
+
+/* Device ops */
+
+static uint64_t virtio_net_get_features(VirtIOPCI *vdev)
+{
+    VirtIONet *n = vdev->opaque;
+    uint64_t features;
+
+    features = (1ULL << VIRTIO_NET_F_MAC) |
+               (1ULL << VIRTIO_NET_F_STATUS) |
+               (1ULL << VIRTIO_NET_F_MRG_RXBUF) |
+               (1ULL << VIRTIO_NET_F_CTRL_VQ) |
+               (1ULL << VIRTIO_NET_F_CSUM) |
+               (1ULL << VIRTIO_NET_F_HOST_TSO4) |
+               (1ULL << VIRTIO_NET_F_HOST_TSO6) |
+               (1ULL << VIRTIO_NET_F_HOST_ECN);
+    if (n->max_queues > 1) {
+        features |= 1ULL << VIRTIO_NET_F_MQ;
+    }
+
+    /* The guest can only be handed offloaded frames by a backend that
+     * describes them in a virtio-net header.
+     */
+    if (n->has_vnet_hdr) {
+        features |= (1ULL << VIRTIO_NET_F_GUEST_CSUM) |
+                    (1ULL << VIRTIO_NET_F_GUEST_TSO4) |
+                    (1ULL << VIRTIO_NET_F_GUEST_TSO6) |
+                    (1ULL << VIRTIO_NET_F_GUEST_ECN);
+        if (vmx_has_ufo(vmx_get_queue(n->nic)->peer)) {
+            features |= (1ULL << VIRTIO_NET_F_GUEST_UFO) |
+                        (1ULL << VIRTIO_NET_F_HOST_UFO);
+        }
+    }
+    return features;
+}
+
+static void virtio_net_set_features(VirtIOPCI *vdev, uint64_t features)
+{
+    VirtIONet *n = vdev->opaque;
+
+    n->mergeable_rx_bufs = virtio_has_feature(features,
+                                              VIRTIO_NET_F_MRG_RXBUF);
+    virtio_net_apply_offloads(n);
+}
+
+static void virtio_net_get_config(VirtIOPCI *vdev, uint8_t *config)
+{
+    VirtIONet *n = vdev->opaque;
+    VirtIONetConfig netcfg;
+
+    memcpy(netcfg.mac, n->conf.macaddr.a, sizeof(netcfg.mac));
+    netcfg.status = cpu_to_le16(n->status);
+    netcfg.max_virtqueue_pairs = cpu_to_le16(n->max_queues);
+    memcpy(config, &netcfg, sizeof(netcfg));
+}
+
+static void virtio_net_set_status(VirtIOPCI *vdev, uint8_t status)
+{
+    VirtIONet *n = vdev->opaque;
+    int i;
+
+    if (!(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        return;
+    }
+    /* Packets may have been held back while the driver was not ready */
+    for (i = 0; i < n->curr_queues; i++) {
+        vmx_flush_queued_packets(vmx_get_subqueue(n->nic, i));
+    }
+}
+
+/* Forget a frame still queued in the backend and hand its buffers back */
+static void virtio_net_drop_async_tx(VirtIONetQueue *q)
+{
+    VirtQueueElement *elem = q->async_tx;
+
+    if (!elem) {
+        return;
+    }
+    /* Cleared first so that the purge does not complete it */
+    q->async_tx = NULL;
+    vmx_purge_queued_packets(vmx_get_subqueue(q->n->nic, q - q->n->vqs));
+    virtqueue_unpop(q->tx_vq, elem);
+    g_free(elem);
+}
+
+static void virtio_net_reset(VirtIOPCI *vdev)
+{
+    VirtIONet *n = vdev->opaque;
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        vmx_bh_cancel(q->tx_bh);
+        q->tx_waiting = 0;
+        virtio_net_drop_async_tx(q);
+    }
+    n->curr_queues = 1;
+    n->mergeable_rx_bufs = false;
+    virtio_net_set_queues(n);
+}
+
+static const VirtIODeviceOps virtio_net_ops = {
+    .get_features = virtio_net_get_features,
+    .set_features = virtio_net_set_features,
+    .get_config = virtio_net_get_config,
+    .set_status = virtio_net_set_status,
+    .reset = virtio_net_reset,
+};
+
+/* Net client */
+
+static void virtio_net_set_link_status(NetClientState *nc)
+{
+    VirtIONet *n = vmx_get_nic_opaque(nc);
+    uint16_t old_status = n->status;
+
+    if (nc->link_down) {
+        n->status &= ~VIRTIO_NET_S_LINK_UP;
+    } else {
+        n->status |= VIRTIO_NET_S_LINK_UP;
+    }
+    if (n->status != old_status) {
+        virtio_notify_config(&n->vdev);
+    }
+}
+
+static NetClientInfo net_virtio_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_NIC,
+    .size = sizeof(NICState),
+    .can_receive = virtio_net_can_receive,
+    .receive = virtio_net_receive,
+    .receive_iov = virtio_net_receive_iov,
+    .link_status_changed = virtio_net_set_link_status,
+};
+
+/* PCI */
+
+static void virtio_net_write_config(PCIDevice *pci_dev, uint32_t address,
+                                    uint32_t val, int len)
+{
+    VirtIONet *n = VIRTIO_NET(pci_dev);
+
+    virtio_pci_write_config(&n->vdev, address, val, len);
+}
+
+static uint32_t virtio_net_read_config(PCIDevice *pci_dev, uint32_t address,
+                                       int len)
+{
+    VirtIONet *n = VIRTIO_NET(pci_dev);
+
+    return virtio_pci_read_config(&n->vdev, address, len);
+}
+
+static bool virtio_net_peers_have_vnet_hdr(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        NetClientState *peer = vmx_get_subqueue(n->nic, i)->peer;
+
+        if (!vmx_has_vnet_hdr(peer) ||
+            !vmx_has_vnet_hdr_len(peer, VIRTIO_NET_HDR_LEN)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+extern NICInfo *current_nd;
+
+static int virtio_net_init(PCIDevice *pci_dev)
+{
+    DeviceState *dev = DEVICE(pci_dev);
+    VirtIONet *n = VIRTIO_NET(pci_dev);
+    int i, queues = 0;
+
+    memcpy(&n->conf.macaddr, &current_nd->macaddr, sizeof(n->conf.macaddr));
+    /* A multiqueue backend registers one client per queue, all sharing
+     * the netdev's name.
+     */
+    if (current_nd->netdev) {
+        queues = vmx_find_net_clients_except(current_nd->netdev->name,
+                                             n->conf.peers.ncs,
+                                             NET_CLIENT_OPTIONS_KIND_NIC,
+                                             MAX_QUEUE_NUM);
+    }
+    if (!queues) {
+        n->conf.peers.ncs[0] = current_nd->netdev;
+        queues = 1;
+    }
+    /* Queue pairs plus the control queue must fit the common config */
+    n->max_queues = MIN(queues, (VIRTIO_QUEUE_MAX - 1) / 2);
+    n->conf.peers.queues = n->max_queues;
+    n->curr_queues = 1;
+
+    pci_dev->config_write = virtio_net_write_config;
+    pci_dev->config_read = virtio_net_read_config;
+
+    vmx_macaddr_default_if_unset(&n->conf.macaddr);
+    n->nic = vmx_new_nic(&net_virtio_info, &n->conf,
+                         get_typename(VeertuTypeHold(n)), dev->id, n);
+    vmx_format_nic_info_str(vmx_get_queue(n->nic), n->conf.macaddr.a);
+    n->status = VIRTIO_NET_S_LINK_UP;
+
+    n->has_vnet_hdr = virtio_net_peers_have_vnet_hdr(n);
+    if (n->has_vnet_hdr) {
+        for (i = 0; i < n->max_queues; i++) {
+            NetClientState *peer = vmx_get_subqueue(n->nic, i)->peer;
+
+            vmx_using_vnet_hdr(peer, true);
+            vmx_set_vnet_hdr_len(peer, VIRTIO_NET_HDR_LEN);
+        }
+    } else {
+        n->tx_buf = g_malloc(NET_BUFSIZE);
+        n->seg_buf = g_malloc(NET_BUFSIZE);
+    }
+
+    virtio_pci_init(&n->vdev, pci_dev, "virtio-net-pci", &virtio_net_ops, n,
+                    sizeof(VirtIONetConfig), n->max_queues * 2 + 1);
+
+    n->vqs = g_new0(VirtIONetQueue, n->max_queues);
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        q->n = n;
+        q->rx_vq = virtio_add_queue(&n->vdev, i * 2, VIRTIO_NET_QUEUE_SIZE,
+                                    virtio_net_handle_output);
+        q->tx_vq = virtio_add_queue(&n->vdev, i * 2 + 1,
+                                    VIRTIO_NET_QUEUE_SIZE,
+                                    virtio_net_handle_output);
+        q->tx_bh = vmx_bh_new(virtio_net_tx_bh, q);
+    }
+    virtio_add_queue(&n->vdev, n->max_queues * 2, VIRTIO_NET_CTRL_QUEUE_SIZE,
+                     virtio_net_handle_output);
+    virtio_net_set_queues(n);
+
+    return 0;
+}
+
+static void virtio_net_exit(PCIDevice *pci_dev)
+{
+    VirtIONet *n = VIRTIO_NET(pci_dev);
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        virtio_net_drop_async_tx(q);
+        vmx_bh_delete(q->tx_bh);
+    }
+    g_free(n->vqs);
+    g_free(n->tx_buf);
+    g_free(n->seg_buf);
+    virtio_pci_cleanup(&n->vdev);
+    vmx_del_nic(n->nic);
+}
+
+static void qdev_virtio_net_reset(DeviceState *dev)
+{
+    VirtIONet *n = VIRTIO_NET(dev);
+
+    virtio_pci_reset(&n->vdev);
+}
+
+static int virtio_net_post_load(void *opaque, int version_id)
+{
+    VirtIONet *n = opaque;
+
+    if (n->curr_queues < 1 || n->curr_queues > n->max_queues) {
+        return -EINVAL;
+    }
+    n->mergeable_rx_bufs = virtio_vdev_has_feature(&n->vdev,
+                                                   VIRTIO_NET_F_MRG_RXBUF);
+    virtio_net_apply_offloads(n);
+    virtio_net_set_queues(n);
+    /* The link state is the host's, not what was saved */
+    virtio_net_set_link_status(vmx_get_queue(n->nic));
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_net = {
+    .name = "virtio-net-pci",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = virtio_net_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(parent_obj, VirtIONet),
+        VMSTATE_VIRTIO_PCI(vdev, VirtIONet),
+        VMSTATE_UINT16(curr_queues, VirtIONet),
+        VMSTATE_UINT16(status, VirtIONet),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void virtio_net_class_init(VeertuTypeClassHold *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    PCIDeviceClass *k = PCI_DEVICE_CLASS(klass);
+
+    k->init = virtio_net_init;
+    k->exit = virtio_net_exit;
+    k->vendor_id = PCI_VENDOR_ID_REDHAT_QUMRANET;
+    k->device_id = VIRTIO_PCI_DEVICE_ID(VIRTIO_ID_NET);
+    k->revision = 1;
+    k->class_id = PCI_CLASS_NETWORK_ETHERNET;
+    set_bit(DEVICE_CATEGORY_NETWORK, dc->categories);
+    dc->desc = "Virtio network device";
+    dc->reset = qdev_virtio_net_reset;
+    dc->vmsd = &vmstate_virtio_net;
+}
+
+static const VeertuTypeInfo virtio_net_info = {
+    .name          = TYPE_VIRTIO_NET,
+    .parent        = TYPE_PCI_DEVICE,
+    .instance_size = sizeof(VirtIONet),
+    .class_init    = virtio_net_class_init,
+};
+
+void virtio_net_register_types(void)
+{
+    register_type_internal(&virtio_net_info);
+}
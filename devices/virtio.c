@@ -0,0 +1,1262 @@
+/*
+ * Virtio 1.0 split virtqueues and modern PCI transport
+ *
+ * The descriptor table and both rings are mapped once when the driver
+ * enables a queue, so that the fast path only touches guest memory
+ * through plain loads and stores.  Buffers are mapped per element when
+ * it is popped and unmapped when it is returned to the used ring.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "hw.h"
+#include "pci.h"
+#include "emudma.h"
+#include "virtio.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/range.h"
+
+/* Capability layout, virtio 1.0 section 4.1.4 */
+#define VIRTIO_PCI_CAP_COMMON_CFG       1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG       2
+#define VIRTIO_PCI_CAP_ISR_CFG          3
+#define VIRTIO_PCI_CAP_DEVICE_CFG       4
+#define VIRTIO_PCI_CAP_PCI_CFG          5
+
+#define VIRTIO_PCI_CAP_BAR              4
+#define VIRTIO_PCI_CAP_OFFSET           8
+#define VIRTIO_PCI_CAP_LENGTH           12
+#define VIRTIO_PCI_CAP_NOTIFY_MULT      16
+#define VIRTIO_PCI_CAP_PCI_CFG_DATA     16
+#define VIRTIO_PCI_CAP_SIZE             16
+#define VIRTIO_PCI_NOTIFY_CAP_SIZE      20
+#define VIRTIO_PCI_CFG_CAP_SIZE         20
+
+/* struct virtio_pci_common_cfg */
+#define VIRTIO_PCI_COMMON_DFSELECT      0x00
+#define VIRTIO_PCI_COMMON_DF            0x04
+#define VIRTIO_PCI_COMMON_GFSELECT      0x08
+#define VIRTIO_PCI_COMMON_GF            0x0c
+#define VIRTIO_PCI_COMMON_MSIX          0x10
+#define VIRTIO_PCI_COMMON_NUMQ          0x12
+#define VIRTIO_PCI_COMMON_STATUS        0x14
+#define VIRTIO_PCI_COMMON_CFGGENERATION 0x15
+#define VIRTIO_PCI_COMMON_Q_SELECT      0x16
+#define VIRTIO_PCI_COMMON_Q_SIZE        0x18
+#define VIRTIO_PCI_COMMON_Q_MSIX        0x1a
+#define VIRTIO_PCI_COMMON_Q_ENABLE      0x1c
+#define VIRTIO_PCI_COMMON_Q_NOFF        0x1e
+#define VIRTIO_PCI_COMMON_Q_DESCLO      0x20
+#define VIRTIO_PCI_COMMON_Q_DESCHI      0x24
+#define VIRTIO_PCI_COMMON_Q_AVAILLO     0x28
+#define VIRTIO_PCI_COMMON_Q_AVAILHI     0x2c
+#define VIRTIO_PCI_COMMON_Q_USEDLO      0x30
+#define VIRTIO_PCI_COMMON_Q_USEDHI      0x34
+
+/* BAR layout */
+#define VIRTIO_PCI_COMMON_OFFSET        0x0000
+#define VIRTIO_PCI_ISR_OFFSET           0x1000
+#define VIRTIO_PCI_DEVICE_OFFSET        0x2000
+#define VIRTIO_PCI_NOTIFY_OFFSET        0x3000
+#define VIRTIO_PCI_REGION_SIZE          0x1000
+#define VIRTIO_PCI_BAR                  4
+#define VIRTIO_PCI_BAR_SIZE             0x4000
+#define VIRTIO_PCI_NOTIFY_MULTIPLIER    4
+
+typedef struct VRingDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VRingDesc;
+
+typedef struct VRingAvail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[0];           /* followed by used_event */
+} VRingAvail;
+
+typedef struct VRingUsedElem {
+    uint32_t id;
+    uint32_t len;
+} VRingUsedElem;
+
+typedef struct VRingUsed {
+    uint16_t flags;
+    uint16_t idx;
+    VRingUsedElem ring[0];      /* followed by avail_event */
+} VRingUsed;
+
+struct VirtQueue {
+    VirtIOPCI *vdev;
+    int index;
+    uint16_t num;
+    uint16_t num_max;
+    uint16_t enabled;
+
+    uint64_t desc_addr;
+    uint64_t avail_addr;
+    uint64_t used_addr;
+    VRingDesc *desc;
+    VRingAvail *avail;
+    VRingUsed *used;
+
+    uint16_t last_avail_idx;
+    /* last avail->idx read from the guest */
+    uint16_t shadow_avail_idx;
+    uint16_t used_idx;
+    /* used->idx at the time of the last interrupt */
+    uint16_t signalled_used;
+    bool signalled_used_valid;
+    bool notification;
+    unsigned int inuse;
+
+    VirtIOHandleOutput *handle_output;
+};
+
+static void virtio_error(VirtIOPCI *vdev, const char *msg)
+{
+    error_report("virtio: %s", msg);
+    vdev->status |= VIRTIO_CONFIG_S_NEEDS_RESET;
+    virtio_notify_config(vdev);
+}
+
+/* Ring mapping */
+
+static size_t vring_desc_size(VirtQueue *vq)
+{
+    return sizeof(VRingDesc) * vq->num;
+}
+
+static size_t vring_avail_size(VirtQueue *vq)
+{
+    return sizeof(VRingAvail) + sizeof(uint16_t) * (vq->num + 1);
+}
+
+static size_t vring_used_size(VirtQueue *vq)
+{
+    return sizeof(VRingUsed) + sizeof(VRingUsedElem) * vq->num +
+           sizeof(uint16_t);
+}
+
+static void *vring_map(VirtQueue *vq, uint64_t addr, size_t size, int is_write)
+{
+    uint64_t len = size;
+    void *p;
+
+    p = pci_dma_map(vq->vdev->pci_dev, addr, &len, is_write);
+    if (p && len < size) {
+        pci_dma_unmap(vq->vdev->pci_dev, p, len, is_write, 0);
+        p = NULL;
+    }
+    return p;
+}
+
+static void virtio_queue_unmap(VirtQueue *vq)
+{
+    PCIDevice *pci_dev = vq->vdev->pci_dev;
+
+    if (vq->desc) {
+        pci_dma_unmap(pci_dev, vq->desc, vring_desc_size(vq), 0, 0);
+    }
+    if (vq->avail) {
+        pci_dma_unmap(pci_dev, vq->avail, vring_avail_size(vq), 0, 0);
+    }
+    if (vq->used) {
+        pci_dma_unmap(pci_dev, vq->used, vring_used_size(vq), 1,
+                      vring_used_size(vq));
+    }
+    vq->desc = NULL;
+    vq->avail = NULL;
+    vq->used = NULL;
+}
+
+static int virtio_queue_map(VirtQueue *vq)
+{
+    virtio_queue_unmap(vq);
+
+    vq->desc = vring_map(vq, vq->desc_addr, vring_desc_size(vq), 0);
+    vq->avail = vring_map(vq, vq->avail_addr, vring_avail_size(vq), 0);
+    /* used also holds avail_event, which we write */
+    vq->used = vring_map(vq, vq->used_addr, vring_used_size(vq), 1);
+    if (!vq->desc || !vq->avail || !vq->used) {
+        virtio_queue_unmap(vq);
+        return -1;
+    }
+    return 0;
+}
+
+static void virtio_queue_reset(VirtQueue *vq)
+{
+    virtio_queue_unmap(vq);
+    vq->num = vq->num_max;
+    vq->enabled = 0;
+    vq->desc_addr = 0;
+    vq->avail_addr = 0;
+    vq->used_addr = 0;
+    vq->last_avail_idx = 0;
+    vq->shadow_avail_idx = 0;
+    vq->used_idx = 0;
+    vq->signalled_used = 0;
+    vq->signalled_used_valid = false;
+    vq->notification = true;
+    vq->inuse = 0;
+}
+
+/* Ring accessors */
+
+static inline uint16_t vring_avail_idx(VirtQueue *vq)
+{
+    vq->shadow_avail_idx = le16_to_cpu(atomic_read(&vq->avail->idx));
+    return vq->shadow_avail_idx;
+}
+
+static inline uint16_t vring_avail_flags(VirtQueue *vq)
+{
+    return le16_to_cpu(atomic_read(&vq->avail->flags));
+}
+
+static inline uint16_t vring_avail_ring(VirtQueue *vq, unsigned int i)
+{
+    return le16_to_cpu(atomic_read(&vq->avail->ring[i]));
+}
+
+static inline uint16_t vring_get_used_event(VirtQueue *vq)
+{
+    return vring_avail_ring(vq, vq->num);
+}
+
+static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
+{
+    if (!vq->notification) {
+        return;
+    }
+    *(volatile uint16_t *)&vq->used->ring[vq->num] = cpu_to_le16(val);
+}
+
+static inline void vring_used_flags_set_bit(VirtQueue *vq, uint16_t mask)
+{
+    vq->used->flags = cpu_to_le16(le16_to_cpu(vq->used->flags) | mask);
+}
+
+static inline void vring_used_flags_unset_bit(VirtQueue *vq, uint16_t mask)
+{
+    vq->used->flags = cpu_to_le16(le16_to_cpu(vq->used->flags) & ~mask);
+}
+
+/* True if used_idx moving from old to new crosses the event index */
+static inline bool vring_need_event(uint16_t event, uint16_t new, uint16_t old)
+{
+    return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+}
+
+/* Virtqueues */
+
+VirtQueue *virtio_add_queue(VirtIOPCI *vdev, int index, int queue_size,
+                            VirtIOHandleOutput *handle_output)
+{
+    VirtQueue *vq;
+
+    assert(index < vdev->nvqs);
+    assert(queue_size <= VIRTQUEUE_MAX_SIZE);
+
+    vq = &vdev->vqs[index];
+    vq->vdev = vdev;
+    vq->index = index;
+    vq->num_max = queue_size;
+    vq->handle_output = handle_output;
+    virtio_queue_reset(vq);
+    return vq;
+}
+
+VirtQueue *virtio_get_queue(VirtIOPCI *vdev, int n)
+{
+    return &vdev->vqs[n];
+}
+
+int virtio_get_queue_index(VirtQueue *vq)
+{
+    return vq->index;
+}
+
+bool virtio_queue_ready(VirtQueue *vq)
+{
+    return vq->enabled && vq->desc;
+}
+
+int virtio_queue_empty(VirtQueue *vq)
+{
+    if (!virtio_queue_ready(vq)) {
+        return 1;
+    }
+    if (vq->shadow_avail_idx != vq->last_avail_idx) {
+        return 0;
+    }
+    return vring_avail_idx(vq) == vq->last_avail_idx;
+}
+
+void virtio_queue_set_notification(VirtQueue *vq, int enable)
+{
+    if (!virtio_queue_ready(vq)) {
+        return;
+    }
+
+    vq->notification = enable;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vring_avail_idx(vq));
+    } else if (enable) {
+        vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
+    } else {
+        vring_used_flags_set_bit(vq, VRING_USED_F_NO_NOTIFY);
+    }
+    if (enable) {
+        /* Expose avail event/used flags before the caller checks the ring */
+        smp_mb();
+    }
+}
+
+/*
+ * Descriptor chains are walked either in the queue's own table or in an
+ * indirect table, which is mapped for the duration of the walk.
+ */
+typedef struct VRingDescTable {
+    VRingDesc *desc;
+    unsigned int max;
+    uint64_t map_len;
+    bool mapped;
+} VRingDescTable;
+
+static bool vring_desc_table_indirect(VirtQueue *vq, VRingDesc *desc,
+                                      VRingDescTable *t)
+{
+    uint32_t len = le32_to_cpu(desc->len);
+
+    if (!len || len % sizeof(VRingDesc)) {
+        virtio_error(vq->vdev, "invalid indirect descriptor table size");
+        return false;
+    }
+    t->map_len = len;
+    t->desc = pci_dma_map(vq->vdev->pci_dev, le64_to_cpu(desc->addr),
+                          &t->map_len, 0);
+    if (!t->desc || t->map_len < len) {
+        if (t->desc) {
+            pci_dma_unmap(vq->vdev->pci_dev, t->desc, t->map_len, 0, 0);
+        }
+        virtio_error(vq->vdev, "cannot map indirect descriptor table");
+        return false;
+    }
+    t->max = len / sizeof(VRingDesc);
+    t->mapped = true;
+    return true;
+}
+
+static void vring_desc_table_release(VirtQueue *vq, VRingDescTable *t)
+{
+    if (t->mapped) {
+        pci_dma_unmap(vq->vdev->pci_dev, t->desc, t->map_len, 0, 0);
+        t->mapped = false;
+    }
+}
+
+/* Returns the descriptor table for the chain at head, or false on error */
+static bool vring_desc_table_get(VirtQueue *vq, unsigned int head,
+                                 VRingDescTable *t, unsigned int *i)
+{
+    t->desc = vq->desc;
+    t->max = vq->num;
+    t->mapped = false;
+    *i = head;
+
+    if (head >= vq->num) {
+        virtio_error(vq->vdev, "descriptor head out of range");
+        return false;
+    }
+    if (le16_to_cpu(vq->desc[head].flags) & VRING_DESC_F_INDIRECT) {
+        if (!virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_INDIRECT_DESC)) {
+            virtio_error(vq->vdev, "indirect descriptor without feature");
+            return false;
+        }
+        if (!vring_desc_table_indirect(vq, &vq->desc[head], t)) {
+            return false;
+        }
+        *i = 0;
+    }
+    return true;
+}
+
+/* Descriptors in an indirect table must not point to another table */
+static bool vring_desc_nested(VirtQueue *vq, VRingDescTable *t, unsigned int i)
+{
+    if (t->mapped &&
+        (le16_to_cpu(t->desc[i].flags) & VRING_DESC_F_INDIRECT)) {
+        virtio_error(vq->vdev, "nested indirect descriptor");
+        return true;
+    }
+    return false;
+}
+
+/* Follow the chain; returns the number of descriptors visited so far
+ * plus one, or 0 at the end of the chain and -1 on a loop.
+ */
+static int vring_desc_next(VRingDescTable *t, unsigned int *i,
+                           unsigned int *visited)
+{
+    VRingDesc *desc = &t->desc[*i];
+
+    if (!(le16_to_cpu(desc->flags) & VRING_DESC_F_NEXT)) {
+        return 0;
+    }
+    *i = le16_to_cpu(desc->next);
+    if (*i >= t->max || ++*visited > t->max) {
+        return -1;
+    }
+    return 1;
+}
+
+int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
+                          unsigned int out_bytes)
+{
+    unsigned int in_total = 0, out_total = 0;
+    uint16_t idx, avail_idx;
+
+    if (!virtio_queue_ready(vq)) {
+        return 0;
+    }
+
+    avail_idx = vring_avail_idx(vq);
+    smp_rmb();
+
+    for (idx = vq->last_avail_idx; idx != avail_idx; idx++) {
+        VRingDescTable t;
+        unsigned int i, visited = 0;
+        int ret;
+
+        if (!vring_desc_table_get(vq, vring_avail_ring(vq, idx % vq->num),
+                                  &t, &i)) {
+            return 0;
+        }
+        do {
+            VRingDesc *desc = &t.desc[i];
+
+            if (vring_desc_nested(vq, &t, i)) {
+                vring_desc_table_release(vq, &t);
+                return 0;
+            }
+            if (le16_to_cpu(desc->flags) & VRING_DESC_F_WRITE) {
+                in_total += le32_to_cpu(desc->len);
+            } else {
+                out_total += le32_to_cpu(desc->len);
+            }
+            if (in_total >= in_bytes && out_total >= out_bytes) {
+                vring_desc_table_release(vq, &t);
+                return 1;
+            }
+        } while ((ret = vring_desc_next(&t, &i, &visited)) > 0);
+        vring_desc_table_release(vq, &t);
+
+        if (ret < 0) {
+            virtio_error(vq->vdev, "looped descriptor chain");
+            return 0;
+        }
+    }
+    return in_bytes <= in_total && out_bytes <= out_total;
+}
+
+static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
+                               unsigned int len)
+{
+    PCIDevice *pci_dev = vq->vdev->pci_dev;
+    unsigned int i;
+    size_t size;
+
+    for (i = 0; i < elem->in_num; i++) {
+        size = MIN(len, elem->in_sg[i].iov_len);
+        pci_dma_unmap(pci_dev, elem->in_sg[i].iov_base,
+                      elem->in_sg[i].iov_len, 1, size);
+        len -= size;
+    }
+    for (i = 0; i < elem->out_num; i++) {
+        pci_dma_unmap(pci_dev, elem->out_sg[i].iov_base,
+                      elem->out_sg[i].iov_len, 0, elem->out_sg[i].iov_len);
+    }
+}
+
+/* Map one descriptor, split at discontiguous guest memory */
+static bool virtqueue_map_desc(VirtQueue *vq, struct iovec *iov,
+                               unsigned int *num, unsigned int max,
+                               uint64_t pa, uint32_t sz, bool is_write)
+{
+    while (sz) {
+        uint64_t len = sz;
+        void *p;
+
+        if (*num == max) {
+            virtio_error(vq->vdev, "too many descriptors in chain");
+            return false;
+        }
+        p = pci_dma_map(vq->vdev->pci_dev, pa, &len, is_write);
+        if (!p || !len) {
+            virtio_error(vq->vdev, "cannot map descriptor buffer");
+            return false;
+        }
+        iov[*num].iov_base = p;
+        iov[*num].iov_len = len;
+        (*num)++;
+        pa += len;
+        sz -= len;
+    }
+    return true;
+}
+
+VirtQueueElement *virtqueue_pop(VirtQueue *vq)
+{
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VirtQueueElement *elem;
+    VirtQueueElement tmp = { 0 };
+    VRingDescTable t;
+    unsigned int head, i, visited = 0, out_num = 0, in_num = 0;
+    int ret;
+
+    if (virtio_queue_empty(vq)) {
+        return NULL;
+    }
+    /* Read descriptors only after seeing avail->idx move */
+    smp_rmb();
+
+    if (vq->inuse >= vq->num) {
+        virtio_error(vq->vdev, "virtqueue size exceeded");
+        return NULL;
+    }
+
+    head = vring_avail_ring(vq, vq->last_avail_idx % vq->num);
+    if (!vring_desc_table_get(vq, head, &t, &i)) {
+        return NULL;
+    }
+
+    /* Device-readable buffers first, then device-writable ones.  The
+     * writable ones are appended right after the readable ones at
+     * iov + out_num, which is safe because no readable descriptor may
+     * follow a writable one.
+     */
+    do {
+        VRingDesc *desc = &t.desc[i];
+        uint16_t flags = le16_to_cpu(desc->flags);
+        bool ok;
+
+        if (vring_desc_nested(vq, &t, i)) {
+            goto err;
+        }
+        if (flags & VRING_DESC_F_WRITE) {
+            ok = virtqueue_map_desc(vq, iov + out_num, &in_num,
+                                    VIRTQUEUE_MAX_SIZE - out_num,
+                                    le64_to_cpu(desc->addr),
+                                    le32_to_cpu(desc->len), true);
+        } else {
+            if (in_num) {
+                virtio_error(vq->vdev, "readable descriptor after writable");
+                goto err;
+            }
+            ok = virtqueue_map_desc(vq, iov, &out_num, VIRTQUEUE_MAX_SIZE,
+                                    le64_to_cpu(desc->addr),
+                                    le32_to_cpu(desc->len), false);
+        }
+        if (!ok) {
+            goto err;
+        }
+    } while ((ret = vring_desc_next(&t, &i, &visited)) > 0);
+
+    if (ret < 0) {
+        virtio_error(vq->vdev, "looped descriptor chain");
+        goto err;
+    }
+    vring_desc_table_release(vq, &t);
+
+    elem = g_malloc(sizeof(*elem) + sizeof(struct iovec) * (out_num + in_num));
+    elem->index = head;
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    elem->out_sg = (struct iovec *)(elem + 1);
+    elem->in_sg = elem->out_sg + out_num;
+    memcpy(elem->out_sg, iov, sizeof(struct iovec) * out_num);
+    memcpy(elem->in_sg, iov + out_num, sizeof(struct iovec) * in_num);
+
+    vq->last_avail_idx++;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    vq->inuse++;
+    return elem;
+
+err:
+    vring_desc_table_release(vq, &t);
+    tmp.out_sg = iov;
+    tmp.out_num = out_num;
+    tmp.in_sg = iov + out_num;
+    tmp.in_num = in_num;
+    virtqueue_unmap_sg(vq, &tmp, 0);
+    return NULL;
+}
+
+/* Give back an element that was popped but not used */
+void virtqueue_unpop(VirtQueue *vq, VirtQueueElement *elem)
+{
+    virtqueue_unmap_sg(vq, elem, 0);
+    vq->last_avail_idx--;
+    vq->inuse--;
+}
+
+/* Return an element unused but as consumed, e.g. a dropped packet */
+void virtqueue_discard(VirtQueue *vq, VirtQueueElement *elem)
+{
+    virtqueue_push(vq, elem, 0);
+}
+
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    VRingUsedElem *uelem;
+
+    virtqueue_unmap_sg(vq, elem, len);
+
+    if (!virtio_queue_ready(vq)) {
+        return;
+    }
+    uelem = &vq->used->ring[(vq->used_idx + idx) % vq->num];
+    uelem->id = cpu_to_le32(elem->index);
+    uelem->len = cpu_to_le32(len);
+}
+
+void virtqueue_flush(VirtQueue *vq, unsigned int count)
+{
+    uint16_t old, new;
+
+    if (!virtio_queue_ready(vq)) {
+        vq->inuse -= count;
+        return;
+    }
+
+    /* Used ring entries must be visible before the index update */
+    smp_wmb();
+    old = vq->used_idx;
+    new = old + count;
+    *(volatile uint16_t *)&vq->used->idx = cpu_to_le16(new);
+    vq->used_idx = new;
+    vq->inuse -= count;
+    if ((uint16_t)(new - vq->signalled_used) < (uint16_t)(new - old)) {
+        vq->signalled_used_valid = false;
+    }
+}
+
+void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len)
+{
+    virtqueue_fill(vq, elem, len, 0);
+    virtqueue_flush(vq, 1);
+}
+
+static bool virtio_should_notify(VirtIOPCI *vdev, VirtQueue *vq)
+{
+    uint16_t old, new;
+    bool valid;
+
+    if (!virtio_queue_ready(vq)) {
+        return false;
+    }
+
+    /* Flush the used index before reading the driver's suppression */
+    smp_mb();
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    valid = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+    return !valid || vring_need_event(vring_get_used_event(vq), new, old);
+}
+
+static void virtio_pci_update_irq(VirtIOPCI *vdev)
+{
+    pci_set_irq(vdev->pci_dev, vdev->isr != 0);
+}
+
+void virtio_notify(VirtIOPCI *vdev, VirtQueue *vq)
+{
+    if (!virtio_should_notify(vdev, vq)) {
+        return;
+    }
+    vdev->isr |= VIRTIO_ISR_QUEUE;
+    virtio_pci_update_irq(vdev);
+}
+
+void virtio_notify_config(VirtIOPCI *vdev)
+{
+    if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        return;
+    }
+    vdev->config_generation++;
+    vdev->isr |= VIRTIO_ISR_CONFIG;
+    virtio_pci_update_irq(vdev);
+}
+
+/* Transport */
+
+void virtio_pci_reset(VirtIOPCI *vdev)
+{
+    int i;
+
+    /* The device must not process its queues from its reset hook */
+    vdev->status = 0;
+    if (vdev->ops->reset) {
+        vdev->ops->reset(vdev);
+    }
+    vdev->guest_features = 0;
+    vdev->device_feature_select = 0;
+    vdev->driver_feature_select = 0;
+    vdev->isr = 0;
+    vdev->queue_sel = 0;
+    for (i = 0; i < vdev->nvqs; i++) {
+        if (vdev->vqs[i].vdev) {
+            virtio_queue_reset(&vdev->vqs[i]);
+        }
+    }
+    virtio_pci_update_irq(vdev);
+}
+
+static void virtio_set_status(VirtIOPCI *vdev, uint8_t val)
+{
+    if (!val) {
+        virtio_pci_reset(vdev);
+        return;
+    }
+
+    if ((val & VIRTIO_CONFIG_S_FEATURES_OK) &&
+        !(vdev->status & VIRTIO_CONFIG_S_FEATURES_OK)) {
+        /* The driver may only accept what we offered, and must speak 1.0 */
+        if ((vdev->guest_features & ~vdev->host_features) ||
+            !virtio_has_feature(vdev->guest_features, VIRTIO_F_VERSION_1)) {
+            val &= ~VIRTIO_CONFIG_S_FEATURES_OK;
+        } else if (vdev->ops->set_features) {
+            vdev->ops->set_features(vdev, vdev->guest_features);
+        }
+    }
+
+    vdev->status = val;
+    if (vdev->ops->set_status) {
+        vdev->ops->set_status(vdev, val);
+    }
+}
+
+static VirtQueue *virtio_pci_selected_queue(VirtIOPCI *vdev)
+{
+    if (vdev->queue_sel >= vdev->nvqs || !vdev->vqs[vdev->queue_sel].vdev) {
+        return NULL;
+    }
+    return &vdev->vqs[vdev->queue_sel];
+}
+
+static uint64_t virtio_pci_common_read(void *opaque, hwaddr addr,
+                                       unsigned size)
+{
+    VirtIOPCI *vdev = opaque;
+    VirtQueue *vq = virtio_pci_selected_queue(vdev);
+
+    switch (addr) {
+    case VIRTIO_PCI_COMMON_DFSELECT:
+        return vdev->device_feature_select;
+    case VIRTIO_PCI_COMMON_DF:
+        if (vdev->device_feature_select > 1) {
+            return 0;
+        }
+        return (uint32_t)(vdev->host_features >>
+                          (32 * vdev->device_feature_select));
+    case VIRTIO_PCI_COMMON_GFSELECT:
+        return vdev->driver_feature_select;
+    case VIRTIO_PCI_COMMON_GF:
+        if (vdev->driver_feature_select > 1) {
+            return 0;
+        }
+        return (uint32_t)(vdev->guest_features >>
+                          (32 * vdev->driver_feature_select));
+    case VIRTIO_PCI_COMMON_MSIX:
+        return VIRTIO_NO_VECTOR;
+    case VIRTIO_PCI_COMMON_NUMQ:
+        return vdev->nvqs;
+    case VIRTIO_PCI_COMMON_STATUS:
+        return vdev->status;
+    case VIRTIO_PCI_COMMON_CFGGENERATION:
+        return vdev->config_generation;
+    case VIRTIO_PCI_COMMON_Q_SELECT:
+        return vdev->queue_sel;
+    case VIRTIO_PCI_COMMON_Q_SIZE:
+        return vq ? vq->num : 0;
+    case VIRTIO_PCI_COMMON_Q_MSIX:
+        return VIRTIO_NO_VECTOR;
+    case VIRTIO_PCI_COMMON_Q_ENABLE:
+        return vq ? vq->enabled : 0;
+    case VIRTIO_PCI_COMMON_Q_NOFF:
+        return vdev->queue_sel;
+    case VIRTIO_PCI_COMMON_Q_DESCLO:
+        return vq ? (uint32_t)vq->desc_addr : 0;
+    case VIRTIO_PCI_COMMON_Q_DESCHI:
+        return vq ? vq->desc_addr >> 32 : 0;
+    case VIRTIO_PCI_COMMON_Q_AVAILLO:
+        return vq ? (uint32_t)vq->avail_addr : 0;
+    case VIRTIO_PCI_COMMON_Q_AVAILHI:
+        return vq ? vq->avail_addr >> 32 : 0;
+    case VIRTIO_PCI_COMMON_Q_USEDLO:
+        return vq ? (uint32_t)vq->used_addr : 0;
+    case VIRTIO_PCI_COMMON_Q_USEDHI:
+        return vq ? vq->used_addr >> 32 : 0;
+    default:
+        return 0;
+    }
+}
+
+static void virtio_pci_set_addr(uint64_t *addr, bool hi, uint32_t val)
+{
+    if (hi) {
+        *addr = (*addr & 0xffffffffULL) | ((uint64_t)val << 32);
+    } else {
+        *addr = (*addr & ~0xffffffffULL) | val;
+    }
+}
+
+static void virtio_pci_common_write(void *opaque, hwaddr addr,
+                                    uint64_t val, unsigned size)
+{
+    VirtIOPCI *vdev = opaque;
+    VirtQueue *vq = virtio_pci_selected_queue(vdev);
+    uint64_t mask;
+
+    switch (addr) {
+    case VIRTIO_PCI_COMMON_DFSELECT:
+        vdev->device_feature_select = val;
+        break;
+    case VIRTIO_PCI_COMMON_GFSELECT:
+        vdev->driver_feature_select = val;
+        break;
+    case VIRTIO_PCI_COMMON_GF:
+        if (vdev->driver_feature_select > 1 ||
+            (vdev->status & VIRTIO_CONFIG_S_FEATURES_OK)) {
+            break;
+        }
+        mask = 0xffffffffULL << (32 * vdev->driver_feature_select);
+        vdev->guest_features = (vdev->guest_features & ~mask) |
+                               ((val << (32 * vdev->driver_feature_select)) &
+                                mask);
+        break;
+    case VIRTIO_PCI_COMMON_STATUS:
+        virtio_set_status(vdev, val & 0xff);
+        break;
+    case VIRTIO_PCI_COMMON_Q_SELECT:
+        vdev->queue_sel = val;
+        break;
+    case VIRTIO_PCI_COMMON_Q_SIZE:
+        /* Any power of two up to the maximum, before the queue is live */
+        if (vq && !vq->enabled && val && val <= vq->num_max &&
+            !(val & (val - 1))) {
+            vq->num = val;
+        }
+        break;
+    case VIRTIO_PCI_COMMON_Q_ENABLE:
+        if (!vq || vq->enabled || val != 1) {
+            break;
+        }
+        if (virtio_queue_map(vq) < 0) {
+            virtio_error(vdev, "cannot map virtqueue rings");
+            break;
+        }
+        vq->enabled = 1;
+        vq->shadow_avail_idx = vq->last_avail_idx = 0;
+        vq->used_idx = 0;
+        break;
+    case VIRTIO_PCI_COMMON_Q_DESCLO:
+    case VIRTIO_PCI_COMMON_Q_DESCHI:
+        if (vq && !vq->enabled) {
+            virtio_pci_set_addr(&vq->desc_addr,
+                                addr == VIRTIO_PCI_COMMON_Q_DESCHI, val);
+        }
+        break;
+    case VIRTIO_PCI_COMMON_Q_AVAILLO:
+    case VIRTIO_PCI_COMMON_Q_AVAILHI:
+        if (vq && !vq->enabled) {
+            virtio_pci_set_addr(&vq->avail_addr,
+                                addr == VIRTIO_PCI_COMMON_Q_AVAILHI, val);
+        }
+        break;
+    case VIRTIO_PCI_COMMON_Q_USEDLO:
+    case VIRTIO_PCI_COMMON_Q_USEDHI:
+        if (vq && !vq->enabled) {
+            virtio_pci_set_addr(&vq->used_addr,
+                                addr == VIRTIO_PCI_COMMON_Q_USEDHI, val);
+        }
+        break;
+    default:
+        /* MSI-X vectors and read-only fields */
+        break;
+    }
+}
+
+static uint64_t virtio_pci_isr_read(void *opaque, hwaddr addr, unsigned size)
+{
+    VirtIOPCI *vdev = opaque;
+    uint8_t val = vdev->isr;
+
+    /* Reading the ISR acknowledges the interrupt */
+    vdev->isr = 0;
+    virtio_pci_update_irq(vdev);
+    return val;
+}
+
+static void virtio_pci_isr_write(void *opaque, hwaddr addr, uint64_t val,
+                                 unsigned size)
+{
+}
+
+static uint64_t virtio_pci_device_read(void *opaque, hwaddr addr,
+                                       unsigned size)
+{
+    VirtIOPCI *vdev = opaque;
+    uint64_t val = 0;
+
+    if (addr + size > vdev->config_len) {
+        return 0;
+    }
+    if (vdev->ops->get_config) {
+        vdev->ops->get_config(vdev, vdev->config);
+    }
+    memcpy(&val, vdev->config + addr, size);
+    return le64_to_cpu(val);
+}
+
+static void virtio_pci_device_write(void *opaque, hwaddr addr, uint64_t val,
+                                    unsigned size)
+{
+    VirtIOPCI *vdev = opaque;
+
+    if (addr + size > vdev->config_len) {
+        return;
+    }
+    val = cpu_to_le64(val);
+    memcpy(vdev->config + addr, &val, size);
+    if (vdev->ops->set_config) {
+        vdev->ops->set_config(vdev, vdev->config);
+    }
+}
+
+static uint64_t virtio_pci_notify_read(void *opaque, hwaddr addr,
+                                       unsigned size)
+{
+    return 0;
+}
+
+static void virtio_pci_notify_write(void *opaque, hwaddr addr, uint64_t val,
+                                    unsigned size)
+{
+    VirtIOPCI *vdev = opaque;
+    unsigned int n = addr / VIRTIO_PCI_NOTIFY_MULTIPLIER;
+    VirtQueue *vq;
+
+    if (n >= vdev->nvqs) {
+        return;
+    }
+    vq = &vdev->vqs[n];
+    if (vq->handle_output && virtio_queue_ready(vq)) {
+        vq->handle_output(vdev, vq);
+    }
+}
+
+static const MemAreaOps virtio_pci_common_ops = {
+    .read = virtio_pci_common_read,
+    .write = virtio_pci_common_write,
+    .valid = {
+        .min_access_size = 1,
+        .max_access_size = 4,
+    },
+    .endianness = DEVICE_LITTLE_ENDIAN,
+};
+
+static const MemAreaOps virtio_pci_isr_ops = {
+    .read = virtio_pci_isr_read,
+    .write = virtio_pci_isr_write,
+    .valid = {
+        .min_access_size = 1,
+        .max_access_size = 4,
+    },
+    .endianness = DEVICE_LITTLE_ENDIAN,
+};
+
+static const MemAreaOps virtio_pci_device_ops = {
+    .read = virtio_pci_device_read,
+    .write = virtio_pci_device_write,
+    .valid = {
+        .min_access_size = 1,
+        .max_access_size = 4,
+    },
+    .endianness = DEVICE_LITTLE_ENDIAN,
+};
+
+static const MemAreaOps virtio_pci_notify_ops = {
+    .read = virtio_pci_notify_read,
+    .write = virtio_pci_notify_write,
+    .valid = {
+        .min_access_size = 1,
+        .max_access_size = 4,
+    },
+    .endianness = DEVICE_LITTLE_ENDIAN,
+};
+
+/* Accesses through the VIRTIO_PCI_CAP_PCI_CFG window */
+static uint64_t virtio_pci_bar_rw(VirtIOPCI *vdev, uint32_t offset,
+                                  uint64_t val, unsigned size, bool is_write)
+{
+    static const struct {
+        uint32_t offset;
+        const MemAreaOps *ops;
+    } regions[] = {
+        { VIRTIO_PCI_COMMON_OFFSET, &virtio_pci_common_ops },
+        { VIRTIO_PCI_ISR_OFFSET, &virtio_pci_isr_ops },
+        { VIRTIO_PCI_DEVICE_OFFSET, &virtio_pci_device_ops },
+        { VIRTIO_PCI_NOTIFY_OFFSET, &virtio_pci_notify_ops },
+    };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(regions); i++) {
+        if (offset >= regions[i].offset &&
+            offset + size <= regions[i].offset + VIRTIO_PCI_REGION_SIZE) {
+            offset -= regions[i].offset;
+            if (is_write) {
+                regions[i].ops->write(vdev, offset, val, size);
+                return 0;
+            }
+            return regions[i].ops->read(vdev, offset, size);
+        }
+    }
+    return 0;
+}
+
+static bool virtio_pci_cfg_window(VirtIOPCI *vdev, uint32_t address, int len,
+                                  uint32_t *offset, unsigned *size)
+{
+    uint8_t *cap;
+
+    if (!vdev->pci_cfg_cap ||
+        !ranges_overlap(address, len,
+                        vdev->pci_cfg_cap + VIRTIO_PCI_CAP_PCI_CFG_DATA, 4)) {
+        return false;
+    }
+    cap = vdev->pci_dev->config + vdev->pci_cfg_cap;
+    *offset = pci_get_long(cap + VIRTIO_PCI_CAP_OFFSET);
+    *size = pci_get_long(cap + VIRTIO_PCI_CAP_LENGTH);
+    if (cap[VIRTIO_PCI_CAP_BAR] != VIRTIO_PCI_BAR ||
+        (*size != 1 && *size != 2 && *size != 4)) {
+        return false;
+    }
+    return true;
+}
+
+void virtio_pci_write_config(VirtIOPCI *vdev, uint32_t address,
+                             uint32_t val, int len)
+{
+    PCIDevice *pci_dev = vdev->pci_dev;
+    uint32_t offset;
+    unsigned size;
+
+    pci_default_write_config(pci_dev, address, val, len);
+
+    if (virtio_pci_cfg_window(vdev, address, len, &offset, &size)) {
+        uint8_t *data = pci_dev->config + vdev->pci_cfg_cap +
+                        VIRTIO_PCI_CAP_PCI_CFG_DATA;
+        uint32_t v = pci_get_long(data);
+
+        virtio_pci_bar_rw(vdev, offset, v & (0xffffffffULL >> (32 - 8 * size)),
+                          size, true);
+    }
+}
+
+uint32_t virtio_pci_read_config(VirtIOPCI *vdev, uint32_t address, int len)
+{
+    PCIDevice *pci_dev = vdev->pci_dev;
+    uint32_t offset;
+    unsigned size;
+
+    if (virtio_pci_cfg_window(vdev, address, len, &offset, &size)) {
+        uint8_t *data = pci_dev->config + vdev->pci_cfg_cap +
+                        VIRTIO_PCI_CAP_PCI_CFG_DATA;
+
+        pci_set_long(data, virtio_pci_bar_rw(vdev, offset, 0, size, false));
+    }
+    return pci_default_read_config(pci_dev, address, len);
+}
+
+static int virtio_pci_add_cap(PCIDevice *pci_dev, uint8_t cfg_type,
+                              uint32_t offset, uint32_t length, uint8_t cap_len)
+{
+    uint8_t *cap;
+    int pos;
+
+    pos = pci_add_capability(pci_dev, PCI_CAP_ID_VNDR, 0, cap_len);
+    assert(pos > 0);
+
+    cap = pci_dev->config + pos;
+    cap[PCI_CAP_FLAGS] = cap_len;
+    cap[PCI_CAP_FLAGS + 1] = cfg_type;
+    cap[VIRTIO_PCI_CAP_BAR] = VIRTIO_PCI_BAR;
+    pci_set_long(cap + VIRTIO_PCI_CAP_OFFSET, offset);
+    pci_set_long(cap + VIRTIO_PCI_CAP_LENGTH, length);
+    return pos;
+}
+
+void virtio_pci_init(VirtIOPCI *vdev, PCIDevice *pci_dev, const char *name,
+                     const VirtIODeviceOps *ops, void *opaque,
+                     size_t config_len, int nvqs)
+{
+    uint8_t *config = pci_dev->config;
+    int pos;
+
+    assert(config_len <= VIRTIO_PCI_REGION_SIZE);
+    assert(nvqs <= VIRTIO_QUEUE_MAX);
+
+    vdev->pci_dev = pci_dev;
+    vdev->ops = ops;
+    vdev->opaque = opaque;
+    vdev->config_len = config_len;
+    vdev->config = g_malloc0(config_len);
+    vdev->nvqs = nvqs;
+    vdev->vqs = g_new0(VirtQueue, nvqs);
+    vdev->host_features = (1ULL << VIRTIO_F_VERSION_1) |
+                          (1ULL << VIRTIO_RING_F_EVENT_IDX) |
+                          (1ULL << VIRTIO_RING_F_INDIRECT_DESC);
+    if (ops->get_features) {
+        vdev->host_features |= ops->get_features(vdev);
+    }
+
+    config[PCI_INTERRUPT_PIN] = 1;  /* interrupt pin A */
+    /* Modern devices report their type as the subsystem ID too */
+    pci_set_word(config + PCI_SUBSYSTEM_VENDOR_ID,
+                 PCI_VENDOR_ID_REDHAT_QUMRANET);
+    pci_set_word(config + PCI_SUBSYSTEM_ID,
+                 pci_get_word(config + PCI_DEVICE_ID) - 0x1040 + 0x40);
+
+    memory_area_init(&vdev->bar, (char *)name, VIRTIO_PCI_BAR_SIZE);
+    memory_area_init_io(&vdev->common, VeertuTypeHold(pci_dev),
+                        &virtio_pci_common_ops, vdev, "virtio-pci-common",
+                        VIRTIO_PCI_REGION_SIZE);
+    memory_area_init_io(&vdev->isr_mem, VeertuTypeHold(pci_dev),
+                        &virtio_pci_isr_ops, vdev, "virtio-pci-isr",
+                        VIRTIO_PCI_REGION_SIZE);
+    memory_area_init_io(&vdev->device, VeertuTypeHold(pci_dev),
+                        &virtio_pci_device_ops, vdev, "virtio-pci-device",
+                        VIRTIO_PCI_REGION_SIZE);
+    memory_area_init_io(&vdev->notify, VeertuTypeHold(pci_dev),
+                        &virtio_pci_notify_ops, vdev, "virtio-pci-notify",
+                        VIRTIO_PCI_REGION_SIZE);
+    mem_area_add_child(&vdev->bar, VIRTIO_PCI_COMMON_OFFSET, &vdev->common);
+    mem_area_add_child(&vdev->bar, VIRTIO_PCI_ISR_OFFSET, &vdev->isr_mem);
+    mem_area_add_child(&vdev->bar, VIRTIO_PCI_DEVICE_OFFSET, &vdev->device);
+    mem_area_add_child(&vdev->bar, VIRTIO_PCI_NOTIFY_OFFSET, &vdev->notify);
+    pci_register_bar(pci_dev, VIRTIO_PCI_BAR,
+                     PCI_BASE_ADDRESS_SPACE_MEMORY |
+                     PCI_BASE_ADDRESS_MEM_TYPE_64 |
+                     PCI_BASE_ADDRESS_MEM_PREFETCH, &vdev->bar);
+
+    virtio_pci_add_cap(pci_dev, VIRTIO_PCI_CAP_COMMON_CFG,
+                       VIRTIO_PCI_COMMON_OFFSET, VIRTIO_PCI_REGION_SIZE,
+                       VIRTIO_PCI_CAP_SIZE);
+    virtio_pci_add_cap(pci_dev, VIRTIO_PCI_CAP_ISR_CFG,
+                       VIRTIO_PCI_ISR_OFFSET, VIRTIO_PCI_REGION_SIZE,
+                       VIRTIO_PCI_CAP_SIZE);
+    virtio_pci_add_cap(pci_dev, VIRTIO_PCI_CAP_DEVICE_CFG,
+                       VIRTIO_PCI_DEVICE_OFFSET, VIRTIO_PCI_REGION_SIZE,
+                       VIRTIO_PCI_CAP_SIZE);
+    pos = virtio_pci_add_cap(pci_dev, VIRTIO_PCI_CAP_NOTIFY_CFG,
+                             VIRTIO_PCI_NOTIFY_OFFSET, VIRTIO_PCI_REGION_SIZE,
+                             VIRTIO_PCI_NOTIFY_CAP_SIZE);
+    pci_set_long(config + pos + VIRTIO_PCI_CAP_NOTIFY_MULT,
+                 VIRTIO_PCI_NOTIFY_MULTIPLIER);
+
+    /* The driver programs bar, offset, length and data of this one */
+    pos = virtio_pci_add_cap(pci_dev, VIRTIO_PCI_CAP_PCI_CFG, 0, 0,
+                             VIRTIO_PCI_CFG_CAP_SIZE);
+    config[pos + VIRTIO_PCI_CAP_BAR] = 0;
+    pci_dev->wmask[pos + VIRTIO_PCI_CAP_BAR] = 0xff;
+    memset(pci_dev->wmask + pos + VIRTIO_PCI_CAP_OFFSET, 0xff, 4);
+    memset(pci_dev->wmask + pos + VIRTIO_PCI_CAP_LENGTH, 0xff, 4);
+    memset(pci_dev->wmask + pos + VIRTIO_PCI_CAP_PCI_CFG_DATA, 0xff, 4);
+    vdev->pci_cfg_cap = pos;
+}
+
+void virtio_pci_cleanup(VirtIOPCI *vdev)
+{
+    int i;
+
+    for (i = 0; i < vdev->nvqs; i++) {
+        virtio_queue_unmap(&vdev->vqs[i]);
+    }
+    g_free(vdev->vqs);
+    g_free(vdev->config);
+    vdev->vqs = NULL;
+    vdev->config = NULL;
+}
+
+/* Migration */
+
+static int virtio_queue_post_load(void *opaque, int version_id)
+{
+    VirtQueue *vq = opaque;
+
+    vq->desc = NULL;
+    vq->avail = NULL;
+    vq->used = NULL;
+    vq->shadow_avail_idx = vq->last_avail_idx;
+    vq->signalled_used_valid = false;
+    vq->notification = true;
+    if (vq->enabled && virtio_queue_map(vq) < 0) {
+        return -EINVAL;
+    }
+    /* Elements in flight at save time are simply made available again */
+    vq->last_avail_idx = vq->used_idx;
+    vq->shadow_avail_idx = vq->used_idx;
+    vq->inuse = 0;
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_queue = {
+    .name = "virtio-queue",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = virtio_queue_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(num, VirtQueue),
+        VMSTATE_UINT16(enabled, VirtQueue),
+        VMSTATE_UINT64(desc_addr, VirtQueue),
+        VMSTATE_UINT64(avail_addr, VirtQueue),
+        VMSTATE_UINT64(used_addr, VirtQueue),
+        VMSTATE_UINT16(last_avail_idx, VirtQueue),
+        VMSTATE_UINT16(used_idx, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+const VMStateDescription vmstate_virtio_pci = {
+    .name = "virtio-pci",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(guest_features, VirtIOPCI),
+        VMSTATE_UINT32(device_feature_select, VirtIOPCI),
+        VMSTATE_UINT32(driver_feature_select, VirtIOPCI),
+        VMSTATE_UINT8(status, VirtIOPCI),
+        VMSTATE_UINT8(isr, VirtIOPCI),
+        VMSTATE_UINT8(config_generation, VirtIOPCI),
+        VMSTATE_UINT16(queue_sel, VirtIOPCI),
+        VMSTATE_STRUCT_VARRAY_POINTER_INT32(vqs, VirtIOPCI, nvqs,
+                                            vmstate_virtio_queue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
@@ -24,6 +24,7 @@
 #ifndef BLOCK_ACCOUNTING_H
 #define BLOCK_ACCOUNTING_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "qemu/typedefs.h"
@@ -35,23 +36,53 @@ enum BlockAcctType {
     BLOCK_MAX_IOTYPE,
 };
 
+/* Completion latencies are counted in log2 buckets: bucket i holds the
+ * requests that took less than 2^(i + BLOCK_ACCT_LATENCY_SHIFT) ns and
+ * the last bucket holds everything slower.  With these values the first
+ * bucket is below ~1 us and the last one starts at 2^32 ns, ~4.3 s.
+ */
+#define BLOCK_ACCT_LATENCY_SHIFT    10
+#define BLOCK_ACCT_LATENCY_BUCKETS  24
+
 typedef struct BlockAcctStats {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
+    uint64_t failed_ops[BLOCK_MAX_IOTYPE];
+    uint64_t invalid_ops[BLOCK_MAX_IOTYPE];
     uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
+    uint64_t latency[BLOCK_MAX_IOTYPE][BLOCK_ACCT_LATENCY_BUCKETS];
     uint64_t wr_highest_sector;
+
+    /* all-zero writes turned into write_zeroes/discard by detect-zeroes */
+    uint64_t zero_detected_ops;
+    uint64_t zero_detected_bytes;
+
+    /* requests started but not yet done or failed */
+    unsigned int in_flight;
+    unsigned int max_in_flight;
+    /* sum of in_flight * elapsed ns, for the time-weighted average */
+    double in_flight_integral;
+    int64_t first_access_time_ns;   /* 0 until the first request */
+    int64_t in_flight_time_ns;      /* last update of in_flight_integral */
+    int64_t last_access_time_ns;
 } BlockAcctStats;
 
 typedef struct BlockAcctCookie {
     int64_t bytes;
     int64_t start_time_ns;
     enum BlockAcctType type;
+    bool in_flight;     /* counted in BlockAcctStats.in_flight */
 } BlockAcctCookie;
 
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type);
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie);
+void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie);
+void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type);
 void block_acct_highest_sector(BlockAcctStats *stats, int64_t sector_num,
                                unsigned int nb_sectors);
+void block_acct_zero_detected(BlockAcctStats *stats, int64_t bytes);
+double block_acct_avg_in_flight(const BlockAcctStats *stats);
+int64_t block_acct_idle_time_ns(const BlockAcctStats *stats);
 
 #endif
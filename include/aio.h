@@ -78,6 +78,24 @@ bool aio_pending(VeertuAioContext *ctx);
 /* Return the ThreadPool bound to this VeertuAioContext */
 struct ThreadPool *aio_get_thread_pool(VeertuAioContext *ctx);
 
+#ifdef CONFIG_LINUX_IO_URING
+typedef struct LuringState LuringState;
+
+/* Return the io_uring ring bound to this VeertuAioContext, creating it on
+ * first use.  NULL if the host kernel does not support io_uring.
+ */
+LuringState *aio_get_linux_io_uring(VeertuAioContext *ctx);
+
+/* io_uring.c */
+LuringState *luring_init(VeertuAioContext *ctx, Error **errp);
+void luring_cleanup(LuringState *s);
+BlockAIOCB *luring_submit(BlockDriverState *bs, LuringState *s, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type);
+void luring_io_plug(BlockDriverState *bs, LuringState *s);
+void luring_io_unplug(BlockDriverState *bs, LuringState *s, bool unplug);
+#endif
+
 QEMUTimer *aio_timer_new(VeertuAioContext *ctx, QEMUClockType type,
                         int scale,
                         QEMUTimerCB *cb, void *opaque);
@@ -28,6 +28,7 @@
 #include "block.h"
 #include "qemu/option.h"
 #include "qemu/queue.h"
+#include "qemu/throttle.h"
 #include "coroutine.h"
 #include "qemu/timer.h"
 #include "util/qapi-types.h"
@@ -357,6 +358,16 @@ struct BlockDriverState {
     /* number of in-flight serialising requests */
     unsigned int serialising_in_flight;
 
+    /* I/O throttling, queues are indexed by is_write */
+    ThrottleState throttle_state;
+    CoQueue      throttled_reqs[2];
+    bool         io_limits_enabled;
+
+    /* throttling statistics, indexed by is_write */
+    unsigned int throttled_depth[2];     /* requests waiting right now */
+    unsigned int throttled_depth_max[2];
+    uint64_t     throttled_ops[2];       /* requests that had to wait */
+    int64_t      throttled_time_ns[2];   /* total time spent waiting */
 
     /* I/O stats (display with "info blockstats"). */
     BlockAcctStats stats;
@@ -421,8 +432,8 @@ int get_tmp_filename(char *filename, int size);
 BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
                             const char *filename);
 
-//void bdrv_set_io_limits(BlockDriverState *bs,
-//                        ThrottleConfig *cfg);
+void bdrv_set_io_limits(BlockDriverState *bs,
+                        ThrottleConfig *cfg);
 
 
 
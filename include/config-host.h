@@ -36,7 +36,12 @@
 #define CONFIG_USB_LIBUSB 1
 #define CONFIG_BSD 1
 #define CONFIG_QOM_CAST_DEBUG 1
+#ifndef CONFIG_COROUTINE_SIGALTSTACK
+#define CONFIG_COROUTINE_BACKEND asm
+#define CONFIG_COROUTINE_ASM 1
+#else
 #define CONFIG_COROUTINE_BACKEND sigaltstack
+#endif
 #define CONFIG_COROUTINE_POOL 1
 #define CONFIG_CPUID_H 1
 #define CONFIG_INT128 1
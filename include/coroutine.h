@@ -171,6 +171,7 @@ void coroutine_fn vmx_co_mutex_unlock(CoMutex *mutex);
 typedef struct CoRwlock {
     bool writer;
     int reader;
+    int pending_writer;
     CoQueue queue;
 } CoRwlock;
 
@@ -182,8 +183,8 @@ void vmx_co_rwlock_init(CoRwlock *lock);
 
 /**
  * Read locks the CoRwlock. If the lock cannot be taken immediately because
- * of a parallel writer, control is transferred to the caller of the current
- * coroutine.
+ * of a parallel or waiting writer, control is transferred to the caller of
+ * the current coroutine.
  */
 void vmx_co_rwlock_rdlock(CoRwlock *lock);
 
@@ -14,6 +14,8 @@ void cpu_clean_all_dirty(void);
 
 void qtest_clock_warp(int64_t dest);
 
+extern int64_t halt_poll_ns_max;
+
 #ifndef CONFIG_USER_ONLY
 /* vl.c */
 extern int smp_cores;
@@ -329,6 +329,7 @@ void phys_mem_set_alloc(void *(*alloc)(size_t, uint64_t *align));
 struct VeertuMemArea *iotlb_to_region(VeertuAddressSpace *as, hwaddr index);
 int memory_area_io_read(VeertuMemArea *area, uint64_t addr, uint64_t *data, int size);
 int memory_area_io_write(VeertuMemArea *area, uint64_t addr, uint64_t data, int size);
+int memory_area_io_rep(VeertuMemArea *area, uint64_t addr, void *buf, int size, uint32_t count, bool is_write);
 
 #endif
 
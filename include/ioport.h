@@ -40,6 +40,9 @@ typedef struct MemoryRegionPortio {
     unsigned size;
     uint32_t (*read)(void *opaque, uint32_t address);
     void (*write)(void *opaque, uint32_t address, uint32_t data);
+    /* optional string I/O, count accesses of size bytes each */
+    void (*read_rep)(void *opaque, uint32_t address, void *buf, uint32_t count);
+    void (*write_rep)(void *opaque, uint32_t address, const void *buf, uint32_t count);
     uint32_t base; /* private field */
 } MemoryRegionPortio;
 
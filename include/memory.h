@@ -12,6 +12,7 @@
 #include "hwaddr.h"
 #include "cpu-common.h"
 #include "qemu/queue.h"
+#include "qemu/thread.h"
 #include "typeinfo.h"
 
 ram_addr_t vmx_ram_alloc_from_ptr(ram_addr_t size, void *host,
@@ -78,6 +79,17 @@ struct MemAreaOps {
     int endianness;
     uint64_t (*read)(void *opaque, uint64_t addr, unsigned size);
     void (*write)(void *opaque, uint64_t addr, uint64_t data, unsigned size);
+    /*
+     * Optional: count accesses of size bytes to the same address, as done
+     * by string port I/O. buf holds the elements in guest byte order.
+     */
+    void (*read_rep)(void *opaque, uint64_t addr, void *buf, unsigned size, uint32_t count);
+    void (*write_rep)(void *opaque, uint64_t addr, const void *buf, unsigned size, uint32_t count);
+    /*
+     * For areas without global locking: return true if the access can be
+     * dispatched without the iothread mutex. Unset means every access can.
+     */
+    bool (*unlocked)(void *opaque, uint64_t addr, unsigned size, bool is_write);
     
     struct {
         int (*accepts)(void *opaque, uint64_t addr, unsigned size, int is_write);
@@ -129,7 +141,10 @@ struct VeertuMemArea {
     uint64_t alias_offset;
     int priority;
     const MemAreaOps *ops;
-    
+    /* dispatch under the iothread mutex, see memory_area_clear_global_locking() */
+    int global_locking;
+    /* optional device lock taken around dispatch, nests inside the iothread mutex */
+    QemuMutex *lock;
 };
 
 struct MemoryCallbacks {
@@ -147,6 +162,7 @@ struct VeertuAddressSpace {
     char * name;
     void *current_mappings;
     MemoryCallbacks dispatch_listener;
+    /* published with atomic_rcu_set(), freed after synchronize_rcu() */
     struct AddressSpaceDispatch *dispatch;
     struct AddressSpaceDispatch *next_dispatch;
     QTAILQ_ENTRY(VeertuAddressSpace) link;
@@ -177,6 +193,9 @@ void mem_area_set_enable(VeertuMemArea *area, int enabled, int flush);
 void mem_area_set_addr(VeertuMemArea *area, uint64_t addr);
 void memory_area_set_size(VeertuMemArea *mem_area, uint64_t size);
 void mem_area_set_alias_offset(VeertuMemArea *area, uint64_t offset);
+void memory_area_set_global_locking(VeertuMemArea *area);
+void memory_area_clear_global_locking(VeertuMemArea *area);
+void memory_area_set_lock(VeertuMemArea *area, QemuMutex *lock);
 int is_addr_in_mem_area(VeertuMemArea *area, uint64_t addr);
 void veertu_mem_referesh();
 void memory_callbacks_register(MemoryCallbacks *callbacks, VeertuAddressSpace *address_space);
@@ -185,11 +204,14 @@ void veertu_address_space_init(VeertuAddressSpace *address_space, VeertuMemArea
 void veertu_address_space_destroy(VeertuAddressSpace *address_space);
 
 bool address_space_rw(VeertuAddressSpace *address_space, hwaddr addr, void *buf, uint64_t len, bool is_write);
+bool address_space_rep_rw(VeertuAddressSpace *address_space, hwaddr addr, void *buf, unsigned size,
+                          uint32_t count, bool is_write);
 bool address_space_write(VeertuAddressSpace *address_space, uint64_t addr, const uint8_t *buf, int len);
 bool address_space_read(VeertuAddressSpace *address_space, uint64_t addr, uint8_t *buf, int len);
 bool address_space_memset(VeertuAddressSpace *as, hwaddr addr, const uint8_t value, int len);
 VeertuMemArea *address_space_translate(VeertuAddressSpace *address_space, uint64_t addr, uint64_t *xlat, uint64_t *len, bool is_write);
 bool address_space_access_valid(VeertuAddressSpace *address_space, uint64_t addr, int len, bool is_write);
+bool address_space_is_direct(VeertuAddressSpace *address_space, hwaddr addr, hwaddr len, bool is_write);
 void *address_space_map(VeertuAddressSpace *address_space, uint64_t addr, uint64_t *plen, bool is_Write);
 void address_space_unmap(VeertuAddressSpace *address_space, void *buf, uint64_t len, int is_write, uint64_t access_len);
 
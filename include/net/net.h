@@ -54,6 +54,7 @@ typedef bool (HasVnetHdrLen)(NetClientState *, int);
 typedef void (UsingVnetHdr)(NetClientState *, bool);
 typedef void (SetOffload)(NetClientState *, int, int, int, int, int);
 typedef void (SetVnetHdrLen)(NetClientState *, int);
+typedef void (NetBatch)(NetClientState *);
 
 typedef struct NetClientInfo {
     NetClientOptionsKind type;
@@ -72,6 +73,12 @@ typedef struct NetClientInfo {
     UsingVnetHdr *using_vnet_hdr;
     SetOffload *set_offload;
     SetVnetHdrLen *set_vnet_hdr_len;
+    /* Optional bracket around a burst of packets sent to this client, so
+     * that it can defer per-packet work (descriptor write-back,
+     * interrupts) to the end of the burst.  Calls may nest.
+     */
+    NetBatch *batch_begin;
+    NetBatch *batch_end;
 } NetClientInfo;
 
 struct NetClientState {
@@ -127,6 +134,8 @@ void vmx_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t vmx_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t vmx_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+void vmx_send_batch_begin(NetClientState *nc);
+void vmx_send_batch_end(NetClientState *nc);
 void vmx_purge_queued_packets(NetClientState *nc);
 void vmx_flush_queued_packets(NetClientState *nc);
 void vmx_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
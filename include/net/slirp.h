@@ -41,6 +41,9 @@ int net_slirp_parse_legacy(QemuOptsList *opts_list, const char *optarg, int *ret
 
 int net_slirp_smb(const char *exported_dir);
 
+void net_slirp_batch_begin(void);
+void net_slirp_batch_end(void);
+
 void do_info_usernet(Monitor *mon, const QDict *qdict);
 
 #endif
@@ -115,6 +115,8 @@ extern int icount_align_option;
 extern int64_t max_delay;
 extern int64_t max_advance;
 void dump_drift_info(FILE *f, fprintf_function cpu_fprintf);
+/* per vcpu VM exit counters of the veertu accelerator */
+void veertu_dump_exit_stats(FILE *f, fprintf_function cpu_fprintf);
 
 #include "qemu/osdep.h"
 #include "qemu/bswap.h"
@@ -0,0 +1,83 @@
+/*
+ * Read-copy-update for data that is read on every VM exit and replaced
+ * rarely, such as the phys map of an address space.
+ *
+ * Readers bracket their accesses with rcu_read_lock()/rcu_read_unlock()
+ * and load the shared pointer with atomic_rcu_read().  These only touch a
+ * per-thread counter, so readers on different vcpus never write to the
+ * same cache line.  An updater publishes the new version with
+ * atomic_rcu_set() and calls synchronize_rcu() before freeing the old one;
+ * synchronize_rcu() returns once every reader that could still see the old
+ * version has left its read-side critical section.
+ *
+ * Read-side critical sections may nest but must not block, in particular
+ * not on the iothread mutex, which synchronize_rcu() callers usually hold.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_RCU_H
+#define QEMU_RCU_H
+
+#include <stdint.h>
+#include "qemu/atomic.h"
+#include "qemu/queue.h"
+#include "qemu/tls.h"
+
+struct rcu_reader_data {
+    /* rcu_gp_ctr when the outermost read-side section began, 0 outside */
+    unsigned long ctr;
+    unsigned depth;
+    QLIST_ENTRY(rcu_reader_data) node;
+};
+
+DECLARE_TLS(struct rcu_reader_data *, rcu_reader);
+
+struct rcu_reader_data *rcu_register_thread(void);
+void synchronize_rcu(void);
+
+extern unsigned long rcu_gp_ctr;
+
+static inline void rcu_read_lock(void)
+{
+    struct rcu_reader_data *p_rcu_reader = tls_var(rcu_reader);
+
+    if (!p_rcu_reader) {
+        p_rcu_reader = rcu_register_thread();
+    }
+    if (p_rcu_reader->depth++ > 0) {
+        return;
+    }
+
+    /* the store must be visible before the protected pointer is loaded */
+    atomic_xchg(&p_rcu_reader->ctr, atomic_read(&rcu_gp_ctr));
+}
+
+static inline void rcu_read_unlock(void)
+{
+    struct rcu_reader_data *p_rcu_reader = tls_var(rcu_reader);
+
+    if (--p_rcu_reader->depth > 0) {
+        return;
+    }
+
+    /* x86 keeps earlier loads ahead of this store */
+    barrier();
+    *(volatile unsigned long *)&p_rcu_reader->ctr = 0;
+}
+
+#define atomic_rcu_read(ptr)                    \
+({                                              \
+    typeof(*(ptr)) _val = atomic_read(ptr);     \
+    smp_read_barrier_depends();                 \
+    _val;                                       \
+})
+
+#define atomic_rcu_set(ptr, val)                \
+do {                                            \
+    smp_wmb();                                  \
+    *(volatile typeof(*(ptr)) *)(ptr) = (val);  \
+} while (0)
+
+#endif
@@ -31,9 +31,6 @@ void vmx_mutex_lock(QemuMutex *mutex);
 int vmx_mutex_trylock(QemuMutex *mutex);
 void vmx_mutex_unlock(QemuMutex *mutex);
 
-#define rcu_read_lock() do { } while (0)
-#define rcu_read_unlock() do { } while (0)
-
 void vmx_cond_init(QemuCond *cond);
 void vmx_cond_destroy(QemuCond *cond);
 
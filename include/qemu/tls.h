@@ -1,8 +1,11 @@
 #ifndef TLS_H
 #define TLS_H
 
-#define DEFINE_TLS(type, name) __typeof__(type) veert__##name
-#define DECLARE_TLS(type, name) extern __typeof__(type) veert__##name
+/* Real thread-local storage: vcpu threads run device emulation without
+ * the iothread mutex, so e.g. current_cpu must not be shared between them.
+ */
+#define DEFINE_TLS(type, name) __thread __typeof__(type) veert__##name
+#define DECLARE_TLS(type, name) extern DEFINE_TLS(type, name)
 #define tls_var(name) veert__##name
 
 #endif
@@ -16,6 +16,8 @@
 
 struct VeertuState;
 
+#define VEERTU_EXIT_REASON_MAX 64
+
 struct CPUState {
     DeviceState parent;
     struct QemuThread *thread;
@@ -47,6 +49,10 @@ struct CPUState {
     uint64_t fetch_rip;
     uint64_t rip;
     struct x86_register regs[16];
+    /* GPRs fetched since load_regs() and their values at fetch time */
+    uint32_t regs_valid;
+    uint64_t regs_loaded[16];
+    uint64_t rflags_loaded;
     struct x86_reg_flags   rflags;
     struct lazy_flags   lflags;
     struct x86_efer efer;
@@ -63,6 +69,30 @@ struct CPUState {
     
     /* Used for "Known Hypervisor Interface" per-cpu context */
     void* hypervisor_iface_context;
+
+    /* VM exit counters, only touched by the vcpu thread */
+    uint64_t exit_count[VEERTU_EXIT_REASON_MAX];
+    uint64_t exit_locked_count[VEERTU_EXIT_REASON_MAX];
+
+    /* decoded instruction cache, see x86_decode.c */
+    struct x86_decode_cache *decode_cache;
+    uint64_t decode_cache_hits;
+    uint64_t decode_cache_misses;
+
+    /* emulator gva->gpa cache, see x86_mmu.c */
+    struct mmu_tlb *mmu_tlb;
+    uint64_t mmu_tlb_hits;
+    uint64_t mmu_tlb_misses;
+
+    /* rreg/wreg/rvmcs/wvmcs calls, summed up before each VM entry */
+    uint64_t hv_reg_calls;
+
+    /* adaptive halt polling, see vmx_halt_poll() in cpus.c */
+    int64_t halt_poll_ns;
+    bool halt_polling;
+    uint64_t halt_poll_success;
+    uint64_t halt_poll_fail;
+    uint64_t halt_wakeups;
 };
 typedef struct CPUState CPUState;
 
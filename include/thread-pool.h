@@ -7,6 +7,7 @@ typedef int ThreadPoolFunc(void *opaque);
 
 typedef struct ThreadPool ThreadPool;
 
+/* threads is an upper bound, workers are started on demand; 0 for default */
 ThreadPool *thread_pool_create(struct VeertuAioContext *ctx, int threads);
 void thread_pool_destroy(ThreadPool *pool);
 
@@ -0,0 +1,162 @@
+/*
+ * Virtio 1.0 split virtqueues and modern PCI transport
+ *
+ * Only the modern (non-transitional) PCI layout is implemented: a single
+ * memory BAR holds the common, ISR, device and notify structures, which
+ * are advertised through vendor specific capabilities.  Interrupts are
+ * delivered through INTx and the ISR register, MSI-X vectors are reported
+ * as VIRTIO_NO_VECTOR.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include "qemu-common.h"
+#include "pci.h"
+#include "vmstate.h"
+
+/* Device status bits */
+#define VIRTIO_CONFIG_S_ACKNOWLEDGE     1
+#define VIRTIO_CONFIG_S_DRIVER          2
+#define VIRTIO_CONFIG_S_DRIVER_OK       4
+#define VIRTIO_CONFIG_S_FEATURES_OK     8
+#define VIRTIO_CONFIG_S_NEEDS_RESET     0x40
+#define VIRTIO_CONFIG_S_FAILED          0x80
+
+/* Transport feature bits */
+#define VIRTIO_RING_F_INDIRECT_DESC     28
+#define VIRTIO_RING_F_EVENT_IDX         29
+#define VIRTIO_F_VERSION_1              32
+
+/* ISR bits */
+#define VIRTIO_ISR_QUEUE                1
+#define VIRTIO_ISR_CONFIG               2
+
+#define VIRTIO_NO_VECTOR                0xffff
+
+#define VIRTQUEUE_MAX_SIZE              1024
+/* Bounded by the 4 byte per queue notify region */
+#define VIRTIO_QUEUE_MAX                1024
+
+/* Vring descriptor and ring flags */
+#define VRING_DESC_F_NEXT               1
+#define VRING_DESC_F_WRITE              2
+#define VRING_DESC_F_INDIRECT           4
+#define VRING_USED_F_NO_NOTIFY          1
+#define VRING_AVAIL_F_NO_INTERRUPT      1
+
+/* Modern device IDs are 0x1040 plus the virtio device type */
+#define VIRTIO_ID_NET                   1
+#define VIRTIO_PCI_DEVICE_ID(type)      (0x1040 + (type))
+
+typedef struct VirtIOPCI VirtIOPCI;
+typedef struct VirtQueue VirtQueue;
+
+typedef struct VirtQueueElement {
+    unsigned int index;         /* head descriptor */
+    unsigned int out_num;
+    unsigned int in_num;
+    struct iovec *in_sg;
+    struct iovec *out_sg;
+} VirtQueueElement;
+
+typedef void (VirtIOHandleOutput)(VirtIOPCI *vdev, VirtQueue *vq);
+
+typedef struct VirtIODeviceOps {
+    /* Features offered to the driver, on top of the transport ones */
+    uint64_t (*get_features)(VirtIOPCI *vdev);
+    /* Called once the driver has set FEATURES_OK */
+    void (*set_features)(VirtIOPCI *vdev, uint64_t features);
+    void (*get_config)(VirtIOPCI *vdev, uint8_t *config);
+    void (*set_config)(VirtIOPCI *vdev, const uint8_t *config);
+    void (*set_status)(VirtIOPCI *vdev, uint8_t status);
+    void (*reset)(VirtIOPCI *vdev);
+} VirtIODeviceOps;
+
+struct VirtIOPCI {
+    PCIDevice *pci_dev;
+    const VirtIODeviceOps *ops;
+    void *opaque;
+
+    VeertuMemArea bar;
+    VeertuMemArea common;
+    VeertuMemArea isr_mem;
+    VeertuMemArea device;
+    VeertuMemArea notify;
+
+    uint64_t host_features;
+    uint64_t guest_features;
+    uint32_t device_feature_select;
+    uint32_t driver_feature_select;
+    uint8_t status;
+    uint8_t isr;
+    uint8_t config_generation;
+    uint16_t queue_sel;
+
+    size_t config_len;
+    uint8_t *config;
+
+    /* VIRTIO_PCI_CAP_PCI_CFG window into the BAR */
+    uint8_t pci_cfg_cap;
+
+    int32_t nvqs;
+    VirtQueue *vqs;
+};
+
+/* Transport */
+void virtio_pci_init(VirtIOPCI *vdev, PCIDevice *pci_dev, const char *name,
+                     const VirtIODeviceOps *ops, void *opaque,
+                     size_t config_len, int nvqs);
+void virtio_pci_cleanup(VirtIOPCI *vdev);
+void virtio_pci_reset(VirtIOPCI *vdev);
+/* To be called from the device's PCI config space hooks */
+void virtio_pci_write_config(VirtIOPCI *vdev, uint32_t address,
+                             uint32_t val, int len);
+uint32_t virtio_pci_read_config(VirtIOPCI *vdev, uint32_t address, int len);
+void virtio_notify_config(VirtIOPCI *vdev);
+
+static inline bool virtio_has_feature(uint64_t features, unsigned int fbit)
+{
+    return !!(features & (1ULL << fbit));
+}
+
+static inline bool virtio_vdev_has_feature(VirtIOPCI *vdev, unsigned int fbit)
+{
+    return virtio_has_feature(vdev->guest_features, fbit);
+}
+
+static inline bool virtio_driver_ok(VirtIOPCI *vdev)
+{
+    return vdev->status & VIRTIO_CONFIG_S_DRIVER_OK;
+}
+
+/* Virtqueues */
+VirtQueue *virtio_add_queue(VirtIOPCI *vdev, int index, int queue_size,
+                            VirtIOHandleOutput *handle_output);
+VirtQueue *virtio_get_queue(VirtIOPCI *vdev, int n);
+int virtio_get_queue_index(VirtQueue *vq);
+bool virtio_queue_ready(VirtQueue *vq);
+int virtio_queue_empty(VirtQueue *vq);
+void virtio_queue_set_notification(VirtQueue *vq, int enable);
+
+VirtQueueElement *virtqueue_pop(VirtQueue *vq);
+void virtqueue_unpop(VirtQueue *vq, VirtQueueElement *elem);
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx);
+void virtqueue_flush(VirtQueue *vq, unsigned int count);
+void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len);
+void virtqueue_discard(VirtQueue *vq, VirtQueueElement *elem);
+int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
+                          unsigned int out_bytes);
+void virtio_notify(VirtIOPCI *vdev, VirtQueue *vq);
+
+extern const VMStateDescription vmstate_virtio_pci;
+
+#define VMSTATE_VIRTIO_PCI(_field, _state) \
+    VMSTATE_STRUCT(_field, _state, 0, vmstate_virtio_pci, VirtIOPCI)
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2016 Veertu Inc,
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * IPI round trip between two vcpus, run inside a Linux guest.
+ *
+ * Two threads pinned to different vcpus pass a token back and forth
+ * through a futex. A thread that waits idles its vcpu, which HLTs; the
+ * FUTEX_WAKE sends it a reschedule IPI. Each round trip is therefore two
+ * IPIs and two wakeups from HLT, which is the path halt polling
+ * (-realtime halt-poll-ns=N) shortens. "spin" mode busy waits instead,
+ * giving the same handoff without HLT or IPIs as a baseline.
+ *
+ * gcc -O2 -o ipi_pingpong ipi_pingpong.c -lpthread
+ * ipi_pingpong [-n ROUNDS] [-a CPU] [-b CPU] [-s]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+static volatile int token;
+static int rounds = 100000;
+static int spin;
+static uint64_t *samples;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void pin(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        fprintf(stderr, "can't run on cpu %d\n", cpu);
+        exit(1);
+    }
+}
+
+/* wait until token == val */
+static void wait_token(int val)
+{
+    int cur;
+
+    while ((cur = token) != val) {
+        if (spin) {
+            __asm__ __volatile__("pause" ::: "memory");
+        } else {
+            syscall(SYS_futex, &token, FUTEX_WAIT, cur, NULL, NULL, 0);
+        }
+    }
+}
+
+static void pass_token(int val)
+{
+    __sync_synchronize();
+    token = val;
+    if (!spin) {
+        syscall(SYS_futex, &token, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+static void *pong(void *opaque)
+{
+    int i;
+
+    pin(*(int *)opaque);
+    for (i = 0; i < rounds; i++) {
+        wait_token(2 * i + 1);
+        pass_token(2 * i + 2);
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+    int cpu_a = 0, cpu_b = 1;
+    uint64_t start, total;
+    pthread_t thread;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "n:a:b:s")) != -1) {
+        switch (c) {
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        case 'a':
+            cpu_a = atoi(optarg);
+            break;
+        case 'b':
+            cpu_b = atoi(optarg);
+            break;
+        case 's':
+            spin = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n ROUNDS] [-a CPU] [-b CPU] [-s]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (rounds <= 0 || cpu_a == cpu_b) {
+        fprintf(stderr, "need at least one round and two different cpus\n");
+        return 2;
+    }
+
+    samples = calloc(rounds, sizeof(*samples));
+    pin(cpu_a);
+    pthread_create(&thread, NULL, pong, &cpu_b);
+
+    total = now_ns();
+    for (i = 0; i < rounds; i++) {
+        start = now_ns();
+        pass_token(2 * i + 1);
+        wait_token(2 * i + 2);
+        samples[i] = now_ns() - start;
+    }
+    total = now_ns() - total;
+    pthread_join(thread, NULL);
+
+    qsort(samples, rounds, sizeof(*samples), cmp_u64);
+    printf("%s, cpu %d <-> cpu %d, %d round trips\n", spin ? "spin" : "futex",
+           cpu_a, cpu_b, rounds);
+    printf("round trip: avg %.1f us, min %.1f us, median %.1f us, "
+           "p99 %.1f us, max %.1f us\n",
+           total / 1e3 / rounds, samples[0] / 1e3, samples[rounds / 2] / 1e3,
+           samples[rounds - 1 - rounds / 100] / 1e3, samples[rounds - 1] / 1e3);
+
+    free(samples);
+    return 0;
+}
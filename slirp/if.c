@@ -113,6 +113,7 @@ diddit:
 	if (so) {
 		/* Update *_queued */
 		so->so_queued++;
+		sopoll_mark(so);
 		so->so_nqueued++;
 		/*
 		 * Check if the interactive session should be downgraded to
@@ -225,9 +226,12 @@ void if_start(Slirp *slirp)
         }
 
         /* Update so_queued */
-        if (ifm->ifq_so && --ifm->ifq_so->so_queued == 0) {
-            /* If there's no more queued, reset nqueued */
-            ifm->ifq_so->so_nqueued = 0;
+        if (ifm->ifq_so) {
+            sopoll_mark(ifm->ifq_so);
+            if (--ifm->ifq_so->so_queued == 0) {
+                /* If there's no more queued, reset nqueued */
+                ifm->ifq_so->so_nqueued = 0;
+            }
         }
 
         m_free(ifm);
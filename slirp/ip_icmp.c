@@ -109,6 +109,7 @@ static int icmp_send(struct socket *so, struct mbuf *m, int hlen)
 
 void icmp_detach(struct socket *so)
 {
+    sopoll_del(so);
     closesocket(so->s);
     sofree(so);
 }
@@ -76,6 +76,9 @@ sbappend(struct socket *so, struct mbuf *m)
 	DEBUG_ARG("m = %lx", (long)m);
 	DEBUG_ARG("m->m_len = %d", m->m_len);
 
+	/* Buffered data changes what so is polled for */
+	sopoll_mark(so);
+
 	/* Shouldn't happen, but...  e.g. foreign host closes connection */
 	if (m->m_len <= 0) {
 		m_free(m);
@@ -207,6 +207,12 @@ struct Slirp {
     u_int last_slowtimo;
     bool do_slowtimo;
 
+    /* epoll or kqueue set holding every socket, see sopoll_flush() */
+    int pollfd;
+    int pollfds_idx;        /* GPollFD GArray index of pollfd */
+    QLIST_HEAD(, socket) so_dirty;
+    QLIST_HEAD(, socket) so_ready;
+
     /* virtual network configuration */
     struct in_addr vnetwork_addr;
     struct in_addr vnetwork_mask;
@@ -11,6 +11,13 @@
 #ifdef __sun__
 //#include <sys/filio.h>
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#elif defined(__APPLE__)
+#include <sys/event.h>
+#else
+#error "slirp socket polling needs epoll or kqueue"
+#endif
 
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
@@ -51,7 +58,8 @@ socreate(struct Slirp *slirp)
     so->so_state = SS_NOFDREF;
     so->s = -1;
     so->slirp = slirp;
-    so->pollfds_idx = -1;
+    so->so_pollfd = -1;
+    sopoll_mark(so);
   }
   return(so);
 }
@@ -77,6 +85,11 @@ sofree(struct socket *so)
   }
   m_free(so->so_m);
 
+  if (so->so_polldirty)
+    QLIST_REMOVE(so, so_dirty_next);
+  if (so->so_revents)
+    QLIST_REMOVE(so, so_ready_next);
+
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
 
@@ -606,7 +619,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 
 	/* Don't tcp_attach... we don't need so_snd nor so_rcv */
 	if ((so->so_tcpcb = tcp_newtcpcb(so)) == NULL) {
-		free(so);
+		sofree(so);
 		return NULL;
 	}
 	insque(so, &slirp->tcb);
@@ -667,6 +680,7 @@ soisfconnecting(struct socket *so)
 	so->so_state &= ~(SS_NOFDREF|SS_ISFCONNECTED|SS_FCANTRCVMORE|
 			  SS_FCANTSENDMORE|SS_FWDRAIN);
 	so->so_state |= SS_ISFCONNECTING; /* Clobber other states */
+	sopoll_mark(so);
 }
 
 void
@@ -674,6 +688,7 @@ soisfconnected(struct socket *so)
 {
 	so->so_state &= ~(SS_ISFCONNECTING|SS_FWDRAIN|SS_NOFDREF);
 	so->so_state |= SS_ISFCONNECTED; /* Clobber other states */
+	sopoll_mark(so);
 }
 
 static void
@@ -689,6 +704,7 @@ sofcantrcvmore(struct socket *so)
 	} else {
 	   so->so_state |= SS_FCANTRCVMORE;
 	}
+	sopoll_mark(so);
 }
 
 static void
@@ -704,6 +720,7 @@ sofcantsendmore(struct socket *so)
 	} else {
 	   so->so_state |= SS_FCANTSENDMORE;
 	}
+	sopoll_mark(so);
 }
 
 /*
@@ -718,3 +735,280 @@ sofwdrain(struct socket *so)
 	else
 		sofcantsendmore(so);
 }
+
+/*
+ * Poll set
+ *
+ * Every socket with an fd is registered in a per-instance epoll (Linux)
+ * or kqueue (OS X) set, with the events it is currently waiting for.  The
+ * main loop only polls the set itself and slirp_pollfds_poll() dispatches
+ * the sockets it reports, so idle sockets cost nothing per iteration.
+ *
+ * Whatever may change the events a socket waits for (its state, buffer
+ * levels, queued packets) calls sopoll_mark(); sopoll_flush() then only
+ * recomputes the registration of the marked sockets.
+ */
+
+#define SOPOLL_MAX_EVENTS 256
+
+/* Events a socket waits for */
+static int
+sopoll_events(struct socket *so)
+{
+	int events = 0;
+
+	if (so->s == -1)
+		return 0;
+
+	/* UDP and ICMP sockets have no tcpcb */
+	if (so->so_tcpcb == NULL) {
+		if (!(so->so_state & SS_ISFCONNECTED))
+			return 0;
+		/*
+		 * Limit the number of packets queued by a UDP session to 4,
+		 * see the comment in if_output()
+		 */
+		if (so->so_type != IPPROTO_ICMP && so->so_queued > 4)
+			return 0;
+		return G_IO_IN | G_IO_HUP | G_IO_ERR;
+	}
+
+	/*
+	 * NOFDREF can include still connecting to local-host,
+	 * newly socreated() sockets etc. Don't want to select these.
+	 */
+	if (so->so_state & SS_NOFDREF)
+		return 0;
+
+	/* Reading sockets which are accepting */
+	if (so->so_state & SS_FACCEPTCONN)
+		return G_IO_IN | G_IO_HUP | G_IO_ERR;
+
+	/* Writing sockets which are connecting */
+	if (so->so_state & SS_ISFCONNECTING)
+		return G_IO_OUT | G_IO_ERR;
+
+	/*
+	 * Writing if we are connected, can send more, and
+	 * we have something to send
+	 */
+	if (CONN_CANFSEND(so) && so->so_rcv.sb_cc)
+		events |= G_IO_OUT | G_IO_ERR;
+
+	/*
+	 * Reading (and urgent data) if we are connected, can
+	 * receive more, and we have room for it XXX /2 ?
+	 */
+	if (CONN_CANFRCV(so) &&
+	    (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2)))
+		events |= G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_PRI;
+
+	return events;
+}
+
+static void
+sopoll_ready(struct socket *so, int revents)
+{
+	if (!revents)
+		return;
+	if (!so->so_revents)
+		QLIST_INSERT_HEAD(&so->slirp->so_ready, so, so_ready_next);
+	so->so_revents |= revents;
+}
+
+#ifdef __linux__
+
+int
+sopoll_create(void)
+{
+	return epoll_create1(EPOLL_CLOEXEC);
+}
+
+static int
+sopoll_ctl(struct socket *so, int old_events, int events)
+{
+	struct epoll_event ev;
+	int op;
+
+	/*
+	 * An fd without interest is dropped altogether, otherwise a hung up
+	 * socket would keep reporting EPOLLHUP while we cannot act on it.
+	 */
+	if (!events)
+		op = EPOLL_CTL_DEL;
+	else
+		op = old_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (events & G_IO_IN ? EPOLLIN : 0) |
+	            (events & G_IO_PRI ? EPOLLPRI : 0) |
+	            (events & G_IO_OUT ? EPOLLOUT : 0);
+	ev.data.ptr = so;
+	return epoll_ctl(so->slirp->pollfd, op, so->s, &ev);
+}
+
+int
+sopoll_wait(Slirp *slirp)
+{
+	struct epoll_event evs[SOPOLL_MAX_EVENTS];
+	int i, n;
+
+	n = epoll_wait(slirp->pollfd, evs, SOPOLL_MAX_EVENTS, 0);
+	for (i = 0; i < n; i++) {
+		uint32_t e = evs[i].events;
+
+		sopoll_ready(evs[i].data.ptr,
+		             (e & EPOLLIN ? G_IO_IN : 0) |
+		             (e & EPOLLPRI ? G_IO_PRI : 0) |
+		             (e & EPOLLOUT ? G_IO_OUT : 0) |
+		             (e & EPOLLHUP ? G_IO_HUP : 0) |
+		             (e & EPOLLERR ? G_IO_ERR : 0));
+	}
+	return n;
+}
+
+#else /* __APPLE__ */
+
+int
+sopoll_create(void)
+{
+	int fd = kqueue();
+
+	if (fd >= 0)
+		vmx_set_cloexec(fd);
+	return fd;
+}
+
+static int
+sopoll_ctl(struct socket *so, int old_events, int events)
+{
+	struct kevent kev[2];
+	bool old_read = old_events & (G_IO_IN | G_IO_PRI);
+	bool want_read = events & (G_IO_IN | G_IO_PRI);
+	bool old_write = old_events & G_IO_OUT;
+	bool want_write = events & G_IO_OUT;
+	int n = 0;
+
+	if (want_read != old_read) {
+		EV_SET(&kev[n++], so->s, EVFILT_READ,
+		       want_read ? EV_ADD | EV_ENABLE : EV_ADD | EV_DISABLE,
+		       0, 0, so);
+	}
+	if (want_write != old_write) {
+		EV_SET(&kev[n++], so->s, EVFILT_WRITE,
+		       want_write ? EV_ADD | EV_ENABLE : EV_ADD | EV_DISABLE,
+		       0, 0, so);
+	}
+	return n ? kevent(so->slirp->pollfd, kev, n, NULL, 0, NULL) : 0;
+}
+
+int
+sopoll_wait(Slirp *slirp)
+{
+	static const struct timespec ts0;
+	struct kevent kev[SOPOLL_MAX_EVENTS];
+	int i, n;
+
+	n = kevent(slirp->pollfd, NULL, 0, kev, SOPOLL_MAX_EVENTS, &ts0);
+	for (i = 0; i < n; i++) {
+		int revents = 0;
+
+		if (kev[i].filter == EVFILT_READ) {
+			revents |= G_IO_IN;
+#ifdef EV_OOBAND
+			if (kev[i].flags & EV_OOBAND)
+				revents |= G_IO_PRI;
+#endif
+		} else if (kev[i].filter == EVFILT_WRITE) {
+			revents |= G_IO_OUT;
+		}
+		if (kev[i].flags & EV_EOF)
+			revents |= G_IO_HUP;
+		if (kev[i].flags & EV_ERROR)
+			revents |= G_IO_ERR;
+		sopoll_ready(kev[i].udata, revents);
+	}
+	return n;
+}
+
+#endif
+
+/* Recompute the registration of so when it next goes through sopoll_flush() */
+void
+sopoll_mark(struct socket *so)
+{
+	if (!so->so_polldirty) {
+		so->so_polldirty = true;
+		QLIST_INSERT_HEAD(&so->slirp->so_dirty, so, so_dirty_next);
+	}
+}
+
+/* Drop so from the poll set; must be called before its fd is closed */
+void
+sopoll_del(struct socket *so)
+{
+	if (so->so_pollevents && so->so_pollfd == so->s)
+		sopoll_ctl(so, so->so_pollevents, 0);
+	so->so_pollevents = 0;
+	so->so_pollfd = -1;
+}
+
+static void
+sopoll_update(struct socket *so)
+{
+	int events = sopoll_events(so) & (G_IO_IN | G_IO_PRI | G_IO_OUT);
+
+	if (so->so_pollfd != so->s) {
+		/* The old fd was closed, and its registration with it */
+		so->so_pollevents = 0;
+		so->so_pollfd = so->s;
+	}
+	if (events == so->so_pollevents)
+		return;
+
+	if (sopoll_ctl(so, so->so_pollevents, events) < 0) {
+		DEBUG_MISC((dfd, " sopoll_update: errno = %d-%s\n",
+			    errno, strerror(errno)));
+		return;
+	}
+	so->so_pollevents = events;
+}
+
+void
+sopoll_flush(Slirp *slirp)
+{
+	struct socket *so;
+
+	while ((so = QLIST_FIRST(&slirp->so_dirty)) != NULL) {
+		QLIST_REMOVE(so, so_dirty_next);
+		so->so_polldirty = false;
+
+		/*
+		 * See if we need a tcp_fasttimo
+		 */
+		if (slirp->time_fasttimo == 0 && so->so_tcpcb &&
+		    so->so_tcpcb->t_flags & TF_DELACK) {
+			slirp->time_fasttimo = curtime; /* Flag when want a fasttimo */
+		}
+
+		sopoll_update(so);
+	}
+}
+
+/*
+ * Take the next socket with events to dispatch.  It is marked, as
+ * handling the events usually changes what it waits for.
+ */
+struct socket *
+sopoll_next(Slirp *slirp, int *revents)
+{
+	struct socket *so = QLIST_FIRST(&slirp->so_ready);
+
+	if (so) {
+		QLIST_REMOVE(so, so_ready_next);
+		*revents = so->so_revents;
+		so->so_revents = 0;
+		sopoll_mark(so);
+	}
+	return so;
+}
@@ -20,7 +20,12 @@ struct socket {
 
   int s;                           /* The actual socket */
 
-  int pollfds_idx;                 /* GPollFD GArray index */
+  int so_pollfd;                   /* fd registered in the poll set */
+  int so_pollevents;               /* G_IO_* events it is registered for */
+  int so_revents;                  /* events reported, not dispatched yet */
+  bool so_polldirty;               /* registration must be recomputed */
+  QLIST_ENTRY(socket) so_dirty_next;
+  QLIST_ENTRY(socket) so_ready_next;
 
   Slirp *slirp;			   /* managing slirp instance */
 
@@ -94,4 +99,14 @@ struct iovec; /* For win32 */
 size_t sopreprbuf(struct socket *so, struct iovec *iov, int *np);
 int soreadbuf(struct socket *so, const char *buf, int size);
 
+#define CONN_CANFSEND(so) (((so)->so_state & (SS_FCANTSENDMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
+#define CONN_CANFRCV(so) (((so)->so_state & (SS_FCANTRCVMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
+
+int sopoll_create(void);
+void sopoll_mark(struct socket *so);
+void sopoll_del(struct socket *so);
+void sopoll_flush(Slirp *slirp);
+int sopoll_wait(Slirp *slirp);
+struct socket *sopoll_next(Slirp *slirp, int *revents);
+
 #endif /* _SOCKET_H_ */
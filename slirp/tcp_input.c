@@ -367,7 +367,7 @@ findso:
 	  if ((so = socreate(slirp)) == NULL)
 	    goto dropwithreset;
 	  if (tcp_attach(so) < 0) {
-	    free(so); /* Not sofree (if it failed, it's not insqued) */
+	    sofree(so); /* not insqued, sofree() copes with that */
 	    goto dropwithreset;
 	  }
 
@@ -402,6 +402,9 @@ findso:
 	if (tp->t_state == TCPS_CLOSED)
 		goto drop;
 
+	/* Whatever the segment does, it may change what we poll so for */
+	sopoll_mark(so);
+
 	tiwin = ti->ti_win;
 
 	/*
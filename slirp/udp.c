@@ -322,6 +322,7 @@ udp_attach(struct socket *so)
 void
 udp_detach(struct socket *so)
 {
+	sopoll_del(so);
 	closesocket(so->s);
 	sofree(so);
 }
@@ -8,3 +8,8 @@ void vmx_mutex_lock_iothread(void)
 void vmx_mutex_unlock_iothread(void)
 {
 }
+
+bool vmx_mutex_iothread_locked(void)
+{
+    return true;
+}
@@ -9,3 +9,11 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
 {
 }
 
+void net_slirp_batch_begin(void)
+{
+}
+
+void net_slirp_batch_end(void)
+{
+}
+
@@ -0,0 +1,88 @@
+/*
+ * Helpers shared by the block layer benchmarks
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef TESTS_BLOCK_BENCH_H
+#define TESTS_BLOCK_BENCH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+#include "block.h"
+
+void bdrv_file_init(void);
+void bdrv_raw_init(void);
+void bdrv_qcow2_init(void);
+void bdrv_dmg_init(void);
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* CPU time of all threads of the process, workers included */
+static inline uint64_t cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Sorts samples; returns the value below which pct percent of them lie */
+static inline uint64_t percentile(uint64_t *samples, int n, int pct)
+{
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+    return samples[(int64_t)(n - 1) * pct / 100];
+}
+
+/* The main loop and the drivers the benchmarks open images with */
+static inline void bench_init(void)
+{
+    vmx_process_events_init(&error_abort);
+    bdrv_file_init();
+    bdrv_raw_init();
+    bdrv_qcow2_init();
+    bdrv_dmg_init();
+}
+
+/* One run of bench_io(): IOPS, MB/s, latency and CPU time per request */
+typedef struct BenchIOResult {
+    int64_t requests;
+    double iops;
+    double mbps;
+    double avg_us;
+    double p50_us;
+    double p99_us;
+    double cpu_us;
+} BenchIOResult;
+
+/*
+ * Keep depth requests of block_size bytes in flight on bs for the given
+ * time, at random or (sequential) consecutive offsets of the first size
+ * bytes, resubmitting from the completion callback.
+ */
+void bench_io(BlockDriverState *bs, int depth, bool is_write, bool sequential,
+              int block_size, int64_t size, double seconds,
+              BenchIOResult *res);
+
+void bench_io_print_header(void);
+void bench_io_print(const char *name, int depth, BenchIOResult *res);
+
+#endif
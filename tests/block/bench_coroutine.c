@@ -0,0 +1,107 @@
+/*
+ * Coroutine create/enter/yield/terminate cycles per second
+ *
+ * Built twice, against the assembly backend (bench_coroutine) and against
+ * the sigaltstack one (bench_coroutine_sigaltstack).  "terminate" and
+ * "yield" create a coroutine that returns at once or yields once first;
+ * with one coroutine alive at a time those come from the pool.  "1000 live"
+ * keeps 1000 yielded coroutines around before finishing them, more than the
+ * pool holds, so that most are allocated and set up from scratch.  "switch"
+ * counts enter/yield pairs of a single coroutine.
+ *
+ * bench_coroutine [-n CYCLES]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include "bench.h"
+#include "coroutine.h"
+
+#define LIVE    1000
+
+static void coroutine_fn terminate_entry(void *opaque)
+{
+}
+
+static void coroutine_fn yield_entry(void *opaque)
+{
+    vmx_coroutine_yield();
+}
+
+static void coroutine_fn switch_entry(void *opaque)
+{
+    for (;;) {
+        vmx_coroutine_yield();
+    }
+}
+
+static void print(const char *name, int64_t cycles, uint64_t ns)
+{
+    printf("%-12s %10" PRId64 " %12.0f %10.1f\n", name, cycles,
+           cycles * 1e9 / ns, (double)ns / cycles);
+}
+
+int main(int argc, char **argv)
+{
+    static Coroutine *live[LIVE];
+    int64_t cycles = 1000000, i;
+    Coroutine *co;
+    uint64_t t;
+    int c, j;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n':
+            cycles = atoll(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n CYCLES]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (cycles < 10 * LIVE) {
+        fprintf(stderr, "need at least %d cycles\n", 10 * LIVE);
+        return 2;
+    }
+
+    printf("%s backend\n", stringify(CONFIG_COROUTINE_BACKEND));
+    printf("%-12s %10s %12s %10s\n", "", "cycles", "cycles/s", "ns/cycle");
+
+    t = now_ns();
+    for (i = 0; i < cycles; i++) {
+        co = vmx_coroutine_create(terminate_entry);
+        vmx_coroutine_enter(co, NULL);
+    }
+    print("terminate", cycles, now_ns() - t);
+
+    t = now_ns();
+    for (i = 0; i < cycles; i++) {
+        co = vmx_coroutine_create(yield_entry);
+        vmx_coroutine_enter(co, NULL);
+        vmx_coroutine_enter(co, NULL);
+    }
+    print("yield", cycles, now_ns() - t);
+
+    t = now_ns();
+    for (i = 0; i + LIVE <= cycles / 10; i += LIVE) {
+        for (j = 0; j < LIVE; j++) {
+            live[j] = vmx_coroutine_create(yield_entry);
+            vmx_coroutine_enter(live[j], NULL);
+        }
+        for (j = 0; j < LIVE; j++) {
+            vmx_coroutine_enter(live[j], NULL);
+        }
+    }
+    print("1000 live", i, now_ns() - t);
+
+    co = vmx_coroutine_create(switch_entry);
+    t = now_ns();
+    for (i = 0; i < cycles; i++) {
+        vmx_coroutine_enter(co, NULL);
+    }
+    print("switch", cycles, now_ns() - t);
+    return 0;
+}
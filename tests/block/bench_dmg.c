@@ -0,0 +1,210 @@
+/*
+ * Sequential read throughput of the DMG driver
+ *
+ * Generates a DMG of -s MB whose chunks of -k KiB are compressed with zlib
+ * (UDZO) and one compressed with bzip2 (UDBZ), reads each from start to end
+ * with 128 KiB requests at queue depths 1 and 4, wrapping around for the
+ * length of the run, and then checks every sector of it.  The image is
+ * several times larger than the driver's cache of decompressed chunks, so
+ * each pass decompresses all of them again.
+ *
+ * bench_dmg [-t SECONDS] [-s MB] [-k CHUNK_KB]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <bzlib.h>
+#include "bench.h"
+#include "qemu/bswap.h"
+
+#define BLOCK_SIZE      (128 << 10)
+
+#define DMG_ZLIB        0x80000005
+#define DMG_BZIP2       0x80000006
+#define DMG_MISH        0x6d697368
+
+static const int depths[] = { 1, 4 };
+
+static int64_t size = 128 << 20;
+static int chunk_size = 256 << 10;
+
+/* Compresses to about a third: half of every 4 KiB is zero, half letters */
+static uint8_t pattern(int64_t offset)
+{
+    uint32_t h = (uint32_t)(offset >> 4) * 2654435761u;
+
+    return (offset & 2048) ? 0 : 'a' + ((h >> (offset & 12)) & 15);
+}
+
+/*
+ * Writes the chunks, then a resource fork with a single "mish" block that
+ * lists them, padded to whole sectors, then the trailer that points to the
+ * resource fork
+ */
+static void create_dmg(const char *path, uint32_t type)
+{
+    int n = size / chunk_size, i, j;
+    int mish_len = 204 + 40 * n;
+    uint8_t *in = g_malloc(chunk_size);
+    unsigned int out_size = chunk_size + chunk_size / 100 + 1024;
+    uint8_t *out = g_malloc(out_size);
+    uint8_t *rsrc = g_malloc0(0x100 + 4 + mish_len + 512);
+    int rsrc_len;
+    uint8_t trailer[512] = { 0 };
+    uint8_t *entry = rsrc + 0x100 + 4 + 204;
+    uint64_t offset = 0;
+    FILE *f = fopen(path, "w");
+
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    for (i = 0; i < n; i++, entry += 40) {
+        unsigned int len = out_size;
+        uLongf zlen = out_size;
+
+        for (j = 0; j < chunk_size; j++) {
+            in[j] = pattern((int64_t)i * chunk_size + j);
+        }
+        if (type == DMG_ZLIB) {
+            if (compress(out, &zlen, in, chunk_size) != Z_OK) {
+                fprintf(stderr, "compress failed\n");
+                exit(1);
+            }
+            len = zlen;
+        } else if (BZ2_bzBuffToBuffCompress((char *)out, &len, (char *)in,
+                                            chunk_size, 9, 0, 0) != BZ_OK) {
+            fprintf(stderr, "BZ2_bzBuffToBuffCompress failed\n");
+            exit(1);
+        }
+        if (fwrite(out, 1, len, f) != len) {
+            perror(path);
+            exit(1);
+        }
+
+        stl_be_p(entry, type);
+        stq_be_p(entry + 8, (uint64_t)i * chunk_size / 512);
+        stq_be_p(entry + 16, chunk_size / 512);
+        stq_be_p(entry + 24, offset);
+        stq_be_p(entry + 32, len);
+        offset += len;
+    }
+
+    rsrc_len = ROUND_UP(offset + 0x100 + 4 + mish_len, 512) - offset;
+    stl_be_p(rsrc, 0x100);
+    stl_be_p(rsrc + 4, 0x100 + 4 + mish_len);
+    stl_be_p(rsrc + 0x100, mish_len);
+    stl_be_p(rsrc + 0x104, DMG_MISH);
+    stq_be_p(trailer + 512 - 0x1d8, offset);
+    if (fwrite(rsrc, 1, rsrc_len, f) != rsrc_len ||
+        fwrite(trailer, 1, sizeof(trailer), f) != sizeof(trailer) ||
+        fclose(f)) {
+        perror(path);
+        exit(1);
+    }
+
+    g_free(in);
+    g_free(out);
+    g_free(rsrc);
+}
+
+static int check(BlockDriverState *bs, const char *name)
+{
+    uint8_t *buf = g_malloc(BLOCK_SIZE);
+    int64_t offset;
+    int i;
+
+    for (offset = 0; offset < size; offset += BLOCK_SIZE) {
+        if (bdrv_pread(bs, offset, buf, BLOCK_SIZE) != BLOCK_SIZE) {
+            fprintf(stderr, "%s: read at %" PRId64 " failed\n", name, offset);
+            return 1;
+        }
+        for (i = 0; i < BLOCK_SIZE; i++) {
+            if (buf[i] != pattern(offset + i)) {
+                fprintf(stderr, "%s: wrong data at offset %" PRId64 "\n",
+                        name, offset + i);
+                return 1;
+            }
+        }
+    }
+    g_free(buf);
+    return 0;
+}
+
+static int run(const char *name, uint32_t type, double seconds)
+{
+    char path[] = "/var/tmp/bench_dmg.XXXXXX.dmg";
+    BlockDriverState *bs = NULL;
+    Error *local_err = NULL;
+    BenchIOResult res;
+    int fd, i, ret;
+
+    fd = mkstemps(path, 4);
+    if (fd < 0) {
+        perror("mkstemps");
+        exit(1);
+    }
+    close(fd);
+    create_dmg(path, type);
+
+    bdrv_open(&bs, path, NULL, NULL, BDRV_O_CACHE_WB, bdrv_find_format("dmg"),
+              &local_err);
+    if (local_err) {
+        printf("%-16s %s\n", name, error_get_pretty(local_err));
+        error_free(local_err);
+        unlink(path);
+        return 0;
+    }
+    for (i = 0; i < ARRAY_SIZE(depths); i++) {
+        bench_io(bs, depths[i], false, true, BLOCK_SIZE, size, seconds, &res);
+        bench_io_print(name, depths[i], &res);
+    }
+    ret = check(bs, name);
+
+    bdrv_unref(bs);
+    unlink(path);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = 2;
+    int c, ret;
+
+    while ((c = getopt(argc, argv, "t:s:k:")) != -1) {
+        switch (c) {
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 's':
+            size = (int64_t)atoi(optarg) << 20;
+            break;
+        case 'k':
+            chunk_size = atoi(optarg) << 10;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t SECONDS] [-s MB] [-k CHUNK_KB]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (seconds <= 0 || chunk_size < 512 || chunk_size % 512 ||
+        size < BLOCK_SIZE || size % chunk_size || size % BLOCK_SIZE) {
+        fprintf(stderr, "need a positive run time, chunks of whole sectors "
+                "and a size of whole chunks and 128 KiB blocks\n");
+        return 2;
+    }
+
+    bench_init();
+
+    printf("DMG, %" PRId64 " MB, %d KiB chunks, 128 KiB sequential reads, "
+           "%.1f s per run\n", size >> 20, chunk_size >> 10, seconds);
+    bench_io_print_header();
+    ret = run("zlib", DMG_ZLIB, seconds);
+    ret |= run("bzip2", DMG_BZIP2, seconds);
+    return ret;
+}
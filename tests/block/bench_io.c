@@ -0,0 +1,150 @@
+/*
+ * Queue depth driven I/O on a BlockDriverState, see bench.h
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include "bench.h"
+#include "aio.h"
+
+#define MAX_DEPTH   128
+
+typedef struct BenchIOReq {
+    struct BenchIOState *state;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    uint64_t start;
+} BenchIOReq;
+
+typedef struct BenchIOState {
+    BlockDriverState *bs;
+    bool is_write;
+    bool sequential;
+    int block_size;
+    int64_t blocks;
+    int64_t next_block;
+    uint64_t deadline;
+    int in_flight;
+
+    uint64_t *latency;
+    int64_t completed;
+    int64_t alloc;
+} BenchIOState;
+
+static void bench_io_cb(void *opaque, int ret);
+
+static void bench_io_submit(BenchIOReq *req)
+{
+    BenchIOState *st = req->state;
+    int nb_sectors = st->block_size >> BDRV_SECTOR_BITS;
+    int64_t block;
+
+    if (st->sequential) {
+        block = st->next_block++ % st->blocks;
+    } else {
+        block = random() % st->blocks;
+    }
+
+    st->in_flight++;
+    req->start = now_ns();
+    if (st->is_write) {
+        bdrv_aio_writev(st->bs, block * nb_sectors, &req->qiov, nb_sectors,
+                        bench_io_cb, req);
+    } else {
+        bdrv_aio_readv(st->bs, block * nb_sectors, &req->qiov, nb_sectors,
+                       bench_io_cb, req);
+    }
+}
+
+static void bench_io_cb(void *opaque, int ret)
+{
+    BenchIOReq *req = opaque;
+    BenchIOState *st = req->state;
+    uint64_t now = now_ns();
+
+    if (ret < 0) {
+        fprintf(stderr, "%s failed: %s\n", st->is_write ? "write" : "read",
+                strerror(-ret));
+        exit(1);
+    }
+    if (st->completed == st->alloc) {
+        st->alloc = st->alloc ? st->alloc * 2 : 65536;
+        st->latency = g_renew(uint64_t, st->latency, st->alloc);
+    }
+    st->latency[st->completed++] = now - req->start;
+    st->in_flight--;
+
+    if (now < st->deadline) {
+        bench_io_submit(req);
+    }
+}
+
+void bench_io(BlockDriverState *bs, int depth, bool is_write, bool sequential,
+              int block_size, int64_t size, double seconds,
+              BenchIOResult *res)
+{
+    VeertuAioContext *ctx = bdrv_get_aio_context(bs);
+    BenchIOState st = {
+        .bs = bs,
+        .is_write = is_write,
+        .sequential = sequential,
+        .block_size = block_size,
+        .blocks = size / block_size,
+    };
+    BenchIOReq reqs[MAX_DEPTH];
+    uint64_t wall, cpu;
+    double sum = 0;
+    int64_t i;
+
+    assert(depth > 0 && depth <= MAX_DEPTH && st.blocks > 0);
+    for (i = 0; i < depth; i++) {
+        reqs[i].state = &st;
+        reqs[i].iov.iov_base = vmx_blockalign(bs, block_size);
+        reqs[i].iov.iov_len = block_size;
+        memset(reqs[i].iov.iov_base, 0x5a, block_size);
+        vmx_iovec_init_external(&reqs[i].qiov, &reqs[i].iov, 1);
+    }
+
+    wall = now_ns();
+    cpu = cpu_ns();
+    st.deadline = wall + (uint64_t)(seconds * 1e9);
+    for (i = 0; i < depth; i++) {
+        bench_io_submit(&reqs[i]);
+    }
+    while (st.in_flight) {
+        aio_poll(ctx, true);
+    }
+    wall = now_ns() - wall;
+    cpu = cpu_ns() - cpu;
+
+    for (i = 0; i < st.completed; i++) {
+        sum += st.latency[i];
+    }
+    res->requests = st.completed;
+    res->iops = st.completed * 1e9 / wall;
+    res->mbps = res->iops * block_size / 1e6;
+    res->avg_us = sum / st.completed / 1e3;
+    res->p50_us = percentile(st.latency, st.completed, 50) / 1e3;
+    res->p99_us = percentile(st.latency, st.completed, 99) / 1e3;
+    res->cpu_us = (double)cpu / st.completed / 1e3;
+
+    for (i = 0; i < depth; i++) {
+        vmx_vfree(reqs[i].iov.iov_base);
+    }
+    g_free(st.latency);
+}
+
+void bench_io_print_header(void)
+{
+    printf("%-16s %5s %10s %9s %9s %9s %9s %9s\n", "", "depth", "IOPS",
+           "MB/s", "avg us", "p50 us", "p99 us", "cpu us/IO");
+}
+
+void bench_io_print(const char *name, int depth, BenchIOResult *res)
+{
+    printf("%-16s %5d %10.0f %9.1f %9.1f %9.1f %9.1f %9.2f\n", name, depth,
+           res->iops, res->mbps, res->avg_us, res->p50_us, res->p99_us,
+           res->cpu_us);
+}
@@ -0,0 +1,131 @@
+/*
+ * Random 4 KiB reads and writes on a qcow2 image at queue depths 1 to 32
+ *
+ * "read" and "rewrite" run on an image whose clusters are all allocated,
+ * which is the path that takes the qcow2 lock shared; "alloc write" writes
+ * into a fresh, empty image, so most requests allocate a cluster and take
+ * it exclusively.  The image sits on a raw-posix file opened O_DIRECT
+ * unless -b is given.
+ *
+ * bench_qcow2 [-b] [-t SECONDS] [-s MB] [-c CLUSTER_SIZE]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define BLOCK_SIZE  4096
+
+static const int depths[] = { 1, 2, 4, 8, 16, 32 };
+
+static char image_path[] = "/var/tmp/bench_qcow2.XXXXXX";
+static int flags = BDRV_O_RDWR | BDRV_O_NOCACHE | BDRV_O_CACHE_WB;
+static int64_t size = 1024 << 20;
+static int cluster_size = 65536;
+
+static BlockDriverState *create_image(void)
+{
+    BlockDriverState *bs = NULL;
+    char options[64];
+    int fd;
+
+    fd = mkstemp(image_path);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    close(fd);
+    snprintf(options, sizeof(options), "cluster_size=%d", cluster_size);
+    bdrv_img_create(image_path, "qcow2", NULL, NULL, options, size, 0,
+                    &error_abort, true);
+    bdrv_open(&bs, image_path, NULL, NULL, flags, bdrv_find_format("qcow2"),
+              &error_abort);
+    return bs;
+}
+
+/* Allocates every cluster, with large sequential writes */
+static void fill_image(BlockDriverState *bs)
+{
+    int chunk = 1 << 20;
+    uint8_t *buf = vmx_blockalign(bs, chunk);
+    int64_t offset;
+
+    memset(buf, 0xa5, chunk);
+    for (offset = 0; offset < size; offset += chunk) {
+        if (bdrv_pwrite(bs, offset, buf, MIN(chunk, size - offset)) < 0) {
+            fprintf(stderr, "filling the image failed\n");
+            exit(1);
+        }
+    }
+    vmx_vfree(buf);
+}
+
+static void destroy_image(BlockDriverState *bs)
+{
+    bdrv_unref(bs);
+    unlink(image_path);
+    strcpy(image_path + strlen(image_path) - 6, "XXXXXX");
+}
+
+int main(int argc, char **argv)
+{
+    BlockDriverState *bs;
+    BenchIOResult res;
+    double seconds = 2;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "bt:s:c:")) != -1) {
+        switch (c) {
+        case 'b':
+            flags &= ~BDRV_O_NOCACHE;
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 's':
+            size = (int64_t)atoi(optarg) << 20;
+            break;
+        case 'c':
+            cluster_size = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-b] [-t SECONDS] [-s MB] [-c CLUSTER_SIZE]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (seconds <= 0 || size < cluster_size) {
+        fprintf(stderr, "need a positive run time and at least one cluster\n");
+        return 2;
+    }
+
+    bench_init();
+
+    printf("qcow2, %d byte clusters, %" PRId64 " MB, %s, %.1f s per run\n",
+           cluster_size, size >> 20,
+           flags & BDRV_O_NOCACHE ? "O_DIRECT" : "page cache", seconds);
+    bench_io_print_header();
+
+    bs = create_image();
+    fill_image(bs);
+    for (i = 0; i < ARRAY_SIZE(depths); i++) {
+        bench_io(bs, depths[i], false, false, BLOCK_SIZE, size, seconds, &res);
+        bench_io_print("read", depths[i], &res);
+    }
+    for (i = 0; i < ARRAY_SIZE(depths); i++) {
+        bench_io(bs, depths[i], true, false, BLOCK_SIZE, size, seconds, &res);
+        bench_io_print("rewrite", depths[i], &res);
+    }
+    destroy_image(bs);
+
+    for (i = 0; i < ARRAY_SIZE(depths); i++) {
+        bs = create_image();
+        bench_io(bs, depths[i], true, false, BLOCK_SIZE, size, seconds, &res);
+        bench_io_print("alloc write", depths[i], &res);
+        destroy_image(bs);
+    }
+    return 0;
+}
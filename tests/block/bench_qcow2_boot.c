@@ -0,0 +1,331 @@
+/*
+ * Boot storm on a compressed qcow2 image
+ *
+ * Writes a golden image with every cluster compressed and replays a boot
+ * trace against it from 1, 4 and 8 guests at once, for several sizes of the
+ * decompressed cluster cache.  Each guest opens the image on its own, with
+ * its own cache, the way VMs booting off the same golden image do, and keeps
+ * -q reads of the trace in flight.  The smallest cache, two clusters, is
+ * about what the single decompressed cluster of old qcow2 gave.
+ *
+ * The trace is read from -f FILE, one "offset length" read in bytes per
+ * line, or generated: four interleaved runs of sequential 4 to 128 KiB reads
+ * at random places in the image, the way the services of a booting guest
+ * load their binaries and libraries side by side, with every tenth read
+ * going back to the first 2 MB.  -v checks the data of every read.
+ *
+ * bench_qcow2_boot [-v] [-s MB] [-c CLUSTER_SIZE] [-n READS] [-q DEPTH] [-f FILE]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include "bench.h"
+#include "aio.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+
+#define MAX_GUESTS      8
+#define MAX_DEPTH       32
+#define TRACE_STREAMS   4
+
+static const int guest_counts[] = { 1, 4, MAX_GUESTS };
+
+typedef struct TraceRead {
+    int64_t offset;
+    int bytes;
+} TraceRead;
+
+typedef struct BootReq {
+    struct Guest *guest;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    TraceRead *read;
+    uint64_t start;
+} BootReq;
+
+typedef struct Guest {
+    BlockDriverState *bs;
+    int next;
+    BootReq reqs[MAX_DEPTH];
+} Guest;
+
+static int64_t size = 256 << 20;
+static int cluster_size = 65536;
+static int depth = 4;
+static bool verify;
+
+static TraceRead *trace;
+static int trace_len;
+static int max_bytes;
+static uint64_t trace_bytes;
+
+static uint64_t *latency;
+static int completed;
+static int in_flight;
+
+/* Compresses to about a third: half of every 4 KiB is zero, half letters */
+static uint8_t pattern(int64_t offset)
+{
+    uint32_t h = (uint32_t)(offset >> 4) * 2654435761u;
+
+    return (offset & 2048) ? 0 : 'a' + ((h >> (offset & 12)) & 15);
+}
+
+static void add_read(int64_t offset, int64_t bytes)
+{
+    offset &= ~(int64_t)(BDRV_SECTOR_SIZE - 1);
+    bytes = ROUND_UP(bytes, BDRV_SECTOR_SIZE);
+    if (bytes <= 0 || offset >= size) {
+        return;
+    }
+    bytes = MIN(bytes, size - offset);
+
+    trace = g_renew(TraceRead, trace, trace_len + 1);
+    trace[trace_len].offset = offset;
+    trace[trace_len].bytes = bytes;
+    trace_len++;
+    max_bytes = MAX(max_bytes, bytes);
+    trace_bytes += bytes;
+}
+
+static void load_trace(const char *path)
+{
+    long long offset, bytes;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    while (fscanf(f, "%lld %lld", &offset, &bytes) == 2) {
+        add_read(offset, MIN(bytes, 1 << 20));
+    }
+    fclose(f);
+}
+
+static void generate_trace(int reads)
+{
+    int64_t blocks = size / 4096, offset[TRACE_STREAMS] = { 0 };
+    int i, k, bytes;
+
+    srandom(1);
+    for (i = 0; i < reads; i++) {
+        bytes = 4096 << (random() % 6);
+        if (i % 10 == 9) {
+            add_read(random() % MIN(blocks, 512) * 4096, bytes);
+            continue;
+        }
+        k = random() % TRACE_STREAMS;
+        if (random() % 8 == 0 || offset[k] + bytes > size) {
+            offset[k] = random() % blocks * 4096;
+        }
+        add_read(offset[k], bytes);
+        offset[k] += bytes;
+    }
+}
+
+static void create_image(const char *path)
+{
+    BlockDriverState *bs = NULL;
+    int chunk = 1 << 20, i;
+    char options[64];
+    int64_t offset;
+    uint8_t *buf;
+
+    snprintf(options, sizeof(options), "cluster_size=%d", cluster_size);
+    bdrv_img_create(path, "qcow2", NULL, NULL, options, size, 0,
+                    &error_abort, true);
+    bdrv_open(&bs, path, NULL, NULL, BDRV_O_RDWR | BDRV_O_CACHE_WB,
+              bdrv_find_format("qcow2"), &error_abort);
+
+    buf = vmx_blockalign(bs, chunk);
+    for (offset = 0; offset < size; offset += chunk) {
+        int n = MIN(chunk, size - offset);
+
+        for (i = 0; i < n; i++) {
+            buf[i] = pattern(offset + i);
+        }
+        if (bdrv_write_compressed(bs, offset >> BDRV_SECTOR_BITS, buf,
+                                  n >> BDRV_SECTOR_BITS) < 0) {
+            fprintf(stderr, "compressed write failed\n");
+            exit(1);
+        }
+    }
+    vmx_vfree(buf);
+    bdrv_unref(bs);
+}
+
+static void boot_cb(void *opaque, int ret);
+
+static void boot_submit(BootReq *req)
+{
+    Guest *g = req->guest;
+
+    req->read = &trace[g->next++];
+    req->iov.iov_len = req->read->bytes;
+    vmx_iovec_init_external(&req->qiov, &req->iov, 1);
+
+    in_flight++;
+    req->start = now_ns();
+    bdrv_aio_readv(g->bs, req->read->offset >> BDRV_SECTOR_BITS, &req->qiov,
+                   req->read->bytes >> BDRV_SECTOR_BITS, boot_cb, req);
+}
+
+static void boot_cb(void *opaque, int ret)
+{
+    BootReq *req = opaque;
+    uint8_t *data = req->iov.iov_base;
+    int i;
+
+    if (ret < 0) {
+        fprintf(stderr, "read failed: %s\n", strerror(-ret));
+        exit(1);
+    }
+    for (i = 0; verify && i < req->read->bytes; i++) {
+        if (data[i] != pattern(req->read->offset + i)) {
+            fprintf(stderr, "wrong data at offset %" PRId64 "\n",
+                    req->read->offset + i);
+            exit(1);
+        }
+    }
+    latency[completed++] = now_ns() - req->start;
+    in_flight--;
+
+    if (req->guest->next < trace_len) {
+        boot_submit(req);
+    }
+}
+
+static void run(const char *path, int64_t cache_size, int guests)
+{
+    Guest g[MAX_GUESTS];
+    uint64_t wall, cpu;
+    char value[32];
+    int i, j;
+
+    for (i = 0; i < guests; i++) {
+        QDict *options = qdict_new();
+
+        snprintf(value, sizeof(value), "%" PRId64, cache_size);
+        qdict_put(options, "compressed-cache-size", qstring_from_str(value));
+        g[i].bs = NULL;
+        g[i].next = 0;
+        bdrv_open(&g[i].bs, path, NULL, options, BDRV_O_CACHE_WB,
+                  bdrv_find_format("qcow2"), &error_abort);
+        for (j = 0; j < depth; j++) {
+            g[i].reqs[j].guest = &g[i];
+            g[i].reqs[j].iov.iov_base = vmx_blockalign(g[i].bs, max_bytes);
+        }
+    }
+    latency = g_new(uint64_t, (int64_t)guests * trace_len);
+    completed = 0;
+
+    wall = now_ns();
+    cpu = cpu_ns();
+    for (j = 0; j < depth; j++) {
+        for (i = 0; i < guests; i++) {
+            if (g[i].next < trace_len) {
+                boot_submit(&g[i].reqs[j]);
+            }
+        }
+    }
+    while (in_flight) {
+        aio_poll(vmx_get_aio_context(), true);
+    }
+    wall = now_ns() - wall;
+    cpu = cpu_ns() - cpu;
+
+    printf("%7" PRId64 " KiB %7d %9.2f %9.1f %9.2f %9.2f\n",
+           cache_size >> 10, guests, wall / 1e9,
+           trace_bytes * guests / (wall / 1e9) / 1e6,
+           percentile(latency, completed, 99) / 1e6, cpu / 1e9);
+
+    for (i = 0; i < guests; i++) {
+        for (j = 0; j < depth; j++) {
+            vmx_vfree(g[i].reqs[j].iov.iov_base);
+        }
+        bdrv_unref(g[i].bs);
+    }
+    g_free(latency);
+}
+
+int main(int argc, char **argv)
+{
+    char path[] = "/var/tmp/bench_qcow2_boot.XXXXXX";
+    const char *trace_file = NULL;
+    int64_t cache_sizes[3];
+    int reads = 2000;
+    int c, fd, i, j;
+
+    while ((c = getopt(argc, argv, "vs:c:n:q:f:")) != -1) {
+        switch (c) {
+        case 'v':
+            verify = true;
+            break;
+        case 's':
+            size = (int64_t)atoi(optarg) << 20;
+            break;
+        case 'c':
+            cluster_size = atoi(optarg);
+            break;
+        case 'n':
+            reads = atoi(optarg);
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        case 'f':
+            trace_file = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-v] [-s MB] [-c CLUSTER_SIZE] "
+                    "[-n READS] [-q DEPTH] [-f FILE]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (size < (1 << 20) || reads <= 0 || depth <= 0 || depth > MAX_DEPTH) {
+        fprintf(stderr, "need at least 1 MB, one read and a depth of 1 to %d\n",
+                MAX_DEPTH);
+        return 2;
+    }
+
+    if (trace_file) {
+        load_trace(trace_file);
+    } else {
+        generate_trace(reads);
+    }
+    if (!trace_len) {
+        fprintf(stderr, "the trace has no reads inside the image\n");
+        return 1;
+    }
+
+    bench_init();
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    create_image(path);
+
+    cache_sizes[0] = 2 * cluster_size;
+    cache_sizes[1] = 1 << 20;
+    cache_sizes[2] = 16 << 20;
+
+    printf("compressed qcow2, %d byte clusters, %" PRId64 " MB, %d reads of "
+           "%" PRIu64 " MB per guest, depth %d, page cache\n", cluster_size,
+           size >> 20, trace_len, trace_bytes >> 20, depth);
+    printf("%11s %7s %9s %9s %9s %9s\n", "cache", "guests", "seconds",
+           "MB/s", "p99 ms", "cpu s");
+    for (i = 0; i < ARRAY_SIZE(cache_sizes); i++) {
+        for (j = 0; j < ARRAY_SIZE(guest_counts); j++) {
+            run(path, cache_sizes[i], guest_counts[j]);
+        }
+    }
+
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * Cluster allocation on a fragmented qcow2 image
+ *
+ * Fills the first half of an image, discards every other cluster of it so
+ * that the host file is left with thousands of one-cluster holes, then
+ * times allocating writes of -w KiB into the empty second half.  Those
+ * need runs of several free clusters, which none of the holes can hold.
+ * The same writes on an image without holes give the baseline.  Both
+ * images are checked for leaks and corruption afterwards.
+ *
+ * bench_qcow2_frag [-s MB] [-c CLUSTER_SIZE] [-w KB] [-n WRITES]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include "bench.h"
+
+static int64_t size = 512 << 20;
+static int cluster_size = 65536;
+static int write_size = 128 << 10;
+static int writes = 2000;
+
+static int run(bool fragment)
+{
+    char path[] = "/var/tmp/bench_qcow2_frag.XXXXXX";
+    int flags = BDRV_O_RDWR | BDRV_O_CACHE_WB | BDRV_O_UNMAP;
+    int chunk = 1 << 20, holes = 0, ret = 0;
+    BlockDriverState *bs = NULL;
+    BdrvCheckResult check;
+    char options[64];
+    uint64_t total;
+    uint8_t *buf;
+    int64_t offset;
+    int fd, i;
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    close(fd);
+    snprintf(options, sizeof(options), "cluster_size=%d", cluster_size);
+    bdrv_img_create(path, "qcow2", NULL, NULL, options, 2 * size, 0,
+                    &error_abort, true);
+    bdrv_open(&bs, path, NULL, NULL, flags, bdrv_find_format("qcow2"),
+              &error_abort);
+
+    buf = vmx_blockalign(bs, MAX(chunk, write_size));
+    memset(buf, 0xa5, MAX(chunk, write_size));
+    for (offset = 0; offset < size; offset += chunk) {
+        if (bdrv_pwrite(bs, offset, buf, chunk) < 0) {
+            fprintf(stderr, "filling the image failed\n");
+            exit(1);
+        }
+    }
+    if (fragment) {
+        for (offset = 0; offset < size; offset += 2 * cluster_size) {
+            if (bdrv_discard(bs, offset >> BDRV_SECTOR_BITS,
+                             cluster_size >> BDRV_SECTOR_BITS) < 0) {
+                fprintf(stderr, "discard failed\n");
+                exit(1);
+            }
+            holes++;
+        }
+    }
+
+    offset = size;
+    total = now_ns();
+    for (i = 0; i < writes && offset + write_size <= 2 * size; i++) {
+        if (bdrv_pwrite(bs, offset, buf, write_size) < 0) {
+            fprintf(stderr, "write failed\n");
+            exit(1);
+        }
+        offset += write_size;
+    }
+    total = now_ns() - total;
+    printf("%-12s %8d %8d %12.1f %12.0f\n", fragment ? "fragmented" : "contiguous",
+           holes, i, total / 1e3 / i, i * 1e9 / total);
+
+    /* The check reads the L2 tables from the file, not from the cache */
+    bdrv_flush(bs);
+    memset(&check, 0, sizeof(check));
+    if (bdrv_check(bs, &check, 0) < 0 || check.corruptions || check.leaks ||
+        check.check_errors) {
+        fprintf(stderr, "check: %d corruptions, %d leaks, %d errors\n",
+                check.corruptions, check.leaks, check.check_errors);
+        ret = 1;
+    }
+
+    vmx_vfree(buf);
+    bdrv_unref(bs);
+    unlink(path);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int c, ret;
+
+    while ((c = getopt(argc, argv, "s:c:w:n:")) != -1) {
+        switch (c) {
+        case 's':
+            size = (int64_t)atoi(optarg) << 20;
+            break;
+        case 'c':
+            cluster_size = atoi(optarg);
+            break;
+        case 'w':
+            write_size = atoi(optarg) << 10;
+            break;
+        case 'n':
+            writes = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s MB] [-c CLUSTER_SIZE] [-w KB] [-n WRITES]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (size < (1 << 20) || write_size < cluster_size || writes <= 0) {
+        fprintf(stderr, "need at least 1 MB, writes of a cluster or more\n");
+        return 2;
+    }
+
+    bench_init();
+
+    printf("qcow2, %d byte clusters, %" PRId64 " MB filled, %d KiB writes, "
+           "page cache\n", cluster_size, size >> 20, write_size >> 10);
+    printf("%-12s %8s %8s %12s %12s\n", "", "holes", "writes", "us/write",
+           "writes/s");
+    ret = run(false);
+    ret |= run(true);
+    return ret;
+}
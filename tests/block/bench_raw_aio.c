@@ -0,0 +1,118 @@
+/*
+ * IOPS and CPU time per request of raw-posix, thread pool against io_uring
+ *
+ * Opens a scratch file with the "file" driver, once with the thread pool
+ * and, when block/io_uring.c is built in, once with BDRV_O_IO_URING, and
+ * runs 4 KiB random reads (or writes) at queue depths 1 to 128.  The file
+ * is opened O_DIRECT unless -b is given, so that requests reach the disk
+ * instead of completing from the page cache.  CPU time counts all threads,
+ * so the thread pool's workers are charged to it.
+ *
+ * bench_raw_aio [-b] [-w] [-t SECONDS] [-s MB] [-f FILE]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "bench.h"
+
+#define BLOCK_SIZE  4096
+
+static const int depths[] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+
+static void run(const char *path, const char *name, int flags,
+                bool is_write, double seconds, int64_t size)
+{
+    BlockDriverState *bs = NULL;
+    BenchIOResult res;
+    int i;
+
+    bdrv_open(&bs, path, NULL, NULL, flags, bdrv_find_format("file"),
+              &error_abort);
+    for (i = 0; i < ARRAY_SIZE(depths); i++) {
+        bench_io(bs, depths[i], is_write, false, BLOCK_SIZE, size, seconds,
+                 &res);
+        bench_io_print(name, depths[i], &res);
+    }
+    bdrv_unref(bs);
+}
+
+int main(int argc, char **argv)
+{
+    char tmp[] = "/var/tmp/bench_raw_aio.XXXXXX";
+    const char *path = NULL;
+    static char chunk[1 << 20];
+    int flags = BDRV_O_RDWR | BDRV_O_NOCACHE | BDRV_O_CACHE_WB;
+    bool is_write = false;
+    double seconds = 2;
+    int64_t size = 256 << 20;
+    int c, fd, i;
+
+    while ((c = getopt(argc, argv, "bwt:s:f:")) != -1) {
+        switch (c) {
+        case 'b':
+            flags &= ~BDRV_O_NOCACHE;
+            break;
+        case 'w':
+            is_write = true;
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 's':
+            size = (int64_t)atoi(optarg) << 20;
+            break;
+        case 'f':
+            path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-b] [-w] [-t SECONDS] [-s MB] [-f FILE]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (seconds <= 0 || size < BLOCK_SIZE) {
+        fprintf(stderr, "need a positive run time and at least one block\n");
+        return 2;
+    }
+
+    bench_init();
+
+    if (!path) {
+        /* Written out, so that reads are not served from unwritten extents */
+        fd = mkstemp(tmp);
+        if (fd < 0) {
+            perror("mkstemp");
+            return 1;
+        }
+        memset(chunk, 0xa5, sizeof(chunk));
+        for (i = 0; i < size / sizeof(chunk); i++) {
+            if (write(fd, chunk, sizeof(chunk)) != sizeof(chunk)) {
+                perror("write");
+                return 1;
+            }
+        }
+        fsync(fd);
+        close(fd);
+        path = tmp;
+    }
+
+    printf("4 KiB random %s, %s, %.1f s per run\n",
+           is_write ? "writes" : "reads",
+           flags & BDRV_O_NOCACHE ? "O_DIRECT" : "page cache", seconds);
+    bench_io_print_header();
+    run(path, "threads", flags, is_write, seconds, size);
+#ifdef CONFIG_LINUX_IO_URING
+    run(path, "io_uring", flags | BDRV_O_IO_URING, is_write, seconds, size);
+#else
+    printf("io_uring not built in\n");
+#endif
+
+    if (path == tmp) {
+        unlink(tmp);
+    }
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * Latency and IOPS of util/thread-pool.c at queue depths 1 to 128
+ *
+ * Keeps DEPTH requests in flight on the thread pool of the main
+ * VeertuAioContext and resubmits from the completion callback, the way
+ * raw-posix drives it.  "null" requests return right away and measure the
+ * pool alone; "pread" requests read 4 KiB at a random offset of a file in
+ * the page cache, the typical raw-posix request.
+ *
+ * bench_thread_pool [-n REQUESTS]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "bench.h"
+#include "aio.h"
+#include "thread-pool.h"
+
+#define FILE_SIZE   (64 << 20)
+#define BLOCK_SIZE  4096
+#define MAX_DEPTH   128
+
+typedef struct BenchReq {
+    uint64_t start;
+    off_t offset;
+    char buf[BLOCK_SIZE];
+} BenchReq;
+
+static ThreadPool *pool;
+static ThreadPoolFunc *work;
+static int fd;
+static int requests;
+static int submitted;
+static int completed;
+static uint64_t *latency;
+static BenchReq reqs[MAX_DEPTH];
+
+static int null_work(void *opaque)
+{
+    return 0;
+}
+
+static int pread_work(void *opaque)
+{
+    BenchReq *req = opaque;
+
+    return pread(fd, req->buf, BLOCK_SIZE, req->offset) == BLOCK_SIZE ? 0 : -EIO;
+}
+
+static void bench_cb(void *opaque, int ret);
+
+static void submit(BenchReq *req)
+{
+    submitted++;
+    req->offset = (off_t)(random() % (FILE_SIZE / BLOCK_SIZE)) * BLOCK_SIZE;
+    req->start = now_ns();
+    thread_pool_submit_aio(pool, work, req, bench_cb, req);
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchReq *req = opaque;
+
+    if (ret < 0) {
+        fprintf(stderr, "request failed: %s\n", strerror(-ret));
+        exit(1);
+    }
+    latency[completed++] = now_ns() - req->start;
+    if (submitted < requests) {
+        submit(req);
+    }
+}
+
+static void run(const char *name, int depth)
+{
+    VeertuAioContext *ctx = vmx_get_aio_context();
+    uint64_t wall, cpu;
+    double avg = 0;
+    int i;
+
+    submitted = completed = 0;
+    wall = now_ns();
+    cpu = cpu_ns();
+    for (i = 0; i < depth && i < requests; i++) {
+        submit(&reqs[i]);
+    }
+    while (completed < requests) {
+        aio_poll(ctx, true);
+    }
+    wall = now_ns() - wall;
+    cpu = cpu_ns() - cpu;
+
+    for (i = 0; i < requests; i++) {
+        avg += latency[i];
+    }
+    avg /= requests;
+    printf("%-6s %5d %10.0f %9.1f %9.1f %9.1f %9.2f\n", name, depth,
+           requests * 1e9 / wall, avg / 1e3,
+           percentile(latency, requests, 50) / 1e3,
+           percentile(latency, requests, 99) / 1e3,
+           (double)cpu / requests / 1e3);
+}
+
+int main(int argc, char **argv)
+{
+    char path[] = "/tmp/bench_thread_pool.XXXXXX";
+    static char chunk[1 << 20];
+    int c, depth, i;
+
+    requests = 200000;
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n':
+            requests = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n REQUESTS]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (requests <= 0) {
+        fprintf(stderr, "need at least one request\n");
+        return 2;
+    }
+
+    bench_init();
+    pool = aio_get_thread_pool(vmx_get_aio_context());
+    latency = g_new(uint64_t, requests);
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    memset(chunk, 0xa5, sizeof(chunk));
+    for (i = 0; i < FILE_SIZE / sizeof(chunk); i++) {
+        if (write(fd, chunk, sizeof(chunk)) != sizeof(chunk)) {
+            perror("write");
+            return 1;
+        }
+    }
+
+    printf("%d requests per run\n", requests);
+    printf("%-6s %5s %10s %9s %9s %9s %9s\n", "work", "depth", "IOPS",
+           "avg us", "p50 us", "p99 us", "cpu us/IO");
+    for (depth = 1; depth <= MAX_DEPTH; depth *= 2) {
+        work = null_work;
+        run("null", depth);
+    }
+    for (depth = 1; depth <= MAX_DEPTH; depth *= 2) {
+        work = pread_work;
+        run("pread", depth);
+    }
+
+    close(fd);
+    g_free(latency);
+    return 0;
+}
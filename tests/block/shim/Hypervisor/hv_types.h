@@ -0,0 +1,2 @@
+/* CPUState needs the Hypervisor.framework types, see tests/x86-emu */
+#include "../../../x86-emu/shim/Hypervisor/hv_types.h"
@@ -0,0 +1,2 @@
+/* see hv_types.h */
+#include "../../../x86-emu/shim/Hypervisor/hv_vmx.h"
@@ -0,0 +1,41 @@
+/*
+ * Included ahead of every source file of the harness (-include): the
+ * block layer is configured for Darwin by include/config-host.h and uses a
+ * few BSD spellings, flags and headers without an #ifdef.
+ */
+
+#ifndef TESTS_BLOCK_DARWIN_COMPAT_H
+#define TESTS_BLOCK_DARWIN_COMPAT_H
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/syscall.h>
+
+/* <sys/cdefs.h> */
+#define __unused            __attribute__((unused))
+
+/*
+ * include/qemu/osdep.h turns every inline into always_inline except on
+ * Apple, which error-report.h's variadic inlines rely on
+ */
+#define always_inline       __inline__
+
+/* clang builtin behind atomic_xchg() in include/qemu/atomic.h */
+#define __sync_swap(ptr, val) __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST)
+
+/* open(2) and fcntl(2) */
+#define O_EXLOCK            0
+#define F_GLOBAL_NOCACHE    F_GETFD
+
+/*
+ * glibc only has these with _GNU_SOURCE, whose REG_* names from
+ * <sys/ucontext.h> clash with vmm/x86.h
+ */
+#ifndef IOV_MAX
+#define IOV_MAX             1024
+#endif
+#ifndef O_DIRECT
+#define O_DIRECT            __O_DIRECT
+#endif
+
+#endif
@@ -0,0 +1,337 @@
+/*
+ * The parts of glib the block layer uses, for building it where the glib
+ * headers are not installed, see tests/block/CMakeLists.txt.
+ *
+ * Allocation and strings map to the C library. GSource only keeps what
+ * block/async.c and util/main-loop.c store in it: the harness drives
+ * AioContexts through aio_poll() and never runs a glib main loop.
+ */
+
+#ifndef TESTS_BLOCK_GLIB_H
+#define TESTS_BLOCK_GLIB_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <poll.h>
+
+typedef char gchar;
+typedef int gint;
+typedef unsigned int guint;
+typedef int gboolean;
+typedef void *gpointer;
+typedef const void *gconstpointer;
+typedef size_t gsize;
+typedef long glong;
+typedef int64_t gint64;
+typedef uint64_t guint64;
+typedef int32_t gint32;
+typedef uint32_t guint32;
+typedef uint16_t guint16;
+typedef uint8_t guint8;
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#define G_IO_IN     POLLIN
+#define G_IO_OUT    POLLOUT
+#define G_IO_PRI    POLLPRI
+#define G_IO_ERR    POLLERR
+#define G_IO_HUP    POLLHUP
+#define G_IO_NVAL   POLLNVAL
+
+#define GLIB_CHECK_VERSION(major, minor, micro)     1
+
+#define g_assert(expr)              assert(expr)
+#define g_assert_not_reached()      abort()
+#define g_warning(...)              (fprintf(stderr, __VA_ARGS__), \
+                                     fputc('\n', stderr))
+
+static inline void *g_malloc(size_t size)
+{
+    void *p = size ? malloc(size) : NULL;
+
+    if (size && !p) {
+        abort();
+    }
+    return p;
+}
+
+static inline void *g_malloc0(size_t size)
+{
+    void *p = size ? calloc(1, size) : NULL;
+
+    if (size && !p) {
+        abort();
+    }
+    return p;
+}
+
+static inline void *g_realloc(void *ptr, size_t size)
+{
+    void *p;
+
+    if (!size) {
+        free(ptr);
+        return NULL;
+    }
+    p = realloc(ptr, size);
+    if (!p) {
+        abort();
+    }
+    return p;
+}
+
+static inline void *g_try_malloc(size_t size)
+{
+    return size ? malloc(size) : NULL;
+}
+
+static inline void *g_try_malloc0(size_t size)
+{
+    return size ? calloc(1, size) : NULL;
+}
+
+static inline void *g_try_realloc(void *ptr, size_t size)
+{
+    if (!size) {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, size);
+}
+
+static inline void g_free(void *ptr)
+{
+    free(ptr);
+}
+
+#define g_new(type, n)          ((type *)g_malloc(sizeof(type) * (n)))
+#define g_new0(type, n)         ((type *)g_malloc0(sizeof(type) * (n)))
+#define g_renew(type, p, n)     ((type *)g_realloc(p, sizeof(type) * (n)))
+#define g_try_new(type, n)      ((type *)g_try_malloc(sizeof(type) * (n)))
+#define g_try_new0(type, n)     ((type *)g_try_malloc0(sizeof(type) * (n)))
+
+#define g_slice_alloc(size)         g_malloc(size)
+#define g_slice_new(type)           g_new(type, 1)
+#define g_slice_new0(type)          g_new0(type, 1)
+#define g_slice_free(type, p)       g_free(p)
+#define g_slice_free1(size, p)      g_free(p)
+
+static inline char *g_strdup(const char *s)
+{
+    return s ? strdup(s) : NULL;
+}
+
+static inline char *g_strdup_vprintf(const char *fmt, va_list ap)
+{
+    va_list ap2;
+    char *s;
+    int len;
+
+    va_copy(ap2, ap);
+    len = vsnprintf(NULL, 0, fmt, ap2);
+    va_end(ap2);
+    s = g_malloc(len + 1);
+    vsnprintf(s, len + 1, fmt, ap);
+    return s;
+}
+
+static inline char *g_strdup_printf(const char *fmt, ...)
+{
+    va_list ap;
+    char *s;
+
+    va_start(ap, fmt);
+    s = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    return s;
+}
+
+typedef struct GSList {
+    gpointer data;
+    struct GSList *next;
+} GSList;
+
+/* GList, only declared for the inline helpers in include/qemu/range.h */
+typedef struct GList {
+    gpointer data;
+    struct GList *next;
+    struct GList *prev;
+} GList;
+
+typedef gint (*GCompareFunc)(gconstpointer a, gconstpointer b);
+
+#define g_list_next(list)   ((list) ? (list)->next : NULL)
+GList *g_list_insert_sorted(GList *list, gpointer data, GCompareFunc func);
+GList *g_list_remove_link(GList *list, GList *link);
+
+/* GIOChannel, only declared for include/emuchar.h */
+typedef int GIOCondition;
+typedef struct GIOChannel GIOChannel;
+typedef gboolean (*GIOFunc)(GIOChannel *source, GIOCondition condition, gpointer data);
+
+/* GArray */
+typedef struct GArray {
+    char *data;
+    guint len;
+    guint elt_size;
+    guint alloc;
+    gboolean clear;
+} GArray;
+
+static inline GArray *g_array_new(gboolean zero_terminated, gboolean clear, guint elt_size)
+{
+    GArray *a = g_new0(GArray, 1);
+
+    a->elt_size = elt_size;
+    a->clear = clear;
+    return a;
+}
+
+static inline GArray *g_array_set_size(GArray *a, guint len)
+{
+    if (len > a->alloc) {
+        guint alloc = a->alloc ? a->alloc : 16;
+
+        while (alloc < len) {
+            alloc *= 2;
+        }
+        a->data = g_realloc(a->data, (size_t)alloc * a->elt_size);
+        if (a->clear) {
+            memset(a->data + (size_t)a->alloc * a->elt_size, 0,
+                   (size_t)(alloc - a->alloc) * a->elt_size);
+        }
+        a->alloc = alloc;
+    }
+    a->len = len;
+    return a;
+}
+
+static inline GArray *g_array_append_vals(GArray *a, const void *data, guint len)
+{
+    guint old = a->len;
+
+    g_array_set_size(a, old + len);
+    memcpy(a->data + (size_t)old * a->elt_size, data, (size_t)len * a->elt_size);
+    return a;
+}
+
+#define g_array_append_val(a, v)    g_array_append_vals(a, &(v), 1)
+#define g_array_index(a, t, i)      (((t *)(void *)(a)->data)[(i)])
+
+static inline char *g_array_free(GArray *a, gboolean free_segment)
+{
+    char *data = a->data;
+
+    if (free_segment) {
+        g_free(data);
+        data = NULL;
+    }
+    g_free(a);
+    return data;
+}
+
+/* GSource: storage only */
+typedef struct GPollFD {
+    int fd;
+    unsigned short events;
+    unsigned short revents;
+} GPollFD;
+
+typedef struct GMainContext GMainContext;
+typedef struct GSource GSource;
+typedef gboolean (*GSourceFunc)(gpointer user_data);
+
+typedef struct GSourceFuncs {
+    gboolean (*prepare)(GSource *source, gint *timeout);
+    gboolean (*check)(GSource *source);
+    gboolean (*dispatch)(GSource *source, GSourceFunc callback, gpointer user_data);
+    void (*finalize)(GSource *source);
+} GSourceFuncs;
+
+struct GSource {
+    GSourceFuncs *funcs;
+    guint ref_count;
+};
+
+static inline GSource *g_source_new(GSourceFuncs *funcs, guint size)
+{
+    GSource *source = g_malloc0(size);
+
+    source->funcs = funcs;
+    source->ref_count = 1;
+    return source;
+}
+
+static inline GSource *g_source_ref(GSource *source)
+{
+    source->ref_count++;
+    return source;
+}
+
+static inline void g_source_unref(GSource *source)
+{
+    if (--source->ref_count == 0) {
+        if (source->funcs->finalize) {
+            source->funcs->finalize(source);
+        }
+        g_free(source);
+    }
+}
+
+static inline void g_source_set_can_recurse(GSource *source, gboolean can_recurse)
+{
+}
+
+static inline void g_source_add_poll(GSource *source, GPollFD *fd)
+{
+}
+
+static inline void g_source_remove_poll(GSource *source, GPollFD *fd)
+{
+}
+
+static inline guint g_source_attach(GSource *source, GMainContext *context)
+{
+    return 1;
+}
+
+static inline GMainContext *g_main_context_default(void)
+{
+    return NULL;
+}
+
+/* No source is ever attached for real, so the default context is idle */
+static inline gboolean g_main_context_prepare(GMainContext *context, gint *priority)
+{
+    return FALSE;
+}
+
+static inline gint g_main_context_query(GMainContext *context, gint max_priority,
+                                        gint *timeout, GPollFD *fds, gint n_fds)
+{
+    return 0;
+}
+
+static inline gboolean g_main_context_check(GMainContext *context, gint max_priority,
+                                            GPollFD *fds, gint n_fds)
+{
+    return FALSE;
+}
+
+static inline void g_main_context_dispatch(GMainContext *context)
+{
+}
+
+static inline gint g_poll(GPollFD *fds, guint nfds, gint timeout)
+{
+    return poll((struct pollfd *)fds, nfds, timeout);
+}
+
+#endif
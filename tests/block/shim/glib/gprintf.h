@@ -0,0 +1,2 @@
+/* everything is in the glib.h stand-in */
+#include <glib.h>
@@ -0,0 +1,2 @@
+/* see mach/semaphore.h */
+#include "mach/semaphore.h"
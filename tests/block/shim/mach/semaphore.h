@@ -0,0 +1,79 @@
+/*
+ * Mach semaphores on top of POSIX ones, for util/qemu-thread-posix.c on
+ * Linux: just the calls QemuSemaphore makes.
+ */
+
+#ifndef TESTS_BLOCK_MACH_SEMAPHORE_H
+#define TESTS_BLOCK_MACH_SEMAPHORE_H
+
+#include <semaphore.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+
+typedef sem_t *semaphore_t;
+typedef int task_t;
+typedef int kern_return_t;
+
+typedef struct mach_timespec {
+    unsigned int tv_sec;
+    int tv_nsec;
+} mach_timespec_t;
+
+#define KERN_SUCCESS                0
+#define KERN_INVALID_ARGUMENT       4
+#define KERN_ABORTED                14
+#define KERN_OPERATION_TIMED_OUT    49
+#define SYNC_POLICY_FIFO            0
+
+static inline task_t mach_task_self(void)
+{
+    return 0;
+}
+
+static inline kern_return_t semaphore_create(task_t task, semaphore_t *sem,
+                                             int policy, int value)
+{
+    *sem = malloc(sizeof(sem_t));
+    return sem_init(*sem, 0, value) ? KERN_INVALID_ARGUMENT : KERN_SUCCESS;
+}
+
+static inline kern_return_t semaphore_destroy(task_t task, semaphore_t sem)
+{
+    sem_destroy(sem);
+    free(sem);
+    return KERN_SUCCESS;
+}
+
+static inline kern_return_t semaphore_signal(semaphore_t sem)
+{
+    sem_post(sem);
+    return KERN_SUCCESS;
+}
+
+static inline kern_return_t semaphore_wait(semaphore_t sem)
+{
+    while (sem_wait(sem) && errno == EINTR) {
+    }
+    return KERN_SUCCESS;
+}
+
+/* relative timeout, as in Mach */
+static inline kern_return_t semaphore_timedwait(semaphore_t sem, mach_timespec_t wait)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += wait.tv_sec;
+    ts.tv_nsec += wait.tv_nsec;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    if (!sem_timedwait(sem, &ts)) {
+        return KERN_SUCCESS;
+    }
+    return errno == ETIMEDOUT ? KERN_OPERATION_TIMED_OUT : KERN_ABORTED;
+}
+
+#endif
@@ -0,0 +1 @@
+/* Darwin header, <endian.h> comes in through the C library */
@@ -0,0 +1 @@
+/* Darwin header, nothing needed on Linux */
@@ -0,0 +1 @@
+/* Darwin header, block.c only includes it under CONFIG_BSD */
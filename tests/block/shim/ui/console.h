@@ -0,0 +1 @@
+/* util/vmx-timer.c includes this but uses nothing from the UI */
@@ -0,0 +1,132 @@
+/*
+ * block/io_uring.c against the thread pool
+ *
+ * Writes a pattern at scattered offsets through io_uring, with plugged
+ * batches larger than the ring, and reads it back both through the thread
+ * pool and through io_uring.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include "bench.h"
+#include "aio.h"
+
+#define BLOCK_SIZE  4096
+#define BLOCKS      1024
+#define BATCH       300     /* more than the 128 entries of the ring */
+
+static int pending;
+
+static void done_cb(void *opaque, int ret)
+{
+    if (ret < 0) {
+        fprintf(stderr, "request failed: %s\n", strerror(-ret));
+        exit(1);
+    }
+    pending--;
+}
+
+static void fill(uint8_t *buf, int block)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_SIZE; i++) {
+        buf[i] = block * 7 + i;
+    }
+}
+
+/* Submits block, block + stride, ... in plugged batches */
+static void transfer(BlockDriverState *bs, uint8_t *data, bool is_write)
+{
+    static QEMUIOVector qiov[BLOCKS];
+    static struct iovec iov[BLOCKS];
+    int stride = 37, i, n;
+
+    for (i = 0; i < BLOCKS; i += n) {
+        bdrv_io_plug(bs);
+        for (n = 0; n < BATCH && i + n < BLOCKS; n++) {
+            int block = (i + n) * stride % BLOCKS;
+
+            iov[block].iov_base = data + block * BLOCK_SIZE;
+            iov[block].iov_len = BLOCK_SIZE;
+            vmx_iovec_init_external(&qiov[block], &iov[block], 1);
+            pending++;
+            if (is_write) {
+                bdrv_aio_writev(bs, block * (BLOCK_SIZE >> BDRV_SECTOR_BITS),
+                                &qiov[block], BLOCK_SIZE >> BDRV_SECTOR_BITS,
+                                done_cb, NULL);
+            } else {
+                bdrv_aio_readv(bs, block * (BLOCK_SIZE >> BDRV_SECTOR_BITS),
+                               &qiov[block], BLOCK_SIZE >> BDRV_SECTOR_BITS,
+                               done_cb, NULL);
+            }
+        }
+        bdrv_io_unplug(bs);
+    }
+    while (pending) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+}
+
+static int check(const char *what, uint8_t *data)
+{
+    uint8_t expect[BLOCK_SIZE];
+    int block;
+
+    for (block = 0; block < BLOCKS; block++) {
+        fill(expect, block);
+        if (memcmp(data + block * BLOCK_SIZE, expect, BLOCK_SIZE)) {
+            fprintf(stderr, "%s: block %d differs\n", what, block);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char path[] = "/var/tmp/test_io_uring.XXXXXX";
+    int flags = BDRV_O_RDWR | BDRV_O_NOCACHE | BDRV_O_CACHE_WB;
+    BlockDriverState *bs = NULL;
+    uint8_t *data;
+    int fd, block, fail = 0;
+
+    bench_init();
+    fd = mkstemp(path);
+    if (fd < 0 || ftruncate(fd, BLOCKS * BLOCK_SIZE) < 0) {
+        perror(path);
+        return 1;
+    }
+    close(fd);
+
+    bdrv_open(&bs, path, NULL, NULL, flags | BDRV_O_IO_URING,
+              bdrv_find_format("file"), &error_abort);
+    data = vmx_blockalign(bs, BLOCKS * BLOCK_SIZE);
+    for (block = 0; block < BLOCKS; block++) {
+        fill(data + block * BLOCK_SIZE, block);
+    }
+    transfer(bs, data, true);
+
+    memset(data, 0, BLOCKS * BLOCK_SIZE);
+    transfer(bs, data, false);
+    fail |= check("io_uring", data);
+    bdrv_unref(bs);
+
+    bs = NULL;
+    bdrv_open(&bs, path, NULL, NULL, flags, bdrv_find_format("file"),
+              &error_abort);
+    memset(data, 0, BLOCKS * BLOCK_SIZE);
+    transfer(bs, data, false);
+    fail |= check("thread pool", data);
+    bdrv_unref(bs);
+
+    vmx_vfree(data);
+    unlink(path);
+    if (!fail) {
+        printf("%d blocks match\n", BLOCKS);
+    }
+    return fail;
+}
@@ -0,0 +1,158 @@
+/*
+ * Phys map lookups per second from several vcpu-like threads, with the map
+ * behind a pthread rwlock (as address_space_translate() used to take
+ * dispatch_lock) and behind rcu_read_lock().  An updater thread replaces
+ * the map every millisecond, as a guest reprogramming BARs would.
+ *
+ * usage: bench_dispatch [SECONDS_PER_RUN]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "qemu/rcu.h"
+
+#define MAP_PAGES       512
+#define MAX_THREADS     8
+
+typedef struct Section {
+    uint64_t offset;
+    uint64_t size;
+} Section;
+
+typedef struct Map {
+    Section *page[MAP_PAGES];
+    Section sections[8];
+} Map;
+
+typedef enum { MODE_RWLOCK, MODE_RCU } Mode;
+
+static Map *cur_map;
+static pthread_rwlock_t map_lock = PTHREAD_RWLOCK_INITIALIZER;
+static Mode mode;
+static volatile int running;
+static unsigned long lookups[MAX_THREADS][8];   /* padded to a cache line */
+static unsigned long updates;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Map *map_new(void)
+{
+    Map *map = calloc(1, sizeof(*map));
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        map->sections[i].offset = (uint64_t)i << 20;
+        map->sections[i].size = 1 << 20;
+    }
+    for (i = 0; i < MAP_PAGES; i++) {
+        map->page[i] = &map->sections[i & 7];
+    }
+    return map;
+}
+
+static uint64_t lookup(Map *map, uint64_t addr)
+{
+    Section *section = map->page[(addr >> 12) % MAP_PAGES];
+
+    return section->offset + (addr & (section->size - 1));
+}
+
+static void *vcpu(void *opaque)
+{
+    unsigned long *count = opaque;
+    uint64_t addr = (uintptr_t)opaque, sum = 0;
+    unsigned long n = 0;
+
+    while (running) {
+        addr = addr * 6364136223846793005ULL + 1442695040888963407ULL;
+        if (mode == MODE_RWLOCK) {
+            pthread_rwlock_rdlock(&map_lock);
+            sum += lookup(cur_map, addr >> 20);
+            pthread_rwlock_unlock(&map_lock);
+        } else {
+            rcu_read_lock();
+            sum += lookup(atomic_rcu_read(&cur_map), addr >> 20);
+            rcu_read_unlock();
+        }
+        n++;
+    }
+    *count = n + (sum & 0);
+    return NULL;
+}
+
+static void *updater(void *opaque)
+{
+    while (running) {
+        Map *old, *map = map_new();
+
+        if (mode == MODE_RWLOCK) {
+            pthread_rwlock_wrlock(&map_lock);
+            old = cur_map;
+            cur_map = map;
+            pthread_rwlock_unlock(&map_lock);
+        } else {
+            old = cur_map;
+            atomic_rcu_set(&cur_map, map);
+            synchronize_rcu();
+        }
+        free(old);
+        updates++;
+        usleep(1000);
+    }
+    return NULL;
+}
+
+static void run(Mode m, int nthreads, double seconds)
+{
+    pthread_t threads[MAX_THREADS], upd;
+    unsigned long total = 0;
+    double start, elapsed;
+    int i;
+
+    mode = m;
+    updates = 0;
+    running = 1;
+    start = now();
+    for (i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, vcpu, lookups[i]);
+    }
+    pthread_create(&upd, NULL, updater, NULL);
+
+    usleep(seconds * 1e6);
+    running = 0;
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        total += lookups[i][0];
+    }
+    pthread_join(upd, NULL);
+    elapsed = now() - start;
+
+    printf("%-8s %2d threads  %8.2f Mlookups/s  %6.2f Mlookups/s/thread  %5lu updates\n",
+           m == MODE_RWLOCK ? "rwlock" : "rcu", nthreads,
+           total / elapsed / 1e6, total / elapsed / 1e6 / nthreads, updates);
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+    int n;
+
+    cur_map = map_new();
+    printf("%ld cpus online\n", sysconf(_SC_NPROCESSORS_ONLN));
+    for (n = 1; n <= MAX_THREADS; n *= 2) {
+        run(MODE_RWLOCK, n, seconds);
+        run(MODE_RCU, n, seconds);
+    }
+    free(cur_map);
+    return 0;
+}
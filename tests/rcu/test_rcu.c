@@ -0,0 +1,113 @@
+/*
+ * Readers must never see a map that synchronize_rcu() let the updater
+ * free, including readers that nest sections and threads that come and go
+ * while updates are running.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "qemu/rcu.h"
+
+#define MAP_ENTRIES     64
+#define MAP_LIVE        0x6c697665
+#define UPDATES         1000
+#define READERS         4
+
+typedef struct Map {
+    uint32_t entry[MAP_ENTRIES];
+} Map;
+
+static Map *cur_map;
+static volatile int done;
+static unsigned long reads[READERS];
+
+static Map *map_new(void)
+{
+    Map *map = malloc(sizeof(*map));
+    int i;
+
+    for (i = 0; i < MAP_ENTRIES; i++) {
+        map->entry[i] = MAP_LIVE;
+    }
+    return map;
+}
+
+static void map_check(Map *map)
+{
+    int i;
+
+    for (i = 0; i < MAP_ENTRIES; i++) {
+        if (map->entry[i] != MAP_LIVE) {
+            fprintf(stderr, "reader saw a freed map\n");
+            abort();
+        }
+    }
+}
+
+static void *reader(void *opaque)
+{
+    unsigned long *count = opaque;
+
+    while (!done) {
+        Map *map;
+
+        rcu_read_lock();
+        map = atomic_rcu_read(&cur_map);
+        map_check(map);
+        rcu_read_lock();
+        map_check(atomic_rcu_read(&cur_map));
+        rcu_read_unlock();
+        map_check(map);
+        rcu_read_unlock();
+        (*count)++;
+    }
+    return NULL;
+}
+
+/* registers on first use and unregisters at exit */
+static void *short_reader(void *opaque)
+{
+    rcu_read_lock();
+    map_check(atomic_rcu_read(&cur_map));
+    rcu_read_unlock();
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t threads[READERS];
+    int i;
+
+    cur_map = map_new();
+    for (i = 0; i < READERS; i++) {
+        pthread_create(&threads[i], NULL, reader, &reads[i]);
+    }
+
+    for (i = 0; i < UPDATES; i++) {
+        Map *old = cur_map;
+
+        atomic_rcu_set(&cur_map, map_new());
+        synchronize_rcu();
+        memset(old->entry, 0xde, sizeof(old->entry));
+        free(old);
+
+        if (i % 100 == 0) {
+            pthread_t t;
+
+            pthread_create(&t, NULL, short_reader, NULL);
+            pthread_join(t, NULL);
+        }
+    }
+
+    done = 1;
+    for (i = 0; i < READERS; i++) {
+        pthread_join(threads[i], NULL);
+        printf("reader %d: %lu lookups\n", i, reads[i]);
+    }
+    free(cur_map);
+    printf("%d grace periods\n", UPDATES);
+    return 0;
+}
@@ -0,0 +1,430 @@
+/*
+ * Main-loop CPU and latency of slirp with many idle TCP connections
+ *
+ * The benchmark is the guest: it speaks just enough TCP over Ethernet to
+ * open connections through slirp to an echo server on the host loopback,
+ * which runs in a child process.  The main loop is the slirp part of
+ * main_loop_wait() in util/main-loop.c: slirp_pollfds_fill(), poll() and
+ * slirp_pollfds_poll().
+ *
+ * One busy connection plays ping-pong with -r round trips of 64 bytes while
+ * 0, a tenth of -n and -n connections stay open and idle.  Each row gives
+ * the CPU the process uses over -i seconds with nothing moving, the CPU
+ * per round trip, and the median and 99th percentile round trip time.
+ *
+ * bench_slirp [-n IDLE] [-r ROUNDS] [-i SECONDS]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "libslirp.h"
+#include "qemu/sockets.h"
+
+#define MSG_LEN         64
+#define GUEST_PORT      10000
+#define OPEN_BATCH      256
+#define ETH_HLEN        14
+#define FRAME_LEN       (ETH_HLEN + sizeof(struct ip) + \
+                         sizeof(struct tcphdr) + MSG_LEN)
+
+/* Used by bootp.c, which the benchmark does not reach */
+uint32_t vm_ip_address;
+
+typedef struct GuestConn {
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    bool established;
+} GuestConn;
+
+static const uint8_t guest_mac[6] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+/* slirp answers for 10.0.2.2 as 52:55:0a:00:02:02 */
+static const uint8_t host_mac[6] = { 0x52, 0x55, 0x0a, 0x00, 0x02, 0x02 };
+
+static Slirp *slirp;
+static GArray *pollfds;
+static struct in_addr guest_addr, host_addr;
+static int server_port;
+static pid_t server_pid;
+
+static GuestConn *conns;
+static int nconns;
+static int *acks;               /* connections owing slirp an ACK */
+static int nacks;
+static int echoed;              /* bytes of the busy connection's echo */
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* One's complement sum of big-endian 16-bit words */
+static uint32_t csum_add(uint32_t sum, const void *data, int len)
+{
+    const uint8_t *p = data;
+
+    for (; len > 1; p += 2, len -= 2) {
+        sum += p[0] << 8 | p[1];
+    }
+    if (len) {
+        sum += p[0] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return htons(~sum);
+}
+
+static void guest_send(int i, int flags, const void *data, int len)
+{
+    static uint16_t ip_id;
+    uint8_t frame[FRAME_LEN];
+    struct ip *ip = (struct ip *)(frame + ETH_HLEN);
+    struct tcphdr *th = (struct tcphdr *)(ip + 1);
+    GuestConn *c = &conns[i];
+    uint32_t sum;
+
+    memcpy(frame, host_mac, 6);
+    memcpy(frame + 6, guest_mac, 6);
+    frame[12] = 0x08;
+    frame[13] = 0x00;
+
+    memset(ip, 0, sizeof(*ip) + sizeof(*th));
+    ip->ip_v = 4;
+    ip->ip_hl = sizeof(*ip) / 4;
+    ip->ip_len = htons(sizeof(*ip) + sizeof(*th) + len);
+    ip->ip_id = htons(ip_id++);
+    ip->ip_ttl = 64;
+    ip->ip_p = IPPROTO_TCP;
+    ip->ip_src = guest_addr;
+    ip->ip_dst = host_addr;
+    ip->ip_sum = csum_fold(csum_add(0, ip, sizeof(*ip)));
+
+    th->th_sport = htons(GUEST_PORT + i);
+    th->th_dport = htons(server_port);
+    th->th_seq = htonl(c->snd_nxt);
+    th->th_ack = flags & TH_ACK ? htonl(c->rcv_nxt) : 0;
+    th->th_off = sizeof(*th) / 4;
+    th->th_flags = flags;
+    th->th_win = htons(65535);
+    memcpy(th + 1, data, len);
+
+    /* pseudo header: addresses, protocol and TCP length */
+    sum = csum_add(0, &ip->ip_src, 8);
+    sum += IPPROTO_TCP + sizeof(*th) + len;
+    th->th_sum = csum_fold(csum_add(sum, th, sizeof(*th) + len));
+
+    c->snd_nxt += len + !!(flags & TH_SYN);
+    slirp_input(slirp, frame, ETH_HLEN + sizeof(*ip) + sizeof(*th) + len);
+}
+
+/* Announce the guest's MAC, so that slirp never has to ask for it */
+static void guest_arp(void)
+{
+    uint8_t frame[42] = { 0 };
+
+    memset(frame, 0xff, 6);
+    memcpy(frame + 6, guest_mac, 6);
+    frame[12] = 0x08;
+    frame[13] = 0x06;
+    frame[15] = 1;                      /* Ethernet */
+    frame[16] = 0x08;                   /* IPv4 */
+    frame[18] = 6;
+    frame[19] = 4;
+    frame[21] = 1;                      /* request */
+    memcpy(frame + 22, guest_mac, 6);
+    memcpy(frame + 28, &guest_addr, 4);
+    memcpy(frame + 38, &guest_addr, 4); /* gratuitous */
+    slirp_input(slirp, frame, sizeof(frame));
+}
+
+/*
+ * Frames slirp sends to the guest.  Replies go out after the main loop
+ * iteration, slirp_input() must not be called from in here.
+ */
+void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
+{
+    const struct ip *ip = (const struct ip *)(pkt + ETH_HLEN);
+    const struct tcphdr *th;
+    GuestConn *c;
+    int i, len;
+
+    if (pkt_len < ETH_HLEN + sizeof(*ip) || pkt[12] != 0x08 ||
+        pkt[13] != 0x00 || ip->ip_p != IPPROTO_TCP) {
+        return;
+    }
+    th = (const struct tcphdr *)((const uint8_t *)ip + ip->ip_hl * 4);
+    i = ntohs(th->th_dport) - GUEST_PORT;
+    if (i < 0 || i >= nconns) {
+        return;
+    }
+    c = &conns[i];
+    len = ntohs(ip->ip_len) - ip->ip_hl * 4 - th->th_off * 4;
+
+    if (th->th_flags & TH_RST) {
+        fprintf(stderr, "connection %d was reset\n", i);
+        exit(1);
+    }
+    if (th->th_flags & TH_SYN) {
+        c->rcv_nxt = ntohl(th->th_seq) + 1;
+        c->established = true;
+        acks[nacks++] = i;
+    } else if (len > 0 && ntohl(th->th_seq) == c->rcv_nxt) {
+        /* only the busy connection gets data, its next request ACKs it */
+        c->rcv_nxt += len;
+        echoed += len;
+    }
+}
+
+static void loop_once(uint32_t max_ms)
+{
+    uint32_t timeout = max_ms;
+    int ret;
+
+    g_array_set_size(pollfds, 0);
+    slirp_pollfds_fill(pollfds, &timeout);
+    ret = g_poll((GPollFD *)pollfds->data, pollfds->len, timeout);
+    slirp_pollfds_poll(pollfds, ret < 0);
+
+    while (nacks) {
+        guest_send(acks[--nacks], TH_ACK, NULL, 0);
+    }
+}
+
+/* Opens connections up to n, a batch of SYNs at a time */
+static void open_conns(int n)
+{
+    uint64_t deadline;
+    int first, i;
+
+    while (nconns < n) {
+        first = nconns;
+        nconns = MIN(n, first + OPEN_BATCH);
+        for (i = first; i < nconns; i++) {
+            conns[i].snd_nxt = i * 100000;
+            guest_send(i, TH_SYN, NULL, 0);
+        }
+        deadline = clock_ns(CLOCK_MONOTONIC) + 10000000000ull;
+        for (i = first; i < nconns; i++) {
+            while (!conns[i].established) {
+                if (clock_ns(CLOCK_MONOTONIC) > deadline) {
+                    fprintf(stderr, "connection %d did not open\n", i);
+                    exit(1);
+                }
+                loop_once(100);
+            }
+        }
+    }
+}
+
+/* CPU percentage of the main loop over the given time, with no traffic */
+static double idle_cpu(double seconds)
+{
+    uint64_t t = clock_ns(CLOCK_MONOTONIC), end = t + seconds * 1e9;
+    uint64_t cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID), now;
+
+    while ((now = clock_ns(CLOCK_MONOTONIC)) < end) {
+        loop_once(DIV_ROUND_UP(end - now, 1000000));
+    }
+    return (clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu) * 100.0 / (now - t);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Round trips on connection 0, returns the CPU per round trip in ns */
+static uint64_t ping_pong(uint64_t *rtt, int rounds)
+{
+    static const uint8_t msg[MSG_LEN];
+    uint64_t cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    uint64_t t;
+    int r;
+
+    for (r = 0; r < rounds; r++) {
+        t = clock_ns(CLOCK_MONOTONIC);
+        echoed = 0;
+        guest_send(0, TH_ACK | TH_PUSH, msg, sizeof(msg));
+        while (echoed < MSG_LEN) {
+            if (clock_ns(CLOCK_MONOTONIC) - t > 5000000000ull) {
+                fprintf(stderr, "no echo after 5 s\n");
+                exit(1);
+            }
+            loop_once(UINT32_MAX);
+        }
+        rtt[r] = clock_ns(CLOCK_MONOTONIC) - t;
+    }
+    return (clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu) / rounds;
+}
+
+/* The host end: accepts every connection and echoes what arrives */
+static void serve(int listen_fd)
+{
+    static char buf[4096];
+    struct epoll_event ev = { .events = EPOLLIN }, events[64];
+    int epfd = epoll_create1(0);
+    int i, n, fd;
+    ssize_t ret;
+
+    ev.data.fd = listen_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+    for (;;) {
+        n = epoll_wait(epfd, events, ARRAY_SIZE(events), -1);
+        for (i = 0; i < n; i++) {
+            fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+                    ev.data.fd = fd;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+                }
+                continue;
+            }
+            ret = read(fd, buf, sizeof(buf));
+            if (ret > 0) {
+                if (write(fd, buf, ret) != ret) {
+                    _exit(1);
+                }
+            } else if (ret == 0 || errno != EAGAIN) {
+                close(fd);
+            }
+        }
+    }
+}
+
+static void start_server(void)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t len = sizeof(addr);
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+        perror("server listen");
+        exit(1);
+    }
+    server_port = ntohs(addr.sin_port);
+    vmx_set_nonblock(fd);
+
+    server_pid = fork();
+    if (server_pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (server_pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        serve(fd);
+    }
+    close(fd);
+}
+
+static void stop_server(void)
+{
+    kill(server_pid, SIGKILL);
+    waitpid(server_pid, NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+    struct in_addr net = { htonl(0x0a000200) }, mask = { htonl(0xffffff00) };
+    struct in_addr dns = { htonl(0x0a000203) };
+    double idle_seconds = 1;
+    int max_idle = 10000, rounds = 20000;
+    struct rlimit rl;
+    uint64_t *rtt, cpu;
+    int idle[3];
+    int c, i;
+
+    while ((c = getopt(argc, argv, "n:r:i:")) != -1) {
+        switch (c) {
+        case 'n':
+            max_idle = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'i':
+            idle_seconds = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n IDLE] [-r ROUNDS] [-i SECONDS]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (max_idle < 0 || rounds <= 0 || idle_seconds <= 0) {
+        fprintf(stderr, "need positive round trips and idle time\n");
+        return 2;
+    }
+
+    /* a socket per connection, and a few to spare */
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < max_idle + 64) {
+        fprintf(stderr, "need %d file descriptors, the limit is %d\n",
+                max_idle + 64, (int)rl.rlim_cur);
+        return 1;
+    }
+
+    start_server();
+    atexit(stop_server);
+
+    guest_addr.s_addr = htonl(0x0a00020f);
+    host_addr.s_addr = htonl(0x0a000202);
+    slirp = slirp_init(0, net, mask, host_addr, NULL, NULL, NULL,
+                       guest_addr, dns, NULL, NULL);
+    pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+    conns = g_new0(GuestConn, max_idle + 1);
+    acks = g_new(int, max_idle + 1);
+    rtt = g_new(uint64_t, rounds);
+    guest_arp();
+
+    idle[0] = 0;
+    idle[1] = max_idle / 10;
+    idle[2] = max_idle;
+
+    printf("1 busy connection, %d round trips of %d bytes, %.1f s idle\n",
+           rounds, MSG_LEN, idle_seconds);
+    printf("%-10s %10s %10s %10s %10s\n", "idle conns", "idle CPU",
+           "CPU us/rt", "p50 us", "p99 us");
+    for (i = 0; i < ARRAY_SIZE(idle); i++) {
+        open_conns(idle[i] + 1);
+
+        printf("%-10d %9.1f%%", idle[i], idle_cpu(idle_seconds));
+        fflush(stdout);
+        cpu = ping_pong(rtt, rounds);
+        qsort(rtt, rounds, sizeof(*rtt), cmp_u64);
+        printf(" %10.1f %10.1f %10.1f\n", cpu / 1e3, rtt[rounds / 2] / 1e3,
+               rtt[rounds * 99 / 100] / 1e3);
+    }
+    return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * The VMM services slirp calls besides sockets, for bench_slirp: there is
+ * no migration, no chardev and no child process to watch, and the realtime
+ * clock reads CLOCK_MONOTONIC as util/vmx-timer.c does.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <time.h>
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "emuchar.h"
+#include "vmstate.h"
+
+int register_savevm(DeviceState *dev,
+                    const char *idstr,
+                    int instance_id,
+                    int version_id,
+                    SaveStateHandler *save_state,
+                    LoadStateHandler *load_state,
+                    void *opaque)
+{
+    return 0;
+}
+
+void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque)
+{
+}
+
+int vmx_add_child_watch(pid_t pid)
+{
+    return 0;
+}
+
+int vmx_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
+{
+    return len;
+}
+
+int64_t vmx_clock_get_ns(QEMUClockType type)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -0,0 +1,336 @@
+/*
+ * e1000 transmit and receive packets per second
+ *
+ * usage: bench_e1000 [-t SECONDS]
+ *
+ * Creates an e1000 on the fake bus with a sink backend that only counts
+ * what it is sent, once, since e1000 numbers its instances in a static.
+ * For each run it resets the device and plays a driver that keeps a 256
+ * descriptor TX ring full: it reclaims the packets the device reported
+ * done, queues new ones behind them, writes TDT and runs the main loop.
+ * Packets are 60 byte and 1514 byte frames with one legacy descriptor
+ * each, and 60 KiB TSO sends with a context descriptor, a header
+ * descriptor and 4 KiB payload descriptors, cut by the device into 1448
+ * byte segments.  Packets per second and Gbit/s are counted as frames and
+ * bytes at the backend, which must add up to whole packets.
+ *
+ * For receive, the driver keeps a 256 descriptor RX ring of 2 KiB buffers
+ * posted and the backend hands the device bursts of 1 or 32 frames, which
+ * it brackets with the device's batch hooks as tap and slirp do.  After
+ * each burst the driver takes the filled descriptors, checks their length
+ * and gives them back through RDT.
+ */
+
+#include <time.h>
+#include "fake_pci.h"
+#include "fake_net.h"
+#include "devices/e1000_regs.h"
+
+void e1000_register_types(void);
+
+#define RING_SIZE       256
+#define RING_ADDR       0x10000
+#define RX_RING_ADDR    0x11000
+#define BUF_ADDR        0x20000
+#define RX_BUF_ADDR     0x40000
+#define RX_BUF_SIZE     2048
+#define HDR_LEN         54
+#define MSS             1448
+#define TSO_PAYLOAD     (60 << 10)
+#define TSO_DESC_LEN    4096
+#define TSO_SEGS        DIV_ROUND_UP(TSO_PAYLOAD, MSS)
+
+typedef struct Bench {
+    PCIDevice *dev;
+    struct e1000_tx_desc *ring;
+    /* for the first descriptor of each queued packet, its last one */
+    int eop[RING_SIZE];
+    int clean;
+    int tail;
+    struct e1000_rx_desc *rx_ring;
+    int rx_clean;
+} Bench;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void mmio_write(Bench *b, hwaddr reg, uint32_t val)
+{
+    fake_bar_write(b->dev, 0, reg, val, 4);
+}
+
+/* An Ethernet, IPv4 and TCP header in front of TSO_PAYLOAD bytes */
+static void build_frame(void)
+{
+    uint8_t *p = fake_guest_mem + BUF_ADDR;
+    int i;
+
+    memset(p, 0x52, 12);
+    stw_be_p(p + 12, 0x0800);
+    p[14] = 0x45;
+    stw_be_p(p + 16, HDR_LEN - 14 + TSO_PAYLOAD);
+    p[22] = 64;
+    p[23] = 6;
+    stl_be_p(p + 26, 0x0a000002);
+    stl_be_p(p + 30, 0x0a000001);
+    stw_be_p(p + 34, 40000);
+    stw_be_p(p + 36, 5001);
+    p[46] = 5 << 4;
+    p[47] = 0x18;
+    stw_be_p(p + 48, 65535);
+    for (i = HDR_LEN; i < HDR_LEN + TSO_PAYLOAD; i++) {
+        p[i] = i;
+    }
+}
+
+static void bench_start(Bench *b)
+{
+    DeviceClass *dc = DEVICE_CLASS(b->dev->qdev.parent.class);
+
+    dc->reset(&b->dev->qdev);
+    fake_net_sink_frames = 0;
+    fake_net_sink_bytes = 0;
+
+    b->ring = (struct e1000_tx_desc *)(fake_guest_mem + RING_ADDR);
+    b->clean = b->tail = 0;
+    build_frame();
+
+    mmio_write(b, E1000_TDBAL, RING_ADDR);
+    mmio_write(b, E1000_TDBAH, 0);
+    mmio_write(b, E1000_TDLEN, RING_SIZE * sizeof(*b->ring));
+    mmio_write(b, E1000_TDH, 0);
+    mmio_write(b, E1000_TDT, 0);
+    mmio_write(b, E1000_TCTL, E1000_TCTL_EN | E1000_TCTL_PSP);
+}
+
+static int ring_free(Bench *b)
+{
+    return (b->clean - b->tail - 1 + RING_SIZE) % RING_SIZE;
+}
+
+static struct e1000_tx_desc *next_desc(Bench *b)
+{
+    struct e1000_tx_desc *d = &b->ring[b->tail];
+
+    b->tail = (b->tail + 1) % RING_SIZE;
+    memset(d, 0, sizeof(*d));
+    return d;
+}
+
+static void queue_frame(Bench *b, int len)
+{
+    int first = b->tail;
+    struct e1000_tx_desc *d = next_desc(b);
+
+    d->buffer_addr = cpu_to_le64(BUF_ADDR);
+    d->lower.data = cpu_to_le32(len | E1000_TXD_CMD_EOP |
+                                E1000_TXD_CMD_IFCS | E1000_TXD_CMD_RS);
+    b->eop[first] = first;
+}
+
+static void queue_tso(Bench *b)
+{
+    uint32_t data_cmd = E1000_TXD_CMD_DEXT | E1000_TXD_DTYP_D |
+                        E1000_TXD_CMD_TSE;
+    uint32_t popts = (E1000_TXD_POPTS_IXSM | E1000_TXD_POPTS_TXSM) << 8;
+    struct e1000_context_desc *c;
+    struct e1000_tx_desc *d;
+    int first = b->tail, off;
+
+    c = (struct e1000_context_desc *)next_desc(b);
+    c->lower_setup.ip_fields.ipcss = 14;
+    c->lower_setup.ip_fields.ipcso = 14 + 10;
+    c->lower_setup.ip_fields.ipcse = cpu_to_le16(14 + 20 - 1);
+    c->upper_setup.tcp_fields.tucss = 34;
+    c->upper_setup.tcp_fields.tucso = 34 + 16;
+    c->cmd_and_length = cpu_to_le32(TSO_PAYLOAD | E1000_TXD_CMD_DEXT |
+                                    E1000_TXD_CMD_TSE | E1000_TXD_CMD_IP |
+                                    E1000_TXD_CMD_TCP);
+    c->tcp_seg_setup.fields.hdr_len = HDR_LEN;
+    c->tcp_seg_setup.fields.mss = cpu_to_le16(MSS);
+
+    d = next_desc(b);
+    d->buffer_addr = cpu_to_le64(BUF_ADDR);
+    d->lower.data = cpu_to_le32(HDR_LEN | data_cmd);
+    d->upper.data = cpu_to_le32(popts);
+
+    for (off = 0; off < TSO_PAYLOAD; off += TSO_DESC_LEN) {
+        d = next_desc(b);
+        d->buffer_addr = cpu_to_le64(BUF_ADDR + HDR_LEN + off);
+        d->lower.data = cpu_to_le32(TSO_DESC_LEN | data_cmd);
+        d->upper.data = cpu_to_le32(popts);
+    }
+    d->lower.data |= cpu_to_le32(E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS);
+    b->eop[first] = (b->tail - 1 + RING_SIZE) % RING_SIZE;
+}
+
+static void rx_start(Bench *b)
+{
+    DeviceClass *dc = DEVICE_CLASS(b->dev->qdev.parent.class);
+    int i;
+
+    dc->reset(&b->dev->qdev);
+    fake_config_write(b->dev, PCI_COMMAND, PCI_COMMAND_MEMORY |
+                      PCI_COMMAND_MASTER, 2);
+
+    b->rx_ring = (struct e1000_rx_desc *)(fake_guest_mem + RX_RING_ADDR);
+    b->rx_clean = 0;
+    memset(b->rx_ring, 0, RING_SIZE * sizeof(*b->rx_ring));
+    for (i = 0; i < RING_SIZE; i++) {
+        b->rx_ring[i].buffer_addr = cpu_to_le64(RX_BUF_ADDR +
+                                                i * RX_BUF_SIZE);
+    }
+
+    mmio_write(b, E1000_RDBAL, RX_RING_ADDR);
+    mmio_write(b, E1000_RDBAH, 0);
+    mmio_write(b, E1000_RDLEN, RING_SIZE * sizeof(*b->rx_ring));
+    mmio_write(b, E1000_RDH, 0);
+    mmio_write(b, E1000_RDT, RING_SIZE - 1);
+    mmio_write(b, E1000_RCTL, E1000_RCTL_EN | E1000_RCTL_UPE |
+               E1000_RCTL_BAM | E1000_RCTL_SECRC | E1000_RCTL_SZ_2048);
+}
+
+/* Take the filled descriptors and post them again, false on a bad one */
+static bool rx_reclaim(Bench *b, int len)
+{
+    struct e1000_rx_desc *d;
+    bool ok = true;
+    int n = 0;
+
+    while ((d = &b->rx_ring[b->rx_clean])->status & E1000_RXD_STAT_DD) {
+        ok &= le16_to_cpu(d->length) == len;
+        d->status = 0;
+        b->rx_clean = (b->rx_clean + 1) % RING_SIZE;
+        n++;
+    }
+    if (n) {
+        mmio_write(b, E1000_RDT, (b->rx_clean - 1 + RING_SIZE) % RING_SIZE);
+    }
+    return ok;
+}
+
+static bool run_rx(Bench *b, const char *name, int len, int burst,
+                   double seconds)
+{
+    uint8_t *frame = fake_guest_mem + BUF_ADDR;
+    uint64_t start, end, t, frames = 0;
+    bool ok = true;
+
+    rx_start(b);
+    start = now_ns();
+    end = start + seconds * 1e9;
+    do {
+        frames += fake_net_receive_burst(0, frame, len, burst);
+        ok &= rx_reclaim(b, len);
+        fake_bh_poll();
+    } while ((t = now_ns()) < end);
+
+    printf("%-12s %12.0f %10.2f\n", name, frames / ((t - start) / 1e9),
+           frames * len * 8 / ((t - start) / 1e9) / 1e9);
+    return ok && frames;
+}
+
+/* Descriptors of the packets whose last descriptor is done are free */
+static void reclaim(Bench *b)
+{
+    while (b->clean != b->tail &&
+           (b->ring[b->eop[b->clean]].upper.fields.status &
+            E1000_TXD_STAT_DD)) {
+        b->clean = (b->eop[b->clean] + 1) % RING_SIZE;
+    }
+}
+
+/* len 0 sends TSO packets, returns whether the backend got whole ones */
+static bool run(Bench *b, const char *name, int len, double seconds)
+{
+    int ndesc = len ? 1 : 2 + TSO_PAYLOAD / TSO_DESC_LEN;
+    uint64_t start, end, t, packets;
+
+    bench_start(b);
+    start = now_ns();
+    end = start + seconds * 1e9;
+    do {
+        reclaim(b);
+        while (ring_free(b) >= ndesc) {
+            if (len) {
+                queue_frame(b, len);
+            } else {
+                queue_tso(b);
+            }
+        }
+        mmio_write(b, E1000_TDT, b->tail);
+        fake_bh_poll();
+    } while ((t = now_ns()) < end);
+
+    printf("%-12s %12.0f %10.2f\n", name,
+           fake_net_sink_frames / ((t - start) / 1e9),
+           fake_net_sink_bytes * 8 / ((t - start) / 1e9) / 1e9);
+
+    if (len) {
+        packets = fake_net_sink_frames;
+        return fake_net_sink_bytes == packets * len;
+    }
+    packets = fake_net_sink_frames / TSO_SEGS;
+    return fake_net_sink_frames == packets * TSO_SEGS &&
+           fake_net_sink_bytes == packets * (TSO_PAYLOAD + TSO_SEGS * HDR_LEN);
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = 1;
+    bool ok;
+    Bench b;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:")) != -1) {
+        switch (c) {
+        case 't':
+            seconds = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t SECONDS]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (seconds <= 0) {
+        fprintf(stderr, "need a positive run time\n");
+        return 2;
+    }
+
+    e1000_register_types();
+    fake_pci_init();
+    fake_net_init(1);
+    fake_net_sink = true;
+    b.dev = fake_pci_create("e1000");
+    assert(b.dev);
+
+    printf("e1000 TX to a sink backend, %d descriptor ring, %.1f s per run\n",
+           RING_SIZE, seconds);
+    printf("%-12s %12s %10s\n", "packets", "pps", "Gbit/s");
+    ok = run(&b, "60 B", 60, seconds);
+    ok &= run(&b, "1514 B", 1514, seconds);
+    ok &= run(&b, "60 KiB TSO", 0, seconds);
+    if (!ok) {
+        printf("the backend got partial packets\n");
+    }
+
+    printf("\ne1000 RX in bursts, %d descriptor ring, %.1f s per run\n",
+           RING_SIZE, seconds);
+    printf("%-12s %12s %10s\n", "packets", "pps", "Gbit/s");
+    if (!(run_rx(&b, "60 B x1", 60, 1, seconds) &
+          run_rx(&b, "60 B x32", 60, 32, seconds) &
+          run_rx(&b, "1514 B x1", 1514, 1, seconds) &
+          run_rx(&b, "1514 B x32", 1514, 32, seconds))) {
+        printf("the ring got frames of the wrong length, or none\n");
+        ok = false;
+    }
+
+    fake_pci_destroy(b.dev);
+    fake_net_cleanup();
+    return ok ? 0 : 1;
+}
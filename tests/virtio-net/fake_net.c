@@ -0,0 +1,508 @@
+/*
+ * Fake net backend and bottom halves, see fake_net.h.
+ */
+
+#include <time.h>
+#include "fake_net.h"
+#include "qemu/main-loop.h"
+#include "qemu/iov.h"
+
+#define FAKE_NET_MAX_QUEUED     16
+#define FAKE_MAX_BHS            16
+#define FAKE_MAX_TIMERS         16
+
+typedef struct FakeQueue {
+    NetClientState backend;
+    /* send waiting for fake_net_complete() */
+    NetClientState *pending_nc;
+    NetPacketSent *pending_cb;
+    /* frames towards the NIC it could not take yet */
+    FakeFrame queued[FAKE_NET_MAX_QUEUED];
+    int nqueued;
+} FakeQueue;
+
+struct QEMUBH {
+    QEMUBHFunc *cb;
+    void *opaque;
+    bool scheduled;
+    bool in_use;
+};
+
+struct QEMUTimer {
+    QEMUTimerCB *cb;
+    void *opaque;
+    int scale;
+    int64_t expire_time;        /* in ns, -1 when not pending */
+    bool in_use;
+};
+
+static NetClientInfo fake_net_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_TAP,
+    .size = sizeof(NetClientState),
+};
+
+static FakeQueue fake_queues[FAKE_NET_MAX_QUEUES];
+static int fake_nqueues;
+static NICInfo fake_nd;
+static QEMUBH fake_bhs[FAKE_MAX_BHS];
+static QEMUTimer fake_timers[FAKE_MAX_TIMERS];
+
+FakeFrame fake_net_sent[FAKE_NET_MAX_FRAMES];
+int fake_net_nsent;
+bool fake_net_vnet_hdr;
+bool fake_net_async;
+bool fake_net_sink;
+uint64_t fake_net_sink_frames;
+uint64_t fake_net_sink_bytes;
+bool fake_net_tap_enabled[FAKE_NET_MAX_QUEUES];
+int fake_net_offload_csum;
+int fake_net_offload_tso4;
+
+NICInfo *current_nd;
+
+/* Bottom halves */
+
+QEMUBH *vmx_bh_new(QEMUBHFunc *cb, void *opaque)
+{
+    int i;
+
+    for (i = 0; i < FAKE_MAX_BHS; i++) {
+        if (!fake_bhs[i].in_use) {
+            fake_bhs[i].cb = cb;
+            fake_bhs[i].opaque = opaque;
+            fake_bhs[i].scheduled = false;
+            fake_bhs[i].in_use = true;
+            return &fake_bhs[i];
+        }
+    }
+    abort();
+}
+
+void vmx_bh_schedule(QEMUBH *bh)
+{
+    bh->scheduled = true;
+}
+
+void vmx_bh_cancel(QEMUBH *bh)
+{
+    bh->scheduled = false;
+}
+
+void vmx_bh_delete(QEMUBH *bh)
+{
+    bh->scheduled = false;
+    bh->in_use = false;
+}
+
+/* Timers, on the host's monotonic clock whatever the type */
+
+int64_t vmx_clock_get_ns(QEMUClockType type)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+QEMUTimer *timer_new(QEMUClockType type, int scale, QEMUTimerCB *cb,
+                     void *opaque)
+{
+    int i;
+
+    for (i = 0; i < FAKE_MAX_TIMERS; i++) {
+        if (!fake_timers[i].in_use) {
+            fake_timers[i].cb = cb;
+            fake_timers[i].opaque = opaque;
+            fake_timers[i].scale = scale;
+            fake_timers[i].expire_time = -1;
+            fake_timers[i].in_use = true;
+            return &fake_timers[i];
+        }
+    }
+    abort();
+}
+
+void timer_mod(QEMUTimer *ts, int64_t expire_time)
+{
+    ts->expire_time = MAX(expire_time, 0) * ts->scale;
+}
+
+void timer_del(QEMUTimer *ts)
+{
+    ts->expire_time = -1;
+}
+
+void timer_free(QEMUTimer *ts)
+{
+    ts->in_use = false;
+}
+
+int fake_bh_poll(void)
+{
+    int i, ran = 0;
+    int64_t now;
+    bool again;
+
+    do {
+        again = false;
+        for (i = 0; i < FAKE_MAX_BHS; i++) {
+            if (fake_bhs[i].in_use && fake_bhs[i].scheduled) {
+                fake_bhs[i].scheduled = false;
+                fake_bhs[i].cb(fake_bhs[i].opaque);
+                again = true;
+                ran++;
+            }
+        }
+        now = vmx_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        for (i = 0; i < FAKE_MAX_TIMERS; i++) {
+            QEMUTimer *ts = &fake_timers[i];
+
+            if (ts->in_use && ts->expire_time >= 0 && ts->expire_time <= now) {
+                ts->expire_time = -1;
+                ts->cb(ts->opaque);
+                again = true;
+                ran++;
+            }
+        }
+    } while (again && ran < 10000);
+    return ran;
+}
+
+/* NIC */
+
+NICState *vmx_new_nic(NetClientInfo *info, NICConf *conf, const char *model,
+                       const char *name, void *opaque)
+{
+    int i, queues = MAX(1, conf->peers.queues);
+    NICState *nic;
+
+    /* The NIC's clients follow it, see vmx_get_nic_opaque() */
+    assert(info->size == sizeof(NICState));
+    nic = g_malloc0(info->size + sizeof(NetClientState) * queues);
+    nic->ncs = (void *)nic + info->size;
+    nic->conf = conf;
+    nic->opaque = opaque;
+
+    for (i = 0; i < queues; i++) {
+        NetClientState *nc = &nic->ncs[i];
+
+        nc->info = info;
+        nc->queue_index = i;
+        nc->model = (char *)model;
+        nc->name = (char *)name;
+        nc->peer = conf->peers.ncs[i];
+        if (nc->peer) {
+            nc->peer->peer = nc;
+        }
+    }
+    return nic;
+}
+
+void vmx_del_nic(NICState *nic)
+{
+    int i;
+
+    for (i = 0; i < MAX(1, nic->conf->peers.queues); i++) {
+        if (nic->ncs[i].peer) {
+            nic->ncs[i].peer->peer = NULL;
+        }
+    }
+    g_free(nic);
+}
+
+NetClientState *vmx_get_subqueue(NICState *nic, int queue_index)
+{
+    return nic->ncs + queue_index;
+}
+
+NetClientState *vmx_get_queue(NICState *nic)
+{
+    return vmx_get_subqueue(nic, 0);
+}
+
+void *vmx_get_nic_opaque(NetClientState *nc)
+{
+    NetClientState *nc0 = nc - nc->queue_index;
+    NICState *nic = (NICState *)((void *)nc0 - nc->info->size);
+
+    return nic->opaque;
+}
+
+void vmx_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6])
+{
+}
+
+void vmx_macaddr_default_if_unset(MACAddr *macaddr)
+{
+    static const MACAddr def = { { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 } };
+    static const MACAddr zero;
+
+    if (!memcmp(macaddr, &zero, sizeof(zero))) {
+        *macaddr = def;
+    }
+}
+
+/* Backend */
+
+int vmx_find_net_clients_except(const char *id, NetClientState **ncs,
+                                 NetClientOptionsKind type, int max)
+{
+    int i;
+
+    for (i = 0; i < fake_nqueues && i < max; i++) {
+        ncs[i] = &fake_queues[i].backend;
+    }
+    return i;
+}
+
+int tap_enable(NetClientState *nc)
+{
+    fake_net_tap_enabled[nc->queue_index] = true;
+    return 0;
+}
+
+int tap_disable(NetClientState *nc)
+{
+    fake_net_tap_enabled[nc->queue_index] = false;
+    return 0;
+}
+
+bool vmx_has_ufo(NetClientState *nc)
+{
+    return false;
+}
+
+bool vmx_has_vnet_hdr(NetClientState *nc)
+{
+    return nc && fake_net_vnet_hdr;
+}
+
+bool vmx_has_vnet_hdr_len(NetClientState *nc, int len)
+{
+    return vmx_has_vnet_hdr(nc);
+}
+
+void vmx_using_vnet_hdr(NetClientState *nc, bool enable)
+{
+}
+
+void vmx_set_vnet_hdr_len(NetClientState *nc, int len)
+{
+}
+
+void vmx_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
+                      int ecn, int ufo)
+{
+    fake_net_offload_csum = csum;
+    fake_net_offload_tso4 = tso4;
+}
+
+ssize_t vmx_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
+                                int iovcnt, NetPacketSent *sent_cb)
+{
+    FakeQueue *q = &fake_queues[nc->queue_index];
+    size_t len = iov_size(iov, iovcnt);
+    FakeFrame *f;
+
+    assert(nc->peer == &q->backend);
+    assert(!q->pending_cb);
+    if (fake_net_sink) {
+        fake_net_sink_frames++;
+        fake_net_sink_bytes += len;
+        return len;
+    }
+    assert(fake_net_nsent < FAKE_NET_MAX_FRAMES);
+
+    f = &fake_net_sent[fake_net_nsent++];
+    f->queue = nc->queue_index;
+    f->len = len;
+    f->data = g_malloc(len);
+    iov_to_buf(iov, iovcnt, 0, f->data, len);
+
+    if (fake_net_async && sent_cb) {
+        q->pending_nc = nc;
+        q->pending_cb = sent_cb;
+        return 0;
+    }
+    return len;
+}
+
+ssize_t vmx_send_packet_async(NetClientState *nc, const uint8_t *buf,
+                               int size, NetPacketSent *sent_cb)
+{
+    struct iovec iov = {
+        .iov_base = (uint8_t *)buf,
+        .iov_len = size
+    };
+
+    return vmx_sendv_packet_async(nc, &iov, 1, sent_cb);
+}
+
+ssize_t vmx_sendv_packet(NetClientState *nc, const struct iovec *iov,
+                          int iovcnt)
+{
+    return vmx_sendv_packet_async(nc, iov, iovcnt, NULL);
+}
+
+void vmx_send_packet(NetClientState *nc, const uint8_t *buf, int size)
+{
+    vmx_send_packet_async(nc, buf, size, NULL);
+}
+
+bool fake_net_complete(int queue)
+{
+    FakeQueue *q = &fake_queues[queue];
+    NetPacketSent *cb = q->pending_cb;
+
+    if (!cb) {
+        return false;
+    }
+    q->pending_cb = NULL;
+    cb(q->pending_nc, 0);
+    return true;
+}
+
+/* Dropping a pending send still completes it, as the real queue does */
+void vmx_purge_queued_packets(NetClientState *nc)
+{
+    FakeQueue *q = &fake_queues[nc->queue_index];
+    NetPacketSent *cb = q->pending_cb;
+
+    if (cb && q->pending_nc == nc) {
+        q->pending_cb = NULL;
+        cb(nc, 0);
+    }
+}
+
+static ssize_t fake_net_deliver(NetClientState *nc, FakeFrame *f)
+{
+    if (!nc->info->can_receive(nc)) {
+        return 0;
+    }
+    return nc->info->receive(nc, f->data, f->len);
+}
+
+void vmx_flush_queued_packets(NetClientState *nc)
+{
+    FakeQueue *q = &fake_queues[nc->queue_index];
+
+    while (q->nqueued) {
+        if (!fake_net_deliver(nc, &q->queued[0])) {
+            break;
+        }
+        g_free(q->queued[0].data);
+        q->nqueued--;
+        memmove(q->queued, q->queued + 1, sizeof(FakeFrame) * q->nqueued);
+    }
+}
+
+ssize_t fake_net_receive(int queue, const uint8_t *buf, size_t len)
+{
+    FakeQueue *q = &fake_queues[queue];
+    NetClientState *nc = q->backend.peer;
+    FakeFrame frame = {
+        .queue = queue,
+        .len = len,
+        .data = (uint8_t *)buf,
+    };
+    ssize_t ret = 0;
+
+    /* Frames are delivered in order, behind any already queued */
+    if (!q->nqueued) {
+        ret = fake_net_deliver(nc, &frame);
+    }
+    if (!ret) {
+        assert(q->nqueued < FAKE_NET_MAX_QUEUED);
+        frame.data = g_malloc(len);
+        memcpy(frame.data, buf, len);
+        q->queued[q->nqueued++] = frame;
+    }
+    return ret;
+}
+
+void vmx_send_batch_begin(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    if (peer && peer->info->batch_begin) {
+        peer->info->batch_begin(peer);
+    }
+}
+
+void vmx_send_batch_end(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    if (peer && peer->info->batch_end) {
+        peer->info->batch_end(peer);
+    }
+}
+
+/* Stops at the first frame the NIC has no room for, nothing is queued */
+int fake_net_receive_burst(int queue, const uint8_t *buf, size_t len, int n)
+{
+    FakeQueue *q = &fake_queues[queue];
+    FakeFrame frame = {
+        .queue = queue,
+        .len = len,
+        .data = (uint8_t *)buf,
+    };
+    int i;
+
+    assert(!q->nqueued);
+    vmx_send_batch_begin(&q->backend);
+    for (i = 0; i < n; i++) {
+        if (fake_net_deliver(q->backend.peer, &frame) <= 0) {
+            break;
+        }
+    }
+    vmx_send_batch_end(&q->backend);
+    return i;
+}
+
+int fake_net_queued(int queue)
+{
+    return fake_queues[queue].nqueued;
+}
+
+void fake_net_init(int queues)
+{
+    int i;
+
+    fake_net_cleanup();
+    assert(queues <= FAKE_NET_MAX_QUEUES);
+    for (i = 0; i < queues; i++) {
+        FakeQueue *q = &fake_queues[i];
+
+        memset(q, 0, sizeof(*q));
+        q->backend.info = &fake_net_info;
+        q->backend.name = "net0";
+        q->backend.queue_index = i;
+    }
+    fake_nqueues = queues;
+
+    memset(&fake_nd, 0, sizeof(fake_nd));
+    fake_nd.netdev = &fake_queues[0].backend;
+    current_nd = &fake_nd;
+}
+
+void fake_net_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < fake_net_nsent; i++) {
+        g_free(fake_net_sent[i].data);
+    }
+    fake_net_nsent = 0;
+    for (i = 0; i < fake_nqueues; i++) {
+        while (fake_queues[i].nqueued) {
+            g_free(fake_queues[i].queued[--fake_queues[i].nqueued].data);
+        }
+    }
+    fake_nqueues = 0;
+    memset(fake_net_tap_enabled, 0, sizeof(fake_net_tap_enabled));
+    fake_net_offload_csum = 0;
+    fake_net_offload_tso4 = 0;
+    fake_net_sink_frames = 0;
+    fake_net_sink_bytes = 0;
+}
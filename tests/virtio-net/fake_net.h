@@ -0,0 +1,64 @@
+/*
+ * A tap-like backend for the NIC under test and a main loop that only
+ * runs bottom halves and timers.
+ *
+ * Frames the NIC sends are recorded in fake_net_sent, or with
+ * fake_net_sink set only counted, for benchmarks.  With fake_net_async
+ * set, sends that pass a completion callback stay pending until
+ * fake_net_complete(), like a tap whose socket buffer is full.
+ * Frames delivered with fake_net_receive() that the NIC cannot take yet
+ * are queued until it flushes them.  fake_net_receive_burst() brackets
+ * its frames with the NIC's batch hooks, as tap and slirp do.
+ */
+
+#ifndef FAKE_NET_H
+#define FAKE_NET_H
+
+#include "qemu-common.h"
+#include "net/net.h"
+
+#define FAKE_NET_MAX_QUEUES     4
+#define FAKE_NET_MAX_FRAMES     64
+
+typedef struct FakeFrame {
+    int queue;
+    size_t len;
+    uint8_t *data;
+} FakeFrame;
+
+extern FakeFrame fake_net_sent[FAKE_NET_MAX_FRAMES];
+extern int fake_net_nsent;
+
+/* Backend behaviour, set before the NIC is created */
+extern bool fake_net_vnet_hdr;
+extern bool fake_net_async;
+extern bool fake_net_sink;
+
+/* What reached a sink backend */
+extern uint64_t fake_net_sink_frames;
+extern uint64_t fake_net_sink_bytes;
+
+/* What the NIC told the backend */
+extern bool fake_net_tap_enabled[FAKE_NET_MAX_QUEUES];
+extern int fake_net_offload_csum;
+extern int fake_net_offload_tso4;
+
+extern NICInfo *current_nd;
+
+void fake_net_init(int queues);
+void fake_net_cleanup(void);
+
+/* Complete the pending send on a queue, returns false if there is none */
+bool fake_net_complete(int queue);
+ssize_t fake_net_receive(int queue, const uint8_t *buf, size_t len);
+/* Deliver n copies of a frame, returns how many the NIC took */
+int fake_net_receive_burst(int queue, const uint8_t *buf, size_t len, int n);
+int fake_net_queued(int queue);
+
+/*
+ * Run scheduled bottom halves and expired timers until none are left,
+ * returns how many ran
+ */
+int fake_bh_poll(void);
+
+#endif
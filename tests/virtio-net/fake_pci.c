@@ -0,0 +1,370 @@
+/*
+ * Fake PCI bus and guest memory, see fake_pci.h.
+ */
+
+#include "fake_pci.h"
+#include "sysemu.h"
+
+#define FAKE_MAX_TYPES      8
+#define FAKE_CAP_START      0x40
+
+typedef struct FakeType {
+    VeertuTypeInfo info;
+    struct FakeType *parent;
+    PCIDeviceClass *klass;
+} FakeType;
+
+static FakeType fake_types[FAKE_MAX_TYPES];
+static int fake_ntypes;
+
+uint8_t *fake_guest_mem;
+int64_t fake_dma_mapped;
+
+/* Types */
+
+static FakeType *fake_find_type(const char *name)
+{
+    int i;
+
+    for (i = 0; name && i < fake_ntypes; i++) {
+        if (!strcmp(fake_types[i].info.name, name)) {
+            return &fake_types[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * As in devices/typeinfo.c, a type's class starts as a copy of its
+ * parent's and sizes it leaves at 0 are inherited.  Parents that are not
+ * registered here, like "pci-device", count as a bare PCIDeviceClass.
+ */
+struct VeertuTypeClass *register_type_internal(const VeertuTypeInfo *info)
+{
+    FakeType *t, *parent = fake_find_type(info->parent);
+
+    assert(fake_ntypes < FAKE_MAX_TYPES);
+    t = &fake_types[fake_ntypes++];
+    t->info = *info;
+    t->parent = parent;
+    if (parent) {
+        t->info.instance_size = info->instance_size ?:
+                                parent->info.instance_size;
+        t->info.class_size = info->class_size ?: parent->info.class_size;
+    }
+    t->info.class_size = MAX(t->info.class_size, sizeof(PCIDeviceClass));
+
+    t->klass = g_malloc0(t->info.class_size);
+    if (parent) {
+        memcpy(t->klass, parent->klass, parent->info.class_size);
+    }
+    if (info->class_init) {
+        info->class_init(VeertuTypeClassHold(t->klass), info->class_data);
+    }
+    return NULL;
+}
+
+char *get_typename(VeertuType *type)
+{
+    int i;
+
+    for (i = 0; i < fake_ntypes; i++) {
+        if (type->class == VeertuTypeClassHold(fake_types[i].klass)) {
+            return fake_types[i].info.name;
+        }
+    }
+    return NULL;
+}
+
+/* Ancestors first, as vtype_init_with_type() does */
+static void fake_instance_init(FakeType *t, VeertuType *obj)
+{
+    if (t->parent) {
+        fake_instance_init(t->parent, obj);
+    }
+    if (t->info.instance_init) {
+        t->info.instance_init(obj);
+    }
+}
+
+void device_add_bootindex_property(VeertuType *obj, int32_t *bootindex,
+                                   char *name, char *suffix,
+                                   DeviceState *dev, struct Error **errp)
+{
+}
+
+/* Memory areas */
+
+void memory_area_init(VeertuMemArea *mr, char *name, uint64_t size)
+{
+    memset(mr, 0, sizeof(*mr));
+    mr->name = name;
+    mr->size = size;
+}
+
+void memory_area_init_io(VeertuMemArea *mr, VeertuType *owner,
+                         const MemAreaOps *ops, void *opaque,
+                         const char *name, uint64_t size)
+{
+    memset(mr, 0, sizeof(*mr));
+    mr->name = name;
+    mr->size = size;
+    mr->ops = ops;
+    mr->opaque = opaque;
+}
+
+void mem_area_add_child(VeertuMemArea *mr, hwaddr offset,
+                        VeertuMemArea *child)
+{
+    assert(mr->nchildren < MEM_AREA_MAX_CHILDREN);
+    mr->children[mr->nchildren].offset = offset;
+    mr->children[mr->nchildren].area = child;
+    mr->nchildren++;
+}
+
+/* Resolve addr to the I/O area below mr that handles it */
+static VeertuMemArea *fake_area_find(VeertuMemArea *mr, hwaddr *addr,
+                                     unsigned size)
+{
+    int i;
+
+    if (*addr + size > mr->size) {
+        return NULL;
+    }
+    if (mr->ops) {
+        return mr;
+    }
+    for (i = 0; i < mr->nchildren; i++) {
+        hwaddr offset = mr->children[i].offset;
+
+        if (*addr >= offset) {
+            hwaddr sub = *addr - offset;
+            VeertuMemArea *area = fake_area_find(mr->children[i].area, &sub,
+                                                 size);
+
+            if (area) {
+                *addr = sub;
+                return area;
+            }
+        }
+    }
+    return NULL;
+}
+
+uint64_t fake_bar_read(PCIDevice *dev, int bar, hwaddr addr, unsigned size)
+{
+    VeertuMemArea *area;
+
+    if (!dev->bars[bar]) {
+        return ~0ULL;
+    }
+    area = fake_area_find(dev->bars[bar], &addr, size);
+    if (!area) {
+        return ~0ULL;
+    }
+    return area->ops->read(area->opaque, addr, size);
+}
+
+void fake_bar_write(PCIDevice *dev, int bar, hwaddr addr, uint64_t val,
+                    unsigned size)
+{
+    VeertuMemArea *area;
+
+    if (!dev->bars[bar]) {
+        return;
+    }
+    area = fake_area_find(dev->bars[bar], &addr, size);
+    if (area) {
+        area->ops->write(area->opaque, addr, val, size);
+    }
+}
+
+/* PCI */
+
+void pci_register_bar(PCIDevice *pci_dev, int region_num,
+                      uint8_t attr, VeertuMemArea *memory)
+{
+    assert(region_num < PCI_NUM_REGIONS);
+    pci_dev->bars[region_num] = memory;
+    pci_set_long(pci_dev->config + PCI_BASE_ADDRESS_0 + region_num * 4, attr);
+}
+
+int pci_add_capability(PCIDevice *pdev, uint8_t cap_id,
+                       uint8_t offset, uint8_t size)
+{
+    uint8_t *config = pdev->config;
+    int pos = FAKE_CAP_START, next;
+
+    /* Capabilities are packed one after the other */
+    for (next = config[PCI_CAPABILITY_LIST]; next;
+         next = config[next + PCI_CAP_LIST_NEXT]) {
+        pos = MAX(pos, next + config[next + PCI_CAP_FLAGS]);
+    }
+    if (offset) {
+        pos = offset;
+    }
+    if (pos + size > PCI_CONFIG_SPACE_SIZE) {
+        return -ENOSPC;
+    }
+
+    config[pos + PCI_CAP_LIST_ID] = cap_id;
+    config[pos + PCI_CAP_LIST_NEXT] = config[PCI_CAPABILITY_LIST];
+    /* the length byte, which vendor capabilities keep in their flags */
+    config[pos + PCI_CAP_FLAGS] = size;
+    config[PCI_CAPABILITY_LIST] = pos;
+    config[PCI_STATUS] |= PCI_STATUS_CAP_LIST;
+    return pos;
+}
+
+uint32_t pci_default_read_config(PCIDevice *d, uint32_t address, int len)
+{
+    uint32_t val = 0;
+
+    assert(address + len <= PCI_CONFIG_SPACE_SIZE);
+    memcpy(&val, d->config + address, len);
+    return le32_to_cpu(val);
+}
+
+void pci_default_write_config(PCIDevice *d, uint32_t address, uint32_t val,
+                              int len)
+{
+    int i;
+
+    assert(address + len <= PCI_CONFIG_SPACE_SIZE);
+    for (i = 0; i < len; i++, val >>= 8) {
+        uint8_t wmask = d->wmask[address + i];
+
+        d->config[address + i] = (d->config[address + i] & ~wmask) |
+                                 (val & wmask);
+    }
+}
+
+void pci_set_irq(PCIDevice *pci_dev, int level)
+{
+    pci_dev->irq_state = level;
+}
+
+/* Guest memory is one flat range, so every mapping is complete */
+void *pci_dma_map(PCIDevice *dev, uint64_t addr, uint64_t *plen, int dir)
+{
+    if (addr >= FAKE_GUEST_MEM_SIZE) {
+        *plen = 0;
+        return NULL;
+    }
+    *plen = MIN(*plen, FAKE_GUEST_MEM_SIZE - addr);
+    fake_dma_mapped++;
+    return fake_guest_mem + addr;
+}
+
+void pci_dma_unmap(PCIDevice *dev, void *buffer, uint64_t len,
+                   int dir, uint64_t access_len)
+{
+    uint8_t *p = buffer;
+
+    assert(p >= fake_guest_mem && p + len <= fake_guest_mem +
+           FAKE_GUEST_MEM_SIZE);
+    assert(access_len <= len);
+    fake_dma_mapped--;
+}
+
+int pci_dma_rw(PCIDevice *dev, uint64_t addr, void *buf, uint64_t len,
+               int dir)
+{
+    assert(addr + len <= FAKE_GUEST_MEM_SIZE);
+    if (dir) {
+        memcpy(fake_guest_mem + addr, buf, len);
+    } else {
+        memcpy(buf, fake_guest_mem + addr, len);
+    }
+    return 0;
+}
+
+/* Bus */
+
+uint32_t fake_config_read(PCIDevice *dev, uint32_t addr, int len)
+{
+    if (dev->config_read) {
+        return dev->config_read(dev, addr, len);
+    }
+    return pci_default_read_config(dev, addr, len);
+}
+
+void fake_config_write(PCIDevice *dev, uint32_t addr, uint32_t val, int len)
+{
+    if (dev->config_write) {
+        dev->config_write(dev, addr, val, len);
+    } else {
+        pci_default_write_config(dev, addr, val, len);
+    }
+}
+
+PCIDevice *fake_pci_create(const char *name)
+{
+    FakeType *t = fake_find_type(name);
+    PCIDeviceClass *k;
+    PCIDevice *dev;
+
+    if (!t) {
+        return NULL;
+    }
+    k = t->klass;
+
+    dev = g_malloc0(t->info.instance_size);
+    dev->qdev.parent.class = VeertuTypeClassHold(k);
+    dev->qdev.id = name;
+    dev->config = g_malloc0(PCI_CONFIG_SPACE_SIZE);
+    dev->wmask = g_malloc0(PCI_CONFIG_SPACE_SIZE);
+    fake_instance_init(t, VeertuTypeHold(dev));
+
+    /* The header bits pci_init_wmask() lets a driver set */
+    dev->wmask[PCI_CACHE_LINE_SIZE] = 0xff;
+    dev->wmask[PCI_INTERRUPT_LINE] = 0xff;
+    pci_set_word(dev->wmask + PCI_COMMAND,
+                 PCI_COMMAND_IO | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER |
+                 PCI_COMMAND_INTX_DISABLE);
+
+    pci_set_word(dev->config + PCI_VENDOR_ID, k->vendor_id);
+    pci_set_word(dev->config + PCI_DEVICE_ID, k->device_id);
+    dev->config[PCI_REVISION_ID] = k->revision;
+    pci_set_word(dev->config + PCI_CLASS_DEVICE, k->class_id);
+
+    if (k->init(dev) < 0) {
+        g_free(dev->config);
+        g_free(dev->wmask);
+        g_free(dev);
+        return NULL;
+    }
+    return dev;
+}
+
+void fake_pci_destroy(PCIDevice *dev)
+{
+    PCIDeviceClass *k = PCI_DEVICE_CLASS(dev->qdev.parent.class);
+
+    if (k->exit) {
+        k->exit(dev);
+    }
+    g_free(dev->config);
+    g_free(dev->wmask);
+    g_free(dev);
+}
+
+void fake_pci_init(void)
+{
+    if (!fake_guest_mem) {
+        fake_guest_mem = g_malloc0(FAKE_GUEST_MEM_SIZE);
+    }
+    memset(fake_guest_mem, 0, FAKE_GUEST_MEM_SIZE);
+    fake_dma_mapped = 0;
+}
+
+/* util/cutils.c drags in too much, io_helpers.c only needs this one */
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    size_t i;
+
+    for (i = 0; i < len && !p[i]; i++) {
+    }
+    return i;
+}
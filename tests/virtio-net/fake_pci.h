@@ -0,0 +1,35 @@
+/*
+ * A PCI bus with a single device slot and flat guest memory, for running
+ * the virtio devices without the VMM.
+ *
+ * Devices register their types as usual and are created by name.  The
+ * test plays the guest: it reads and writes config space and BARs like a
+ * driver would and lays out rings and buffers in fake_guest_mem, which
+ * the device maps through pci_dma_map().
+ */
+
+#ifndef FAKE_PCI_H
+#define FAKE_PCI_H
+
+#include "hw.h"
+#include "pci.h"
+
+#define FAKE_GUEST_MEM_SIZE     (4 << 20)
+
+extern uint8_t *fake_guest_mem;
+
+/* pci_dma_map() calls not yet matched by pci_dma_unmap() */
+extern int64_t fake_dma_mapped;
+
+void fake_pci_init(void);
+PCIDevice *fake_pci_create(const char *name);
+void fake_pci_destroy(PCIDevice *dev);
+
+uint32_t fake_config_read(PCIDevice *dev, uint32_t addr, int len);
+void fake_config_write(PCIDevice *dev, uint32_t addr, uint32_t val, int len);
+
+uint64_t fake_bar_read(PCIDevice *dev, int bar, hwaddr addr, unsigned size);
+void fake_bar_write(PCIDevice *dev, int bar, hwaddr addr, uint64_t val,
+                    unsigned size);
+
+#endif
@@ -0,0 +1,12 @@
+/*
+ * Stand-in for include/hw.h, see tests/virtio-net/CMakeLists.txt.
+ */
+
+#ifndef QEMU_HW_H
+#define QEMU_HW_H
+
+#include "qemu-common.h"
+#include "qdev-core.h"
+#include "vmstate.h"
+
+#endif
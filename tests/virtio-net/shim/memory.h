@@ -0,0 +1,60 @@
+/*
+ * Stand-in for include/memory.h, see tests/virtio-net/CMakeLists.txt.
+ * A memory area is either a container of children at fixed offsets or
+ * an I/O area with ops, which is all a device BAR needs here.
+ */
+
+#ifndef VEERTUMEM_H
+#define VEERTUMEM_H
+
+#include "qemu-common.h"
+#include "hwaddr.h"
+
+#define MEM_AREA_MAX_CHILDREN   8
+
+enum device_endian {
+    DEVICE_NATIVE_ENDIAN,
+    DEVICE_BIG_ENDIAN,
+    DEVICE_LITTLE_ENDIAN,
+};
+
+typedef struct MemAreaOps {
+    uint64_t (*read)(void *opaque, hwaddr addr, unsigned size);
+    void (*write)(void *opaque, hwaddr addr, uint64_t data, unsigned size);
+    enum device_endian endianness;
+    bool (*unlocked)(void *opaque, uint64_t addr, unsigned size, bool is_write);
+    struct {
+        unsigned min_access_size;
+        unsigned max_access_size;
+    } valid;
+    struct {
+        unsigned min_access_size;
+        unsigned max_access_size;
+    } impl;
+} MemAreaOps;
+
+struct VeertuMemArea {
+    const char *name;
+    uint64_t size;
+    const MemAreaOps *ops;
+    void *opaque;
+    int nchildren;
+    struct {
+        hwaddr offset;
+        VeertuMemArea *area;
+    } children[MEM_AREA_MAX_CHILDREN];
+};
+
+void memory_area_init(VeertuMemArea *mr, char *name, uint64_t size);
+void memory_area_init_io(VeertuMemArea *mr, VeertuType *owner,
+                         const MemAreaOps *ops, void *opaque,
+                         const char *name, uint64_t size);
+void mem_area_add_child(VeertuMemArea *mr, hwaddr offset,
+                        VeertuMemArea *child);
+
+/* There is no iothread mutex here, every access is dispatched unlocked */
+static inline void memory_area_clear_global_locking(VeertuMemArea *area)
+{
+}
+
+#endif
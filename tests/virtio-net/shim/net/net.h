@@ -0,0 +1,108 @@
+/*
+ * Stand-in for include/net/net.h, see tests/virtio-net/CMakeLists.txt.
+ * The net client structures as in the real header, the functions behind
+ * them are the fake backend in fake_net.c.
+ */
+
+#ifndef QEMU_NET_H
+#define QEMU_NET_H
+
+#include "qemu-common.h"
+#include "util/qapi-types.h"
+
+#define MAX_QUEUE_NUM 1024
+
+/* Maximum GSO packet size (64k) plus plenty of room for
+ * the ethernet and virtio_net headers
+ */
+#define NET_BUFSIZE (4096 + 65536)
+
+struct MACAddr {
+    uint8_t a[6];
+};
+
+typedef struct NICPeers {
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    int32_t queues;
+} NICPeers;
+
+typedef struct NICConf {
+    MACAddr macaddr;
+    NICPeers peers;
+    int32_t bootindex;
+} NICConf;
+
+typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
+
+typedef int (NetCanReceive)(NetClientState *);
+typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
+typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef void (LinkStatusChanged)(NetClientState *);
+typedef void (NetBatch)(NetClientState *);
+
+typedef struct NetClientInfo {
+    NetClientOptionsKind type;
+    size_t size;
+    NetReceive *receive;
+    NetReceiveIOV *receive_iov;
+    NetCanReceive *can_receive;
+    LinkStatusChanged *link_status_changed;
+    NetBatch *batch_begin;
+    NetBatch *batch_end;
+} NetClientInfo;
+
+struct NetClientState {
+    NetClientInfo *info;
+    int link_down;
+    NetClientState *peer;
+    char *model;
+    char *name;
+    unsigned int queue_index;
+};
+
+typedef struct NICState {
+    NetClientState *ncs;
+    NICConf *conf;
+    void *opaque;
+} NICState;
+
+int vmx_find_net_clients_except(const char *id, NetClientState **ncs,
+                                 NetClientOptionsKind type, int max);
+NICState *vmx_new_nic(NetClientInfo *info,
+                       NICConf *conf,
+                       const char *model,
+                       const char *name,
+                       void *opaque);
+void vmx_del_nic(NICState *nic);
+NetClientState *vmx_get_subqueue(NICState *nic, int queue_index);
+NetClientState *vmx_get_queue(NICState *nic);
+void *vmx_get_nic_opaque(NetClientState *nc);
+ssize_t vmx_sendv_packet(NetClientState *nc, const struct iovec *iov,
+                          int iovcnt);
+ssize_t vmx_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
+                                int iovcnt, NetPacketSent *sent_cb);
+void vmx_send_packet(NetClientState *nc, const uint8_t *buf, int size);
+ssize_t vmx_send_packet_async(NetClientState *nc, const uint8_t *buf,
+                               int size, NetPacketSent *sent_cb);
+void vmx_send_batch_begin(NetClientState *nc);
+void vmx_send_batch_end(NetClientState *nc);
+void vmx_purge_queued_packets(NetClientState *nc);
+void vmx_flush_queued_packets(NetClientState *nc);
+void vmx_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
+bool vmx_has_ufo(NetClientState *nc);
+bool vmx_has_vnet_hdr(NetClientState *nc);
+bool vmx_has_vnet_hdr_len(NetClientState *nc, int len);
+void vmx_using_vnet_hdr(NetClientState *nc, bool enable);
+void vmx_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
+                      int ecn, int ufo);
+void vmx_set_vnet_hdr_len(NetClientState *nc, int len);
+void vmx_macaddr_default_if_unset(MACAddr *macaddr);
+
+struct NICInfo {
+    MACAddr macaddr;
+    char *model;
+    char *name;
+    NetClientState *netdev;
+};
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * Stand-in for include/pci.h, see tests/virtio-net/CMakeLists.txt.
+ *
+ * A device sits alone on a fake bus: config space accesses go straight
+ * to it, its BARs are reached through fake_bar_read/write() and bus
+ * master DMA maps flat guest memory, all in fake_pci.c.
+ */
+
+#ifndef QEMU_PCI_H
+#define QEMU_PCI_H
+
+#include "qemu-common.h"
+#include "qdev-core.h"
+#include "memory.h"
+#include "pci_ids.h"
+#include "pci_regs.h"
+
+#define PCI_VENDOR_ID_REDHAT_QUMRANET    0x1af4
+
+#define PCI_CONFIG_SPACE_SIZE   0x100
+#define PCI_NUM_REGIONS         7
+
+#define TYPE_PCI_DEVICE "pci-device"
+#define PCI_DEVICE(obj) ((PCIDevice *)(obj))
+#define PCI_DEVICE_CLASS(klass) ((PCIDeviceClass *)(klass))
+#define PCI_DEVICE_GET_CLASS(obj) ((VeertuType *)obj)->class
+
+typedef uint32_t PCIConfigReadFunc(PCIDevice *pci_dev,
+                                   uint32_t address, int len);
+typedef void PCIConfigWriteFunc(PCIDevice *pci_dev,
+                                uint32_t address, uint32_t data, int len);
+typedef void PCIUnregisterFunc(PCIDevice *pci_dev);
+
+typedef struct PCIDeviceClass {
+    DeviceClass parent_class;
+
+    int (*init)(PCIDevice *dev);
+    PCIUnregisterFunc *exit;
+
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t revision;
+    uint16_t class_id;
+    const char *romfile;
+} PCIDeviceClass;
+
+struct PCIDevice {
+    DeviceState qdev;
+
+    uint8_t *config;
+    uint8_t *wmask;
+
+    VeertuMemArea *bars[PCI_NUM_REGIONS];
+
+    PCIConfigReadFunc *config_read;
+    PCIConfigWriteFunc *config_write;
+
+    uint8_t irq_state;
+};
+
+void pci_register_bar(PCIDevice *pci_dev, int region_num,
+                      uint8_t attr, VeertuMemArea *memory);
+int pci_add_capability(PCIDevice *pdev, uint8_t cap_id,
+                       uint8_t offset, uint8_t size);
+uint32_t pci_default_read_config(PCIDevice *d,
+                                 uint32_t address, int len);
+void pci_default_write_config(PCIDevice *d,
+                              uint32_t address, uint32_t val, int len);
+void pci_set_irq(PCIDevice *pci_dev, int level);
+
+void *pci_dma_map(PCIDevice *dev, uint64_t addr, uint64_t *plen, int dir);
+void pci_dma_unmap(PCIDevice *dev, void *buffer, uint64_t len,
+                   int dir, uint64_t access_len);
+int pci_dma_rw(PCIDevice *dev, uint64_t addr, void *buf, uint64_t len,
+               int dir);
+
+static inline int pci_dma_read(PCIDevice *dev, uint64_t addr,
+                               void *buf, uint64_t len)
+{
+    return pci_dma_rw(dev, addr, buf, len, 0);
+}
+
+static inline int pci_dma_write(PCIDevice *dev, uint64_t addr,
+                                const void *buf, uint64_t len)
+{
+    return pci_dma_rw(dev, addr, (void *) buf, len, 1);
+}
+
+static inline void pci_set_word(uint8_t *config, uint16_t val)
+{
+    stw_le_p(config, val);
+}
+
+static inline uint16_t pci_get_word(const uint8_t *config)
+{
+    return lduw_le_p(config);
+}
+
+static inline void pci_set_long(uint8_t *config, uint32_t val)
+{
+    stl_le_p(config, val);
+}
+
+static inline uint32_t pci_get_long(const uint8_t *config)
+{
+    return ldl_le_p(config);
+}
+
+#define VMSTATE_PCI_DEVICE(_field, _state)  VMSTATE_FIELD(_field)
+
+#endif
@@ -0,0 +1,47 @@
+/*
+ * Stand-in for include/qdev-core.h, see tests/virtio-net/CMakeLists.txt.
+ * Only the DeviceState and DeviceClass fields the virtio devices use.
+ */
+
+#ifndef QDEV_CORE_H
+#define QDEV_CORE_H
+
+#include "qemu/typedefs.h"
+#include "typeinfo.h"
+
+#define DEVICE(obj) ((DeviceState *)(obj))
+#define DEVICE_CLASS(klass) ((DeviceClass *)(klass))
+
+typedef enum DeviceCategory {
+    DEVICE_CATEGORY_BRIDGE,
+    DEVICE_CATEGORY_USB,
+    DEVICE_CATEGORY_STORAGE,
+    DEVICE_CATEGORY_NETWORK,
+    DEVICE_CATEGORY_INPUT,
+    DEVICE_CATEGORY_DISPLAY,
+    DEVICE_CATEGORY_SOUND,
+    DEVICE_CATEGORY_MISC,
+    DEVICE_CATEGORY_MAX
+} DeviceCategory;
+
+struct VMStateDescription;
+
+struct DeviceState {
+    VeertuType parent;
+    const char *id;
+};
+
+typedef struct DeviceClass {
+    VeertuTypeClassHold *parent_class;
+    unsigned long categories[1];
+    const char *desc;
+    void (*reset)(DeviceState *dev);
+    const struct VMStateDescription *vmsd;
+} DeviceClass;
+
+static inline void set_bit(long nr, unsigned long *addr)
+{
+    addr[nr / (8 * sizeof(long))] |= 1UL << (nr % (8 * sizeof(long)));
+}
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * Stand-in for include/qemu-common.h when the virtio devices are built
+ * outside the VMM, see tests/virtio-net/CMakeLists.txt.
+ *
+ * Provides the C library, the glib allocators, the little/big endian
+ * accessors and what util/io_helpers.c needs from the real header.
+ */
+
+#ifndef QEMU_COMMON_H
+#define QEMU_COMMON_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "qemu/compiler.h"
+#include "qemu/typedefs.h"
+
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+#ifndef DIV_ROUND_UP
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#endif
+
+static inline void *g_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+static inline void *g_malloc0(size_t size)
+{
+    return calloc(1, size);
+}
+
+static inline void *g_realloc(void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+static inline void g_free(void *ptr)
+{
+    free(ptr);
+}
+
+#define g_new(type, n)          ((type *)g_malloc(sizeof(type) * (n)))
+#define g_new0(type, n)         ((type *)g_malloc0(sizeof(type) * (n)))
+#define g_renew(type, p, n)     ((type *)g_realloc(p, sizeof(type) * (n)))
+
+/* The hosts this builds on are little endian */
+#define cpu_to_le16(x)  ((uint16_t)(x))
+#define cpu_to_le32(x)  ((uint32_t)(x))
+#define cpu_to_le64(x)  ((uint64_t)(x))
+#define le16_to_cpu(x)  ((uint16_t)(x))
+#define le32_to_cpu(x)  ((uint32_t)(x))
+#define le64_to_cpu(x)  ((uint64_t)(x))
+
+static inline uint16_t le16_to_cpup(const uint16_t *p)
+{
+    return le16_to_cpu(*p);
+}
+
+static inline uint32_t le32_to_cpup(const uint32_t *p)
+{
+    return le32_to_cpu(*p);
+}
+
+static inline uint16_t be16_to_cpup(const uint16_t *p)
+{
+    return __builtin_bswap16(*p);
+}
+
+static inline int lduw_le_p(const void *ptr)
+{
+    uint16_t v;
+
+    memcpy(&v, ptr, sizeof(v));
+    return v;
+}
+
+static inline int ldl_le_p(const void *ptr)
+{
+    uint32_t v;
+
+    memcpy(&v, ptr, sizeof(v));
+    return v;
+}
+
+static inline void stw_le_p(void *ptr, uint16_t v)
+{
+    memcpy(ptr, &v, sizeof(v));
+}
+
+static inline void stl_le_p(void *ptr, uint32_t v)
+{
+    memcpy(ptr, &v, sizeof(v));
+}
+
+static inline int lduw_be_p(const void *ptr)
+{
+    return __builtin_bswap16(lduw_le_p(ptr));
+}
+
+static inline int ldl_be_p(const void *ptr)
+{
+    return __builtin_bswap32(ldl_le_p(ptr));
+}
+
+static inline void stw_be_p(void *ptr, uint16_t v)
+{
+    stw_le_p(ptr, __builtin_bswap16(v));
+}
+
+static inline void stl_be_p(void *ptr, uint32_t v)
+{
+    stl_le_p(ptr, __builtin_bswap32(v));
+}
+
+/* util/io_helpers.c */
+typedef struct QEMUIOVector {
+    struct iovec *iov;
+    int niov;
+    int nalloc;
+    size_t size;
+} QEMUIOVector;
+
+#define VECTYPE        unsigned long
+#define BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR 8
+size_t buffer_find_nonzero_offset(const void *buf, size_t len);
+
+#endif
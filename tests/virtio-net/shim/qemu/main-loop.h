@@ -0,0 +1,20 @@
+/*
+ * Stand-in for include/qemu/main-loop.h, see
+ * tests/virtio-net/CMakeLists.txt.  Bottom halves and timers run when
+ * the test calls fake_bh_poll().
+ */
+
+#ifndef QEMU_MAIN_LOOP_H
+#define QEMU_MAIN_LOOP_H
+
+#include "qemu/typedefs.h"
+#include "qemu/timer.h"
+
+typedef void QEMUBHFunc(void *opaque);
+
+QEMUBH *vmx_bh_new(QEMUBHFunc *cb, void *opaque);
+void vmx_bh_schedule(QEMUBH *bh);
+void vmx_bh_cancel(QEMUBH *bh);
+void vmx_bh_delete(QEMUBH *bh);
+
+#endif
@@ -0,0 +1,10 @@
+/*
+ * Stand-in for include/qemu/sockets.h, see tests/virtio-net/CMakeLists.txt.
+ */
+
+#ifndef QEMU_SOCKET_H
+#define QEMU_SOCKET_H
+
+#include <sys/socket.h>
+
+#endif
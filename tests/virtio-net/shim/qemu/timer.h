@@ -0,0 +1,52 @@
+/*
+ * Stand-in for include/qemu/timer.h, see tests/virtio-net/CMakeLists.txt.
+ * Timers run on the host's monotonic clock when the test calls
+ * fake_bh_poll(), in fake_net.c.
+ */
+
+#ifndef QEMU_TIMER_H
+#define QEMU_TIMER_H
+
+#include <stdint.h>
+#include "qemu/typedefs.h"
+
+#define SCALE_MS 1000000
+#define SCALE_US 1000
+#define SCALE_NS 1
+
+typedef enum {
+    QEMU_CLOCK_REALTIME = 0,
+    QEMU_CLOCK_VIRTUAL = 1,
+    QEMU_CLOCK_HOST = 2,
+    QEMU_CLOCK_VIRTUAL_RT = 3,
+    QEMU_CLOCK_MAX
+} QEMUClockType;
+
+typedef void QEMUTimerCB(void *opaque);
+
+int64_t vmx_clock_get_ns(QEMUClockType type);
+
+static inline int64_t vmx_clock_get_ms(QEMUClockType type)
+{
+    return vmx_clock_get_ns(type) / SCALE_MS;
+}
+
+QEMUTimer *timer_new(QEMUClockType type, int scale, QEMUTimerCB *cb,
+                     void *opaque);
+void timer_mod(QEMUTimer *ts, int64_t expire_time);
+void timer_del(QEMUTimer *ts);
+void timer_free(QEMUTimer *ts);
+
+static inline QEMUTimer *timer_new_ns(QEMUClockType type, QEMUTimerCB *cb,
+                                      void *opaque)
+{
+    return timer_new(type, SCALE_NS, cb, opaque);
+}
+
+static inline QEMUTimer *timer_new_ms(QEMUClockType type, QEMUTimerCB *cb,
+                                      void *opaque)
+{
+    return timer_new(type, SCALE_MS, cb, opaque);
+}
+
+#endif
@@ -0,0 +1,16 @@
+/*
+ * Stand-in for include/sysemu.h, see tests/virtio-net/CMakeLists.txt.
+ */
+
+#ifndef SYSEMU_H
+#define SYSEMU_H
+
+#include "qdev-core.h"
+
+struct Error;
+
+void device_add_bootindex_property(VeertuType *obj, int32_t *bootindex,
+                                   char *name, char *suffix,
+                                   DeviceState *dev, struct Error **errp);
+
+#endif
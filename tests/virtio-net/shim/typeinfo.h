@@ -0,0 +1,36 @@
+/*
+ * Stand-in for include/typeinfo.h without glib, see
+ * tests/virtio-net/CMakeLists.txt.  Types are registered with the fake
+ * PCI bus in fake_pci.c, which instantiates them by name.
+ */
+
+#ifndef TYPEINFO_H
+#define TYPEINFO_H
+
+#include <stddef.h>
+
+typedef struct VeertuTypeClassHold VeertuTypeClassHold;
+typedef struct VeertuType VeertuType;
+
+struct VeertuType {
+    VeertuTypeClassHold *class;
+    VeertuType *father;
+};
+
+typedef struct VeertuTypeInfo {
+    char *name;
+    char *parent;
+    size_t instance_size;
+    size_t class_size;
+    void (*class_init)(VeertuTypeClassHold *class, void *data);
+    void *class_data;
+    void (*instance_init)(VeertuType *type);
+} VeertuTypeInfo;
+
+#define VeertuTypeHold(___type) ((VeertuType *)(___type))
+#define VeertuTypeClassHold(__type) ((VeertuTypeClassHold *)(__type))
+
+char *get_typename(VeertuType *type);
+struct VeertuTypeClass *register_type_internal(const VeertuTypeInfo *type);
+
+#endif
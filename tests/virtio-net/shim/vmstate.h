@@ -0,0 +1,50 @@
+/*
+ * Stand-in for include/vmstate.h, see tests/virtio-net/CMakeLists.txt.
+ * Migration is not exercised; the descriptions only have to compile.
+ */
+
+#ifndef QEMU_VMSTATE_H
+#define QEMU_VMSTATE_H
+
+typedef struct VMStateDescription VMStateDescription;
+
+typedef struct VMStateField {
+    const char *name;
+    const VMStateDescription *vmsd;
+} VMStateField;
+
+typedef struct VMStateSubsection {
+    const VMStateDescription *vmsd;
+    bool (*needed)(void *opaque);
+} VMStateSubsection;
+
+struct VMStateDescription {
+    const char *name;
+    int version_id;
+    int minimum_version_id;
+    void (*pre_save)(void *opaque);
+    int (*post_load)(void *opaque, int version_id);
+    VMStateField *fields;
+    const VMStateSubsection *subsections;
+};
+
+#define VMSTATE_FIELD(_field)   { .name = #_field }
+
+#define VMSTATE_BOOL(_f, _s)                    VMSTATE_FIELD(_f)
+#define VMSTATE_INT8(_f, _s)                    VMSTATE_FIELD(_f)
+#define VMSTATE_UINT8(_f, _s)                   VMSTATE_FIELD(_f)
+#define VMSTATE_UINT16(_f, _s)                  VMSTATE_FIELD(_f)
+#define VMSTATE_UINT32(_f, _s)                  VMSTATE_FIELD(_f)
+#define VMSTATE_UINT64(_f, _s)                  VMSTATE_FIELD(_f)
+#define VMSTATE_UINT16_ARRAY(_f, _s, _n)        VMSTATE_FIELD(_f)
+#define VMSTATE_UINT32_SUB_ARRAY(_f, _s, _start, _num) VMSTATE_FIELD(_f)
+#define VMSTATE_BUFFER(_f, _s)                  VMSTATE_FIELD(_f)
+#define VMSTATE_UNUSED(_size)                   { .name = "unused" }
+#define VMSTATE_UNUSED_TEST(_test, _size)       { .name = "unused" }
+#define VMSTATE_STRUCT(_f, _s, _v, _vmsd, _t) \
+    { .name = #_f, .vmsd = &(_vmsd) }
+#define VMSTATE_STRUCT_VARRAY_POINTER_INT32(_f, _s, _n, _vmsd, _t) \
+    { .name = #_f, .vmsd = &(_vmsd) }
+#define VMSTATE_END_OF_LIST()                   { .name = NULL }
+
+#endif
@@ -0,0 +1,1229 @@
+/*
+ * Device side tests for the virtqueues and virtio-net.
+ *
+ * usage: test_virtio_net [TEST...]
+ *
+ * Each test creates a virtio-net-pci device on the fake bus and plays
+ * its driver: it finds the transport through the PCI capabilities,
+ * negotiates features, lays out descriptor, avail and used rings in fake
+ * guest memory and kicks queues through the notify region, then checks
+ * the used rings, the interrupt state and what reached the backend.
+ */
+
+#include "fake_pci.h"
+#include "fake_net.h"
+#include "virtio.h"
+#include "net/tap.h"
+
+void virtio_net_register_types(void);
+
+/* What a driver knows from the virtio 1.0 spec */
+#define VIRTIO_NET_F_CSUM               0
+#define VIRTIO_NET_F_GUEST_CSUM         1
+#define VIRTIO_NET_F_MAC                5
+#define VIRTIO_NET_F_GUEST_TSO4         7
+#define VIRTIO_NET_F_HOST_TSO4          11
+#define VIRTIO_NET_F_MRG_RXBUF          15
+#define VIRTIO_NET_F_STATUS             16
+#define VIRTIO_NET_F_CTRL_VQ            17
+#define VIRTIO_NET_F_MQ                 22
+
+#define VIRTIO_NET_OK                   0
+#define VIRTIO_NET_ERR                  1
+#define VIRTIO_NET_CTRL_MQ              4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+
+#define VIRTIO_PCI_CAP_COMMON_CFG       1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG       2
+#define VIRTIO_PCI_CAP_ISR_CFG          3
+#define VIRTIO_PCI_CAP_DEVICE_CFG       4
+#define VIRTIO_PCI_CAP_PCI_CFG          5
+
+#define COMMON_DFSELECT                 0x00
+#define COMMON_DF                       0x04
+#define COMMON_GFSELECT                 0x08
+#define COMMON_GF                       0x0c
+#define COMMON_NUMQ                     0x12
+#define COMMON_STATUS                   0x14
+#define COMMON_Q_SELECT                 0x16
+#define COMMON_Q_SIZE                   0x18
+#define COMMON_Q_ENABLE                 0x1c
+#define COMMON_Q_DESCLO                 0x20
+#define COMMON_Q_DESCHI                 0x24
+#define COMMON_Q_AVAILLO                0x28
+#define COMMON_Q_AVAILHI                0x2c
+#define COMMON_Q_USEDLO                 0x30
+#define COMMON_Q_USEDHI                 0x34
+
+#define NET_HDR_LEN     sizeof(struct virtio_net_hdr_mrg_rxbuf)
+#define QUEUE_SIZE      64
+#define MAX_VQS         (FAKE_NET_MAX_QUEUES * 2 + 1)
+
+/* Guest side view of a split virtqueue, all addresses guest physical */
+typedef struct GuestQueue {
+    uint16_t num;
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+    uint16_t next_desc;
+    uint16_t avail_idx;
+    uint16_t last_used;
+} GuestQueue;
+
+typedef struct GuestBuf {
+    uint64_t addr;
+    uint32_t len;
+    bool write;
+} GuestBuf;
+
+typedef struct Guest {
+    PCIDevice *dev;
+    int bar;
+    uint32_t common;
+    uint32_t isr;
+    uint32_t device;
+    uint32_t notify;
+    uint32_t notify_mult;
+    uint8_t pci_cfg;
+    uint64_t features;
+    int nvqs;
+    GuestQueue vqs[MAX_VQS];
+    uint64_t brk;
+} Guest;
+
+static const char *cur_test;
+static bool cur_failed;
+static Guest guest;
+
+static void fail(int line, const char *fmt, ...)
+{
+    va_list ap;
+
+    printf("FAIL %s:%d %s: ", __FILE__, line, cur_test);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+    cur_failed = true;
+}
+
+#define CHECK(cond) \
+    do { if (!(cond)) fail(__LINE__, "%s", #cond); } while (0)
+#define CHECK_EQ(a, b) \
+    do { \
+        uint64_t a_ = (a), b_ = (b); \
+        if (a_ != b_) \
+            fail(__LINE__, "%s = 0x%" PRIx64 ", expected 0x%" PRIx64, \
+                 #a, a_, b_); \
+    } while (0)
+
+/* Guest memory */
+
+static void *gptr(uint64_t addr)
+{
+    return fake_guest_mem + addr;
+}
+
+static uint64_t galloc(Guest *g, size_t len, size_t align)
+{
+    uint64_t addr = (g->brk + align - 1) & ~(uint64_t)(align - 1);
+
+    assert(addr + len <= FAKE_GUEST_MEM_SIZE);
+    g->brk = addr + len;
+    return addr;
+}
+
+static uint16_t gread16(uint64_t addr)
+{
+    return lduw_le_p(gptr(addr));
+}
+
+static uint32_t gread32(uint64_t addr)
+{
+    return ldl_le_p(gptr(addr));
+}
+
+static void gwrite16(uint64_t addr, uint16_t val)
+{
+    stw_le_p(gptr(addr), val);
+}
+
+/* Transport */
+
+static uint64_t common_read(Guest *g, hwaddr off, unsigned size)
+{
+    return fake_bar_read(g->dev, g->bar, g->common + off, size);
+}
+
+static void common_write(Guest *g, hwaddr off, uint64_t val, unsigned size)
+{
+    fake_bar_write(g->dev, g->bar, g->common + off, val, size);
+}
+
+static uint8_t isr_read(Guest *g)
+{
+    return fake_bar_read(g->dev, g->bar, g->isr, 1);
+}
+
+static uint8_t status_read(Guest *g)
+{
+    return common_read(g, COMMON_STATUS, 1);
+}
+
+static void status_write(Guest *g, uint8_t status)
+{
+    common_write(g, COMMON_STATUS, status, 1);
+}
+
+static void kick(Guest *g, int n)
+{
+    fake_bar_write(g->dev, g->bar, g->notify + n * g->notify_mult, n, 2);
+}
+
+/* Locate the structures through the vendor capabilities */
+static bool guest_probe(Guest *g)
+{
+    PCIDevice *dev = g->dev;
+    int found = 0;
+    uint8_t pos;
+
+    if (!(fake_config_read(dev, PCI_STATUS, 2) & PCI_STATUS_CAP_LIST)) {
+        return false;
+    }
+    for (pos = fake_config_read(dev, PCI_CAPABILITY_LIST, 1); pos;
+         pos = fake_config_read(dev, pos + PCI_CAP_LIST_NEXT, 1)) {
+        uint8_t type = fake_config_read(dev, pos + 3, 1);
+        uint32_t offset = fake_config_read(dev, pos + 8, 4);
+
+        if (fake_config_read(dev, pos + PCI_CAP_LIST_ID, 1) != PCI_CAP_ID_VNDR) {
+            continue;
+        }
+        if (type != VIRTIO_PCI_CAP_PCI_CFG) {
+            g->bar = fake_config_read(dev, pos + 4, 1);
+        }
+        switch (type) {
+        case VIRTIO_PCI_CAP_COMMON_CFG:
+            g->common = offset;
+            break;
+        case VIRTIO_PCI_CAP_NOTIFY_CFG:
+            g->notify = offset;
+            g->notify_mult = fake_config_read(dev, pos + 16, 4);
+            break;
+        case VIRTIO_PCI_CAP_ISR_CFG:
+            g->isr = offset;
+            break;
+        case VIRTIO_PCI_CAP_DEVICE_CFG:
+            g->device = offset;
+            break;
+        case VIRTIO_PCI_CAP_PCI_CFG:
+            g->pci_cfg = pos;
+            break;
+        default:
+            continue;
+        }
+        found |= 1 << type;
+    }
+    return found == 0x3e;
+}
+
+static void guest_queue_setup(Guest *g, int n, uint16_t num)
+{
+    GuestQueue *q = &g->vqs[n];
+
+    memset(q, 0, sizeof(*q));
+    common_write(g, COMMON_Q_SELECT, n, 2);
+    common_write(g, COMMON_Q_SIZE, num, 2);
+    q->num = common_read(g, COMMON_Q_SIZE, 2);
+    q->desc = galloc(g, 16 * q->num, 4096);
+    q->avail = galloc(g, 6 + 2 * q->num, 4096);
+    q->used = galloc(g, 6 + 8 * q->num, 4096);
+
+    common_write(g, COMMON_Q_DESCLO, (uint32_t)q->desc, 4);
+    common_write(g, COMMON_Q_DESCHI, q->desc >> 32, 4);
+    common_write(g, COMMON_Q_AVAILLO, (uint32_t)q->avail, 4);
+    common_write(g, COMMON_Q_AVAILHI, q->avail >> 32, 4);
+    common_write(g, COMMON_Q_USEDLO, (uint32_t)q->used, 4);
+    common_write(g, COMMON_Q_USEDHI, q->used >> 32, 4);
+    common_write(g, COMMON_Q_ENABLE, 1, 2);
+}
+
+/* Reset, negotiate what both sides have of features and bring it up */
+static bool guest_init(Guest *g, uint64_t features)
+{
+    uint64_t host;
+    int i;
+
+    status_write(g, 0);
+    status_write(g, VIRTIO_CONFIG_S_ACKNOWLEDGE);
+    status_write(g, VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER);
+
+    common_write(g, COMMON_DFSELECT, 0, 4);
+    host = common_read(g, COMMON_DF, 4);
+    common_write(g, COMMON_DFSELECT, 1, 4);
+    host |= common_read(g, COMMON_DF, 4) << 32;
+
+    g->features = host & (features | (1ULL << VIRTIO_F_VERSION_1));
+    common_write(g, COMMON_GFSELECT, 0, 4);
+    common_write(g, COMMON_GF, (uint32_t)g->features, 4);
+    common_write(g, COMMON_GFSELECT, 1, 4);
+    common_write(g, COMMON_GF, g->features >> 32, 4);
+    status_write(g, status_read(g) | VIRTIO_CONFIG_S_FEATURES_OK);
+    if (!(status_read(g) & VIRTIO_CONFIG_S_FEATURES_OK)) {
+        return false;
+    }
+
+    g->brk = 0x10000;
+    g->nvqs = common_read(g, COMMON_NUMQ, 2);
+    assert(g->nvqs <= MAX_VQS);
+    for (i = 0; i < g->nvqs; i++) {
+        guest_queue_setup(g, i, QUEUE_SIZE);
+    }
+    status_write(g, status_read(g) | VIRTIO_CONFIG_S_DRIVER_OK);
+    return true;
+}
+
+static bool guest_has(Guest *g, int fbit)
+{
+    return virtio_has_feature(g->features, fbit);
+}
+
+/* Rings */
+
+static void avail_set_flags(GuestQueue *q, uint16_t flags)
+{
+    gwrite16(q->avail, flags);
+}
+
+static void avail_set_used_event(GuestQueue *q, uint16_t val)
+{
+    gwrite16(q->avail + 4 + 2 * q->num, val);
+}
+
+static uint16_t used_idx(GuestQueue *q)
+{
+    return gread16(q->used + 2);
+}
+
+static uint16_t used_flags(GuestQueue *q)
+{
+    return gread16(q->used);
+}
+
+static uint16_t used_avail_event(GuestQueue *q)
+{
+    return gread16(q->used + 4 + 8 * q->num);
+}
+
+static void write_desc(uint64_t table, uint16_t i, uint64_t addr, uint32_t len,
+                       uint16_t flags, uint16_t next)
+{
+    uint8_t *d = gptr(table + 16 * i);
+
+    stl_le_p(d, (uint32_t)addr);
+    stl_le_p(d + 4, addr >> 32);
+    stl_le_p(d + 8, len);
+    stw_le_p(d + 12, flags);
+    stw_le_p(d + 14, next);
+}
+
+static uint16_t alloc_desc(GuestQueue *q)
+{
+    uint16_t i = q->next_desc;
+
+    q->next_desc = (q->next_desc + 1) % q->num;
+    return i;
+}
+
+/* Link bufs into a chain in the queue's table and make it available */
+static uint16_t guest_add(GuestQueue *q, const GuestBuf *bufs, int n)
+{
+    uint16_t head = alloc_desc(q), i = head, next;
+    int j;
+
+    for (j = 0; j < n; j++, i = next) {
+        uint16_t flags = bufs[j].write ? VRING_DESC_F_WRITE : 0;
+
+        next = j + 1 < n ? alloc_desc(q) : 0;
+        if (j + 1 < n) {
+            flags |= VRING_DESC_F_NEXT;
+        }
+        write_desc(q->desc, i, bufs[j].addr, bufs[j].len, flags, next);
+    }
+
+    gwrite16(q->avail + 4 + 2 * (q->avail_idx % q->num), head);
+    q->avail_idx++;
+    gwrite16(q->avail + 2, q->avail_idx);
+    return head;
+}
+
+/* Same with the chain in an indirect table */
+static uint16_t guest_add_indirect(Guest *g, GuestQueue *q,
+                                   const GuestBuf *bufs, int n,
+                                   uint16_t extra_flags)
+{
+    uint64_t table = galloc(g, 16 * n, 16);
+    uint16_t head = alloc_desc(q);
+    int j;
+
+    for (j = 0; j < n; j++) {
+        uint16_t flags = bufs[j].write ? VRING_DESC_F_WRITE : 0;
+
+        if (j + 1 < n) {
+            flags |= VRING_DESC_F_NEXT;
+        }
+        if (j == n - 1) {
+            flags |= extra_flags;
+        }
+        write_desc(table, j, bufs[j].addr, bufs[j].len, flags, j + 1);
+    }
+    write_desc(q->desc, head, table, 16 * n, VRING_DESC_F_INDIRECT, 0);
+
+    gwrite16(q->avail + 4 + 2 * (q->avail_idx % q->num), head);
+    q->avail_idx++;
+    gwrite16(q->avail + 2, q->avail_idx);
+    return head;
+}
+
+static bool guest_get_used(GuestQueue *q, uint32_t *id, uint32_t *len)
+{
+    uint64_t elem;
+
+    *id = *len = 0;
+    if (q->last_used == used_idx(q)) {
+        return false;
+    }
+    elem = q->used + 4 + 8 * (q->last_used % q->num);
+    *id = gread32(elem);
+    *len = gread32(elem + 4);
+    q->last_used++;
+    return true;
+}
+
+/* The driver side of VIRTIO_RING_F_EVENT_IDX */
+static bool need_event(uint16_t event, uint16_t new, uint16_t old)
+{
+    return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+}
+
+/* Frames */
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *p, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += (p[i] << 8) | p[i + 1];
+    }
+    if (len & 1) {
+        sum += p[len - 1] << 8;
+    }
+    return sum;
+}
+
+/* Sum over the TCP pseudo header of an IPv4 frame */
+static uint32_t tcp4_pseudo(const uint8_t *ip, uint16_t tcp_len)
+{
+    return csum_add(0, ip + 12, 8) + 6 + tcp_len;
+}
+
+#define ETH_HLEN        14
+#define IP4_HLEN        20
+#define TCP_HLEN        20
+#define TCP4_HDRS       (ETH_HLEN + IP4_HLEN + TCP_HLEN)
+
+/* Ethernet, IPv4 and TCP headers with a patterned payload */
+static size_t build_tcp4(uint8_t *buf, size_t payload, uint8_t tcp_flags)
+{
+    uint8_t *ip = buf + ETH_HLEN, *tcp = ip + IP4_HLEN;
+    size_t i;
+
+    memset(buf, 0, TCP4_HDRS);
+    memcpy(buf, "\x52\x54\x00\x12\x34\x56\x52\x54\x00\xab\xcd\xef", 12);
+    stw_be_p(buf + 12, 0x0800);
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, IP4_HLEN + TCP_HLEN + payload);
+    stw_be_p(ip + 4, 0x1000);
+    ip[8] = 64;
+    ip[9] = 6;
+    memcpy(ip + 12, "\x0a\x00\x00\x01\x0a\x00\x00\x02", 8);
+    stw_be_p(ip + 10, ~csum_fold(csum_add(0, ip, IP4_HLEN)));
+
+    stw_be_p(tcp, 40000);
+    stw_be_p(tcp + 2, 80);
+    stl_be_p(tcp + 4, 0x01020304);
+    tcp[12] = (TCP_HLEN / 4) << 4;
+    tcp[13] = tcp_flags;
+    stw_be_p(tcp + 14, 65535);
+
+    for (i = 0; i < payload; i++) {
+        buf[TCP4_HDRS + i] = i * 7 + 3;
+    }
+    return TCP4_HDRS + payload;
+}
+
+static bool tcp4_csum_ok(const uint8_t *frame, size_t len)
+{
+    const uint8_t *ip = frame + ETH_HLEN;
+    uint16_t tcp_len = len - ETH_HLEN - IP4_HLEN;
+
+    return csum_fold(csum_add(0, ip, IP4_HLEN)) == 0xffff &&
+           csum_fold(csum_add(tcp4_pseudo(ip, tcp_len), ip + IP4_HLEN,
+                              tcp_len)) == 0xffff;
+}
+
+/* Queue a frame for transmission on pair qp, header in its own buffer */
+static uint16_t guest_tx(Guest *g, int qp, const struct virtio_net_hdr *hdr,
+                         const uint8_t *frame, size_t len)
+{
+    GuestBuf bufs[2];
+    struct virtio_net_hdr_mrg_rxbuf mhdr = { };
+
+    if (hdr) {
+        mhdr.hdr = *hdr;
+    }
+    bufs[0].addr = galloc(g, NET_HDR_LEN, 16);
+    bufs[0].len = NET_HDR_LEN;
+    bufs[0].write = false;
+    memcpy(gptr(bufs[0].addr), &mhdr, NET_HDR_LEN);
+    bufs[1].addr = galloc(g, len, 16);
+    bufs[1].len = len;
+    bufs[1].write = false;
+    memcpy(gptr(bufs[1].addr), frame, len);
+    return guest_add(&g->vqs[qp * 2 + 1], bufs, 2);
+}
+
+/* Post n receive buffers of size bytes each, returns the first head */
+static uint16_t guest_rx_post(Guest *g, int qp, int n, uint32_t size,
+                              uint64_t *addrs)
+{
+    uint16_t first = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        GuestBuf buf = {
+            .addr = galloc(g, size, 16),
+            .len = size,
+            .write = true,
+        };
+        uint16_t head = guest_add(&g->vqs[qp * 2], &buf, 1);
+
+        memset(gptr(buf.addr), 0xee, size);
+        if (addrs) {
+            addrs[i] = buf.addr;
+        }
+        if (!i) {
+            first = head;
+        }
+    }
+    return first;
+}
+
+/* Send a control command, returns the ack or -1 if none came back */
+static int guest_ctrl(Guest *g, int vq, uint8_t class, uint8_t cmd,
+                      const void *data, size_t len)
+{
+    GuestQueue *q = &g->vqs[vq];
+    GuestBuf bufs[3];
+    uint32_t id, used_len;
+    uint16_t head;
+    int n = 0;
+
+    bufs[n].addr = galloc(g, 2, 16);
+    bufs[n].len = 2;
+    bufs[n].write = false;
+    *(uint8_t *)gptr(bufs[n].addr) = class;
+    *((uint8_t *)gptr(bufs[n].addr) + 1) = cmd;
+    n++;
+    if (len) {
+        bufs[n].addr = galloc(g, len, 16);
+        bufs[n].len = len;
+        bufs[n].write = false;
+        memcpy(gptr(bufs[n].addr), data, len);
+        n++;
+    }
+    bufs[n].addr = galloc(g, 1, 16);
+    bufs[n].len = 1;
+    bufs[n].write = true;
+    *(uint8_t *)gptr(bufs[n].addr) = 0xff;
+    n++;
+
+    head = guest_add(q, bufs, n);
+    kick(g, vq);
+    if (!guest_get_used(q, &id, &used_len) || id != head || used_len != 1) {
+        return -1;
+    }
+    return *(uint8_t *)gptr(bufs[n - 1].addr);
+}
+
+/* Setup */
+
+static bool guest_start(int queues, uint64_t features)
+{
+    Guest *g = &guest;
+
+    memset(g, 0, sizeof(*g));
+    fake_pci_init();
+    fake_net_init(queues);
+
+    g->dev = fake_pci_create("virtio-net-pci");
+    if (!g->dev) {
+        fail(__LINE__, "cannot create virtio-net-pci");
+        return false;
+    }
+    if (!guest_probe(g)) {
+        fail(__LINE__, "virtio capabilities missing");
+        return false;
+    }
+    if (!guest_init(g, features)) {
+        fail(__LINE__, "features 0x%" PRIx64 " not accepted", features);
+        return false;
+    }
+    return true;
+}
+
+static void guest_stop(void)
+{
+    Guest *g = &guest;
+
+    if (g->dev) {
+        /* A reset must hand back every mapping the device holds */
+        status_write(g, 0);
+        CHECK_EQ(fake_dma_mapped, 0);
+        CHECK_EQ(g->dev->irq_state, 0);
+        fake_pci_destroy(g->dev);
+    }
+    fake_net_cleanup();
+}
+
+/* Tests */
+
+static void test_probe(void)
+{
+    Guest *g = &guest;
+    uint8_t mac[6];
+    int i;
+
+    if (!guest_start(1, 1ULL << VIRTIO_NET_F_MAC | 1ULL << VIRTIO_NET_F_STATUS)) {
+        return;
+    }
+    CHECK_EQ(fake_config_read(g->dev, PCI_VENDOR_ID, 2), 0x1af4);
+    CHECK_EQ(fake_config_read(g->dev, PCI_DEVICE_ID, 2), 0x1041);
+    CHECK_EQ(fake_config_read(g->dev, PCI_SUBSYSTEM_ID, 2), 0x41);
+    CHECK_EQ(g->notify_mult, 4);
+    /* rx, tx and the control queue */
+    CHECK_EQ(g->nvqs, 3);
+    CHECK(guest_has(g, VIRTIO_F_VERSION_1));
+
+    for (i = 0; i < 6; i++) {
+        mac[i] = fake_bar_read(g->dev, g->bar, g->device + i, 1);
+    }
+    CHECK(!memcmp(mac, "\x52\x54\x00\x12\x34\x56", 6));
+    CHECK_EQ(fake_bar_read(g->dev, g->bar, g->device + 6, 2), 1);
+    CHECK_EQ(fake_bar_read(g->dev, g->bar, g->device + 8, 2), 1);
+
+    /* The same status through the VIRTIO_PCI_CAP_PCI_CFG window */
+    fake_config_write(g->dev, g->pci_cfg + 4, g->bar, 1);
+    fake_config_write(g->dev, g->pci_cfg + 8, g->common + COMMON_STATUS, 4);
+    fake_config_write(g->dev, g->pci_cfg + 12, 1, 4);
+    CHECK_EQ(fake_config_read(g->dev, g->pci_cfg + 16, 1), status_read(g));
+}
+
+static void test_features_ok(void)
+{
+    Guest *g = &guest;
+
+    if (!guest_start(1, 0)) {
+        return;
+    }
+    /* Without VERSION_1 FEATURES_OK does not stick */
+    status_write(g, 0);
+    status_write(g, VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER);
+    common_write(g, COMMON_GFSELECT, 1, 4);
+    common_write(g, COMMON_GF, 0, 4);
+    status_write(g, status_read(g) | VIRTIO_CONFIG_S_FEATURES_OK);
+    CHECK(!(status_read(g) & VIRTIO_CONFIG_S_FEATURES_OK));
+}
+
+static void test_tx(void)
+{
+    Guest *g = &guest;
+    GuestQueue *tx = &g->vqs[1];
+    uint8_t frame[128];
+    uint32_t id, len;
+    size_t flen;
+    uint16_t head;
+
+    if (!guest_start(1, 0)) {
+        return;
+    }
+    flen = build_tcp4(frame, 60, 0x18);
+    head = guest_tx(g, 0, NULL, frame, flen);
+    kick(g, 1);
+
+    /* Transmission happens from a bottom half, kicks are off until then */
+    CHECK_EQ(fake_net_nsent, 0);
+    CHECK(used_flags(tx) & VRING_USED_F_NO_NOTIFY);
+    CHECK(fake_bh_poll() > 0);
+    CHECK(!(used_flags(tx) & VRING_USED_F_NO_NOTIFY));
+
+    CHECK_EQ(fake_net_nsent, 1);
+    if (fake_net_nsent == 1) {
+        CHECK_EQ(fake_net_sent[0].len, flen);
+        CHECK(!memcmp(fake_net_sent[0].data, frame, flen));
+    }
+    CHECK(guest_get_used(tx, &id, &len));
+    CHECK_EQ(id, head);
+    CHECK_EQ(len, 0);
+
+    CHECK_EQ(g->dev->irq_state, 1);
+    CHECK_EQ(isr_read(g), VIRTIO_ISR_QUEUE);
+    CHECK_EQ(g->dev->irq_state, 0);
+}
+
+static void test_tx_csum(void)
+{
+    Guest *g = &guest;
+    struct virtio_net_hdr hdr = { };
+    uint8_t frame[256];
+    uint8_t *ip = frame + ETH_HLEN;
+    size_t flen;
+
+    if (!guest_start(1, 1ULL << VIRTIO_NET_F_CSUM)) {
+        return;
+    }
+    CHECK(guest_has(g, VIRTIO_NET_F_CSUM));
+
+    /* The guest leaves the pseudo header sum in the checksum field */
+    flen = build_tcp4(frame, 101, 0x18);
+    stw_be_p(ip + IP4_HLEN + 16,
+             csum_fold(tcp4_pseudo(ip, flen - ETH_HLEN - IP4_HLEN)));
+    hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr.csum_start = ETH_HLEN + IP4_HLEN;
+    hdr.csum_offset = 16;
+
+    guest_tx(g, 0, &hdr, frame, flen);
+    kick(g, 1);
+    fake_bh_poll();
+
+    CHECK_EQ(fake_net_nsent, 1);
+    if (fake_net_nsent == 1) {
+        CHECK_EQ(fake_net_sent[0].len, flen);
+        CHECK(tcp4_csum_ok(fake_net_sent[0].data, fake_net_sent[0].len));
+        CHECK(!memcmp(fake_net_sent[0].data + TCP4_HDRS, frame + TCP4_HDRS,
+                      flen - TCP4_HDRS));
+    }
+}
+
+static void test_tx_tso(void)
+{
+    Guest *g = &guest;
+    struct virtio_net_hdr hdr = { };
+    uint8_t frame[1024];
+    size_t flen, payload = 250, mss = 100, off;
+    int i;
+
+    if (!guest_start(1, 1ULL << VIRTIO_NET_F_CSUM |
+                        1ULL << VIRTIO_NET_F_HOST_TSO4)) {
+        return;
+    }
+    flen = build_tcp4(frame, payload, 0x19);    /* FIN PSH ACK */
+    hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+    hdr.hdr_len = TCP4_HDRS;
+    hdr.gso_size = mss;
+    hdr.csum_start = ETH_HLEN + IP4_HLEN;
+    hdr.csum_offset = 16;
+
+    guest_tx(g, 0, &hdr, frame, flen);
+    kick(g, 1);
+    fake_bh_poll();
+
+    CHECK_EQ(fake_net_nsent, 3);
+    for (i = 0, off = 0; i < fake_net_nsent && i < 3; i++, off += mss) {
+        const uint8_t *seg = fake_net_sent[i].data;
+        const uint8_t *ip = seg + ETH_HLEN, *tcp = ip + IP4_HLEN;
+        size_t plen = MIN(mss, payload - off);
+        bool last = i == 2;
+
+        CHECK_EQ(fake_net_sent[i].len, TCP4_HDRS + plen);
+        CHECK_EQ(lduw_be_p(ip + 2), IP4_HLEN + TCP_HLEN + plen);
+        CHECK_EQ(lduw_be_p(ip + 4), 0x1000 + i);
+        CHECK_EQ(ldl_be_p(tcp + 4), 0x01020304 + off);
+        CHECK_EQ(tcp[13], last ? 0x19 : 0x10);
+        CHECK(tcp4_csum_ok(seg, fake_net_sent[i].len));
+        CHECK(!memcmp(seg + TCP4_HDRS, frame + TCP4_HDRS + off, plen));
+    }
+}
+
+static void test_tx_async(void)
+{
+    Guest *g = &guest;
+    GuestQueue *tx = &g->vqs[1];
+    uint8_t frame[128];
+    uint32_t id, len;
+    uint16_t head[3];
+    size_t flen;
+
+    fake_net_async = true;
+    if (!guest_start(1, 0)) {
+        return;
+    }
+    flen = build_tcp4(frame, 40, 0x10);
+    head[0] = guest_tx(g, 0, NULL, frame, flen);
+    head[1] = guest_tx(g, 0, NULL, frame, flen);
+    kick(g, 1);
+    fake_bh_poll();
+
+    /* The backend holds the first frame, the second waits for it */
+    CHECK_EQ(fake_net_nsent, 1);
+    CHECK_EQ(used_idx(tx), 0);
+
+    CHECK(fake_net_complete(0));
+    CHECK_EQ(fake_net_nsent, 2);
+    CHECK(guest_get_used(tx, &id, &len));
+    CHECK_EQ(id, head[0]);
+    CHECK(fake_net_complete(0));
+    CHECK(guest_get_used(tx, &id, &len));
+    CHECK_EQ(id, head[1]);
+    CHECK(!fake_net_complete(0));
+
+    /* A reset with a frame in the backend takes the buffers back */
+    head[2] = guest_tx(g, 0, NULL, frame, flen);
+    kick(g, 1);
+    fake_bh_poll();
+    CHECK_EQ(fake_net_nsent, 3);
+    CHECK(!guest_get_used(tx, &id, &len));
+}
+
+static void test_tx_indirect(void)
+{
+    Guest *g = &guest;
+    GuestQueue *tx = &g->vqs[1];
+    struct virtio_net_hdr_mrg_rxbuf mhdr = { };
+    uint8_t frame[128];
+    GuestBuf bufs[2];
+    uint32_t id, len;
+    uint16_t head;
+    size_t flen;
+
+    if (!guest_start(1, 1ULL << VIRTIO_RING_F_INDIRECT_DESC)) {
+        return;
+    }
+    CHECK(guest_has(g, VIRTIO_RING_F_INDIRECT_DESC));
+
+    flen = build_tcp4(frame, 30, 0x10);
+    bufs[0].addr = galloc(g, NET_HDR_LEN, 16);
+    bufs[0].len = NET_HDR_LEN;
+    bufs[0].write = false;
+    memcpy(gptr(bufs[0].addr), &mhdr, NET_HDR_LEN);
+    bufs[1].addr = galloc(g, flen, 16);
+    bufs[1].len = flen;
+    bufs[1].write = false;
+    memcpy(gptr(bufs[1].addr), frame, flen);
+
+    head = guest_add_indirect(g, tx, bufs, 2, 0);
+    kick(g, 1);
+    fake_bh_poll();
+
+    CHECK_EQ(fake_net_nsent, 1);
+    CHECK(guest_get_used(tx, &id, &len));
+    CHECK_EQ(id, head);
+    CHECK(!(status_read(g) & VIRTIO_CONFIG_S_NEEDS_RESET));
+
+    /* An indirect descriptor inside an indirect table is a driver bug */
+    guest_add_indirect(g, tx, bufs, 2, VRING_DESC_F_INDIRECT);
+    kick(g, 1);
+    fake_bh_poll();
+
+    CHECK_EQ(fake_net_nsent, 1);
+    CHECK(!guest_get_used(tx, &id, &len));
+    CHECK(status_read(g) & VIRTIO_CONFIG_S_NEEDS_RESET);
+    CHECK(isr_read(g) & VIRTIO_ISR_CONFIG);
+}
+
+static void test_rx(void)
+{
+    Guest *g = &guest;
+    GuestQueue *rx = &g->vqs[0];
+    struct virtio_net_hdr_mrg_rxbuf mhdr;
+    uint8_t frame[1514];
+    GuestBuf bufs[2];
+    uint32_t id, len;
+    uint16_t head;
+    size_t flen;
+
+    if (!guest_start(1, 0)) {
+        return;
+    }
+    CHECK(!guest_has(g, VIRTIO_NET_F_MRG_RXBUF));
+
+    /* One chain: header and a full sized frame buffer */
+    bufs[0].addr = galloc(g, NET_HDR_LEN, 16);
+    bufs[0].len = NET_HDR_LEN;
+    bufs[0].write = true;
+    bufs[1].addr = galloc(g, sizeof(frame), 16);
+    bufs[1].len = sizeof(frame);
+    bufs[1].write = true;
+    head = guest_add(rx, bufs, 2);
+
+    flen = build_tcp4(frame, 1000, 0x10);
+    CHECK_EQ(fake_net_receive(0, frame, flen), flen);
+    CHECK(guest_get_used(rx, &id, &len));
+    CHECK_EQ(id, head);
+    CHECK_EQ(len, NET_HDR_LEN + flen);
+    memcpy(&mhdr, gptr(bufs[0].addr), NET_HDR_LEN);
+    CHECK_EQ(mhdr.num_buffers, 1);
+    CHECK(!memcmp(gptr(bufs[1].addr), frame, flen));
+    CHECK_EQ(isr_read(g), VIRTIO_ISR_QUEUE);
+
+    /* Too big for any single buffer without MRG_RXBUF: dropped */
+    guest_rx_post(g, 0, 3, 64, NULL);
+    flen = build_tcp4(frame, 100, 0x10);
+    CHECK_EQ(fake_net_receive(0, frame, flen), flen);
+    CHECK(!guest_get_used(rx, &id, &len));
+    CHECK_EQ(fake_net_queued(0), 0);
+}
+
+static void test_rx_mergeable(void)
+{
+    Guest *g = &guest;
+    GuestQueue *rx = &g->vqs[0];
+    struct virtio_net_hdr_mrg_rxbuf mhdr;
+    uint8_t frame[256], got[256];
+    uint64_t addrs[4];
+    uint32_t id, len, total = 0;
+    uint16_t head;
+    size_t flen;
+    int i;
+
+    if (!guest_start(1, 1ULL << VIRTIO_NET_F_MRG_RXBUF)) {
+        return;
+    }
+    CHECK(guest_has(g, VIRTIO_NET_F_MRG_RXBUF));
+
+    head = guest_rx_post(g, 0, 4, 64, addrs);
+    flen = build_tcp4(frame, 96, 0x10);     /* 150 bytes */
+    CHECK_EQ(fake_net_receive(0, frame, flen), flen);
+
+    /* 12 + 52, 64, 34: three buffers, the fourth is left over */
+    for (i = 0; i < 3; i++) {
+        uint32_t want = MIN(64, NET_HDR_LEN + flen - 64 * i);
+
+        if (!guest_get_used(rx, &id, &len)) {
+            fail(__LINE__, "buffer %d not used", i);
+            break;
+        }
+        CHECK_EQ(id, head + i);
+        CHECK_EQ(len, want);
+        memcpy((uint8_t *)got + total, gptr(addrs[i]), len);
+        total += len;
+    }
+    CHECK(!guest_get_used(rx, &id, &len));
+    CHECK_EQ(total, NET_HDR_LEN + flen);
+    memcpy(&mhdr, got, NET_HDR_LEN);
+    CHECK_EQ(mhdr.num_buffers, 3);
+    CHECK(!memcmp(got + NET_HDR_LEN, frame, flen));
+    CHECK_EQ(g->dev->irq_state, 1);
+}
+
+static void test_rx_refill(void)
+{
+    Guest *g = &guest;
+    GuestQueue *rx = &g->vqs[0];
+    uint8_t frame[256];
+    uint64_t addrs[2];
+    uint32_t id, len;
+    size_t flen;
+
+    if (!guest_start(1, 1ULL << VIRTIO_NET_F_MRG_RXBUF)) {
+        return;
+    }
+    /* Nothing posted: the frame waits in the backend, kicks are on */
+    flen = build_tcp4(frame, 100, 0x10);
+    CHECK_EQ(fake_net_receive(0, frame, flen), 0);
+    CHECK_EQ(fake_net_queued(0), 1);
+    CHECK(!(used_flags(rx) & VRING_USED_F_NO_NOTIFY));
+
+    /* Half the frame fits: nothing is consumed until the rest arrives */
+    guest_rx_post(g, 0, 1, 100, addrs);
+    kick(g, 0);
+    CHECK_EQ(fake_net_queued(0), 1);
+    CHECK_EQ(used_idx(rx), 0);
+
+    guest_rx_post(g, 0, 1, 100, addrs + 1);
+    kick(g, 0);
+    CHECK_EQ(fake_net_queued(0), 0);
+    CHECK(guest_get_used(rx, &id, &len));
+    CHECK_EQ(len, 100);
+    CHECK(guest_get_used(rx, &id, &len));
+    CHECK_EQ(len, NET_HDR_LEN + flen - 100);
+    CHECK(!memcmp((uint8_t *)gptr(addrs[0]) + NET_HDR_LEN, frame,
+                  100 - NET_HDR_LEN));
+}
+
+static void test_vnet_hdr(void)
+{
+    Guest *g = &guest;
+    GuestQueue *rx = &g->vqs[0];
+    struct virtio_net_hdr_mrg_rxbuf mhdr = { };
+    struct virtio_net_hdr hdr = { };
+    uint8_t frame[256], pkt[256 + NET_HDR_LEN];
+    uint64_t addr;
+    uint32_t id, len;
+    size_t flen;
+
+    fake_net_vnet_hdr = true;
+    if (!guest_start(1, 1ULL << VIRTIO_NET_F_GUEST_CSUM |
+                        1ULL << VIRTIO_NET_F_GUEST_TSO4)) {
+        return;
+    }
+    /* Offloads toward the guest are the backend's to do */
+    CHECK(guest_has(g, VIRTIO_NET_F_GUEST_TSO4));
+    CHECK_EQ(fake_net_offload_csum, 1);
+    CHECK_EQ(fake_net_offload_tso4, 1);
+
+    /* Transmit passes the header through */
+    flen = build_tcp4(frame, 50, 0x10);
+    hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr.csum_start = ETH_HLEN + IP4_HLEN;
+    hdr.csum_offset = 16;
+    guest_tx(g, 0, &hdr, frame, flen);
+    kick(g, 1);
+    fake_bh_poll();
+    CHECK_EQ(fake_net_nsent, 1);
+    if (fake_net_nsent == 1) {
+        CHECK_EQ(fake_net_sent[0].len, NET_HDR_LEN + flen);
+        CHECK(!memcmp(fake_net_sent[0].data, &hdr, sizeof(hdr)));
+        CHECK(!memcmp(fake_net_sent[0].data + NET_HDR_LEN, frame, flen));
+    }
+
+    /* Receive keeps the backend's header, num_buffers is filled in */
+    mhdr.hdr.flags = VIRTIO_NET_HDR_F_DATA_VALID;
+    memcpy(pkt, &mhdr, NET_HDR_LEN);
+    memcpy(pkt + NET_HDR_LEN, frame, flen);
+    guest_rx_post(g, 0, 1, 1024, &addr);
+    CHECK_EQ(fake_net_receive(0, pkt, NET_HDR_LEN + flen), NET_HDR_LEN + flen);
+    CHECK(guest_get_used(rx, &id, &len));
+    CHECK_EQ(len, NET_HDR_LEN + flen);
+    memcpy(&mhdr, gptr(addr), NET_HDR_LEN);
+    CHECK_EQ(mhdr.hdr.flags, VIRTIO_NET_HDR_F_DATA_VALID);
+    CHECK_EQ(mhdr.num_buffers, 1);
+    CHECK(!memcmp((uint8_t *)gptr(addr) + NET_HDR_LEN, frame, flen));
+}
+
+static void test_ctrl_mq(void)
+{
+    Guest *g = &guest;
+    uint16_t pairs;
+
+    if (!guest_start(2, 1ULL << VIRTIO_NET_F_CTRL_VQ |
+                        1ULL << VIRTIO_NET_F_MQ)) {
+        return;
+    }
+    /* Two pairs and the control queue after them */
+    CHECK_EQ(g->nvqs, 5);
+    CHECK(fake_net_tap_enabled[0]);
+    CHECK(!fake_net_tap_enabled[1]);
+
+    pairs = cpu_to_le16(2);
+    CHECK_EQ(guest_ctrl(g, 4, VIRTIO_NET_CTRL_MQ,
+                        VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, 2),
+             VIRTIO_NET_OK);
+    CHECK(fake_net_tap_enabled[1]);
+
+    pairs = cpu_to_le16(3);
+    CHECK_EQ(guest_ctrl(g, 4, VIRTIO_NET_CTRL_MQ,
+                        VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, 2),
+             VIRTIO_NET_ERR);
+    CHECK_EQ(guest_ctrl(g, 4, 0x7f, 0, NULL, 0), VIRTIO_NET_ERR);
+    CHECK(fake_net_tap_enabled[1]);
+
+    /* The second pair carries traffic now */
+    {
+        uint8_t frame[128];
+        size_t flen = build_tcp4(frame, 20, 0x10);
+
+        guest_tx(g, 1, NULL, frame, flen);
+        kick(g, 3);
+        fake_bh_poll();
+        CHECK_EQ(fake_net_nsent, 1);
+        CHECK_EQ(fake_net_sent[0].queue, 1);
+    }
+
+    /* A reset goes back to a single pair */
+    status_write(g, 0);
+    CHECK(!fake_net_tap_enabled[1]);
+}
+
+static void test_ctrl_no_mq(void)
+{
+    Guest *g = &guest;
+    uint16_t pairs = cpu_to_le16(1);
+
+    if (!guest_start(1, 1ULL << VIRTIO_NET_F_CTRL_VQ)) {
+        return;
+    }
+    CHECK(!guest_has(g, VIRTIO_NET_F_MQ));
+    CHECK_EQ(guest_ctrl(g, 2, VIRTIO_NET_CTRL_MQ,
+                        VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, 2),
+             VIRTIO_NET_ERR);
+}
+
+static void test_no_interrupt(void)
+{
+    Guest *g = &guest;
+    GuestQueue *tx = &g->vqs[1];
+    uint8_t frame[128];
+    size_t flen;
+
+    if (!guest_start(1, 0)) {
+        return;
+    }
+    flen = build_tcp4(frame, 20, 0x10);
+
+    avail_set_flags(tx, VRING_AVAIL_F_NO_INTERRUPT);
+    guest_tx(g, 0, NULL, frame, flen);
+    kick(g, 1);
+    fake_bh_poll();
+    CHECK_EQ(used_idx(tx), 1);
+    CHECK_EQ(g->dev->irq_state, 0);
+
+    avail_set_flags(tx, 0);
+    guest_tx(g, 0, NULL, frame, flen);
+    kick(g, 1);
+    fake_bh_poll();
+    CHECK_EQ(used_idx(tx), 2);
+    CHECK_EQ(g->dev->irq_state, 1);
+}
+
+static void test_event_idx(void)
+{
+    Guest *g = &guest;
+    GuestQueue *tx = &g->vqs[1], *rx = &g->vqs[0];
+    uint8_t frame[128];
+    uint16_t old;
+    size_t flen;
+    int i;
+
+    if (!guest_start(1, 1ULL << VIRTIO_RING_F_EVENT_IDX |
+                        1ULL << VIRTIO_NET_F_MRG_RXBUF)) {
+        return;
+    }
+    CHECK(guest_has(g, VIRTIO_RING_F_EVENT_IDX));
+    flen = build_tcp4(frame, 20, 0x10);
+
+    /* The first completion always interrupts */
+    guest_tx(g, 0, NULL, frame, flen);
+    kick(g, 1);
+    fake_bh_poll();
+    CHECK_EQ(isr_read(g), VIRTIO_ISR_QUEUE);
+    /* With kicks back on, avail_event asks for the next one */
+    CHECK_EQ(used_avail_event(tx), tx->avail_idx);
+
+    /* Interrupt only once used->idx passes 3 */
+    avail_set_used_event(tx, 3);
+    for (i = 2; i <= 4; i++) {
+        guest_tx(g, 0, NULL, frame, flen);
+        kick(g, 1);
+        fake_bh_poll();
+        CHECK_EQ(used_idx(tx), i);
+        if (i < 4) {
+            CHECK_EQ(g->dev->irq_state, 0);
+        } else {
+            CHECK_EQ(g->dev->irq_state, 1);
+        }
+    }
+    isr_read(g);
+
+    /* While the bottom half is pending the guest need not kick again */
+    guest_tx(g, 0, NULL, frame, flen);
+    kick(g, 1);
+    old = tx->avail_idx;
+    guest_tx(g, 0, NULL, frame, flen);
+    CHECK(!need_event(used_avail_event(tx), tx->avail_idx, old));
+    fake_bh_poll();
+    CHECK_EQ(used_idx(tx), 6);
+    CHECK_EQ(used_avail_event(tx), tx->avail_idx);
+
+    /* Receive out of buffers asks to be kicked on the next post */
+    CHECK_EQ(fake_net_receive(0, frame, flen), 0);
+    old = rx->avail_idx;
+    guest_rx_post(g, 0, 1, 256, NULL);
+    CHECK(need_event(used_avail_event(rx), rx->avail_idx, old));
+    kick(g, 0);
+    CHECK_EQ(fake_net_queued(0), 0);
+    CHECK_EQ(used_idx(rx), 1);
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} tests[] = {
+    { "probe", test_probe },
+    { "features_ok", test_features_ok },
+    { "tx", test_tx },
+    { "tx_csum", test_tx_csum },
+    { "tx_tso", test_tx_tso },
+    { "tx_async", test_tx_async },
+    { "tx_indirect", test_tx_indirect },
+    { "rx", test_rx },
+    { "rx_mergeable", test_rx_mergeable },
+    { "rx_refill", test_rx_refill },
+    { "vnet_hdr", test_vnet_hdr },
+    { "ctrl_mq", test_ctrl_mq },
+    { "ctrl_no_mq", test_ctrl_no_mq },
+    { "no_interrupt", test_no_interrupt },
+    { "event_idx", test_event_idx },
+};
+
+static bool selected(int argc, char **argv, const char *name)
+{
+    int i;
+
+    if (argc < 2) {
+        return true;
+    }
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    int i, run = 0, failed = 0;
+
+    virtio_net_register_types();
+
+    for (i = 0; i < ARRAY_SIZE(tests); i++) {
+        if (!selected(argc, argv, tests[i].name)) {
+            continue;
+        }
+        cur_test = tests[i].name;
+        cur_failed = false;
+        fake_net_vnet_hdr = false;
+        fake_net_async = false;
+
+        tests[i].fn();
+        guest_stop();
+
+        run++;
+        if (cur_failed) {
+            failed++;
+        }
+    }
+
+    printf("%d tests, %d failed\n", run, failed);
+    return failed ? 1 : 0;
+}
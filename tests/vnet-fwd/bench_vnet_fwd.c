@@ -0,0 +1,308 @@
+/*
+ * Throughput and idle CPU of the port forwarder in util/vnet_fwd.c
+ *
+ * A "guest" thread on 127.0.0.1 serves a discard port and a port that
+ * sends -s MB and closes, and a forwarding rule leads a host port to each.
+ * With 1, 100 and 1000 forwarded connections open, all but one of them
+ * idle, this measures the CPU the process uses while no data moves, then
+ * sends -s MB through a forward to the discard port (upload) and reads
+ * -s MB from the other one (download).  The first row makes the same
+ * transfers straight to the guest ports, for reference.
+ *
+ * bench_vnet_fwd [-s MB] [-i SECONDS]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "vnet_fwd.h"
+
+#define CHUNK       (256 << 10)
+#define MAX_CONNS   1000
+
+static const int forwards[] = { 1, 100, MAX_CONNS };
+
+/* Used by rules without a guest address; ours all have one */
+uint32_t vm_ip_address;
+
+typedef struct GuestConn {
+    int fd;
+    int64_t left;               /* bytes still to send, -1 for discard */
+} GuestConn;
+
+static int64_t size = 256 << 20;
+static int discard_port, source_port;
+static volatile int guest_conns;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int listen_port(int *port)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t len = sizeof(addr);
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+        perror("guest listen");
+        exit(1);
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/* A port that nothing listens on right now, for the host side of a rule */
+static int free_port(void)
+{
+    int port, fd = listen_port(&port);
+
+    close(fd);
+    return port;
+}
+
+static void guest_close(int epfd, GuestConn *gc)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, gc->fd, NULL);
+    close(gc->fd);
+    if (gc->left < 0) {
+        __atomic_fetch_sub(&guest_conns, 1, __ATOMIC_SEQ_CST);
+    }
+    free(gc);
+}
+
+static void *guest_thread(void *opaque)
+{
+    static char buf[CHUNK];
+    struct epoll_event ev, events[64];
+    int discard_fd = listen_port(&discard_port);
+    int source_fd = listen_port(&source_port);
+    int epfd = epoll_create1(0);
+    int *ready = opaque;
+    int i, n;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &discard_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, discard_fd, &ev);
+    ev.data.ptr = &source_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, source_fd, &ev);
+    __atomic_store_n(ready, 1, __ATOMIC_SEQ_CST);
+
+    for (;;) {
+        n = epoll_wait(epfd, events, ARRAY_SIZE(events), -1);
+        for (i = 0; i < n; i++) {
+            void *p = events[i].data.ptr;
+            GuestConn *gc;
+            ssize_t ret;
+            int fd;
+
+            if (p == &discard_fd || p == &source_fd) {
+                fd = accept(*(int *)p, NULL, NULL);
+                if (fd < 0) {
+                    continue;
+                }
+                gc = calloc(1, sizeof(*gc));
+                gc->fd = fd;
+                gc->left = p == &source_fd ? size : -1;
+                if (gc->left < 0) {
+                    __atomic_fetch_add(&guest_conns, 1, __ATOMIC_SEQ_CST);
+                }
+                ev.events = gc->left < 0 ? EPOLLIN : EPOLLOUT;
+                ev.data.ptr = gc;
+                epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+                continue;
+            }
+
+            gc = p;
+            if (gc->left < 0) {
+                ret = read(gc->fd, buf, sizeof(buf));
+                if (ret == 0 || (ret < 0 && errno != EAGAIN &&
+                                 errno != EINTR)) {
+                    guest_close(epfd, gc);
+                }
+            } else {
+                ret = write(gc->fd, buf, MIN(gc->left, sizeof(buf)));
+                if (ret > 0) {
+                    gc->left -= ret;
+                }
+                if (gc->left == 0 || (ret < 0 && errno != EAGAIN &&
+                                      errno != EINTR)) {
+                    guest_close(epfd, gc);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static int connect_port(int port)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+static void wait_guest_conns(int n)
+{
+    uint64_t deadline = clock_ns(CLOCK_MONOTONIC) + 10000000000ull;
+
+    while (__atomic_load_n(&guest_conns, __ATOMIC_SEQ_CST) != n) {
+        if (clock_ns(CLOCK_MONOTONIC) > deadline) {
+            fprintf(stderr, "%d of %d connections reached the guest\n",
+                    guest_conns, n);
+            exit(1);
+        }
+        usleep(1000);
+    }
+}
+
+/* Sends size bytes to the discard port, returns MB/s up to its close */
+static double upload(int port)
+{
+    static char buf[CHUNK];
+    uint64_t t = clock_ns(CLOCK_MONOTONIC);
+    int64_t left = size;
+    int fd = connect_port(port);
+    ssize_t ret;
+
+    while (left > 0) {
+        ret = write(fd, buf, MIN(left, sizeof(buf)));
+        if (ret < 0) {
+            perror("upload");
+            exit(1);
+        }
+        left -= ret;
+    }
+    shutdown(fd, SHUT_WR);
+    while ((ret = read(fd, buf, sizeof(buf))) > 0) {
+        /* wait for the guest to close */
+    }
+    close(fd);
+    return size / ((clock_ns(CLOCK_MONOTONIC) - t) / 1e9) / 1e6;
+}
+
+static double download(int port)
+{
+    static char buf[CHUNK];
+    uint64_t t = clock_ns(CLOCK_MONOTONIC);
+    int fd = connect_port(port);
+    int64_t total = 0;
+    ssize_t ret;
+
+    while ((ret = read(fd, buf, sizeof(buf))) > 0) {
+        total += ret;
+    }
+    close(fd);
+    if (total != size) {
+        fprintf(stderr, "downloaded %" PRId64 " of %" PRId64 " bytes\n",
+                total, size);
+        exit(1);
+    }
+    return size / ((clock_ns(CLOCK_MONOTONIC) - t) / 1e9) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    static int idle[MAX_CONNS];
+    double idle_seconds = 1;
+    int host_discard, host_source;
+    pthread_t thread;
+    int ready = 0;
+    char rule[64];
+    uint64_t t, cpu;
+    int c, i, j;
+
+    while ((c = getopt(argc, argv, "s:i:")) != -1) {
+        switch (c) {
+        case 's':
+            size = (int64_t)atoi(optarg) << 20;
+            break;
+        case 'i':
+            idle_seconds = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s MB] [-i SECONDS]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (size <= 0 || idle_seconds <= 0) {
+        fprintf(stderr, "need a positive size and idle time\n");
+        return 2;
+    }
+
+    pthread_create(&thread, NULL, guest_thread, &ready);
+    while (!__atomic_load_n(&ready, __ATOMIC_SEQ_CST)) {
+        usleep(1000);
+    }
+
+    host_discard = free_port();
+    snprintf(rule, sizeof(rule), "tcp:127.0.0.1:%d-127.0.0.1:%d",
+             host_discard, discard_port);
+    if (vnet_add_port_fwd(rule) < 0) {
+        return 1;
+    }
+    host_source = free_port();
+    snprintf(rule, sizeof(rule), "tcp:127.0.0.1:%d-127.0.0.1:%d",
+             host_source, source_port);
+    if (vnet_add_port_fwd(rule) < 0) {
+        return 1;
+    }
+
+    printf("loopback, %" PRId64 " MB per transfer, %.1f s idle\n",
+           size >> 20, idle_seconds);
+    printf("%-10s %10s %12s %14s\n", "forwards", "idle CPU", "upload MB/s",
+           "download MB/s");
+    printf("%-10s %10s %12.0f %14.0f\n", "direct", "-", upload(discard_port),
+           download(source_port));
+    wait_guest_conns(0);
+
+    for (i = 0; i < ARRAY_SIZE(forwards); i++) {
+        int n = forwards[i] - 1;
+
+        /* All but the connection that moves data sit idle */
+        for (j = 0; j < n; j++) {
+            idle[j] = connect_port(host_discard);
+        }
+        wait_guest_conns(n);
+
+        t = clock_ns(CLOCK_MONOTONIC);
+        cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+        usleep(idle_seconds * 1e6);
+        cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+        t = clock_ns(CLOCK_MONOTONIC) - t;
+
+        printf("%-10d %9.1f%% %12.0f %14.0f\n", forwards[i], cpu * 100.0 / t,
+               upload(host_discard), download(host_source));
+
+        for (j = 0; j < n; j++) {
+            close(idle[j]);
+        }
+        wait_guest_conns(0);
+    }
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Decoder and emulator throughput on the instructions that typically
+ * trap on MMIO: decodes per second with and without the decode cache,
+ * emulated instructions per second (a full EPT fault exit minus the VM
+ * exit itself) and hv register/VMCS calls per instruction, then guest
+ * page table walks per second with and without the software TLB.
+ *
+ * usage: bench [ITERATIONS]
+ */
+
+#include <time.h>
+#include "fake_vcpu.h"
+
+/* RAM operand, RBX points here; MMIO operands use RSI */
+#define BENCH_DATA      0x200000
+
+/* 4KB pages for the walk benchmark: this 2MB region goes through BENCH_PT */
+#define BENCH_4K_BASE   0x800000
+#define BENCH_PT        0x4000
+/* distinct pages translated in turn, all of them fit in the TLB */
+#define BENCH_PAGES     16
+
+static const struct bench_insn {
+    const char *name;
+    uint8_t code[16];
+    int len;
+    bool mmio;
+} bench_insns[] = {
+    { "mov [rsi], eax",         { 0x89, 0x06 }, 2, true },
+    { "mov eax, [rsi]",         { 0x8b, 0x06 }, 2, true },
+    { "mov [rsi+0x10], rax",    { 0x48, 0x89, 0x46, 0x10 }, 4, true },
+    { "mov dword [rsi], imm32", { 0xc7, 0x06, 0x78, 0x56, 0x34, 0x12 }, 6, true },
+    { "movzx eax, byte [rsi]",  { 0x0f, 0xb6, 0x06 }, 3, true },
+    { "or [rsi], eax",          { 0x09, 0x06 }, 2, true },
+    { "and eax, [rsi]",         { 0x23, 0x06 }, 2, true },
+    { "test [rsi], eax",        { 0x85, 0x06 }, 2, true },
+    { "add [rbx], eax",         { 0x01, 0x03 }, 2, false },
+    { "xchg [rbx], eax",        { 0x87, 0x03 }, 2, false },
+    { "rep stosd (64)",         { 0xf3, 0xab }, 2, false },
+    { "rep movsb (256)",        { 0xf3, 0xa4 }, 2, false },
+    { "out dx, al",             { 0xee }, 1, false },
+    { "in eax, dx",             { 0xed }, 1, false },
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_setup(CPUState *cpu, const struct bench_insn *insn)
+{
+    fake_vcpu_reset(cpu, FAKE_MODE_LONG64);
+    memcpy(fake_ram + FAKE_RIP, insn->code, insn->len);
+    fake_vcpu_write_reg(HV_X86_RAX, 0x11223344);
+    fake_vcpu_write_reg(HV_X86_RBX, BENCH_DATA);
+    fake_vcpu_write_reg(HV_X86_RSI, insn->mmio ? FAKE_MMIO_BASE : BENCH_DATA);
+    fake_vcpu_write_reg(HV_X86_RDI, BENCH_DATA + 0x1000);
+    fake_vcpu_write_reg(HV_X86_RDX, 0x80);
+}
+
+/* the part of the setup an instruction consumes */
+static void bench_rewind(const struct bench_insn *insn)
+{
+    fake_vcpu_write_reg(HV_X86_RIP, FAKE_RIP);
+    fake_vcpu_write_reg(HV_X86_RSI, insn->mmio ? FAKE_MMIO_BASE : BENCH_DATA);
+    fake_vcpu_write_reg(HV_X86_RDI, BENCH_DATA + 0x1000);
+    fake_vcpu_write_reg(HV_X86_RCX, strstr(insn->name, "stos") ? 64 : 256);
+}
+
+static double bench_decode(CPUState *cpu, const struct bench_insn *insn, long iterations, bool cached)
+{
+    struct x86_decode_cache *cache = cpu->decode_cache;
+    struct x86_decode decode;
+    double elapsed;
+    long i;
+
+    bench_setup(cpu, insn);
+    load_regs(cpu);
+    cpu->fetch_rip = RIP(cpu);
+
+    /* without a cache decode_instruction() always decodes from scratch */
+    if (!cached)
+        cpu->decode_cache = NULL;
+
+    elapsed = now();
+    for (i = 0; i < iterations; i++)
+        decode_instruction(cpu, &decode);
+    elapsed = now() - elapsed;
+
+    cpu->decode_cache = cache;
+    return elapsed;
+}
+
+static double bench_step(CPUState *cpu, const struct bench_insn *insn, long iterations, uint64_t *reg_calls)
+{
+    double start, elapsed;
+    long i;
+
+    bench_setup(cpu, insn);
+    fake_hv_calls = 0;
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        bench_rewind(insn);
+        fake_vcpu_step(cpu);
+    }
+    elapsed = now() - start;
+
+    *reg_calls = fake_hv_calls;
+    return elapsed;
+}
+
+/* replace the 2MB mapping of BENCH_4K_BASE by a page table */
+static void bench_map_4k(void)
+{
+    uint64_t *pd = (uint64_t *)(fake_ram + FAKE_PD);
+    uint64_t *pt = (uint64_t *)(fake_ram + BENCH_PT);
+    int i;
+
+    pd[BENCH_4K_BASE >> 21] = BENCH_PT | PT_PRESENT | PT_WRITE;
+    for (i = 0; i < 512; i++)
+        pt[i] = (BENCH_4K_BASE + ((uint64_t)i << 12)) | PT_PRESENT | PT_WRITE;
+}
+
+/*
+ * Translate BENCH_PAGES pages round robin, as a REP string instruction or
+ * a multi-page access does. Without the TLB every translation is a walk.
+ */
+static double bench_translate(CPUState *cpu, addr_t base, long iterations, bool tlb)
+{
+    double start, elapsed;
+    addr_t gpa;
+    long i;
+
+    fake_vcpu_reset(cpu, FAKE_MODE_LONG64);
+    bench_map_4k();
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        if (!tlb)
+            mmu_flush_tlb(cpu);
+        if (!mmu_gva_to_gpa(cpu, base + (i % BENCH_PAGES) * 0x1000 + 0x10, &gpa)) {
+            fprintf(stderr, "translation of %" PRIx64 " failed\n", base);
+            exit(1);
+        }
+    }
+    elapsed = now() - start;
+
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    double cold, warm, step, total_cold = 0, total_warm = 0, total_step = 0;
+    uint64_t reg_calls, total_reg_calls = 0;
+    CPUState *cpu;
+    int i;
+
+    if (iterations <= 0) {
+        fprintf(stderr, "usage: %s [ITERATIONS]\n", argv[0]);
+        return 2;
+    }
+
+    cpu = fake_vcpu_create();
+
+    printf("%-24s %12s %12s %12s %10s\n", "instruction", "decode M/s", "cached M/s",
+           "execute M/s", "hv calls");
+    for (i = 0; i < ARRAY_SIZE(bench_insns); i++) {
+        cold = bench_decode(cpu, &bench_insns[i], iterations, false);
+        warm = bench_decode(cpu, &bench_insns[i], iterations, true);
+        step = bench_step(cpu, &bench_insns[i], iterations, &reg_calls);
+
+        printf("%-24s %12.2f %12.2f %12.2f %10.1f\n", bench_insns[i].name,
+               iterations / cold / 1e6, iterations / warm / 1e6, iterations / step / 1e6,
+               (double)reg_calls / iterations);
+
+        total_cold += cold;
+        total_warm += warm;
+        total_step += step;
+        total_reg_calls += reg_calls;
+    }
+
+    iterations *= ARRAY_SIZE(bench_insns);
+    printf("%-24s %12.2f %12.2f %12.2f %10.1f\n", "all",
+           iterations / total_cold / 1e6, iterations / total_warm / 1e6, iterations / total_step / 1e6,
+           (double)total_reg_calls / iterations);
+    printf("decode cache: %" PRIu64 " hits, %" PRIu64 " misses; mmu tlb: %" PRIu64 " hits, %" PRIu64 " misses\n",
+           cpu->decode_cache_hits, cpu->decode_cache_misses, cpu->mmu_tlb_hits, cpu->mmu_tlb_misses);
+
+    iterations /= ARRAY_SIZE(bench_insns);
+    printf("\n%-24s %12s %12s\n", "translation", "walk M/s", "tlb M/s");
+    printf("%-24s %12.2f %12.2f\n", "long mode, 2MB pages",
+           iterations / bench_translate(cpu, BENCH_DATA, iterations, false) / 1e6,
+           iterations / bench_translate(cpu, BENCH_DATA, iterations, true) / 1e6);
+    printf("%-24s %12.2f %12.2f\n", "long mode, 4KB pages",
+           iterations / bench_translate(cpu, BENCH_4K_BASE, iterations, false) / 1e6,
+           iterations / bench_translate(cpu, BENCH_4K_BASE, iterations, true) / 1e6);
+
+    return 0;
+}
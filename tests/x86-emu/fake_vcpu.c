@@ -0,0 +1,259 @@
+/*
+ * In-memory vcpu for running the x86 decoder and emulator without
+ * Hypervisor.framework, see fake_vcpu.h.
+ */
+
+#include "fake_vcpu.h"
+#include "known_hypervisor_interface.h"
+
+#define FAKE_VMCS_FIELDS    0x8000
+
+DEFINE_TLS(CPUState *, current_cpu);
+DEFINE_TLS(uint64_t, hv_reg_calls);
+
+struct known_hypervisor_interface *g_hypervisor_iface;
+VeertuAddressSpace address_space_memory;
+
+uint8_t *fake_ram;
+uint8_t fake_mmio[FAKE_MMIO_SIZE];
+uint64_t fake_mmio_accesses;
+uint32_t fake_ports[0x10000];
+uint64_t fake_hv_calls;
+
+static uint64_t fake_regs[HV_X86_REGISTERS_MAX];
+static uint64_t fake_vmcs[FAKE_VMCS_FIELDS];
+static uint64_t fake_apic_base;
+
+hv_return_t hv_vcpu_read_register(hv_vcpuid_t vcpu, hv_x86_reg_t reg, uint64_t *value)
+{
+    fake_hv_calls++;
+    if (vcpu || reg >= HV_X86_REGISTERS_MAX)
+        return HV_ERROR;
+    *value = fake_regs[reg];
+    return HV_SUCCESS;
+}
+
+hv_return_t hv_vcpu_write_register(hv_vcpuid_t vcpu, hv_x86_reg_t reg, uint64_t value)
+{
+    fake_hv_calls++;
+    if (vcpu || reg >= HV_X86_REGISTERS_MAX)
+        return HV_ERROR;
+    fake_regs[reg] = value;
+    return HV_SUCCESS;
+}
+
+hv_return_t hv_vmx_vcpu_read_vmcs(hv_vcpuid_t vcpu, uint32_t field, uint64_t *value)
+{
+    fake_hv_calls++;
+    if (vcpu || field >= FAKE_VMCS_FIELDS)
+        return HV_ERROR;
+    *value = fake_vmcs[field];
+    return HV_SUCCESS;
+}
+
+hv_return_t hv_vmx_vcpu_write_vmcs(hv_vcpuid_t vcpu, uint32_t field, uint64_t value)
+{
+    fake_hv_calls++;
+    if (vcpu || field >= FAKE_VMCS_FIELDS)
+        return HV_ERROR;
+    fake_vmcs[field] = value;
+    return HV_SUCCESS;
+}
+
+hv_return_t hv_vcpu_invalidate_tlb(hv_vcpuid_t vcpu)
+{
+    return HV_SUCCESS;
+}
+
+hv_return_t hv_vcpu_flush(hv_vcpuid_t vcpu)
+{
+    return HV_SUCCESS;
+}
+
+uint64_t fake_vcpu_read_reg(hv_x86_reg_t reg)
+{
+    return fake_regs[reg];
+}
+
+void fake_vcpu_write_reg(hv_x86_reg_t reg, uint64_t value)
+{
+    fake_regs[reg] = value;
+}
+
+/* RAM is direct, the MMIO window is accessed element by element */
+bool address_space_is_direct(VeertuAddressSpace *as, hwaddr addr, hwaddr len, bool is_write)
+{
+    return addr < as->ram_size && len <= as->ram_size - addr;
+}
+
+bool address_space_rw(VeertuAddressSpace *as, hwaddr addr, void *buf, uint64_t len, bool is_write)
+{
+    uint8_t *mem;
+
+    if (address_space_is_direct(as, addr, len, is_write)) {
+        mem = as->ram + addr;
+    } else if (addr >= FAKE_MMIO_BASE && addr - FAKE_MMIO_BASE + len <= FAKE_MMIO_SIZE) {
+        mem = fake_mmio + (addr - FAKE_MMIO_BASE);
+        fake_mmio_accesses++;
+    } else {
+        /* unassigned: writes are dropped, reads return all ones */
+        if (!is_write)
+            memset(buf, 0xff, len);
+        return true;
+    }
+
+    if (is_write)
+        memcpy(mem, buf, len);
+    else
+        memcpy(buf, mem, len);
+    return false;
+}
+
+/* ports latch the last value written and read it back */
+void veertu_handle_io(struct CPUState *cpu, uint16_t port, void *data, int direction, int size, uint32_t count)
+{
+    uint8_t *p = data;
+    uint32_t i;
+
+    for (i = 0; i < count; i++, p += size) {
+        if (!direction && port == FAKE_SEQ_PORT)
+            fake_ports[port] = fake_mmio_accesses;
+        if (direction)
+            memcpy(&fake_ports[port], p, size);
+        else
+            memcpy(p, &fake_ports[port], size);
+    }
+}
+
+void cpu_set_apic_base(DeviceState *s, uint64_t val)
+{
+    fake_apic_base = val;
+}
+
+uint64_t cpu_get_apic_base(DeviceState *s)
+{
+    return fake_apic_base;
+}
+
+bool osx_is_sierra(void)
+{
+    return 1;
+}
+
+static void fake_set_segment(CPUState *cpu, x86_reg_segment seg, uint64_t base, uint64_t limit, uint64_t ar)
+{
+    struct vmx_segment desc = {
+        .sel = 0,
+        .base = base,
+        .limit = limit,
+        .ar = ar,
+    };
+
+    vmx_write_segment_descriptor(cpu, &desc, seg);
+}
+
+static void fake_map_1g(void)
+{
+    uint64_t *pml4 = (uint64_t *)(fake_ram + FAKE_PML4);
+    uint64_t *pdpt = (uint64_t *)(fake_ram + FAKE_PDPT);
+    uint64_t *pd = (uint64_t *)(fake_ram + FAKE_PD);
+    int i;
+
+    pml4[0] = FAKE_PDPT | PT_PRESENT | PT_WRITE;
+    pdpt[0] = FAKE_PD | PT_PRESENT | PT_WRITE;
+    for (i = 0; i < 512; i++)
+        pd[i] = ((uint64_t)i << 21) | PT_PS | PT_PRESENT | PT_WRITE;
+}
+
+void fake_vcpu_reset(CPUState *cpu, fake_mode mode)
+{
+    uint64_t code_ar, data_ar, limit;
+    int seg;
+
+    memset(fake_regs, 0, sizeof(fake_regs));
+    memset(fake_vmcs, 0, sizeof(fake_vmcs));
+    memset(fake_ram, 0, FAKE_RAM_SIZE);
+    memset(fake_mmio, 0, sizeof(fake_mmio));
+    memset(fake_ports, 0, sizeof(fake_ports));
+    fake_mmio_accesses = 0;
+    fake_apic_base = 0;
+
+    switch (mode) {
+        case FAKE_MODE_REAL:
+            wvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_CR0, CR0_ET);
+            code_ar = 0x9b;
+            data_ar = 0x93;
+            limit = 0xffff;
+            fake_regs[HV_X86_RIP] = FAKE_REAL_RIP;
+            break;
+        case FAKE_MODE_PROT32:
+            wvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_CR0, CR0_PE | CR0_ET);
+            code_ar = 0xc09b;
+            data_ar = 0xc093;
+            limit = 0xffffffff;
+            fake_regs[HV_X86_RIP] = FAKE_RIP;
+            break;
+        case FAKE_MODE_LONG64:
+        default:
+            fake_map_1g();
+            wvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_CR0, CR0_PG | CR0_WP | CR0_PE | CR0_ET);
+            wvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_CR3, FAKE_PML4);
+            wvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_CR4, CR4_PAE);
+            wvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_IA32_EFER, EFER_LME | EFER_LMA);
+            code_ar = 0xa09b;
+            data_ar = 0xc093;
+            limit = 0xffffffff;
+            fake_regs[HV_X86_RIP] = FAKE_RIP;
+            break;
+    }
+
+    for (seg = REG_SEG_ES; seg <= REG_SEG_GS; seg++)
+        fake_set_segment(cpu, seg, 0, limit, seg == REG_SEG_CS ? code_ar : data_ar);
+    fake_set_segment(cpu, REG_SEG_LDTR, 0, 0, 0x10000);
+    fake_set_segment(cpu, REG_SEG_TR, 0, 0xffff, 0x8b);
+
+    fake_regs[HV_X86_RFLAGS] = 0x2;
+    fake_regs[HV_X86_RSP] = FAKE_RIP;
+
+    decode_cache_flush(cpu);
+    mmu_flush_tlb(cpu);
+}
+
+CPUState *fake_vcpu_create(void)
+{
+    X86CPU *x86_cpu = g_malloc0(sizeof(X86CPU));
+    CPUState *cpu = &x86_cpu->parent;
+
+    fake_ram = g_malloc0(FAKE_RAM_SIZE);
+    address_space_memory.name = "memory";
+    address_space_memory.ram = fake_ram;
+    address_space_memory.ram_size = FAKE_RAM_SIZE;
+
+    cpu->mac_vcpu_fd = 0;
+    current_cpu = cpu;
+
+    init_emu(cpu);
+    init_decoder(cpu);
+    fake_vcpu_reset(cpu, FAKE_MODE_LONG64);
+
+    return cpu;
+}
+
+int fake_vcpu_step(CPUState *cpu)
+{
+    struct x86_decode decode;
+    uint64_t rip = rreg(cpu->mac_vcpu_fd, HV_X86_RIP);
+    int len;
+
+    load_regs(cpu);
+    cpu->fetch_rip = rip;
+
+    len = decode_instruction(cpu, &decode);
+    exec_instruction(cpu, &decode);
+    store_regs(cpu);
+
+    /* software TLB entries don't survive VM entry */
+    mmu_flush_tlb(cpu);
+
+    return len;
+}
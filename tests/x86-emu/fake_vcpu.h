@@ -0,0 +1,59 @@
+/*
+ * In-memory vcpu for running the x86 decoder and emulator without
+ * Hypervisor.framework.
+ *
+ * One vcpu with a register file and a VMCS array behind hv_vcpu_* and
+ * hv_vmx_vcpu_*, flat guest RAM behind address_space_memory, an MMIO window
+ * above RAM whose accesses are counted, and I/O ports that read back the
+ * last value written to them.  FAKE_SEQ_PORT instead reads the MMIO access
+ * count, which shows how port and MMIO accesses interleave.
+ */
+
+#ifndef FAKE_VCPU_H
+#define FAKE_VCPU_H
+
+#include "qemu-common.h"
+#include "vmx.h"
+#include "x86.h"
+#include "x86_decode.h"
+#include "x86_emu.h"
+#include "x86_mmu.h"
+#include "x86_descr.h"
+
+#define FAKE_RAM_SIZE       (16 << 20)
+#define FAKE_MMIO_BASE      0x30000000
+#define FAKE_MMIO_SIZE      0x10000
+#define FAKE_SEQ_PORT       0xf0
+
+/* long mode identity maps the first 1GB with 2MB pages from here */
+#define FAKE_PML4           0x1000
+#define FAKE_PDPT           0x2000
+#define FAKE_PD             0x3000
+
+/* where reset points RIP */
+#define FAKE_REAL_RIP       0x7c00
+#define FAKE_RIP            0x100000
+
+typedef enum fake_mode {
+    FAKE_MODE_REAL,
+    FAKE_MODE_PROT32,
+    FAKE_MODE_LONG64,
+} fake_mode;
+
+extern uint8_t *fake_ram;
+extern uint8_t fake_mmio[FAKE_MMIO_SIZE];
+extern uint64_t fake_mmio_accesses;
+extern uint32_t fake_ports[0x10000];
+/* hv_vcpu_* and hv_vmx_vcpu_* register and VMCS accesses */
+extern uint64_t fake_hv_calls;
+
+CPUState *fake_vcpu_create(void);
+/* clear registers, VMCS, RAM and devices and enter the given mode */
+void fake_vcpu_reset(CPUState *cpu, fake_mode mode);
+/* emulate the instruction at RIP the way an EPT fault exit does */
+int fake_vcpu_step(CPUState *cpu);
+
+uint64_t fake_vcpu_read_reg(hv_x86_reg_t reg);
+void fake_vcpu_write_reg(hv_x86_reg_t reg, uint64_t value);
+
+#endif
@@ -0,0 +1,345 @@
+/*
+ * Corpus driven tests for the x86 decoder and emulator.
+ *
+ * usage: run_corpus FILE...
+ *
+ * A corpus file is a list of tests, one directive per line, "#" comments:
+ *
+ *   test NAME              start a test, in long mode
+ *   mode real|prot32|long64
+ *                          restart it in another mode
+ *   code XX XX ...         instruction bytes, placed from the initial RIP on
+ *   reg NAME=VALUE ...     set GPRs, rip or rflags
+ *   mem ADDR XX XX ...     set guest memory, RAM or the MMIO window
+ *   port PORT=VALUE        value the port reads back
+ *   steps N                instructions to run, 1 by default
+ *   expect reg NAME=VALUE ...
+ *   expect flags [-]FLAG ...
+ *                          flags set, or clear with "-" (cf pf af zf sf df of...)
+ *   expect mem ADDR XX XX ...
+ *   expect port PORT=VALUE
+ *   expect mmio N          element accesses to the MMIO window
+ *   end
+ *
+ * The instructions run at the first expect, each the way an EPT fault
+ * exit emulates it.
+ */
+
+#include "fake_vcpu.h"
+
+static const struct {
+    const char *name;
+    hv_x86_reg_t reg;
+} reg_names[] = {
+    { "rax", HV_X86_RAX }, { "rcx", HV_X86_RCX }, { "rdx", HV_X86_RDX },
+    { "rbx", HV_X86_RBX }, { "rsp", HV_X86_RSP }, { "rbp", HV_X86_RBP },
+    { "rsi", HV_X86_RSI }, { "rdi", HV_X86_RDI }, { "r8", HV_X86_R8 },
+    { "r9", HV_X86_R9 }, { "r10", HV_X86_R10 }, { "r11", HV_X86_R11 },
+    { "r12", HV_X86_R12 }, { "r13", HV_X86_R13 }, { "r14", HV_X86_R14 },
+    { "r15", HV_X86_R15 }, { "rip", HV_X86_RIP }, { "rflags", HV_X86_RFLAGS },
+};
+
+struct corpus_case {
+    const char *file;
+    int line;
+    char name[64];
+    int steps;
+    bool ran;
+    bool failed;
+    uint64_t code_addr;
+};
+
+static int tests_run;
+static int tests_failed;
+
+static void fail(struct corpus_case *c, const char *fmt, ...)
+{
+    va_list ap;
+
+    printf("FAIL %s:%d %s: ", c->file, c->line, c->name);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+    c->failed = true;
+}
+
+static bool parse_reg(const char *name, hv_x86_reg_t *reg)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(reg_names); i++) {
+        if (!strcmp(reg_names[i].name, name)) {
+            *reg = reg_names[i].reg;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_num(const char *s, uint64_t *val)
+{
+    char *end;
+
+    errno = 0;
+    *val = strtoull(s, &end, 0);
+    return !errno && *s && !*end;
+}
+
+/* NAME=VALUE */
+static bool parse_assign(char *tok, char **name, uint64_t *val)
+{
+    char *eq = strchr(tok, '=');
+
+    if (!eq)
+        return false;
+    *eq = 0;
+    *name = tok;
+    return parse_num(eq + 1, val);
+}
+
+/* hex bytes from the remaining tokens */
+static int parse_bytes(char **tok, int ntok, uint8_t *buf, int size)
+{
+    unsigned long val;
+    char *end;
+    int i;
+
+    for (i = 0; i < ntok; i++) {
+        val = strtoul(tok[i], &end, 16);
+        if (i == size || *end || end - tok[i] != 2)
+            return -1;
+        buf[i] = val;
+    }
+    return ntok;
+}
+
+/* set up and check guest memory without counting MMIO accesses */
+static void guest_rw(uint64_t addr, uint8_t *buf, int len, bool is_write)
+{
+    uint64_t mmio_accesses = fake_mmio_accesses;
+
+    address_space_rw(&address_space_memory, addr, buf, len, is_write);
+    fake_mmio_accesses = mmio_accesses;
+}
+
+/* flag names, "-" in front expects the flag clear */
+static bool check_flags(struct corpus_case *c, char **tok, int ntok)
+{
+    static const char *names[] = {
+        "cf", NULL, "pf", NULL, "af", NULL, "zf", "sf", "tf", "if", "df", "of",
+    };
+    uint64_t rflags = fake_vcpu_read_reg(HV_X86_RFLAGS);
+    bool set;
+    int i, bit;
+
+    for (i = 0; i < ntok; i++) {
+        set = tok[i][0] != '-';
+        for (bit = 0; bit < ARRAY_SIZE(names); bit++) {
+            if (names[bit] && !strcmp(names[bit], tok[i] + !set))
+                break;
+        }
+        if (bit == ARRAY_SIZE(names))
+            return false;
+        if (!(rflags & (1ull << bit)) == set)
+            fail(c, "%s %s, expected %s (rflags 0x%" PRIx64 ")", names[bit],
+                 set ? "clear" : "set", set ? "set" : "clear", rflags);
+    }
+    return true;
+}
+
+static void run_case(CPUState *cpu, struct corpus_case *c)
+{
+    int i;
+
+    if (c->ran)
+        return;
+    c->ran = true;
+    for (i = 0; i < c->steps; i++)
+        fake_vcpu_step(cpu);
+}
+
+static void finish_case(CPUState *cpu, struct corpus_case *c)
+{
+    run_case(cpu, c);
+    tests_run++;
+    if (c->failed)
+        tests_failed++;
+}
+
+static void start_case(CPUState *cpu, struct corpus_case *c, fake_mode mode)
+{
+    fake_vcpu_reset(cpu, mode);
+    c->steps = 1;
+    c->ran = false;
+    c->failed = false;
+    c->code_addr = fake_vcpu_read_reg(HV_X86_RIP);
+}
+
+static bool parse_line(CPUState *cpu, struct corpus_case *c, char **tok, int ntok)
+{
+    uint8_t bytes[256], got[256];
+    hv_x86_reg_t reg;
+    uint64_t val, addr, port;
+    char *name;
+    int i, n;
+
+    if (!strcmp(tok[0], "test") && ntok == 2) {
+        snprintf(c->name, sizeof(c->name), "%s", tok[1]);
+        start_case(cpu, c, FAKE_MODE_LONG64);
+        return true;
+    }
+    if (!strcmp(tok[0], "mode") && ntok == 2) {
+        if (!strcmp(tok[1], "real"))
+            start_case(cpu, c, FAKE_MODE_REAL);
+        else if (!strcmp(tok[1], "prot32"))
+            start_case(cpu, c, FAKE_MODE_PROT32);
+        else if (!strcmp(tok[1], "long64"))
+            start_case(cpu, c, FAKE_MODE_LONG64);
+        else
+            return false;
+        return true;
+    }
+    if (!strcmp(tok[0], "code")) {
+        if ((n = parse_bytes(tok + 1, ntok - 1, bytes, sizeof(bytes))) < 0)
+            return false;
+        guest_rw(c->code_addr, bytes, n, true);
+        c->code_addr += n;
+        return true;
+    }
+    if (!strcmp(tok[0], "steps") && ntok == 2)
+        return parse_num(tok[1], &val) && (c->steps = val) > 0;
+    if (!strcmp(tok[0], "reg")) {
+        for (i = 1; i < ntok; i++) {
+            if (!parse_assign(tok[i], &name, &val) || !parse_reg(name, &reg))
+                return false;
+            fake_vcpu_write_reg(reg, val);
+        }
+        return true;
+    }
+    if (!strcmp(tok[0], "mem") && ntok >= 3) {
+        if (!parse_num(tok[1], &addr) ||
+            (n = parse_bytes(tok + 2, ntok - 2, bytes, sizeof(bytes))) < 0)
+            return false;
+        guest_rw(addr, bytes, n, true);
+        return true;
+    }
+    if (!strcmp(tok[0], "port") && ntok == 2) {
+        if (!parse_assign(tok[1], &name, &val) || !parse_num(name, &port) || port > 0xffff)
+            return false;
+        fake_ports[port] = val;
+        return true;
+    }
+    if (!strcmp(tok[0], "expect") && ntok >= 2) {
+        run_case(cpu, c);
+        if (!strcmp(tok[1], "reg")) {
+            for (i = 2; i < ntok; i++) {
+                if (!parse_assign(tok[i], &name, &val) || !parse_reg(name, &reg))
+                    return false;
+                if (fake_vcpu_read_reg(reg) != val)
+                    fail(c, "%s = 0x%" PRIx64 ", expected 0x%" PRIx64, name,
+                         fake_vcpu_read_reg(reg), val);
+            }
+            return true;
+        }
+        if (!strcmp(tok[1], "mem") && ntok >= 4) {
+            if (!parse_num(tok[2], &addr) ||
+                (n = parse_bytes(tok + 3, ntok - 3, bytes, sizeof(bytes))) < 0)
+                return false;
+            guest_rw(addr, got, n, false);
+            for (i = 0; i < n; i++) {
+                if (got[i] != bytes[i])
+                    fail(c, "mem 0x%" PRIx64 " = 0x%02x, expected 0x%02x", addr + i, got[i], bytes[i]);
+            }
+            return true;
+        }
+        if (!strcmp(tok[1], "port") && ntok == 3) {
+            if (!parse_assign(tok[2], &name, &val) || !parse_num(name, &port) || port > 0xffff)
+                return false;
+            if (fake_ports[port] != val)
+                fail(c, "port 0x%" PRIx64 " = 0x%x, expected 0x%" PRIx64, port, fake_ports[port], val);
+            return true;
+        }
+        if (!strcmp(tok[1], "flags"))
+            return check_flags(c, tok + 2, ntok - 2);
+        if (!strcmp(tok[1], "mmio") && ntok == 3) {
+            if (!parse_num(tok[2], &val))
+                return false;
+            if (fake_mmio_accesses != val)
+                fail(c, "%" PRIu64 " MMIO accesses, expected %" PRIu64, fake_mmio_accesses, val);
+            return true;
+        }
+    }
+    return false;
+}
+
+static int run_file(CPUState *cpu, const char *file)
+{
+    struct corpus_case c = { .file = file };
+    char line[1024], *tok[128], *p;
+    bool in_case = false;
+    int ntok;
+    FILE *f;
+
+    f = fopen(file, "r");
+    if (!f) {
+        perror(file);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        c.line++;
+        if ((p = strchr(line, '#')))
+            *p = 0;
+        ntok = 0;
+        for (p = strtok(line, " \t\r\n"); p && ntok < ARRAY_SIZE(tok); p = strtok(NULL, " \t\r\n"))
+            tok[ntok++] = p;
+        if (!ntok)
+            continue;
+
+        if (!strcmp(tok[0], "end") && in_case) {
+            finish_case(cpu, &c);
+            in_case = false;
+            continue;
+        }
+        if (!in_case && strcmp(tok[0], "test"))
+            goto syntax;
+        if (in_case && !strcmp(tok[0], "test"))
+            goto syntax;
+        if (!parse_line(cpu, &c, tok, ntok))
+            goto syntax;
+        in_case = true;
+    }
+    fclose(f);
+
+    if (in_case) {
+        fprintf(stderr, "%s: %s: missing end\n", file, c.name);
+        return -1;
+    }
+    return 0;
+
+syntax:
+    fprintf(stderr, "%s:%d: syntax error\n", file, c.line);
+    fclose(f);
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    CPUState *cpu;
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s FILE...\n", argv[0]);
+        return 2;
+    }
+
+    cpu = fake_vcpu_create();
+    for (i = 1; i < argc; i++) {
+        if (run_file(cpu, argv[i]))
+            return 2;
+    }
+
+    printf("%d tests, %d failed\n", tests_run, tests_failed);
+    return tests_failed ? 1 : 0;
+}
@@ -0,0 +1,23 @@
+/*
+ * Hypervisor.framework vcpu interface for building the emulator off macOS.
+ * tests/x86-emu/fake_vcpu.c implements it over an in-memory register file.
+ */
+
+#ifndef HV_H
+#define HV_H
+
+#include <stddef.h>
+#include <Hypervisor/hv_types.h>
+#include <Hypervisor/hv_arch_x86.h>
+
+hv_return_t hv_vcpu_read_register(hv_vcpuid_t vcpu, hv_x86_reg_t reg, uint64_t *value);
+hv_return_t hv_vcpu_write_register(hv_vcpuid_t vcpu, hv_x86_reg_t reg, uint64_t value);
+hv_return_t hv_vcpu_read_fpstate(hv_vcpuid_t vcpu, void *buffer, size_t size);
+hv_return_t hv_vcpu_write_fpstate(hv_vcpuid_t vcpu, void *buffer, size_t size);
+hv_return_t hv_vcpu_read_msr(hv_vcpuid_t vcpu, uint32_t msr, uint64_t *value);
+hv_return_t hv_vcpu_write_msr(hv_vcpuid_t vcpu, uint32_t msr, uint64_t value);
+hv_return_t hv_vcpu_invalidate_tlb(hv_vcpuid_t vcpu);
+hv_return_t hv_vcpu_flush(hv_vcpuid_t vcpu);
+hv_return_t hv_vm_sync_tsc(uint64_t tsc);
+
+#endif
@@ -0,0 +1,24 @@
+/*
+ * Hypervisor.framework types for building the emulator off macOS,
+ * see tests/x86-emu/CMakeLists.txt.
+ */
+
+#ifndef HV_TYPES_H
+#define HV_TYPES_H
+
+#include <stdint.h>
+
+typedef unsigned hv_vcpuid_t;
+typedef int hv_return_t;
+typedef uint64_t hv_vm_options_t;
+typedef uint64_t hv_vcpu_options_t;
+typedef uint64_t hv_memory_flags_t;
+typedef const void *hv_uvaddr_t;
+typedef uint64_t hv_gpaddr_t;
+
+#define HV_SUCCESS 0
+#define HV_ERROR 0xfae94001
+#define HV_VM_DEFAULT 0
+#define HV_VCPU_DEFAULT 0
+
+#endif
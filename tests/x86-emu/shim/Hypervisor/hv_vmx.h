@@ -0,0 +1,24 @@
+/*
+ * Hypervisor.framework VMCS interface for building the emulator off macOS.
+ * tests/x86-emu/fake_vcpu.c implements it over an in-memory VMCS.
+ */
+
+#ifndef HV_VMX_H
+#define HV_VMX_H
+
+#include <Hypervisor/hv.h>
+
+typedef enum {
+    HV_VMX_CAP_PINBASED = 0,
+    HV_VMX_CAP_PROCBASED,
+    HV_VMX_CAP_PROCBASED2,
+    HV_VMX_CAP_ENTRY,
+    HV_VMX_CAP_EXIT,
+    HV_VMX_CAP_PREEMPTION_TIMER = 32,
+} hv_vmx_capability_t;
+
+hv_return_t hv_vmx_vcpu_read_vmcs(hv_vcpuid_t vcpu, uint32_t field, uint64_t *value);
+hv_return_t hv_vmx_vcpu_write_vmcs(hv_vcpuid_t vcpu, uint32_t field, uint64_t value);
+hv_return_t hv_vmx_read_capability(hv_vmx_capability_t field, uint64_t *value);
+
+#endif
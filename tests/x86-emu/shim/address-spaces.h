@@ -0,0 +1,12 @@
+/*
+ * Stand-in for include/address-spaces.h, so that the flat RAM memory.h
+ * next to it is the one picked up.
+ */
+
+#ifndef EXEC_MEMORY_H
+#define EXEC_MEMORY_H
+
+#include "memory.h"
+extern VeertuAddressSpace address_space_memory;
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * Stand-in for include/memory.h when the x86 decoder and emulator are
+ * built outside the VMM. tests/x86-emu/fake_vcpu.c backs
+ * address_space_memory with flat RAM.
+ */
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hwaddr.h"
+#include "qemu/typedefs.h"
+
+
+struct VeertuAddressSpace {
+    char *name;
+    uint8_t *ram;
+    uint64_t ram_size;
+};
+
+bool address_space_rw(VeertuAddressSpace *address_space, hwaddr addr, void *buf, uint64_t len, bool is_write);
+bool address_space_is_direct(VeertuAddressSpace *address_space, hwaddr addr, hwaddr len, bool is_write);
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ * Stand-in for include/qdev-core.h when the x86 decoder and emulator are
+ * built outside the VMM: CPUState only needs a DeviceState to embed and
+ * the type header that CPU_GET_CLASS() looks at.
+ */
+
+#ifndef QDEV_CORE_H
+#define QDEV_CORE_H
+
+#include "qemu/typedefs.h"
+
+typedef struct VeertuType {
+    void *class;
+    struct VeertuType *father;
+} VeertuType;
+
+struct DeviceState {
+    VeertuType type;
+    const char *id;
+    void *opaque;
+};
+
+typedef struct DeviceClass {
+    const char *desc;
+} DeviceClass;
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * Stand-in for include/qemu-common.h when the x86 decoder and emulator are
+ * built outside the VMM, see tests/x86-emu/CMakeLists.txt.
+ *
+ * Only what vmm/x86_*.c need is provided: the C library, g_malloc0(), the
+ * queue macros used by CPUState, and the real CPUState from include/qom/cpu.h.
+ */
+
+#ifndef QEMU_COMMON_H
+#define QEMU_COMMON_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#include "qemu/compiler.h"
+
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+
+/* the only glib calls in vmm/x86_*.c */
+static inline void *g_malloc0(size_t size)
+{
+    return calloc(1, size);
+}
+
+static inline void g_free(void *ptr)
+{
+    free(ptr);
+}
+
+#include "qemu/queue.h"
+#include "util/cpu.h"
+
+#endif
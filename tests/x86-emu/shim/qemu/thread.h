@@ -0,0 +1,13 @@
+/*
+ * Stand-in for include/qemu/thread.h when the x86 decoder and emulator are
+ * built outside the VMM: the emulator itself never takes a lock.
+ */
+
+#ifndef __QEMU_THREAD_H
+#define __QEMU_THREAD_H 1
+
+typedef struct QemuMutex QemuMutex;
+typedef struct QemuCond QemuCond;
+typedef struct QemuThread QemuThread;
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Stand-in for util/cpu.h when the x86 decoder and emulator are built
+ * outside the VMM, see tests/x86-emu/CMakeLists.txt.
+ *
+ * X86CPU and CPUX86State only carry the fields the emulator touches; the
+ * MSR numbers are copied from util/cpu.h.
+ */
+
+#ifndef CPU_I386_H
+#define CPU_I386_H
+
+#include "qemu-common.h"
+#include "qom/cpu.h"
+
+#define MSR_IA32_TSC                    0x10
+#define MSR_IA32_APICBASE               0x1b
+#define MSR_MTRRcap                     0xfe
+#define MSR_MTRRcap_VCNT                8
+#define MSR_IA32_MISC_ENABLE            0x1a0
+#define MSR_MTRRphysBase(reg)           (0x200 + 2 * (reg))
+#define MSR_MTRRphysMask(reg)           (0x200 + 2 * (reg) + 1)
+#define MSR_MTRRfix64K_00000            0x250
+#define MSR_MTRRfix16K_80000            0x258
+#define MSR_MTRRfix16K_A0000            0x259
+#define MSR_MTRRfix4K_C0000             0x268
+#define MSR_MTRRfix4K_C8000             0x269
+#define MSR_MTRRfix4K_D0000             0x26a
+#define MSR_MTRRfix4K_D8000             0x26b
+#define MSR_MTRRfix4K_E0000             0x26c
+#define MSR_MTRRfix4K_E8000             0x26d
+#define MSR_MTRRfix4K_F0000             0x26e
+#define MSR_MTRRfix4K_F8000             0x26f
+#define MSR_MTRRdefType                 0x2ff
+#define MSR_EFER                        0xc0000080
+#define MSR_STAR                        0xc0000081
+#define MSR_LSTAR                       0xc0000082
+#define MSR_CSTAR                       0xc0000083
+#define MSR_FSBASE                      0xc0000100
+#define MSR_GSBASE                      0xc0000101
+#define MSR_KERNELGSBASE                0xc0000102
+
+typedef struct MTRRVar {
+    uint64_t base;
+    uint64_t mask;
+} MTRRVar;
+
+typedef struct CPUX86State {
+    uint64_t msr_ia32_misc_enable;
+    uint64_t mtrr_fixed[11];
+    uint64_t mtrr_deftype;
+    MTRRVar mtrr_var[MSR_MTRRcap_VCNT];
+} CPUX86State;
+
+typedef struct X86CPU {
+    CPUState parent;
+    CPUX86State env;
+    struct DeviceState *apic_state;
+} X86CPU;
+
+#define X86_CPU(obj) ((X86CPU*)(obj))
+
+void cpu_set_apic_base(DeviceState *s, uint64_t val);
+uint64_t cpu_get_apic_base(DeviceState *s);
+
+#endif
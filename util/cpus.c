@@ -743,6 +743,7 @@ static void vmx_tcg_init_cpu_signals(void)
 #endif /* _WIN32 */
 
 static QemuMutex vmx_global_mutex;
+static __thread bool iothread_locked;
 static QemuCond vmx_io_proceeded_cond;
 static bool iothread_requesting_mutex;
 
@@ -875,8 +876,77 @@ static void vmx_tcg_wait_io_event(void)
     }
 }
 
+/* Upper bound for the per-vcpu halt poll window, -realtime halt-poll-ns=N */
+int64_t halt_poll_ns_max = 200000;
+#define HALT_POLL_NS_START 10000
+
+/*
+ * Spin for up to cpu->halt_poll_ns after HLT, outside of the iothread
+ * mutex, waiting for interrupt_request to change.  A wakeup that arrives
+ * within the window avoids the condvar handoff and the SIG_IPI that
+ * vmx_cpu_kick would otherwise send.  halt_polling is only changed with
+ * the mutex held, so vmx_cpu_kick can rely on it to skip the signal.
+ */
+static bool vmx_halt_poll(CPUState *cpu)
+{
+    int interrupt_request = cpu->interrupt_request;
+    int64_t deadline = get_clock() + cpu->halt_poll_ns;
+    bool woken = false;
+
+    cpu->halt_polling = true;
+    vmx_mutex_unlock_iothread();
+    do {
+        if (atomic_read(&cpu->interrupt_request) != interrupt_request ||
+            atomic_read(&cpu->stop) || atomic_read(&cpu->queued_work_first)) {
+            woken = true;
+            break;
+        }
+        __asm__ __volatile__("pause" ::: "memory");
+    } while (get_clock() < deadline);
+    vmx_mutex_lock_iothread();
+    cpu->halt_polling = false;
+    return woken;
+}
+
+/* Grow or shrink the poll window the way KVM's halt_poll_ns does. */
+static void vmx_halt_poll_adjust(CPUState *cpu, int64_t block_ns)
+{
+    if (block_ns <= cpu->halt_poll_ns) {
+        return;
+    }
+    if (block_ns > halt_poll_ns_max) {
+        /* long sleep, polling would only have burnt host cpu */
+        cpu->halt_poll_ns = 0;
+    } else if (cpu->halt_poll_ns < halt_poll_ns_max) {
+        cpu->halt_poll_ns = cpu->halt_poll_ns ? cpu->halt_poll_ns * 2
+                                              : HALT_POLL_NS_START;
+        if (cpu->halt_poll_ns > halt_poll_ns_max) {
+            cpu->halt_poll_ns = halt_poll_ns_max;
+        }
+    }
+}
+
 static void vmx_wait_for_io(CPUState *cpu)
 {
+    if (cpu->hlt && !cpu_is_stopped(cpu) && cpu_thread_is_idle(cpu)) {
+        int64_t start = get_clock();
+
+        cpu->halt_wakeups++;
+        if (cpu->halt_poll_ns > halt_poll_ns_max) {
+            cpu->halt_poll_ns = halt_poll_ns_max;
+        }
+        if (cpu->halt_poll_ns > 0) {
+            if (vmx_halt_poll(cpu) && !cpu_thread_is_idle(cpu)) {
+                cpu->halt_poll_success++;
+            } else {
+                cpu->halt_poll_fail++;
+            }
+        }
+        while (cpu_thread_is_idle(cpu)) {
+            vmx_cond_wait(cpu->halt_cond, &vmx_global_mutex);
+        }
+        vmx_halt_poll_adjust(cpu, get_clock() - start);
+    }
     while (cpu_thread_is_idle(cpu)) {
         vmx_cond_wait(cpu->halt_cond, &vmx_global_mutex);
     }
@@ -890,6 +960,7 @@ static void *vmx_cpu_thread_fn(void *arg)
     int r;
 
     vmx_mutex_lock(&vmx_global_mutex);
+    iothread_locked = true;
     vmx_thread_get_self(cpu->thread);
     cpu->thread_id = vmx_get_thread_id();
     cpu->can_do_io = 1;
@@ -973,6 +1044,7 @@ static void *vmx_tcg_cpu_thread_fn(void *arg)
     vmx_thread_get_self(cpu->thread);
 
     vmx_mutex_lock(&vmx_global_mutex);
+    iothread_locked = true;
     CPU_FOREACH(cpu) {
         cpu->thread_id = vmx_get_thread_id();
         cpu->created = true;
@@ -1049,6 +1121,10 @@ static void vmx_cpu_kick_thread(CPUState *cpu)
 void vmx_cpu_kick(CPUState *cpu)
 {
     vmx_cond_broadcast(cpu->halt_cond);
+    if (cpu->halt_polling) {
+        /* vmx_halt_poll will notice interrupt_request by itself */
+        return;
+    }
     if (!cpu->thread_kicked) {
         vmx_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
@@ -1092,13 +1168,20 @@ void vmx_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         vmx_cond_broadcast(&vmx_io_proceeded_cond);
     }
+    iothread_locked = true;
 }
 
 void vmx_mutex_unlock_iothread(void)
 {
+    iothread_locked = false;
     vmx_mutex_unlock(&vmx_global_mutex);
 }
 
+bool vmx_mutex_iothread_locked(void)
+{
+    return iothread_locked;
+}
+
 static int all_vcpus_paused(void)
 {
     CPUState *cpu;
@@ -30,6 +30,7 @@
 #include "veertuemu.h"
 #include "sysemu.h"
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
 #include "memory.h"
@@ -41,6 +42,7 @@
 #include "cpu-all.h"
 
 #include "qemu/range.h"
+#include "qemu/rcu.h"
 #include "vmm/vmx.h"
 
 //#define DEBUG_SUBPAGE
@@ -357,14 +359,67 @@ VeertuMemArea *address_space_translate(VeertuAddressSpace *as, hwaddr addr,
     VeertuMemArea *mr;
     hwaddr len = *plen;
 
-    section = address_space_translate_internal(as->dispatch, addr, &addr, plen, true);
+    /*
+     * The returned area is only guaranteed to stay valid while the iothread
+     * mutex is held: subpages are freed together with the phys map they
+     * belong to. Callers that may not hold it go through
+     * address_space_translate_access().
+     */
+    rcu_read_lock();
+    section = address_space_translate_internal(atomic_rcu_read(&as->dispatch),
+                                               addr, &addr, plen, true);
     mr = section->mr;
+    rcu_read_unlock();
 
     *plen = len;
     *xlat = addr;
     return mr;
 }
 
+/*
+ * Translate for an access that is about to be dispatched, taking the
+ * iothread mutex first unless the caller holds it or the area can be
+ * accessed without it. *unlock_iothread tells the caller to drop the mutex
+ * once the access is done.
+ */
+static VeertuMemArea *address_space_translate_access(VeertuAddressSpace *as,
+                                                     hwaddr addr, hwaddr *xlat,
+                                                     hwaddr *plen, bool is_write,
+                                                     bool *unlock_iothread)
+{
+    MemAreaSection *section;
+    VeertuMemArea *mr;
+    hwaddr len = *plen;
+    bool lockless;
+
+    *unlock_iothread = false;
+    if (vmx_mutex_iothread_locked()) {
+        return address_space_translate(as, addr, xlat, plen, is_write);
+    }
+
+    /*
+     * Only RAM and areas that opted out of global locking outlive the phys
+     * map, so mr must not be looked at after rcu_read_unlock() unless it is
+     * one of those.
+     */
+    rcu_read_lock();
+    section = address_space_translate_internal(atomic_rcu_read(&as->dispatch),
+                                               addr, xlat, plen, true);
+    mr = section->mr;
+    lockless = memory_access_is_direct(mr, is_write) || !mr->global_locking;
+    rcu_read_unlock();
+
+    *plen = len;
+    if (lockless) {
+        return mr;
+    }
+
+    /* mem_commit runs under the iothread mutex, the lookup is stable now */
+    vmx_mutex_lock_iothread();
+    *unlock_iothread = true;
+    return address_space_translate(as, addr, xlat, plen, is_write);
+}
+
 MemAreaSection *
 address_space_translate_for_iotlb(VeertuAddressSpace *as, hwaddr addr, hwaddr *xlat,
                                   hwaddr *plen)
@@ -1594,9 +1649,11 @@ static void mem_commit(MemoryCallbacks *listener)
 
     phys_page_compact_all(next, next->map.nodes_nb);
 
-    as->dispatch = next;
+    atomic_rcu_set(&as->dispatch, next);
 
     if (cur) {
+        /* lockless readers may still be walking the old phys map */
+        synchronize_rcu();
         phys_sections_free(&cur->map);
         g_free(cur);
     }
@@ -1651,8 +1708,9 @@ void address_space_destroy_dispatch(VeertuAddressSpace *as)
     AddressSpaceDispatch *d = as->dispatch;
 
     memory_callbacks_unregister(&as->dispatch_listener);
+    atomic_rcu_set(&as->dispatch, NULL);
+    synchronize_rcu();
     g_free(d);
-    as->dispatch = NULL;
 }
 
 static void memory_map_init(void)
@@ -1771,10 +1829,12 @@ bool address_space_rw(VeertuAddressSpace *as, hwaddr addr, void *buf,
     hwaddr addr1;
     VeertuMemArea *mr;
     bool error = false;
+    bool unlock_iothread;
 
     while (len > 0) {
         l = len;
-        mr = address_space_translate(as, addr, &addr1, &l, is_write);
+        mr = address_space_translate_access(as, addr, &addr1, &l, is_write,
+                                            &unlock_iothread);
 
         if (is_write) {
             if (!memory_access_is_direct(mr, is_write)) {
@@ -1846,6 +1906,8 @@ bool address_space_rw(VeertuAddressSpace *as, hwaddr addr, void *buf,
                 memcpy(buf, ptr, l);
             }
         }
+        if (unlock_iothread)
+            vmx_mutex_unlock_iothread();
         len -= l;
         buf += l;
         addr += l;
@@ -1854,6 +1916,45 @@ bool address_space_rw(VeertuAddressSpace *as, hwaddr addr, void *buf,
     return error;
 }
 
+/*
+ * Access the same size byte location count times, buf holding one element
+ * per access. Areas with rep callbacks get the whole string in one call,
+ * everything else is dispatched one element at a time.
+ */
+bool address_space_rep_rw(VeertuAddressSpace *as, hwaddr addr, void *buf, unsigned size,
+                          uint32_t count, bool is_write)
+{
+    hwaddr l = size;
+    hwaddr addr1;
+    VeertuMemArea *mr;
+    bool error = false;
+    bool unlock_iothread;
+    bool has_rep = false;
+    uint8_t *ptr = buf;
+
+    mr = address_space_translate_access(as, addr, &addr1, &l, is_write,
+                                        &unlock_iothread);
+
+    if (l == size && !memory_access_is_direct(mr, is_write)) {
+        if (is_write) {
+            has_rep = mr->ops->write_rep != NULL;
+        } else {
+            has_rep = mr->ops->read_rep != NULL;
+        }
+    }
+
+    if (has_rep) {
+        error = memory_area_io_rep(mr, addr1, buf, size, count, is_write);
+    } else {
+        for (; count; count--, ptr += size)
+            error |= address_space_rw(as, addr, ptr, size, is_write);
+    }
+
+    if (unlock_iothread)
+        vmx_mutex_unlock_iothread();
+    return error;
+}
+
 bool address_space_write(VeertuAddressSpace *as, hwaddr addr,
                          const uint8_t *buf, int len)
 {
@@ -2011,6 +2112,16 @@ bool address_space_access_valid(VeertuAddressSpace *as, hwaddr addr, int len, bo
     return true;
 }
 
+/* true if [addr, addr + len) is plain RAM that can be copied in one go */
+bool address_space_is_direct(VeertuAddressSpace *as, hwaddr addr, hwaddr len, bool is_write)
+{
+    VeertuMemArea *mr;
+    hwaddr l = len, xlat;
+
+    mr = address_space_translate(as, addr, &xlat, &l, is_write);
+    return l >= len && memory_access_is_direct(mr, is_write);
+}
+
 /* Map a physical memory region into a host virtual address.
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
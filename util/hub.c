@@ -129,6 +129,30 @@ static void net_hub_port_cleanup(NetClientState *nc)
     QLIST_REMOVE(port, next);
 }
 
+static void net_hub_port_batch_begin(NetClientState *nc)
+{
+    NetHubPort *port;
+    NetHubPort *src_port = DO_UPCAST(NetHubPort, nc, nc);
+
+    QLIST_FOREACH(port, &src_port->hub->ports, next) {
+        if (port != src_port) {
+            vmx_send_batch_begin(&port->nc);
+        }
+    }
+}
+
+static void net_hub_port_batch_end(NetClientState *nc)
+{
+    NetHubPort *port;
+    NetHubPort *src_port = DO_UPCAST(NetHubPort, nc, nc);
+
+    QLIST_FOREACH(port, &src_port->hub->ports, next) {
+        if (port != src_port) {
+            vmx_send_batch_end(&port->nc);
+        }
+    }
+}
+
 static NetClientInfo net_hub_port_info = {
     .type = NET_CLIENT_OPTIONS_KIND_HUBPORT,
     .size = sizeof(NetHubPort),
@@ -136,6 +160,8 @@ static NetClientInfo net_hub_port_info = {
     .receive = net_hub_port_receive,
     .receive_iov = net_hub_port_receive_iov,
     .cleanup = net_hub_port_cleanup,
+    .batch_begin = net_hub_port_batch_begin,
+    .batch_end = net_hub_port_batch_end,
 };
 
 static NetHubPort *net_hub_port_new(NetHub *hub, const char *name)
@@ -32,35 +32,39 @@
 size_t iov_from_buf(const struct iovec *iov, unsigned int iov_cnt,
                     size_t offset, const void *buf, size_t bytes)
 {
-    int total = 0;
+    size_t done = 0;
 
-    while (bytes > 0 && iov_cnt) {
-        size_t len = MIN(bytes, iov->iov_len);
-        memcpy(iov->iov_base, buf, len);
-
-        total += len;
-        bytes -= len;
-        buf += len;
+    for (int i = 0; (offset || done < bytes) && i < iov_cnt; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
 
-        iov++;
-        iov_cnt--;
+        size_t len = MIN(iov[i].iov_len - offset, bytes - done);
+        memcpy(iov[i].iov_base + offset, buf + done, len);
+        done += len;
+        offset = 0;
     }
-    return total;
+    return done;
 }
 
 size_t iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
                   size_t offset, void *buf, size_t bytes)
 {
-    int total = 0;
-    for (int i = 0; i < iov_cnt && bytes; i++) {
-        size_t len = MIN(bytes, iov->iov_len);
-        memcpy(buf, iov->iov_base, len);
-        total += len;
-        buf += len;
-        bytes -= len;
-        iov++;
+    size_t done = 0;
+
+    for (int i = 0; (offset || done < bytes) && i < iov_cnt; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+
+        size_t len = MIN(iov[i].iov_len - offset, bytes - done);
+        memcpy(buf + done, iov[i].iov_base + offset, len);
+        done += len;
+        offset = 0;
     }
-    return total;
+    return done;
 }
 
 size_t iov_memset(const struct iovec *iov, unsigned int iov_cnt,
@@ -246,16 +250,60 @@ void vmx_iovec_destroy(QEMUIOVector *qiov)
     qiov->iov = NULL;
 }
 
-static bool is_buf_empty(char *buf, size_t size)
+/*
+ * Checks a buffer of any alignment and length for zeroes.  The aligned
+ * bulk goes through the vectorized buffer_find_nonzero_offset, the
+ * unaligned head and tail are checked bytewise.
+ */
+static bool is_buf_empty(const uint8_t *buf, size_t size)
 {
-    return buf[0] == 0 && !memcmp(buf, buf + 1, size - 1);
+    const size_t chunk = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR *
+                         sizeof(VECTYPE);
+    size_t head, bulk;
+
+    head = -(uintptr_t)buf & (sizeof(VECTYPE) - 1);
+    head = MIN(head, size);
+    for (; head > 0; head--, size--) {
+        if (*buf++) {
+            return false;
+        }
+    }
+
+    bulk = size - size % chunk;
+    if (bulk) {
+        if (buffer_find_nonzero_offset(buf, bulk) < bulk) {
+            return false;
+        }
+        buf += bulk;
+        size -= bulk;
+    }
+
+    while (size--) {
+        if (*buf++) {
+            return false;
+        }
+    }
+    return true;
 }
 
 bool vmx_iovec_is_zero(QEMUIOVector *qiov)
 {
-    for (int i = 0; i < qiov->niov; i++) {
-        if (!is_buf_empty(qiov->iov[i].iov_base, qiov->iov[i].iov_len))
+    int i;
+
+    /* Real data rarely starts with a zero byte; reject it cheaply before
+     * scanning anything in full.
+     */
+    for (i = 0; i < qiov->niov; i++) {
+        if (qiov->iov[i].iov_len &&
+            *(uint8_t *)qiov->iov[i].iov_base) {
             return false;
+        }
+    }
+
+    for (i = 0; i < qiov->niov; i++) {
+        if (!is_buf_empty(qiov->iov[i].iov_base, qiov->iov[i].iov_len)) {
+            return false;
+        }
     }
     return true;
 }
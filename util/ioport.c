@@ -200,9 +200,65 @@ static void portio_write(void *opaque, hwaddr addr, uint64_t data,
     }
 }
 
+static void portio_read_rep(void *opaque, hwaddr addr, void *buf,
+                            unsigned size, uint32_t count)
+{
+    MemoryRegionPortioList *mrpio = opaque;
+    const MemoryRegionPortio *mrp = find_portio(mrpio, addr, size, false);
+    uint8_t *ptr = buf;
+
+    if (mrp && mrp->read_rep) {
+        mrp->read_rep(mrpio->portio_opaque, mrp->base + addr, buf, count);
+        return;
+    }
+    for (; count; count--, ptr += size) {
+        uint64_t data = portio_read(opaque, addr, size);
+
+        switch (size) {
+        case 1:
+            stb_p(ptr, data);
+            break;
+        case 2:
+            stw_le_p(ptr, data);
+            break;
+        default:
+            stl_le_p(ptr, data);
+            break;
+        }
+    }
+}
+
+static void portio_write_rep(void *opaque, hwaddr addr, const void *buf,
+                             unsigned size, uint32_t count)
+{
+    MemoryRegionPortioList *mrpio = opaque;
+    const MemoryRegionPortio *mrp = find_portio(mrpio, addr, size, true);
+    const uint8_t *ptr = buf;
+
+    if (mrp && mrp->write_rep) {
+        mrp->write_rep(mrpio->portio_opaque, mrp->base + addr, buf, count);
+        return;
+    }
+    for (; count; count--, ptr += size) {
+        switch (size) {
+        case 1:
+            portio_write(opaque, addr, ldub_p(ptr), size);
+            break;
+        case 2:
+            portio_write(opaque, addr, lduw_le_p(ptr), size);
+            break;
+        default:
+            portio_write(opaque, addr, ldl_le_p(ptr), size);
+            break;
+        }
+    }
+}
+
 static const MemAreaOps portio_ops = {
     .read = portio_read,
     .write = portio_write,
+    .read_rep = portio_read_rep,
+    .write_rep = portio_write_rep,
     .endianness = DEVICE_LITTLE_ENDIAN,
     .valid.unaligned = true,
     .impl.unaligned = true,
@@ -26,6 +26,7 @@
 #include "qemu/timer.h"
 #include "qemu/sockets.h"	// struct in_addr needed for libslirp.h
 #include "slirp/libslirp.h"
+#include "net/slirp.h"
 #include "qemu/main-loop.h"
 #include "aio.h"
 
@@ -586,7 +587,9 @@ int main_loop_wait(int nonblocking)
     ret = vmx_event_wait_ns(timeout_ns);
     vmx_iohandler_poll(gpollfds, ret);
 #ifdef CONFIG_SLIRP
+    net_slirp_batch_begin();
     slirp_pollfds_poll(gpollfds, (ret < 0));
+    net_slirp_batch_end();
 #endif
 
     vmx_clock_run_all_timers();
@@ -3,6 +3,7 @@
 #include "sysemu.h"
 #include "typeinfo.h"
 #include "ioport.h"
+#include "qemu/main-loop.h"
 
 #define VEERTU_MEMORY "VeertuMem"
 
@@ -247,6 +248,7 @@ void mem_area_initfn(VeertuType *obj)
     
     area->type = TYPE_FN;
     area->enabled = 1;
+    area->global_locking = 1;
     area->ops = &do_nothing_ops;
     QTAILQ_INIT(&area->child);
 }
@@ -265,7 +267,36 @@ int mem_area_is_valid_access(VeertuMemArea *area, uint64_t addr, int size, int w
     return (!area->ops->valid.accepts || area->ops->valid.accepts(area->opaque, addr, size, write));
 }
 
-int memory_area_io_write(VeertuMemArea *area, uint64_t addr, uint64_t data, int size)
+/*
+ * Take the locks an access to area needs. The iothread mutex is taken unless
+ * the caller already holds it or the area opted out of global locking for
+ * this access; the area's own lock always nests inside it.
+ */
+static bool memory_area_access_lock(VeertuMemArea *area, uint64_t addr, int size, bool is_write)
+{
+    bool unlock_iothread = false;
+
+    if (!vmx_mutex_iothread_locked()) {
+        if (area->global_locking ||
+            (area->ops->unlocked && !area->ops->unlocked(area->opaque, addr, size, is_write))) {
+            vmx_mutex_lock_iothread();
+            unlock_iothread = true;
+        }
+    }
+    if (area->lock)
+        vmx_mutex_lock(area->lock);
+    return unlock_iothread;
+}
+
+static void memory_area_access_unlock(VeertuMemArea *area, bool unlock_iothread)
+{
+    if (area->lock)
+        vmx_mutex_unlock(area->lock);
+    if (unlock_iothread)
+        vmx_mutex_unlock_iothread();
+}
+
+static int __memory_area_io_write(VeertuMemArea *area, uint64_t addr, uint64_t data, int size)
 {
     if (!mem_area_is_valid_access(area, addr, size, 1))
         return 1;
@@ -314,7 +345,33 @@ int memory_area_io_write(VeertuMemArea *area, uint64_t addr, uint64_t data, int
     return 0;
 }
 
-int memory_area_io_read(VeertuMemArea *area, uint64_t addr, uint64_t *data, int size)
+int memory_area_io_write(VeertuMemArea *area, uint64_t addr, uint64_t data, int size)
+{
+    bool unlock_iothread = memory_area_access_lock(area, addr, size, true);
+    int ret = __memory_area_io_write(area, addr, data, size);
+
+    memory_area_access_unlock(area, unlock_iothread);
+    return ret;
+}
+
+/* count accesses to the same address, only for areas with rep callbacks */
+int memory_area_io_rep(VeertuMemArea *area, uint64_t addr, void *buf, int size, uint32_t count, bool is_write)
+{
+    bool unlock_iothread = memory_area_access_lock(area, addr, size, is_write);
+    int ret = 0;
+
+    if (!mem_area_is_valid_access(area, addr, size, is_write))
+        ret = 1;
+    else if (is_write)
+        area->ops->write_rep(area->opaque, addr, buf, size, count);
+    else
+        area->ops->read_rep(area->opaque, addr, buf, size, count);
+
+    memory_area_access_unlock(area, unlock_iothread);
+    return ret;
+}
+
+static int __memory_area_io_read(VeertuMemArea *area, uint64_t addr, uint64_t *data, int size)
 {
     if (!mem_area_is_valid_access(area, addr, size, 0))
         return 1;
@@ -365,6 +422,15 @@ int memory_area_io_read(VeertuMemArea *area, uint64_t addr, uint64_t *data, int
     return 0;
 }
 
+int memory_area_io_read(VeertuMemArea *area, uint64_t addr, uint64_t *data, int size)
+{
+    bool unlock_iothread = memory_area_access_lock(area, addr, size, false);
+    int ret = __memory_area_io_read(area, addr, data, size);
+
+    memory_area_access_unlock(area, unlock_iothread);
+    return ret;
+}
+
 void memory_area_init_io(VeertuMemArea *mem_area, VeertuType *owner, MemAreaOps *mem_ops, void *opaque, char * name, uint64_t size)
 {
     memory_area_init(mem_area, name, size);
@@ -528,6 +594,26 @@ void mem_area_set_alias_offset(VeertuMemArea *area, uint64_t offset)
     veertu_mem_referesh();
 }
 
+void memory_area_set_global_locking(VeertuMemArea *area)
+{
+    area->global_locking = 1;
+}
+
+/*
+ * Let vcpu threads dispatch accesses to area without the iothread mutex.
+ * The device has to protect its state with memory_area_set_lock() or its
+ * MemAreaOps.unlocked filter.
+ */
+void memory_area_clear_global_locking(VeertuMemArea *area)
+{
+    area->global_locking = 0;
+}
+
+void memory_area_set_lock(VeertuMemArea *area, QemuMutex *lock)
+{
+    area->lock = lock;
+}
+
 uint64_t mem_area_get_ram_addr(VeertuMemArea *area)
 {
     return area->ram_addr;
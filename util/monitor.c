@@ -424,6 +424,27 @@ void cmd_show_ip_address(Monitor *mon, int argc, char *argv[])
     monitor_puts(mon, buf);
 }
 
+static int GCC_FMT_ATTR(2, 3) monitor_fprintf(FILE *stream,
+                                              const char *fmt, ...)
+{
+    Monitor *mon = (Monitor *)stream;
+    va_list ap;
+    char *buf;
+
+    va_start(ap, fmt);
+    buf = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    monitor_puts(mon, buf);
+    g_free(buf);
+    return 0;
+}
+
+/* Per vcpu exit counters of the running VM, see veertu_count_exit() */
+void cmd_exit_stats(Monitor *mon, int argc, char *argv[])
+{
+    veertu_dump_exit_stats((FILE *)mon, monitor_fprintf);
+}
+
 void cmd_add_port_forward(Monitor *mon, int argc, char *argv[])
 {
     int res = -1;
@@ -457,6 +478,7 @@ static struct cmd_handler handlers[] = {
     {"shutdown", cmd_shutdown},
     {"suspend", cmd_suspend},
     {"ip_addr", cmd_show_ip_address},
+    {"exit_stats", cmd_exit_stats},
     {"add_port_forward", cmd_add_port_forward},
     {"del_port_forward", cmd_del_port_forward},
 };
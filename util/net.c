@@ -513,6 +513,27 @@ ssize_t vmx_deliver_packet(NetClientState *sender,
     return ret;
 }
 
+/* Bracket a burst of packets sent by nc, so that the receiving peer can
+ * batch its per-packet work.  Must be paired with vmx_send_batch_end().
+ */
+void vmx_send_batch_begin(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    if (peer && peer->info->batch_begin) {
+        peer->info->batch_begin(peer);
+    }
+}
+
+void vmx_send_batch_end(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    if (peer && peer->info->batch_end) {
+        peer->info->batch_end(peer);
+    }
+}
+
 void vmx_purge_queued_packets(NetClientState *nc)
 {
     if (!nc->peer) {
@@ -525,6 +546,8 @@ void vmx_purge_queued_packets(NetClientState *nc)
 static
 void vmx_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
 {
+    bool flushed;
+
     nc->receive_disabled = 0;
 
     if (nc->peer && nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_HUBPORT) {
@@ -532,7 +555,15 @@ void vmx_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
             vmx_notify_event();
         }
     }
-    if (vmx_net_queue_flush(nc->incoming_queue)) {
+    if (nc->info->batch_begin) {
+        nc->info->batch_begin(nc);
+    }
+    flushed = vmx_net_queue_flush(nc->incoming_queue);
+    if (nc->info->batch_end) {
+        nc->info->batch_end(nc);
+    }
+
+    if (flushed) {
         /* We emptied the queue successfully, signal to the IO thread to repoll
          * the file descriptor (for tap, for example).
          */
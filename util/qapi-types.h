@@ -2743,6 +2743,14 @@ struct ImageInfoSpecificQCow2
     bool lazy_refcounts;
     bool has_corrupt;
     bool corrupt;
+    bool has_l2_cache_hits;
+    int64_t l2_cache_hits;
+    bool has_l2_cache_misses;
+    int64_t l2_cache_misses;
+    bool has_refcount_cache_hits;
+    int64_t refcount_cache_hits;
+    bool has_refcount_cache_misses;
+    int64_t refcount_cache_misses;
 };
 
 void qapi_free_ImageInfoSpecificQCow2List(ImageInfoSpecificQCow2List *obj);
@@ -2938,6 +2946,38 @@ struct BlockDeviceStats
     int64_t wr_total_time_ns;
     int64_t rd_total_time_ns;
     int64_t wr_highest_offset;
+    int64_t failed_rd_operations;
+    int64_t failed_wr_operations;
+    int64_t failed_flush_operations;
+    int64_t invalid_rd_operations;
+    int64_t invalid_wr_operations;
+    int64_t invalid_flush_operations;
+    int64_t zero_detected_operations;
+    int64_t zero_detected_bytes;
+    int64_t in_flight;
+    int64_t max_in_flight;
+    double avg_in_flight;
+    intList *rd_latency_histogram;
+    intList *wr_latency_histogram;
+    intList *flush_latency_histogram;
+    bool has_idle_time_ns;
+    int64_t idle_time_ns;
+    bool has_rd_throttled_operations;
+    int64_t rd_throttled_operations;
+    bool has_wr_throttled_operations;
+    int64_t wr_throttled_operations;
+    bool has_rd_throttled_time_ns;
+    int64_t rd_throttled_time_ns;
+    bool has_wr_throttled_time_ns;
+    int64_t wr_throttled_time_ns;
+    bool has_rd_throttled_queue_depth;
+    int64_t rd_throttled_queue_depth;
+    bool has_wr_throttled_queue_depth;
+    int64_t wr_throttled_queue_depth;
+    bool has_rd_throttled_queue_depth_max;
+    int64_t rd_throttled_queue_depth_max;
+    bool has_wr_throttled_queue_depth_max;
+    int64_t wr_throttled_queue_depth_max;
 };
 
 void qapi_free_BlockDeviceStatsList(BlockDeviceStatsList *obj);
@@ -596,6 +596,34 @@ static void visit_type_ImageInfoSpecificQCow2_fields(Visitor *m, ImageInfoSpecif
     if (err) {
         goto out;
     }
+    visit_optional(m, &(*obj)->has_l2_cache_hits, "l2-cache-hits", &err);
+    if (!err && (*obj)->has_l2_cache_hits) {
+        visit_type_int(m, &(*obj)->l2_cache_hits, "l2-cache-hits", &err);
+    }
+    if (err) {
+        goto out;
+    }
+    visit_optional(m, &(*obj)->has_l2_cache_misses, "l2-cache-misses", &err);
+    if (!err && (*obj)->has_l2_cache_misses) {
+        visit_type_int(m, &(*obj)->l2_cache_misses, "l2-cache-misses", &err);
+    }
+    if (err) {
+        goto out;
+    }
+    visit_optional(m, &(*obj)->has_refcount_cache_hits, "refcount-cache-hits", &err);
+    if (!err && (*obj)->has_refcount_cache_hits) {
+        visit_type_int(m, &(*obj)->refcount_cache_hits, "refcount-cache-hits", &err);
+    }
+    if (err) {
+        goto out;
+    }
+    visit_optional(m, &(*obj)->has_refcount_cache_misses, "refcount-cache-misses", &err);
+    if (!err && (*obj)->has_refcount_cache_misses) {
+        visit_type_int(m, &(*obj)->refcount_cache_misses, "refcount-cache-misses", &err);
+    }
+    if (err) {
+        goto out;
+    }
 
 out:
     error_propagate(errp, err);
@@ -1536,6 +1564,125 @@ static void visit_type_BlockDeviceStats_fields(Visitor *m, BlockDeviceStats **ob
     if (err) {
         goto out;
     }
+    visit_type_int(m, &(*obj)->failed_rd_operations, "failed_rd_operations", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->failed_wr_operations, "failed_wr_operations", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->failed_flush_operations, "failed_flush_operations", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->invalid_rd_operations, "invalid_rd_operations", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->invalid_wr_operations, "invalid_wr_operations", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->invalid_flush_operations, "invalid_flush_operations", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->zero_detected_operations, "zero_detected_operations", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->zero_detected_bytes, "zero_detected_bytes", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->in_flight, "in_flight", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_int(m, &(*obj)->max_in_flight, "max_in_flight", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_number(m, &(*obj)->avg_in_flight, "avg_in_flight", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_intList(m, &(*obj)->rd_latency_histogram, "rd_latency_histogram", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_intList(m, &(*obj)->wr_latency_histogram, "wr_latency_histogram", &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_intList(m, &(*obj)->flush_latency_histogram, "flush_latency_histogram", &err);
+    if (err) {
+        goto out;
+    }
+    visit_optional(m, &(*obj)->has_idle_time_ns, "idle_time_ns", &err);
+    if (!err && (*obj)->has_idle_time_ns) {
+        visit_type_int(m, &(*obj)->idle_time_ns, "idle_time_ns", &err);
+    }
+    if (err) {
+        goto out;
+    }
+    visit_optional(m, &(*obj)->has_rd_throttled_operations, "rd_throttled_operations", &err);
+    if (!err && (*obj)->has_rd_throttled_operations) {
+        visit_type_int(m, &(*obj)->rd_throttled_operations, "rd_throttled_operations", &err);
+    }
+    if (err) {
+        goto out;
+    }
+    visit_optional(m, &(*obj)->has_wr_throttled_operations, "wr_throttled_operations", &err);
+    if (!err && (*obj)->has_wr_throttled_operations) {
+        visit_type_int(m, &(*obj)->wr_throttled_operations, "wr_throttled_operations", &err);
+    }
+    if (err) {
+        goto out;
+    }
+    visit_optional(m, &(*obj)->has_rd_throttled_time_ns, "rd_throttled_time_ns", &err);
+    if (!err && (*obj)->has_rd_throttled_time_ns) {
+        visit_type_int(m, &(*obj)->rd_throttled_time_ns, "rd_throttled_time_ns", &err);
+    }
+    if (err) {
+        goto out;
+    }
+    visit_optional(m, &(*obj)->has_wr_throttled_time_ns, "wr_throttled_time_ns", &err);
+    if (!err && (*obj)->has_wr_throttled_time_ns) {
+        visit_type_int(m, &(*obj)->wr_throttled_time_ns, "wr_throttled_time_ns", &err);
+    }
+    if (err) {
+        goto out;
+    }
+    visit_optional(m, &(*obj)->has_rd_throttled_queue_depth, "rd_throttled_queue_depth", &err);
+    if (!err && (*obj)->has_rd_throttled_queue_depth) {
+        visit_type_int(m, &(*obj)->rd_throttled_queue_depth, "rd_throttled_queue_depth", &err);
+    }
+    if (err) {
+        goto out;
+    }
+    visit_optional(m, &(*obj)->has_wr_throttled_queue_depth, "wr_throttled_queue_depth", &err);
+    if (!err && (*obj)->has_wr_throttled_queue_depth) {
+        visit_type_int(m, &(*obj)->wr_throttled_queue_depth, "wr_throttled_queue_depth", &err);
+    }
+    if (err) {
+        goto out;
+    }
+    visit_optional(m, &(*obj)->has_rd_throttled_queue_depth_max, "rd_throttled_queue_depth_max", &err);
+    if (!err && (*obj)->has_rd_throttled_queue_depth_max) {
+        visit_type_int(m, &(*obj)->rd_throttled_queue_depth_max, "rd_throttled_queue_depth_max", &err);
+    }
+    if (err) {
+        goto out;
+    }
+    visit_optional(m, &(*obj)->has_wr_throttled_queue_depth_max, "wr_throttled_queue_depth_max", &err);
+    if (!err && (*obj)->has_wr_throttled_queue_depth_max) {
+        visit_type_int(m, &(*obj)->wr_throttled_queue_depth_max, "wr_throttled_queue_depth_max", &err);
+    }
+    if (err) {
+        goto out;
+    }
 
 out:
     error_propagate(errp, err);
@@ -0,0 +1,92 @@
+/*
+ * Read-copy-update, see include/qemu/rcu.h
+ *
+ * Every thread that enters a read-side critical section registers a
+ * rcu_reader_data on first use.  synchronize_rcu() bumps rcu_gp_ctr and
+ * waits for each registered reader that is inside a section begun under an
+ * older counter value.  A reader that starts after the bump already sees
+ * the pointer the updater published before calling synchronize_rcu().
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+#include <stdlib.h>
+#include "qemu/rcu.h"
+
+unsigned long rcu_gp_ctr = 1;
+
+DEFINE_TLS(struct rcu_reader_data *, rcu_reader);
+
+/* protects registry and serializes synchronize_rcu() */
+static pthread_mutex_t rcu_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static QLIST_HEAD(, rcu_reader_data) registry = QLIST_HEAD_INITIALIZER(registry);
+
+static pthread_once_t rcu_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t rcu_key;
+
+static void rcu_unregister_thread(void *opaque)
+{
+    struct rcu_reader_data *p_rcu_reader = opaque;
+
+    pthread_mutex_lock(&rcu_registry_lock);
+    QLIST_REMOVE(p_rcu_reader, node);
+    pthread_mutex_unlock(&rcu_registry_lock);
+    free(p_rcu_reader);
+}
+
+static void rcu_init_key(void)
+{
+    pthread_key_create(&rcu_key, rcu_unregister_thread);
+}
+
+/* Called by rcu_read_lock() the first time a thread enters a section */
+struct rcu_reader_data *rcu_register_thread(void)
+{
+    struct rcu_reader_data *p_rcu_reader = calloc(1, sizeof(*p_rcu_reader));
+
+    assert(p_rcu_reader);
+    pthread_once(&rcu_key_once, rcu_init_key);
+    pthread_setspecific(rcu_key, p_rcu_reader);
+
+    pthread_mutex_lock(&rcu_registry_lock);
+    QLIST_INSERT_HEAD(&registry, p_rcu_reader, node);
+    pthread_mutex_unlock(&rcu_registry_lock);
+
+    tls_var(rcu_reader) = p_rcu_reader;
+    return p_rcu_reader;
+}
+
+void synchronize_rcu(void)
+{
+    struct rcu_reader_data *p_rcu_reader = tls_var(rcu_reader);
+    unsigned long gp;
+
+    /* waiting for our own section would never finish */
+    assert(!p_rcu_reader || !p_rcu_reader->depth);
+
+    pthread_mutex_lock(&rcu_registry_lock);
+
+    /*
+     * Order the caller's atomic_rcu_set() before the reader counters are
+     * sampled; rcu_read_lock() orders its counter store before its loads
+     * of protected pointers the same way.
+     */
+    gp = atomic_fetch_inc(&rcu_gp_ctr) + 1;
+
+    QLIST_FOREACH(p_rcu_reader, &registry, node) {
+        for (;;) {
+            unsigned long ctr = atomic_read(&p_rcu_reader->ctr);
+
+            if (!ctr || ctr == gp) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+
+    pthread_mutex_unlock(&rcu_registry_lock);
+}
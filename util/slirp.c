@@ -108,6 +108,27 @@ void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
     vmx_send_packet(&s->nc, pkt, pkt_len);
 }
 
+/* Bracket slirp_pollfds_poll() so that the frames it emits reach each
+ * peer as a single burst.
+ */
+void net_slirp_batch_begin(void)
+{
+    SlirpState *s;
+
+    QTAILQ_FOREACH(s, &slirp_stacks, entry) {
+        vmx_send_batch_begin(&s->nc);
+    }
+}
+
+void net_slirp_batch_end(void)
+{
+    SlirpState *s;
+
+    QTAILQ_FOREACH(s, &slirp_stacks, entry) {
+        vmx_send_batch_end(&s->nc);
+    }
+}
+
 static ssize_t net_slirp_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
@@ -189,6 +189,7 @@ static void tap_send(void *opaque)
     int size;
     int packets = 0;
 
+    vmx_send_batch_begin(&s->nc);
     while (vmx_can_send_packet(&s->nc)) {
         uint8_t *buf = s->buf;
 
@@ -221,6 +222,7 @@ static void tap_send(void *opaque)
             break;
         }
     }
+    vmx_send_batch_end(&s->nc);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -25,6 +25,9 @@ struct ThreadPoolElement {
     enum ThreadState state;
     int ret;
 
+    /* Link in pool->submitted or pool->completed, pushed without locks.  */
+    ThreadPoolElement *next;
+
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
@@ -42,27 +45,92 @@ struct ThreadPool {
 
     /* The following variables are only accessed from one VeertuAioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    ThreadPoolElement *completion_list;
+
+    /* Lock-free stacks: any thread pushes, one consumer takes them whole.  */
+    ThreadPoolElement *submitted;
+    ThreadPoolElement *completed;
 
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    int cur_threads;
+
+    /* Workers blocked in vmx_sem_wait, updated atomically.  */
+    int idle_threads;
 
     bool stopping;
 };
 
+/* Push elem on a lock-free stack, return true if the stack was empty.  */
+static bool thread_pool_push(ThreadPoolElement **stack, ThreadPoolElement *elem)
+{
+    ThreadPoolElement *old;
+
+    do {
+        old = atomic_read(stack);
+        elem->next = old;
+    } while (atomic_cmpxchg(stack, old, elem) != old);
+    return old == NULL;
+}
+
+/* Take the whole stack, returned in push (i.e. FIFO) order.  */
+static ThreadPoolElement *thread_pool_take_all(ThreadPoolElement **stack)
+{
+    ThreadPoolElement *elem = atomic_xchg(stack, NULL);
+    ThreadPoolElement *fifo = NULL, *next;
+
+    for (; elem; elem = next) {
+        next = elem->next;
+        elem->next = fifo;
+        fifo = elem;
+    }
+    return fifo;
+}
+
+/* Move submitted requests to request_list.  Called with lock held.  */
+static void thread_pool_drain_submitted(ThreadPool *pool)
+{
+    ThreadPoolElement *elem, *next;
+
+    for (elem = thread_pool_take_all(&pool->submitted); elem; elem = next) {
+        next = elem->next;
+        QTAILQ_INSERT_TAIL(&pool->request_list, elem, reqs);
+    }
+}
+
+static void thread_pool_complete(ThreadPool *pool, ThreadPoolElement *elem)
+{
+    /* The first completion of a batch schedules the bottom half, later
+     * ones ride along until it has run.
+     */
+    if (thread_pool_push(&pool->completed, elem)) {
+        vmx_bh_schedule(pool->completion_bh);
+    }
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
 
     while (!pool->stopping) {
-        vmx_sem_timedwait(&pool->sem, 10000);
+        ThreadPoolElement *req;
+
+        atomic_inc(&pool->idle_threads);
+        vmx_sem_wait(&pool->sem);
+        atomic_dec(&pool->idle_threads);
 
+        /* One token is posted per request, but cancelled requests leave
+         * their token behind, so the queue may be empty here.
+         */
         vmx_mutex_lock(&pool->lock);
         if (QTAILQ_EMPTY(&pool->request_list)) {
+            thread_pool_drain_submitted(pool);
+        }
+        req = QTAILQ_FIRST(&pool->request_list);
+        if (!req) {
             vmx_mutex_unlock(&pool->lock);
             continue;
         }
-
-        ThreadPoolElement *req = QTAILQ_FIRST(&pool->request_list);
         QTAILQ_REMOVE(&pool->request_list, req, reqs);
         req->state = THREAD_ACTIVE;
         vmx_mutex_unlock(&pool->lock);
@@ -71,47 +139,58 @@ static void *worker_thread(void *opaque)
         smp_wmb();
         req->state = THREAD_DONE;
 
-        vmx_mutex_lock(&pool->lock);
-        vmx_bh_schedule(pool->completion_bh);
-        vmx_mutex_unlock(&pool->lock);
+        thread_pool_complete(pool, req);
     }
 
     return NULL;
 }
 
-static void spawn_thread(ThreadPool *pool, int i)
+static void spawn_thread(ThreadPool *pool)
 {
-    vmx_thread_create(&pool->threads[i], "worker", worker_thread, pool, QEMU_THREAD_JOINABLE);
+    vmx_mutex_lock(&pool->lock);
+    /* Recheck, another submitter may have spawned one meanwhile */
+    if (atomic_read(&pool->idle_threads) == 0 &&
+        pool->cur_threads < pool->max_threads && !pool->stopping) {
+        vmx_thread_create(&pool->threads[pool->cur_threads++], "worker",
+                          worker_thread, pool, QEMU_THREAD_JOINABLE);
+    }
+    vmx_mutex_unlock(&pool->lock);
 }
 
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
-
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE)
+    ThreadPoolElement *elem, *tail;
+
+    /* Append the new batch to completion_list, which may still hold
+     * elements of an outer invocation if a callback ran aio_poll().
+     */
+    elem = thread_pool_take_all(&pool->completed);
+    if (pool->completion_list) {
+        for (tail = pool->completion_list; tail->next; tail = tail->next) {
             continue;
+        }
+        tail->next = elem;
+    } else {
+        pool->completion_list = elem;
+    }
 
-        if (elem->state == THREAD_DONE && elem->common.cb) {
-            QLIST_REMOVE(elem, all);
-            /* Read state before ret.  */
-            smp_rmb();
+    while ((elem = pool->completion_list) != NULL) {
+        pool->completion_list = elem->next;
+        QLIST_REMOVE(elem, all);
+        /* Read state before ret.  */
+        smp_rmb();
 
-            /* Schedule ourselves in case elem->common.cb() calls aio_poll() to
-             * wait for another request that completed at the same time.
+        if (elem->common.cb) {
+            /* Schedule ourselves in case elem->common.cb() calls aio_poll()
+             * to wait for another request that completed at the same time.
              */
-            vmx_bh_schedule(pool->completion_bh);
-
+            if (pool->completion_list) {
+                vmx_bh_schedule(pool->completion_bh);
+            }
             elem->common.cb(elem->common.opaque, elem->ret);
-            vmx_aio_unref(elem);
-            goto restart;
-        } else {
-            /* remove the request */
-            QLIST_REMOVE(elem, all);
-            vmx_aio_unref(elem);
         }
+        vmx_aio_unref(elem);
     }
 }
 
@@ -119,17 +198,24 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
     ThreadPool *pool = elem->pool;
+    bool cancelled = false;
 
     vmx_mutex_lock(&pool->lock);
-    if (elem->state == THREAD_QUEUED && vmx_sem_timedwait(&pool->sem, 0) == 0) {
+    if (elem->state == THREAD_QUEUED) {
+        /* A queued request is either still on the submission stack or
+         * already on request_list; after draining it is on the latter.
+         */
+        thread_pool_drain_submitted(pool);
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        vmx_bh_schedule(pool->completion_bh);
-
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        cancelled = true;
     }
-
     vmx_mutex_unlock(&pool->lock);
+
+    if (cancelled) {
+        thread_pool_complete(pool, elem);
+    }
 }
 
 static VeertuAioContext *thread_pool_get_aio_context(BlockAIOCB *acb)
@@ -157,12 +243,13 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     req->state = THREAD_QUEUED;
     req->pool = pool;
 
-    vmx_mutex_lock(&pool->lock);
-
     QLIST_INSERT_HEAD(&pool->head, req, all);
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    vmx_mutex_unlock(&pool->lock);
+    thread_pool_push(&pool->submitted, req);
 
+    if (atomic_read(&pool->idle_threads) == 0 &&
+        pool->cur_threads < pool->max_threads) {
+        spawn_thread(pool);
+    }
     vmx_sem_post(&pool->sem);
     return &req->common;
 }
@@ -208,14 +295,14 @@ ThreadPool *thread_pool_create(VeertuAioContext *ctx, int thread_cnt)
     pool->completion_bh = aio_bh_new(ctx, thread_pool_completion_bh, pool);
     vmx_mutex_init(&pool->lock);
     vmx_sem_init(&pool->sem, 0);
+    if (thread_cnt <= 0 || thread_cnt > MAX_THREADS)
+        thread_cnt = MAX_THREADS;
     pool->max_threads = thread_cnt;
 
     QLIST_INIT(&pool->head);
     QTAILQ_INIT(&pool->request_list);
 
-    for (int i = 0; i < thread_cnt; i++)
-        spawn_thread(pool, i);
-
+    /* Workers are spawned on demand by thread_pool_submit_aio */
     return pool;
 }
 
@@ -227,11 +314,13 @@ void thread_pool_destroy(ThreadPool *pool)
     assert(QLIST_EMPTY(&pool->head));
 
     /* Wait for worker threads to terminate */
+    vmx_mutex_lock(&pool->lock);
     pool->stopping = true;
+    vmx_mutex_unlock(&pool->lock);
 
-    for (int i = 0; i < pool->max_threads; i++)
+    for (int i = 0; i < pool->cur_threads; i++)
         vmx_sem_post(&pool->sem);
-    for (int i = 0; i < pool->max_threads; i++)
+    for (int i = 0; i < pool->cur_threads; i++)
         vmx_thread_join(&pool->threads[i]);
 
     vmx_bh_delete(pool->completion_bh);
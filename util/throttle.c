@@ -0,0 +1,289 @@
+/*
+ * Leaky bucket I/O throttling
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/throttle.h"
+#include "qemu/timer.h"
+#include "aio.h"
+
+/* Drain a bucket by the amount its average rate allows over delta_ns */
+void throttle_leak_bucket(LeakyBucket *bkt, int64_t delta_ns)
+{
+    double leak;
+
+    leak = (bkt->avg * (double) delta_ns) / NANOSECONDS_PER_SECOND;
+    bkt->level = MAX(bkt->level - leak, 0);
+}
+
+static void throttle_do_leak(ThrottleState *ts, int64_t now)
+{
+    int64_t delta_ns = now - ts->previous_leak;
+    int i;
+
+    ts->previous_leak = now;
+
+    if (delta_ns <= 0) {
+        return;
+    }
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        throttle_leak_bucket(&ts->cfg.buckets[i], delta_ns);
+    }
+}
+
+/* Time in ns until a bucket has drained below its burst allowance,
+ * or 0 if the next request may go right away.
+ */
+int64_t throttle_compute_wait(LeakyBucket *bkt)
+{
+    double extra;
+
+    if (!bkt->avg) {
+        return 0;
+    }
+
+    extra = bkt->level - bkt->max;
+    if (extra <= 0) {
+        return 0;
+    }
+
+    return extra * NANOSECONDS_PER_SECOND / bkt->avg;
+}
+
+static int64_t throttle_compute_wait_for(ThrottleState *ts, bool is_write)
+{
+    static const BucketType to_check[2][4] = {
+        { THROTTLE_BPS_TOTAL, THROTTLE_OPS_TOTAL,
+          THROTTLE_BPS_READ, THROTTLE_OPS_READ },
+        { THROTTLE_BPS_TOTAL, THROTTLE_OPS_TOTAL,
+          THROTTLE_BPS_WRITE, THROTTLE_OPS_WRITE },
+    };
+    int64_t wait, max_wait = 0;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        wait = throttle_compute_wait(&ts->cfg.buckets[to_check[is_write][i]]);
+        max_wait = MAX(max_wait, wait);
+    }
+
+    return max_wait;
+}
+
+/* Leak the buckets up to now and return true if a request in the given
+ * direction must wait, with *next_timestamp set to when it may proceed.
+ */
+bool throttle_compute_timer(ThrottleState *ts, bool is_write, int64_t now,
+                            int64_t *next_timestamp)
+{
+    int64_t wait;
+
+    throttle_do_leak(ts, now);
+    wait = throttle_compute_wait_for(ts, is_write);
+    *next_timestamp = now + wait;
+    return wait != 0;
+}
+
+void throttle_attach_aio_context(ThrottleState *ts,
+                                 VeertuAioContext *new_context)
+{
+    ts->timers[0] = aio_timer_new(new_context, ts->clock_type, SCALE_NS,
+                                  ts->read_timer_cb, ts->timer_opaque);
+    ts->timers[1] = aio_timer_new(new_context, ts->clock_type, SCALE_NS,
+                                  ts->write_timer_cb, ts->timer_opaque);
+}
+
+void throttle_init(ThrottleState *ts, VeertuAioContext *aio_context,
+                   QEMUClockType clock_type,
+                   QEMUTimerCB *read_timer_cb,
+                   QEMUTimerCB *write_timer_cb,
+                   void *timer_opaque)
+{
+    memset(ts, 0, sizeof(ThrottleState));
+
+    ts->clock_type = clock_type;
+    ts->read_timer_cb = read_timer_cb;
+    ts->write_timer_cb = write_timer_cb;
+    ts->timer_opaque = timer_opaque;
+    throttle_attach_aio_context(ts, aio_context);
+}
+
+static void throttle_cancel_timer(QEMUTimer *timer)
+{
+    if (timer) {
+        timer_del(timer);
+    }
+}
+
+void throttle_detach_aio_context(ThrottleState *ts)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (ts->timers[i]) {
+            timer_del(ts->timers[i]);
+            timer_free(ts->timers[i]);
+            ts->timers[i] = NULL;
+        }
+    }
+}
+
+void throttle_destroy(ThrottleState *ts)
+{
+    throttle_detach_aio_context(ts);
+}
+
+bool throttle_have_timer(ThrottleState *ts)
+{
+    return ts->timers[0] != NULL;
+}
+
+bool throttle_enabled(ThrottleConfig *cfg)
+{
+    int i;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        if (cfg->buckets[i].avg > 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* A total limit cannot be combined with a read or write limit of the
+ * same kind.
+ */
+bool throttle_conflicting(ThrottleConfig *cfg)
+{
+    LeakyBucket *b = cfg->buckets;
+    bool bps_flag, ops_flag, bps_max_flag, ops_max_flag;
+
+    bps_flag = b[THROTTLE_BPS_TOTAL].avg &&
+               (b[THROTTLE_BPS_READ].avg || b[THROTTLE_BPS_WRITE].avg);
+    ops_flag = b[THROTTLE_OPS_TOTAL].avg &&
+               (b[THROTTLE_OPS_READ].avg || b[THROTTLE_OPS_WRITE].avg);
+    bps_max_flag = b[THROTTLE_BPS_TOTAL].max &&
+                   (b[THROTTLE_BPS_READ].max || b[THROTTLE_BPS_WRITE].max);
+    ops_max_flag = b[THROTTLE_OPS_TOTAL].max &&
+                   (b[THROTTLE_OPS_READ].max || b[THROTTLE_OPS_WRITE].max);
+
+    return bps_flag || ops_flag || bps_max_flag || ops_max_flag;
+}
+
+bool throttle_is_valid(ThrottleConfig *cfg)
+{
+    int i;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        if (cfg->buckets[i].avg < 0 || cfg->buckets[i].max < 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Without an explicit burst limit a bucket still absorbs a tenth of a
+ * second worth of I/O, so that requests are not serialized one by one.
+ */
+static void throttle_fix_bucket(LeakyBucket *bkt)
+{
+    bkt->level = 0;
+    if (bkt->avg && !bkt->max) {
+        bkt->max = bkt->avg / 10;
+    }
+}
+
+static void throttle_unfix_bucket(LeakyBucket *bkt)
+{
+    if (bkt->max < bkt->avg) {
+        bkt->max = 0;
+    }
+}
+
+void throttle_config(ThrottleState *ts, ThrottleConfig *cfg)
+{
+    int i;
+
+    ts->cfg = *cfg;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        throttle_fix_bucket(&ts->cfg.buckets[i]);
+    }
+
+    ts->previous_leak = vmx_clock_get_ns(ts->clock_type);
+
+    for (i = 0; i < 2; i++) {
+        throttle_cancel_timer(ts->timers[i]);
+    }
+}
+
+void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg)
+{
+    int i;
+
+    *cfg = ts->cfg;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        throttle_unfix_bucket(&cfg->buckets[i]);
+    }
+}
+
+/* Return true if a request in the given direction must wait, arming the
+ * direction's timer for when it may proceed.
+ */
+bool throttle_schedule_timer(ThrottleState *ts, bool is_write)
+{
+    int64_t now = vmx_clock_get_ns(ts->clock_type);
+    int64_t next_timestamp;
+
+    if (!throttle_compute_timer(ts, is_write, now, &next_timestamp)) {
+        return false;
+    }
+
+    if (!timer_pending(ts->timers[is_write])) {
+        timer_mod(ts->timers[is_write], next_timestamp);
+    }
+    return true;
+}
+
+/* Fill the buckets for a request that is about to be issued.  Requests
+ * larger than op_size count as several operations.
+ */
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
+{
+    double units = 1.0;
+
+    if (ts->cfg.op_size && size > ts->cfg.op_size) {
+        units = (double) size / ts->cfg.op_size;
+    }
+
+    ts->cfg.buckets[THROTTLE_BPS_TOTAL].level += size;
+    ts->cfg.buckets[THROTTLE_OPS_TOTAL].level += units;
+
+    if (is_write) {
+        ts->cfg.buckets[THROTTLE_BPS_WRITE].level += size;
+        ts->cfg.buckets[THROTTLE_OPS_WRITE].level += units;
+    } else {
+        ts->cfg.buckets[THROTTLE_BPS_READ].level += size;
+        ts->cfg.buckets[THROTTLE_OPS_READ].level += units;
+    }
+}
@@ -375,6 +375,9 @@ static QemuOptsList vmx_realtime_opts = {
         {
             .name = "mlock",
             .type = QEMU_OPT_BOOL,
+        }, {
+            .name = "halt-poll-ns",
+            .type = QEMU_OPT_NUMBER,
         },
         { /* end of list */ }
     },
@@ -2902,6 +2905,8 @@ int veertu_run(int argc, char **argv, char **envp)
                     exit(1);
                 }
                 enable_mlock = vmx_opt_get_bool(opts, "mlock", true);
+                halt_poll_ns_max = vmx_opt_get_number(opts, "halt-poll-ns",
+                                                      halt_poll_ns_max);
                 break;
             case QEMU_OPTION_msg:
                 opts = vmx_opts_parse(vmx_find_opts("msg"), optarg, 0);
@@ -3449,6 +3454,10 @@ int veertu_run(int argc, char **argv, char **envp)
     vmx_process_events();
     bdrv_close_all();
     pause_all_vcpus();
+    /* VEERTU_EXIT_STATS=1 prints the per vcpu exit counters on shutdown */
+    if (parse_debug_env("VEERTU_EXIT_STATS", 1, 0)) {
+        veertu_dump_exit_stats(stderr, fprintf);
+    }
     res_free();
 #ifdef CONFIG_TPM
     tpm_cleanup();
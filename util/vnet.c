@@ -358,10 +358,9 @@ static NetClientInfo net_vnet_info = {
     .cleanup = vnet_cleanup,
 };
 
-static void vnet_send(void *opaque)
+/* Read one frame into s->buf_rcv, returning its length or <= 0 if none */
+static int vnet_read_packet(VnetState *s)
 {
-    NetClientState *nc = opaque;
-    VnetState *s = DO_UPCAST(VnetState, nc, nc);
     int pkt_cnt = 1;
     struct iovec iov;
 
@@ -372,7 +371,7 @@ static void vnet_send(void *opaque)
     if (-1 != s->proxyfd) {
         pktlen = readv(s->proxyfd, &iov, 1);
         if (pktlen <= 0)
-            return;
+            return -1;
     } else {
         char c;
         while (read(s->fd[0], &c, 1) >= 0);
@@ -385,24 +384,51 @@ static void vnet_send(void *opaque)
         pkt_desc.vm_pkt_size = sizeof(s->buf_rcv);
 
         vmnet_return_t res = vmnet_read(s->iface, &pkt_desc, &pkt_cnt);
-        if (res != VMNET_SUCCESS)
-            return;
+        if (res != VMNET_SUCCESS || pkt_cnt == 0)
+            return -1;
 
         if (pkt_desc.vm_pkt_size == sizeof(s->buf_rcv)) {
             // weird bug: received a dummy buffer
             // drop it as a workaround
-            return;
+            return -1;
         }
         pktlen = pkt_desc.vm_pkt_size;
     }
 
     assert(pktlen >= 0 && pktlen < sizeof(s->buf_rcv));
-    vnet_mac_change(s, s->buf_rcv, pktlen, true);
-    vnet_mac_change_for_arp(s, s->buf_rcv, pktlen, true);
-    vnet_mac_change_for_dhcp(s, s->buf_rcv, pktlen, true);
+    return pktlen;
+}
+
+static void vnet_send(void *opaque)
+{
+    NetClientState *nc = opaque;
+    VnetState *s = DO_UPCAST(VnetState, nc, nc);
+    int pktlen;
+    int packets = 0;
 
-    if (vmx_send_packet_async(nc, s->buf_rcv, pktlen, vnet_send_completed) == 0)
-        vnet_read_poll(s, false);
+    /* Hand the peer a burst, bounded like tap_send() so that a busy host
+     * interface cannot hog the global mutex.
+     */
+    vmx_send_batch_begin(nc);
+    while (vmx_can_send_packet(nc)) {
+        pktlen = vnet_read_packet(s);
+        if (pktlen <= 0)
+            break;
+
+        vnet_mac_change(s, s->buf_rcv, pktlen, true);
+        vnet_mac_change_for_arp(s, s->buf_rcv, pktlen, true);
+        vnet_mac_change_for_dhcp(s, s->buf_rcv, pktlen, true);
+
+        if (vmx_send_packet_async(nc, s->buf_rcv, pktlen,
+                                  vnet_send_completed) == 0) {
+            vnet_read_poll(s, false);
+            break;
+        }
+
+        if (++packets >= 50)
+            break;
+    }
+    vmx_send_batch_end(nc);
 }
 
 static void vnet_save_state(QEMUFile *f, void *opaque)
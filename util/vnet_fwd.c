@@ -21,11 +21,22 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <net/if.h>
 #include <netinet/in.h>
-#include <poll.h>
+#include <fcntl.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#elif defined(__APPLE__)
+#include <sys/event.h>
+#else
+#error "vnet port forwarding needs epoll or kqueue"
+#endif
 
 #include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
 #include "net/net.h"
 #include "clients.h"
 #include "monitor/monitor.h"
@@ -34,8 +45,36 @@
 
 #include "vnet_fwd.h"
 
+/* splice() is only declared when building with _GNU_SOURCE */
+#if defined(__linux__) && defined(SPLICE_F_NONBLOCK)
+#define CONFIG_FWD_SPLICE 1
+#endif
+
+/*
+ * All forwarded connections are serviced by a single thread that waits on
+ * an epoll (Linux) or kqueue (OS X) instance, so idle connections cost no
+ * CPU.  Every connection has two sides, the accepted host client (side 0)
+ * and the socket connected to the guest (side 1), and one direction per
+ * side: direction d moves data read from side d to side !d.
+ *
+ * Interest is level triggered and recomputed after each event: a side is
+ * polled for reading only while its direction has buffer space left, and
+ * for writing only while the opposite direction has data pending.  A slow
+ * reader therefore stops the writer on the other end instead of growing
+ * any buffer.
+ *
+ * Buffers are only held while data is in flight.  On Linux a direction
+ * moves data with splice() through a pipe taken from a small pool; when no
+ * pipe is available it falls back to a ring buffer, as OS X always does.
+ */
+
 #define MAX_PORT_FWD    128
 
+#define FWD_RING_SIZE   (64 * 1024)
+#define FWD_PIPE_POOL   16
+#define FWD_MAX_EVENTS  64
+#define FWD_MAX_ACCEPT  32
+
 typedef struct PortFwd
 {
     struct in_addr host_addr;
@@ -45,19 +84,77 @@ typedef struct PortFwd
     int is_udp;
 } PortFwd;
 
+typedef enum {
+    FWD_EP_LISTEN,
+    FWD_EP_CONN,
+    FWD_EP_WAKEUP,
+} FwdEndpointType;
+
+typedef struct FwdEndpoint {
+    FwdEndpointType type;
+    int fd;
+    int idx;                    /* side of the connection */
+    bool want_read;             /* interest currently registered */
+    bool want_write;
+    void *opaque;
+} FwdEndpoint;
+
 typedef struct PortFwdState {
     int used;
+    int closing;                /* deleted, connections not yet torn down */
     PortFwd port_fwd;
     int listen_fd;
-
-    int redir_fd;
-    int redir_fd_connected;
-    int client_fd;
+    FwdEndpoint listen_ep;
 } PortFwdState;
 
-static PortFwdState port_fwd_states[MAX_PORT_FWD];
+typedef struct FwdRing {
+    char *buf;
+    size_t head;
+    size_t len;
+} FwdRing;
+
+typedef struct FwdDir {
+    FwdRing ring;
+    int pipe[2];                /* splice pipe, -1 when not held */
+    size_t pipe_size;
+    size_t pipe_len;
+    bool eof;                   /* source side has no more data */
+    bool shut;                  /* sink side has been shut down */
+} FwdDir;
+
+typedef struct FwdConn {
+    PortFwdState *rule;
+    FwdEndpoint ep[2];
+    FwdDir dir[2];
+    bool connected;
+    bool dead;
+    QLIST_ENTRY(FwdConn) next;
+} FwdConn;
+
+typedef struct FwdPollEvent {
+    FwdEndpoint *ep;
+    bool readable;
+    bool writable;
+    bool error;
+} FwdPollEvent;
+
+typedef struct FwdLoop {
+    bool started;
+    int poll_fd;
+    int wakeup[2];
+    FwdEndpoint wakeup_ep;
+    QemuThread thread;
+    QemuMutex lock;             /* protects port_fwd_states */
+    QLIST_HEAD(, FwdConn) conns;
+    QLIST_HEAD(, FwdConn) dead_conns;
+#ifdef CONFIG_FWD_SPLICE
+    int pipe_pool[FWD_PIPE_POOL][2];
+    int pipe_pool_len;
+#endif
+} FwdLoop;
 
-static void net_socket_accept(void *opaque);
+static PortFwdState port_fwd_states[MAX_PORT_FWD];
+static FwdLoop fwd_loop;
 
 extern uint32_t vm_ip_address;
 
@@ -134,293 +231,743 @@ fail_syntax:
     return -1;
 }
 
-static void vnet_free_fwd_state(PortFwdState *s, int close_listen)
+/* Poller: thin wrapper around epoll or kqueue */
+
+#ifdef __linux__
+
+static int fwd_poller_create(void)
 {
-    printf("closing conn\n");
-    /*if (s->listen_fd > 0) {
-        close(s->listen_fd);
-        vmx_set_fd_handler(s->listen_fd, NULL, NULL, NULL);
-    }*/
-    if (s->redir_fd > 0) {
-        close(s->redir_fd);
-        vmx_set_fd_handler(s->redir_fd, NULL, NULL, NULL);
-        s->redir_fd = 0;
+    return epoll_create1(EPOLL_CLOEXEC);
+}
+
+static int fwd_poller_update(FwdEndpoint *ep, bool want_read, bool want_write)
+{
+    struct epoll_event ev;
+    bool registered = ep->want_read || ep->want_write;
+    int op;
+
+    if (want_read == ep->want_read && want_write == ep->want_write) {
+        return 0;
     }
-    if (s->client_fd > 0) {
-        close(s->client_fd);
-        vmx_set_fd_handler(s->client_fd, NULL, NULL, NULL);
-        s->client_fd = 0;
+
+    /* An fd without interest is dropped altogether, otherwise a hung up
+     * socket would keep reporting EPOLLHUP while we cannot act on it.
+     */
+    if (!want_read && !want_write) {
+        op = EPOLL_CTL_DEL;
+    } else {
+        op = registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
     }
-    if (close_listen) {
-        close(s->listen_fd);
-        vmx_set_fd_handler(s->listen_fd, NULL, NULL, NULL);
-        s->listen_fd = 0;
-        s->used = 0;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (want_read ? EPOLLIN : 0) | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = ep;
+    if (epoll_ctl(fwd_loop.poll_fd, op, ep->fd, &ev) < 0) {
+        return -errno;
     }
+    ep->want_read = want_read;
+    ep->want_write = want_write;
+    return 0;
 }
 
-static int do_poll(struct pollfd fds[], nfds_t nfds, int timeout)
+static int fwd_poller_wait(FwdPollEvent *events, int max)
 {
-    int res;
-    do {
-        res = poll(fds, nfds, timeout);
-    } while (res < 0 && (errno == EAGAIN || errno == EINTR));
-    return res;
+    struct epoll_event evs[FWD_MAX_EVENTS];
+    int i, n;
+
+    n = epoll_wait(fwd_loop.poll_fd, evs, MIN(max, FWD_MAX_EVENTS), -1);
+    for (i = 0; i < n; i++) {
+        uint32_t e = evs[i].events;
+
+        events[i].ep = evs[i].data.ptr;
+        events[i].readable = e & (EPOLLIN | EPOLLHUP);
+        events[i].writable = e & (EPOLLOUT | EPOLLHUP);
+        events[i].error = e & EPOLLERR;
+    }
+    return n;
 }
 
-static ssize_t do_send(int socket, const void *buffer, size_t length, int flags)
+#else /* __APPLE__ */
+
+static int fwd_poller_create(void)
 {
-    ssize_t res;
+    int fd = kqueue();
+
+    if (fd >= 0) {
+        vmx_set_cloexec(fd);
+    }
+    return fd;
+}
+
+static int fwd_poller_update(FwdEndpoint *ep, bool want_read, bool want_write)
+{
+    struct kevent kev[2];
+    int n = 0;
+
+    if (want_read != ep->want_read) {
+        EV_SET(&kev[n++], ep->fd, EVFILT_READ,
+               want_read ? EV_ADD | EV_ENABLE : EV_ADD | EV_DISABLE,
+               0, 0, ep);
+    }
+    if (want_write != ep->want_write) {
+        EV_SET(&kev[n++], ep->fd, EVFILT_WRITE,
+               want_write ? EV_ADD | EV_ENABLE : EV_ADD | EV_DISABLE,
+               0, 0, ep);
+    }
+    if (n && kevent(fwd_loop.poll_fd, kev, n, NULL, 0, NULL) < 0) {
+        return -errno;
+    }
+    ep->want_read = want_read;
+    ep->want_write = want_write;
+    return 0;
+}
+
+static int fwd_poller_wait(FwdPollEvent *events, int max)
+{
+    struct kevent kev[FWD_MAX_EVENTS];
+    int i, n;
+
+    n = kevent(fwd_loop.poll_fd, NULL, 0, kev, MIN(max, FWD_MAX_EVENTS), NULL);
+    for (i = 0; i < n; i++) {
+        events[i].ep = kev[i].udata;
+        events[i].readable = kev[i].filter == EVFILT_READ;
+        events[i].writable = kev[i].filter == EVFILT_WRITE;
+        events[i].error = (kev[i].flags & EV_ERROR) != 0;
+    }
+    return n;
+}
+
+#endif
+
+/* Drop all interest before the fd goes away */
+static void fwd_poller_remove(FwdEndpoint *ep)
+{
+    fwd_poller_update(ep, false, false);
+}
+
+/* Ring buffers, allocated on first use and released once drained */
+
+static size_t fwd_ring_space(FwdRing *r)
+{
+    return FWD_RING_SIZE - r->len;
+}
+
+static int fwd_ring_iov(FwdRing *r, struct iovec *iov, bool for_read)
+{
+    size_t start, avail;
+    int n = 0;
+
+    if (for_read) {
+        start = (r->head + r->len) % FWD_RING_SIZE;
+        avail = fwd_ring_space(r);
+    } else {
+        start = r->head;
+        avail = r->len;
+    }
+    while (avail) {
+        size_t chunk = MIN(avail, FWD_RING_SIZE - start);
+
+        iov[n].iov_base = r->buf + start;
+        iov[n].iov_len = chunk;
+        n++;
+        avail -= chunk;
+        start = 0;
+    }
+    return n;
+}
+
+static ssize_t fwd_ring_read(FwdRing *r, int fd)
+{
+    struct iovec iov[2];
+    ssize_t ret;
+
+    if (!r->buf) {
+        r->buf = g_malloc(FWD_RING_SIZE);
+        r->head = 0;
+    }
     do {
-        res = vmx_send(socket, buffer, length, flags);
-    } while (res < 0 && (errno == EAGAIN || errno == EINTR));
-    return res;
+        ret = readv(fd, iov, fwd_ring_iov(r, iov, true));
+    } while (ret < 0 && errno == EINTR);
+    if (ret > 0) {
+        r->len += ret;
+    } else if (!r->len) {
+        g_free(r->buf);
+        r->buf = NULL;
+    }
+    return ret;
 }
 
-static ssize_t do_recv(int socket, void *buffer, size_t length, int flags)
+static ssize_t fwd_ring_write(FwdRing *r, int fd)
 {
-    ssize_t res;
+    struct iovec iov[2];
+    ssize_t ret;
+
     do {
-        res = vmx_recv(socket, buffer, length, flags);
-    } while (res < 0 && (errno == EAGAIN || errno == EINTR));
-    return res;
+        ret = writev(fd, iov, fwd_ring_iov(r, iov, false));
+    } while (ret < 0 && errno == EINTR);
+    if (ret > 0) {
+        r->head = (r->head + ret) % FWD_RING_SIZE;
+        r->len -= ret;
+        if (!r->len) {
+            g_free(r->buf);
+            r->buf = NULL;
+        }
+    }
+    return ret;
 }
 
-void *redirect_func(void *opaque)
+#ifdef CONFIG_FWD_SPLICE
+
+static bool fwd_pipe_get(int p[2], size_t *size)
 {
-    PortFwdState *s = opaque;
-    char buf[4096], *pbuf;
-    struct pollfd fds[2];
-    ssize_t size, sent;
-    int res;
-    
-    vmx_set_nonblock(s->redir_fd);
-    vmx_set_nonblock(s->client_fd);
+    int sz;
 
-    fds[0].fd = s->redir_fd;
-    fds[1].fd = s->client_fd;
+    if (fwd_loop.pipe_pool_len) {
+        fwd_loop.pipe_pool_len--;
+        p[0] = fwd_loop.pipe_pool[fwd_loop.pipe_pool_len][0];
+        p[1] = fwd_loop.pipe_pool[fwd_loop.pipe_pool_len][1];
+    } else {
+        if (vmx_pipe(p) < 0) {
+            return false;
+        }
+        vmx_set_nonblock(p[0]);
+        vmx_set_nonblock(p[1]);
+        fcntl(p[1], F_SETPIPE_SZ, FWD_RING_SIZE);
+    }
+    sz = fcntl(p[1], F_GETPIPE_SZ);
+    *size = sz > 0 ? sz : 4096;
+    return true;
+}
 
-    fds[0].events = POLLIN;
-    fds[1].events = POLLIN;
+/* Only empty pipes go back to the pool */
+static void fwd_pipe_put(int p[2])
+{
+    if (fwd_loop.pipe_pool_len < FWD_PIPE_POOL) {
+        fwd_loop.pipe_pool[fwd_loop.pipe_pool_len][0] = p[0];
+        fwd_loop.pipe_pool[fwd_loop.pipe_pool_len][1] = p[1];
+        fwd_loop.pipe_pool_len++;
+    } else {
+        close(p[0]);
+        close(p[1]);
+    }
+    p[0] = p[1] = -1;
+}
 
-    while (1) {
-        res = do_poll(fds, 2, 0);
-        if (!res)
-            continue;
-        if (res < 0)
-            break;
+#endif
 
-        if (fds[0].revents & (POLLERR | POLLHUP))
-            break;
-        if (fds[1].revents & (POLLERR | POLLHUP))
-            break;
+static size_t fwd_dir_pending(FwdDir *d)
+{
+    return d->ring.len + d->pipe_len;
+}
 
-        if (fds[0].revents & POLLIN) {
-            size = do_recv(fds[0].fd, buf, sizeof(buf), 0);
-            if (size < 0)
-                break;
-    
-            pbuf = buf;
-            fds[1].events = POLLOUT;
-            while (size && do_poll(&fds[1], 1, 0) >= 0) {
-                if (fds[1].revents & (POLLERR | POLLHUP))
-                    break;
-                if (!(fds[1].revents & POLLOUT))
-                    continue;
-                if ((sent = do_send(fds[1].fd, pbuf, size, 0)) < 0)
-                    break;
-
-                pbuf += sent;
-                size -= sent;
-            }
-            if (size)
-                break;
-        } else if (fds[1].revents & POLLIN) {
-            size = do_recv(fds[1].fd, buf, sizeof(buf), 0);
-            if (size < 0)
-                break;
+static bool fwd_dir_has_space(FwdDir *d)
+{
+    if (d->pipe[0] >= 0) {
+        return d->pipe_len < d->pipe_size;
+    }
+    return fwd_ring_space(&d->ring) > 0;
+}
 
-            pbuf = buf;
-            fds[0].events = POLLOUT;
-            while (size && do_poll(&fds[0], 1, 0) >= 0) {
-                if (fds[0].revents & (POLLERR | POLLHUP))
-                    break;
+/* Pull data from the source socket.  Returns false on a fatal error. */
+static bool fwd_dir_fill(FwdDir *d, int fd)
+{
+    ssize_t ret;
 
-                if (!(fds[0].revents & POLLOUT))
-                    continue;
-                if ((sent = do_send(fds[0].fd, pbuf, size, 0)) < 0)
-                    break;
+    if (d->eof || !fwd_dir_has_space(d)) {
+        return true;
+    }
 
-                pbuf += sent;
-                size -= sent;
+#ifdef CONFIG_FWD_SPLICE
+    /* Switching between pipe and ring is only done while empty */
+    if (d->pipe[0] < 0 && !d->ring.len) {
+        fwd_pipe_get(d->pipe, &d->pipe_size);
+    }
+    if (d->pipe[0] >= 0) {
+        do {
+            ret = splice(fd, NULL, d->pipe[1], NULL,
+                         d->pipe_size - d->pipe_len,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } while (ret < 0 && errno == EINTR);
+        if (ret > 0) {
+            d->pipe_len += ret;
+        } else if (!d->pipe_len) {
+            fwd_pipe_put(d->pipe);
+        }
+    } else
+#endif
+    {
+        ret = fwd_ring_read(&d->ring, fd);
+    }
+
+    if (ret == 0) {
+        d->eof = true;
+    } else if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        return false;
+    }
+    return true;
+}
+
+/* Push pending data to the sink socket.  Returns false on a fatal error. */
+static bool fwd_dir_flush(FwdDir *d, int fd)
+{
+    ssize_t ret;
+
+    if (!fwd_dir_pending(d)) {
+        return true;
+    }
+
+#ifdef CONFIG_FWD_SPLICE
+    if (d->pipe[0] >= 0) {
+        do {
+            ret = splice(d->pipe[0], NULL, fd, NULL, d->pipe_len,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } while (ret < 0 && errno == EINTR);
+        if (ret > 0) {
+            d->pipe_len -= ret;
+            if (!d->pipe_len) {
+                fwd_pipe_put(d->pipe);
             }
-            if (size)
-                break;
         }
+    } else
+#endif
+    {
+        ret = fwd_ring_write(&d->ring, fd);
+    }
 
-        fds[0].events = POLLIN;
-        fds[1].events = POLLIN;
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        return false;
     }
+    return true;
+}
 
-    vnet_free_fwd_state(s, 0);
-    return NULL;
+static void fwd_dir_release(FwdDir *d)
+{
+    g_free(d->ring.buf);
+    d->ring.buf = NULL;
+    d->ring.len = 0;
+#ifdef CONFIG_FWD_SPLICE
+    if (d->pipe[0] >= 0) {
+        /* Still holds data, cannot be reused */
+        close(d->pipe[0]);
+        close(d->pipe[1]);
+        d->pipe[0] = d->pipe[1] = -1;
+    }
+#endif
+    d->pipe_len = 0;
 }
 
-static void vnet_socket_connect(void *opaque)
+/* Connections */
+
+static void fwd_conn_close(FwdConn *c)
 {
-    pthread_t tid;
-    PortFwdState *s = opaque;
-    printf("vnet_socket_connect\n");
+    int i;
 
-    pthread_create(&tid, NULL, redirect_func, s);
-    
-    vmx_set_fd_handler(s->redir_fd, NULL, NULL, s);
-    vmx_set_fd_handler(s->client_fd, NULL, NULL, s);
-    //vmx_set_fd_handler(s->redir_fd, vnet_redir_read, NULL, s);
-    //vmx_set_fd_handler(s->client_fd, vnet_client_read, NULL, s);
-    
+    if (c->dead) {
+        return;
+    }
+    for (i = 0; i < 2; i++) {
+        fwd_poller_remove(&c->ep[i]);
+        closesocket(c->ep[i].fd);
+        fwd_dir_release(&c->dir[i]);
+    }
+    c->dead = true;
+    QLIST_REMOVE(c, next);
+    /* Events for it may still be pending in the current batch */
+    QLIST_INSERT_HEAD(&fwd_loop.dead_conns, c, next);
 }
 
+static void fwd_conn_update(FwdConn *c)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        FwdDir *in = &c->dir[i], *out = &c->dir[!i];
+        bool want_read, want_write;
 
-static int vnet_init_guest_socket(PortFwdState *s)
+        if (!c->connected) {
+            /* Wait for the guest connection before reading the client */
+            want_read = false;
+            want_write = i == 1;
+        } else {
+            want_read = !in->eof && fwd_dir_has_space(in);
+            want_write = fwd_dir_pending(out) > 0;
+        }
+        if (fwd_poller_update(&c->ep[i], want_read, want_write) < 0) {
+            fwd_conn_close(c);
+            return;
+        }
+    }
+}
+
+static bool fwd_conn_check_connect(FwdConn *c)
 {
-    // connect to guest socket
-    struct sockaddr_in daddr;
+    int err = 0;
+    socklen_t len = sizeof(err);
 
-    if (!s->port_fwd.guest_addr.s_addr) {
-        if (!vm_ip_address)
-            return -1;
-        s->port_fwd.guest_addr.s_addr = vm_ip_address;
+    if (getsockopt(c->ep[1].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+        err) {
+        return false;
     }
-    
+    c->connected = true;
+    return true;
+}
+
+static void fwd_conn_event(FwdConn *c, int idx, FwdPollEvent *ev)
+{
+    int i;
+
+    if (ev->error) {
+        fwd_conn_close(c);
+        return;
+    }
+
+    if (!c->connected) {
+        if (idx != 1 || !ev->writable) {
+            return;
+        }
+        if (!fwd_conn_check_connect(c)) {
+            fwd_conn_close(c);
+            return;
+        }
+    }
+
+    /* Write straight after reading so that data does not wait for
+     * another trip through the poller.
+     */
+    if (ev->readable &&
+        (!fwd_dir_fill(&c->dir[idx], c->ep[idx].fd) ||
+         !fwd_dir_flush(&c->dir[idx], c->ep[!idx].fd))) {
+        fwd_conn_close(c);
+        return;
+    }
+    if (ev->writable &&
+        !fwd_dir_flush(&c->dir[!idx], c->ep[idx].fd)) {
+        fwd_conn_close(c);
+        return;
+    }
+
+    /* Propagate a half close once everything before it went through */
+    for (i = 0; i < 2; i++) {
+        FwdDir *d = &c->dir[i];
+
+        if (d->eof && !d->shut && !fwd_dir_pending(d)) {
+            shutdown(c->ep[!i].fd, SHUT_WR);
+            d->shut = true;
+        }
+    }
+    if (c->dir[0].shut && c->dir[1].shut) {
+        fwd_conn_close(c);
+        return;
+    }
+
+    fwd_conn_update(c);
+}
+
+static void fwd_conn_init_endpoint(FwdConn *c, int idx, int fd)
+{
+    c->ep[idx].type = FWD_EP_CONN;
+    c->ep[idx].fd = fd;
+    c->ep[idx].idx = idx;
+    c->ep[idx].opaque = c;
+    c->dir[idx].pipe[0] = c->dir[idx].pipe[1] = -1;
+}
+
+/* Start a non-blocking connection to the guest for an accepted client */
+static void fwd_conn_new(PortFwdState *s, int client_fd)
+{
+    struct sockaddr_in daddr;
+    FwdConn *c;
+    int fd, ret;
+
+    /* Rules without a guest address follow the VM's current address.
+     * The rule itself is left alone so that it still matches on delete.
+     */
     daddr.sin_family = AF_INET;
-    memcpy(&daddr.sin_addr.s_addr, &s->port_fwd.guest_addr, sizeof(daddr.sin_addr.s_addr));
+    daddr.sin_addr = s->port_fwd.guest_addr;
+    if (!daddr.sin_addr.s_addr) {
+        if (!vm_ip_address) {
+            closesocket(client_fd);
+            return;
+        }
+        daddr.sin_addr.s_addr = vm_ip_address;
+    }
     daddr.sin_port = htons(s->port_fwd.guest_port);
-    
-    s->redir_fd = vmx_socket(PF_INET, SOCK_STREAM, 0);
-    if (s->redir_fd < 0) {
+
+    fd = vmx_socket(PF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
         perror("socket");
-        return -1;
+        closesocket(client_fd);
+        return;
     }
-    
-    vmx_set_nonblock(s->redir_fd);
-
-    s->redir_fd_connected = 0;
-    for(;;) {
-        int ret = connect(s->redir_fd, (struct sockaddr *)&daddr, sizeof(daddr));
-        if (ret < 0) {
-            int err = socket_error();
-            if (err == EINTR || err == EWOULDBLOCK) {
-            } else if (err == EINPROGRESS) {
-                break;
-            } else {
-                vnet_free_fwd_state(s, 0);
-                return -1;
+    vmx_set_nonblock(fd);
+    vmx_set_nonblock(client_fd);
+    socket_set_nodelay(fd);
+    socket_set_nodelay(client_fd);
+
+    c = g_new0(FwdConn, 1);
+    c->rule = s;
+    fwd_conn_init_endpoint(c, 0, client_fd);
+    fwd_conn_init_endpoint(c, 1, fd);
+    QLIST_INSERT_HEAD(&fwd_loop.conns, c, next);
+
+    do {
+        ret = connect(fd, (struct sockaddr *)&daddr, sizeof(daddr));
+    } while (ret < 0 && socket_error() == EINTR);
+    if (ret < 0 && socket_error() != EINPROGRESS) {
+        fwd_conn_close(c);
+        return;
+    }
+    c->connected = ret == 0;
+    fwd_conn_update(c);
+}
+
+static void fwd_listen_event(PortFwdState *s)
+{
+    struct sockaddr_in saddr;
+    socklen_t len;
+    int i, fd;
+
+    vmx_mutex_lock(&fwd_loop.lock);
+    /* A listener removed by vnet_del_port_fwd may still have an event
+     * in the current batch.
+     */
+    if (!s->used || s->closing || s->listen_fd < 0) {
+        vmx_mutex_unlock(&fwd_loop.lock);
+        return;
+    }
+    for (i = 0; i < FWD_MAX_ACCEPT; i++) {
+        len = sizeof(saddr);
+        fd = vmx_accept(s->listen_fd, (struct sockaddr *)&saddr, &len);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-        } else {
-            s->redir_fd_connected = 1;
             break;
         }
+        fwd_conn_new(s, fd);
     }
-    
-    vmx_set_fd_handler(s->redir_fd, NULL, vnet_socket_connect, s);
-    return 0;
+    vmx_mutex_unlock(&fwd_loop.lock);
 }
 
-static void vnet_socket_accept(void *opaque)
+/* Tear down the connections of deleted rules and release their slots */
+static void fwd_wakeup_event(void)
 {
-    PortFwdState *s = opaque;
-    struct sockaddr_in saddr;
-    socklen_t len;
+    FwdConn *c, *next;
+    char buf[64];
+    int i;
 
-    for(;;) {
-        len = sizeof(saddr);
-        s->client_fd = vmx_accept(s->listen_fd, (struct sockaddr *)&saddr, &len);
-        if (s->client_fd < 0 && errno != EINTR) {
-            vnet_free_fwd_state(s, 1);
-        } else if (s->client_fd  >= 0) {
-            vmx_set_nonblock(s->client_fd);
+    while (read(fwd_loop.wakeup[0], buf, sizeof(buf)) > 0) {
+        /* drain */
+    }
+
+    vmx_mutex_lock(&fwd_loop.lock);
+    QLIST_FOREACH_SAFE(c, &fwd_loop.conns, next, next) {
+        if (c->rule->closing) {
+            fwd_conn_close(c);
+        }
+    }
+    for (i = 0; i < ARRAY_SIZE(port_fwd_states); i++) {
+        if (port_fwd_states[i].closing) {
+            port_fwd_states[i].closing = 0;
+            port_fwd_states[i].used = 0;
+        }
+    }
+    vmx_mutex_unlock(&fwd_loop.lock);
+}
+
+static void *fwd_thread(void *opaque)
+{
+    FwdPollEvent events[FWD_MAX_EVENTS];
+    FwdConn *c, *next;
+    int i, n;
+
+    for (;;) {
+        n = fwd_poller_wait(events, FWD_MAX_EVENTS);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("vnet_fwd poll");
             break;
         }
+
+        for (i = 0; i < n; i++) {
+            FwdEndpoint *ep = events[i].ep;
+
+            switch (ep->type) {
+            case FWD_EP_LISTEN:
+                fwd_listen_event(ep->opaque);
+                break;
+            case FWD_EP_WAKEUP:
+                fwd_wakeup_event();
+                break;
+            case FWD_EP_CONN:
+                c = ep->opaque;
+                if (!c->dead) {
+                    fwd_conn_event(c, ep->idx, &events[i]);
+                }
+                break;
+            }
+        }
+
+        QLIST_FOREACH_SAFE(c, &fwd_loop.dead_conns, next, next) {
+            QLIST_REMOVE(c, next);
+            g_free(c);
+        }
     }
+    return NULL;
+}
 
-    if (s->client_fd >= 0 && vnet_init_guest_socket(s) < 0) {
-        vnet_free_fwd_state(s, 0);
+static int fwd_loop_start(void)
+{
+    if (fwd_loop.started) {
+        return 0;
+    }
+
+    fwd_loop.poll_fd = fwd_poller_create();
+    if (fwd_loop.poll_fd < 0) {
+        perror("vnet_fwd poller");
+        return -1;
     }
+    if (vmx_pipe(fwd_loop.wakeup) < 0) {
+        perror("vnet_fwd pipe");
+        close(fwd_loop.poll_fd);
+        return -1;
+    }
+    vmx_set_nonblock(fwd_loop.wakeup[0]);
+    vmx_set_nonblock(fwd_loop.wakeup[1]);
+
+    fwd_loop.wakeup_ep.type = FWD_EP_WAKEUP;
+    fwd_loop.wakeup_ep.fd = fwd_loop.wakeup[0];
+    if (fwd_poller_update(&fwd_loop.wakeup_ep, true, false) < 0) {
+        perror("vnet_fwd wakeup");
+        close(fwd_loop.wakeup[0]);
+        close(fwd_loop.wakeup[1]);
+        close(fwd_loop.poll_fd);
+        return -1;
+    }
+
+    vmx_mutex_init(&fwd_loop.lock);
+    QLIST_INIT(&fwd_loop.conns);
+    QLIST_INIT(&fwd_loop.dead_conns);
+    vmx_thread_create(&fwd_loop.thread, "vnet_fwd", fwd_thread, NULL,
+                      QEMU_THREAD_DETACHED);
+    fwd_loop.started = true;
+    return 0;
 }
 
 int vnet_add_port_fwd(const char *redir_str)
 {
     PortFwdState *s = NULL;
+    PortFwd fwd;
     int fd, ret;
     struct sockaddr_in saddr;
 
-    for (int i = 0; i < ARRAY_SIZE(port_fwd_states); i++) {
-        if (!port_fwd_states[i].used) {
-            s = &port_fwd_states[i];
-            break;
-        }
-    }
-    memset(s, 0, sizeof(*s));
-    if (!s)
-        return -1;
-
-    if (parse_port_fwd(redir_str, &s->port_fwd) < 0) {
+    if (parse_port_fwd(redir_str, &fwd) < 0) {
         printf("parse port_fwd failed\n");
         return -1;
     }
+    if (fwd_loop_start() < 0) {
+        return -1;
+    }
+
     saddr.sin_family = AF_INET;
-    memcpy(&saddr.sin_addr.s_addr, &s->port_fwd.host_addr, sizeof(saddr.sin_addr.s_addr));
-    saddr.sin_port = htons(s->port_fwd.host_port);
+    memcpy(&saddr.sin_addr.s_addr, &fwd.host_addr, sizeof(saddr.sin_addr.s_addr));
+    saddr.sin_port = htons(fwd.host_port);
 
-    printf("parse port_fwd\n");
-    
-    s->listen_fd = vmx_socket(PF_INET, SOCK_STREAM, 0);
-    if (s->listen_fd < 0) {
+    fd = vmx_socket(PF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
         perror("socket");
         return -1;
     }
-    vmx_set_nonblock(s->listen_fd);
-    
-    socket_set_fast_reuse(s->listen_fd);
+    vmx_set_nonblock(fd);
+
+    socket_set_fast_reuse(fd);
 
-    ret = bind(s->listen_fd, (struct sockaddr *)&saddr, sizeof(saddr));
+    ret = bind(fd, (struct sockaddr *)&saddr, sizeof(saddr));
     if (ret < 0) {
         perror("bind");
         closesocket(fd);
         return -1;
     }
-    ret = listen(s->listen_fd, 0);
+    ret = listen(fd, SOMAXCONN);
     if (ret < 0) {
         perror("listen");
-        closesocket(s->listen_fd);
+        closesocket(fd);
+        return -1;
+    }
+
+    vmx_mutex_lock(&fwd_loop.lock);
+    for (int i = 0; i < ARRAY_SIZE(port_fwd_states); i++) {
+        if (!port_fwd_states[i].used) {
+            s = &port_fwd_states[i];
+            break;
+        }
+    }
+    if (!s) {
+        vmx_mutex_unlock(&fwd_loop.lock);
+        closesocket(fd);
         return -1;
     }
 
-    s->redir_fd = -1;
+    memset(s, 0, sizeof(*s));
+    s->port_fwd = fwd;
+    s->listen_fd = fd;
+    s->listen_ep.type = FWD_EP_LISTEN;
+    s->listen_ep.fd = fd;
+    s->listen_ep.opaque = s;
+    if (fwd_poller_update(&s->listen_ep, true, false) < 0) {
+        vmx_mutex_unlock(&fwd_loop.lock);
+        closesocket(fd);
+        return -1;
+    }
     s->used = 1;
-    
-    vmx_set_fd_handler(s->listen_fd, vnet_socket_accept, NULL, s);
+    vmx_mutex_unlock(&fwd_loop.lock);
     return 0;
 }
 
 int vnet_del_port_fwd(const char *redir_str)
 {
     PortFwd fwd;
+    bool found = false;
 
     if (parse_port_fwd(redir_str, &fwd) < 0) {
         printf("parse port_fwd failed\n");
         return -1;
     }
-    for (int i = 0; i < ARRAY_SIZE(port_fwd_states); i++) {
-        if (port_fwd_states[i].used &&
-            port_fwd_states[i].port_fwd.guest_addr.s_addr == fwd.guest_addr.s_addr &&
-            port_fwd_states[i].port_fwd.guest_port == fwd.guest_port &&
-            port_fwd_states[i].port_fwd.host_addr.s_addr == fwd.host_addr.s_addr &&
-            port_fwd_states[i].port_fwd.host_port == fwd.host_port) {
+    if (!fwd_loop.started) {
+        return 0;
+    }
 
-            vnet_free_fwd_state(&port_fwd_states[i], 1);
+    vmx_mutex_lock(&fwd_loop.lock);
+    for (int i = 0; i < ARRAY_SIZE(port_fwd_states); i++) {
+        PortFwdState *s = &port_fwd_states[i];
+
+        if (s->used && !s->closing &&
+            s->port_fwd.guest_addr.s_addr == fwd.guest_addr.s_addr &&
+            s->port_fwd.guest_port == fwd.guest_port &&
+            s->port_fwd.host_addr.s_addr == fwd.host_addr.s_addr &&
+            s->port_fwd.host_port == fwd.host_port) {
+
+            /* Free the host port right away, the forwarder thread drops
+             * the rule's connections and the slot when it wakes up.
+             */
+            fwd_poller_remove(&s->listen_ep);
+            closesocket(s->listen_fd);
+            s->listen_fd = -1;
+            s->closing = 1;
+            found = true;
         }
     }
+    vmx_mutex_unlock(&fwd_loop.lock);
+
+    if (found) {
+        char c = 0;
+        ssize_t ret;
+
+        do {
+            ret = write(fwd_loop.wakeup[1], &c, 1);
+        } while (ret < 0 && errno == EINTR);
+    }
     return 0;
 }
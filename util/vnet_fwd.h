@@ -21,5 +21,6 @@
 #include "qemu-common.h"
 
 int vnet_add_port_fwd(const char *redir_str);
+int vnet_del_port_fwd(const char *redir_str);
 
 #endif /* __VNET_FWD_H__ */
@@ -53,6 +53,7 @@ struct VeertuState {
 
 pthread_rwlock_t mem_lock = PTHREAD_RWLOCK_INITIALIZER;
 VeertuState *veertu_state;
+DEFINE_TLS(uint64_t, hv_reg_calls);
 
 VeertuSlot *veertu_find_overlap_slot(uint64_t start, uint64_t end)
 {
@@ -210,6 +211,7 @@ void vmx_reset_vcpu(CPUState *cpu)
     cpu->hlt = 0;
     hv_vcpu_invalidate_tlb(cpu->mac_vcpu_fd);
     hv_vcpu_flush(cpu->mac_vcpu_fd);
+    decode_cache_flush(cpu);
 }
 
 int veertu_vcpu_init(CPUState *cpu)
@@ -395,51 +397,44 @@ int veertu_machine_init(MachineState *machine)
 extern void vmx_fs_port_write(hwaddr addr, uint64_t val, unsigned size);
 extern uint32_t vmx_fs_port_read(hwaddr addr, unsigned size);
 
+/* the shared folder protocol is not thread safe, run it under the iothread mutex */
+static void veertu_handle_fs_port(hwaddr index, void *data, int direction, int size)
+{
+    bool unlock_iothread = !vmx_mutex_iothread_locked();
+
+    if (unlock_iothread)
+        vmx_mutex_lock_iothread();
+    if (direction) {
+        vmx_fs_port_write(index, *(uint32_t *)data, size);
+    } else {
+        *((uint32_t *)data) = vmx_fs_port_read(index, size);
+    }
+    if (unlock_iothread)
+        vmx_mutex_unlock_iothread();
+}
+
 void veertu_handle_io(CPUState *cpu_state, uint16_t port, void *data, int direction, int size, uint32_t count)
 {
     int x;
     uint8_t *ptr = data;
 
-    if (port == 0x185c) {
-        if (direction) {
-            vmx_fs_port_write(3, *(uint32_t *)data, size);
-        } else {
-            *((uint32_t *)data) = vmx_fs_port_read(3, size);
-        }
-        return;
-    }
-    
-    if (port == 0x1854) {
-        if (direction) {
-            vmx_fs_port_write(1, *(uint32_t *)data, size);
-        } else {
-            *((uint32_t *)data) = vmx_fs_port_read(1, size);
-        }
-        return;
-    }
-    
-    if (port == 0x1850) {
-        if (direction) {
-            vmx_fs_port_write(0, *(uint32_t *)data, size);
-        } else {
-            *((uint32_t *)data) = vmx_fs_port_read(0, size);
-        }
-        return;
-    }
-    
-    if (port == 0x1858) {
-        if (direction) {
-            vmx_fs_port_write(2, *(uint32_t *)data, size);
-        } else {
-            *((uint32_t *)data) = vmx_fs_port_read(2, size);
-        }
-        return;
+    switch (port) {
+        case 0x1850:
+        case 0x1854:
+        case 0x1858:
+        case 0x185c:
+            for (x = 0; x < count; ++x) {
+                veertu_handle_fs_port((port - 0x1850) >> 2, ptr, direction, size);
+                ptr += size;
+            }
+            return;
     }
 
-    for (x = 0; x < count ;++x) {
-        address_space_rw(&address_space_io, port, ptr, size, direction);
-        ptr += size;
+    if (count > 1) {
+        address_space_rep_rw(&address_space_io, port, data, size, count, direction);
+        return;
     }
+    address_space_rw(&address_space_io, port, data, size, direction);
 }
 
 void __veertu_cpu_synchronize_state(void *data)
@@ -668,6 +663,7 @@ static void vmx_handle_task_switch(CPUState *cpu, x68_segment_selector tss_sel,
 
     hv_vcpu_invalidate_tlb(cpu->mac_vcpu_fd);
     hv_vcpu_flush(cpu->mac_vcpu_fd);
+    decode_cache_flush(cpu);
 }
 
 void vmx_update_tpr(CPUState *cpu)
@@ -692,11 +688,232 @@ void update_apic_tpr(CPUState *cpu)
 
 #define VECTORING_INFO_VECTOR_MASK     0xff
 
+static inline void veertu_count_exit(CPUState *cpu, uint64_t exit_reason, bool locked)
+{
+    if (exit_reason >= VEERTU_EXIT_REASON_MAX)
+        return;
+    cpu->exit_count[exit_reason]++;
+    if (locked)
+        cpu->exit_locked_count[exit_reason]++;
+}
+
+void veertu_dump_exit_stats(FILE *f, fprintf_function cpu_fprintf)
+{
+    CPUState *cpu;
+    int i;
+
+    CPU_FOREACH(cpu) {
+        uint64_t exits = 0;
+
+        cpu_fprintf(f, "cpu %d:\n", cpu->cpu_index);
+        for (i = 0; i < VEERTU_EXIT_REASON_MAX; i++) {
+            exits += cpu->exit_count[i];
+            if (!cpu->exit_count[i])
+                continue;
+            cpu_fprintf(f, "  exit %2d: %12llu total %12llu locked\n", i,
+                        cpu->exit_count[i], cpu->exit_locked_count[i]);
+        }
+        cpu_fprintf(f, "  decode cache: %12llu hits %12llu misses\n",
+                    cpu->decode_cache_hits, cpu->decode_cache_misses);
+        cpu_fprintf(f, "  mmu tlb:      %12llu hits %12llu walks\n",
+                    cpu->mmu_tlb_hits, cpu->mmu_tlb_misses);
+        cpu_fprintf(f, "  hv register calls: %llu (%llu per exit)\n", cpu->hv_reg_calls,
+                    exits ? cpu->hv_reg_calls / exits : 0);
+        cpu_fprintf(f, "  halt: %llu wakeups, poll %llu ok %llu failed, "
+                    "window %lld ns\n", cpu->halt_wakeups,
+                    cpu->halt_poll_success, cpu->halt_poll_fail,
+                    (long long)cpu->halt_poll_ns);
+    }
+}
+
+/*
+ * Handle exits which only touch vcpu private state (registers, VMCS and
+ * CPUX86State) without taking the iothread mutex. MMIO and PIO exits are
+ * emulated here too, address_space_rw takes the iothread mutex for memory
+ * areas that did not opt out of global locking. Returns false if the exit
+ * has to go through the locked path.
+ */
+static bool veertu_handle_exit_nolock(CPUState *cpu, uint64_t exit_reason, uint64_t exit_qual,
+                                      uint64_t idtvec_info, uint64_t rip, uint32_t ins_len)
+{
+    switch (exit_reason) {
+        case EXIT_REASON_CPUID: {
+            uint32_t rax = (uint32_t)rreg(cpu->mac_vcpu_fd, HV_X86_RAX);
+            uint32_t rbx = (uint32_t)rreg(cpu->mac_vcpu_fd, HV_X86_RBX);
+            uint32_t rcx = (uint32_t)rreg(cpu->mac_vcpu_fd, HV_X86_RCX);
+            uint32_t rdx = (uint32_t)rreg(cpu->mac_vcpu_fd, HV_X86_RDX);
+
+            get_cpuid_func(cpu, rax, rcx, &rax, &rbx, &rcx, &rdx);
+
+            wreg(cpu->mac_vcpu_fd, HV_X86_RAX, rax);
+            wreg(cpu->mac_vcpu_fd, HV_X86_RBX, rbx);
+            wreg(cpu->mac_vcpu_fd, HV_X86_RCX, rcx);
+            wreg(cpu->mac_vcpu_fd, HV_X86_RDX, rdx);
+
+            macvm_set_rip(cpu, rip + ins_len);
+            return true;
+        }
+        case EXIT_REASON_XSETBV: {
+            X86CPU *x86_cpu = X86_CPU(cpu);
+            CPUX86State *env = &x86_cpu->env;
+            uint32_t eax = (uint32_t)rreg(cpu->mac_vcpu_fd, HV_X86_RAX);
+            uint32_t ecx = (uint32_t)rreg(cpu->mac_vcpu_fd, HV_X86_RCX);
+            uint32_t edx = (uint32_t)rreg(cpu->mac_vcpu_fd, HV_X86_RDX);
+
+            if (ecx) {
+                printf("xsetbv: invalid index %d\n", ecx);
+                macvm_set_rip(cpu, rip + ins_len);
+                return true;
+            }
+            env->xcr0 = ((uint64_t)edx << 32) | eax;
+            wreg(cpu->mac_vcpu_fd, HV_X86_XCR0, env->xcr0 | 1);
+            macvm_set_rip(cpu, rip + ins_len);
+            return true;
+        }
+        case EXIT_REASON_RDPMC:
+            wreg(cpu->mac_vcpu_fd, HV_X86_RAX, 0);
+            wreg(cpu->mac_vcpu_fd, HV_X86_RDX, 0);
+            macvm_set_rip(cpu, rip + ins_len);
+            return true;
+        case EXIT_REASON_RDMSR:
+        case EXIT_REASON_WRMSR: {
+            if (!msr_is_vcpu_local((uint32_t)rreg(cpu->mac_vcpu_fd, HV_X86_RCX)))
+                return false;
+            load_regs(cpu);
+            if (exit_reason == EXIT_REASON_RDMSR)
+                simulate_rdmsr(cpu);
+            else
+                simulate_wrmsr(cpu);
+            RIP(cpu) += ins_len;
+            store_regs(cpu);
+            return true;
+        }
+        case EXIT_REASON_EPT_FAULT: {
+            addr_t gpa = rvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_PHYSICAL_ADDRESS);
+            struct x86_decode decode;
+
+            /*
+             * The slot lookup races with memory map updates; a stale slot
+             * sends us to the locked path, a stale miss is still emulated
+             * correctly by address_space_rw.
+             */
+            if (!ept_emulation_fault(exit_qual) || veertu_find_overlap_slot(gpa, gpa))
+                return false;
+
+            if ((idtvec_info & VMCS_IDT_VEC_VALID) == 0 && (exit_qual & EXIT_QUAL_NMIUDTI) != 0)
+                vmx_set_nmi_blocking(cpu);
+
+            load_regs(cpu);
+            cpu->fetch_rip = rip;
+
+            decode_instruction(cpu, &decode);
+#if 0
+            printf("%llx: fetched %s, %x %x modrm %x len %d, gpa %lx\n", rip, decode_cmd_to_string(decode.cmd),
+                   decode.opcode[0], decode.opcode[1], decode.modrm.byte, decode.len, gpa);
+#endif
+            exec_instruction(cpu, &decode);
+            store_regs(cpu);
+            return true;
+        }
+        case EXIT_REASON_APIC_ACCESS: {
+            struct x86_decode decode;
+
+            load_regs(cpu);
+            cpu->fetch_rip = rip;
+
+            decode_instruction(cpu, &decode);
+            //printf("apic fetched %s, %x %x len %d\n", decode_cmd_to_string(decode.cmd), decode.opcode[0], decode.opcode[1], decode.len);
+            exec_instruction(cpu, &decode);
+            store_regs(cpu);
+            return true;
+        }
+        case EXIT_REASON_INOUT: {
+            uint32_t in = (exit_qual & 8) != 0;
+            uint32_t size =  (exit_qual & 7) + 1;
+            uint32_t string =  (exit_qual & 16) != 0;
+            uint32_t port =  exit_qual >> 16;
+            struct x86_decode decode;
+
+            if (!string && in) {
+                uint64_t val = 0;
+                load_regs(cpu);
+                veertu_handle_io(cpu, port, &val, 0, size, 1);
+                if (size == 1) AL(cpu) = val;
+                else if (size == 2) AX(cpu) = val;
+                else if (size == 4) RAX(cpu) = (uint32_t)val;
+                else VM_PANIC("size");
+                RIP(cpu) += ins_len;
+                store_regs(cpu);
+                return true;
+            } else if (!string && !in) {
+                uint64_t val = rreg(cpu->mac_vcpu_fd, HV_X86_RAX);
+                veertu_handle_io(cpu, port, &val, 1, size, 1);
+                macvm_set_rip(cpu, rip + ins_len);
+                return true;
+            }
+
+            load_regs(cpu);
+            cpu->fetch_rip = rip;
+
+            decode_instruction(cpu, &decode);
+            //printf("%llx: IN/OUT fetched %s, %x %x len %d\n", rip, decode_cmd_to_string(decode.cmd), decode.opcode[0], decode.opcode[1], decode.len);
+            VM_PANIC_ON(ins_len != decode.len);
+            exec_instruction(cpu, &decode);
+            store_regs(cpu);
+            return true;
+        }
+        case EXIT_REASON_CR_ACCESS: {
+            int cr = exit_qual & 15;
+            int reg = (exit_qual >> 8) & 15;
+            uint64_t val;
+
+            /* only mov to cr0/cr4, cr8 goes to the apic */
+            if ((cr != 0 && cr != 4) || ((exit_qual >> 4) & 3))
+                return false;
+
+            load_regs(cpu);
+            val = RRX(cpu, reg);
+            if (cr == 0) {
+                /* loading PAE pdptes reads guest memory through the memory map */
+                if ((val & CR0_PG) && (rvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_CR4) & CR4_PAE) &&
+                    !(rvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_IA32_EFER) & EFER_LME))
+                    return false;
+                macvm_set_cr0(cpu->mac_vcpu_fd, val);
+            } else {
+                macvm_set_cr4(cpu->mac_vcpu_fd, val);
+            }
+            decode_cache_flush(cpu);
+            RIP(cpu) += ins_len;
+            store_regs(cpu);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+/*
+ * After a lockless exit the vcpu can go straight back into the guest unless
+ * something needs the locked path: event re-injection, pending interrupts,
+ * queued work, a kick or dirty register state.
+ */
+static bool veertu_can_reenter_nolock(CPUState *cpu, uint64_t idtvec_info)
+{
+    if (idtvec_info & VMCS_IDT_VEC_VALID)
+        return false;
+    if (cpu->interrupt_request || cpu->exit_request || cpu->thread_kicked)
+        return false;
+    if (cpu->queued_work_first || cpu->stop || cpu->vmx_vcpu_dirty)
+        return false;
+    return true;
+}
+
 int veertu_cpu_exec(CPUState *cpu)
 {
     X86CPU *x86_cpu = X86_CPU(cpu);
     CPUX86State *env = &x86_cpu->env;
     int ret = 0;
+    int r;
     uint64_t rip = 0;
 
     if (veertu_process_events(cpu)) {
@@ -726,7 +943,11 @@ again:
             return EXCP_HLT;
         }
         
-        int r;
+run:
+        mmu_flush_tlb(cpu);
+        cpu->regs_valid = 0;
+        cpu->hv_reg_calls += tls_var(hv_reg_calls);
+        tls_var(hv_reg_calls) = 0;
         if ((r = hv_vcpu_run(cpu->mac_vcpu_fd))) {
             printf("%ld: run %llx failed with %x\n", veertu_vcpu_id(cpu), rip, r);
             abort();
@@ -741,7 +962,20 @@ again:
         RFLAGS(cpu) = rreg(cpu->mac_vcpu_fd, HV_X86_RFLAGS);
         env->eflags = RFLAGS(cpu);
 
+        if (veertu_handle_exit_nolock(cpu, exit_reason, exit_qual, idtvec_info, rip, ins_len)) {
+            veertu_count_exit(cpu, exit_reason, false);
+            if (veertu_can_reenter_nolock(cpu, idtvec_info))
+                goto run;
+
+            vmx_mutex_lock_iothread();
+            update_apic_tpr(cpu);
+            current_cpu = cpu;
+            ret = 0;
+            continue;
+        }
+
         vmx_mutex_lock_iothread();
+        veertu_count_exit(cpu, exit_reason, true);
         
         update_apic_tpr(cpu);
         current_cpu = cpu;
@@ -764,30 +998,13 @@ again:
                 /* Need to check if MMIO or unmmaped fault */
             case EXIT_REASON_EPT_FAULT:
             {
-                VeertuSlot *slot;
-                addr_t gpa = rvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_PHYSICAL_ADDRESS);
-                
+                /* mmio is emulated in veertu_handle_exit_nolock() */
                 if ((idtvec_info & VMCS_IDT_VEC_VALID) == 0 && (exit_qual & EXIT_QUAL_NMIUDTI) != 0)
                     vmx_set_nmi_blocking(cpu);
                 
-                slot = veertu_find_overlap_slot(gpa, gpa);
-                // mmio
-                if (ept_emulation_fault(exit_qual) && !slot) {
-                    struct x86_decode decode;
-                    
-                    load_regs(cpu);
-                    cpu->fetch_rip = rip;
-                    
-                    decode_instruction(cpu, &decode);
-#if 0
-                    printf("%llx: fetched %s, %x %x modrm %x len %d, gpa %lx\n", rip, decode_cmd_to_string(decode.cmd),
-                           decode.opcode[0], decode.opcode[1], decode.modrm.byte, decode.len, gpa);
-#endif
-                    exec_instruction(cpu, &decode);
-                    store_regs(cpu);
-                    break;
-                }
 #ifdef DIRTY_VGA_TRACKING
+                addr_t gpa = rvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_PHYSICAL_ADDRESS);
+                VeertuSlot *slot = veertu_find_overlap_slot(gpa, gpa);
                 if (slot) {
                     bool read = exit_qual & EPT_VIOLATION_DATA_READ ? 1 : 0;
                     bool write = exit_qual & EPT_VIOLATION_DATA_WRITE ? 1 : 0;
@@ -805,80 +1022,6 @@ again:
 #endif
                 break;
             }
-            case EXIT_REASON_INOUT:
-            {
-                uint32_t in = (exit_qual & 8) != 0;
-                uint32_t size =  (exit_qual & 7) + 1;
-                uint32_t string =  (exit_qual & 16) != 0;
-                uint32_t port =  exit_qual >> 16;
-                uint32_t rep = (exit_qual & 0x20) != 0;
-                
-#if 1
-                if (!string && in) {
-                    uint64_t val = 0;
-                    load_regs(cpu);
-                    veertu_handle_io(cpu, port, &val, 0, size, 1);
-                    if (size == 1) AL(cpu) = val;
-                    else if (size == 2) AX(cpu) = val;
-                    else if (size == 4) RAX(cpu) = (uint32_t)val;
-                    else VM_PANIC("size");
-                    RIP(cpu) += ins_len;
-                    store_regs(cpu);
-                    break;
-                } else if (!string && !in) {
-                    RAX(cpu) = rreg(cpu->mac_vcpu_fd, HV_X86_RAX);
-                    veertu_handle_io(cpu, port, &RAX(cpu), 1, size, 1);
-                    macvm_set_rip(cpu, rip + ins_len);
-                    break;
-                }
-#endif
-                struct x86_decode decode;
-                
-                load_regs(cpu);
-                cpu->fetch_rip = rip;
-                
-                decode_instruction(cpu, &decode);
-                //printf("%llx: IN/OUT fetched %s, %x %x len %d\n", rip, decode_cmd_to_string(decode.cmd), decode.opcode[0], decode.opcode[1], decode.len);
-                VM_PANIC_ON(ins_len != decode.len);
-                exec_instruction(cpu, &decode);
-                store_regs(cpu);
-                
-                break;
-            }
-            case EXIT_REASON_CPUID: {
-                uint32_t rax = (uint32_t)rreg(cpu->mac_vcpu_fd, HV_X86_RAX);
-                uint32_t rbx = (uint32_t)rreg(cpu->mac_vcpu_fd, HV_X86_RBX);
-                uint32_t rcx = (uint32_t)rreg(cpu->mac_vcpu_fd, HV_X86_RCX);
-                uint32_t rdx = (uint32_t)rreg(cpu->mac_vcpu_fd, HV_X86_RDX);
-                
-                get_cpuid_func(cpu, rax, rcx, &rax, &rbx, &rcx, &rdx);
-                
-                wreg(cpu->mac_vcpu_fd, HV_X86_RAX, rax);
-                wreg(cpu->mac_vcpu_fd, HV_X86_RBX, rbx);
-                wreg(cpu->mac_vcpu_fd, HV_X86_RCX, rcx);
-                wreg(cpu->mac_vcpu_fd, HV_X86_RDX, rdx);
-                
-                // printf("cpuid %lx at %lx\n", rax, rip);
-                macvm_set_rip(cpu, rip + ins_len);
-                break;
-            }
-            case EXIT_REASON_XSETBV: {
-                X86CPU *x86_cpu = X86_CPU(cpu);
-                CPUX86State *env = &x86_cpu->env;
-                uint32_t eax = (uint32_t)rreg(cpu->mac_vcpu_fd, HV_X86_RAX);
-                uint32_t ecx = (uint32_t)rreg(cpu->mac_vcpu_fd, HV_X86_RCX);
-                uint32_t edx = (uint32_t)rreg(cpu->mac_vcpu_fd, HV_X86_RDX);
-                
-                if (ecx) {
-                    printf("xsetbv: invalid index %d\n", ecx);
-                    macvm_set_rip(cpu, rip + ins_len);
-                    break;
-                }
-                env->xcr0 = ((uint64_t)edx << 32) | eax;
-                wreg(cpu->mac_vcpu_fd, HV_X86_XCR0, env->xcr0 | 1);
-                macvm_set_rip(cpu, rip + ins_len);
-                break;
-            }
             case EXIT_REASON_INTR_WINDOW:
                 vmx_clear_int_window_exiting(cpu);
                 ret = EXCP_INTERRUPT;
@@ -915,10 +1058,12 @@ again:
                 switch (cr) {
                     case 0x0: {
                         macvm_set_cr0(cpu->mac_vcpu_fd, RRX(cpu, reg));
+                        decode_cache_flush(cpu);
                         break;
                     }
                     case 4: {
                         macvm_set_cr4(cpu->mac_vcpu_fd, RRX(cpu, reg));
+                        decode_cache_flush(cpu);
                         break;
                     }
                     case 8: {
@@ -940,18 +1085,6 @@ again:
                 store_regs(cpu);
                 break;
             }
-            case EXIT_REASON_APIC_ACCESS: {
-                struct x86_decode decode;
-                
-                load_regs(cpu);
-                cpu->fetch_rip = rip;
-                
-                decode_instruction(cpu, &decode);
-                //printf("apic fetched %s, %x %x len %d\n", decode_cmd_to_string(decode.cmd), decode.opcode[0], decode.opcode[1], decode.len);
-                exec_instruction(cpu, &decode);
-                store_regs(cpu);
-                break;
-            }
             case EXIT_REASON_TPR: {
                 ret = 1;
                 break;
@@ -973,11 +1106,6 @@ again:
                 ret = EXCP_INTERRUPT;
                 break;
             }
-            case EXIT_REASON_RDPMC:
-                wreg(cpu->mac_vcpu_fd, HV_X86_RAX, 0);
-                wreg(cpu->mac_vcpu_fd, HV_X86_RDX, 0);
-                macvm_set_rip(cpu, rip + ins_len);
-                break;
             case VMX_REASON_VMCALL:
                 if (g_hypervisor_iface) {
                     load_regs(cpu);
@@ -65,10 +65,17 @@ QTAILQ_HEAD(CPUTailQ, CPUState);
 #define first_cpu QTAILQ_FIRST(&cpus)
 #define CPU_FOREACH(cpu_state) QTAILQ_FOREACH(cpu_state, &cpus, node)
 
+/* vmmanager/utils.c */
+bool osx_is_sierra(void);
+
+/* per vcpu thread count of register and VMCS accesses */
+DECLARE_TLS(uint64_t, hv_reg_calls);
+
 static uint64_t inline rreg(hv_vcpuid_t vcpu, hv_x86_reg_t reg)
 {
 	uint64_t v;
 
+	tls_var(hv_reg_calls)++;
 	if (hv_vcpu_read_register(vcpu, reg, &v)) {
 		abort();
 	}
@@ -79,6 +86,7 @@ static uint64_t inline rreg(hv_vcpuid_t vcpu, hv_x86_reg_t reg)
 /* write GPR */
 static void inline wreg(hv_vcpuid_t vcpu, hv_x86_reg_t reg, uint64_t v)
 {
+	tls_var(hv_reg_calls)++;
 	if (hv_vcpu_write_register(vcpu, reg, v)) {
 		abort();
 	}
@@ -89,6 +97,7 @@ static uint64_t inline rvmcs(hv_vcpuid_t vcpu, uint32_t field)
 {
 	uint64_t v;
 
+	tls_var(hv_reg_calls)++;
 	hv_vmx_vcpu_read_vmcs(vcpu, field, &v);
 
 	return v;
@@ -97,6 +106,7 @@ static uint64_t inline rvmcs(hv_vcpuid_t vcpu, uint32_t field)
 /* write VMCS field */
 static void inline wvmcs(hv_vcpuid_t vcpu, uint32_t field, uint64_t v)
 {
+	tls_var(hv_reg_calls)++;
 	hv_vmx_vcpu_write_vmcs(vcpu, field, v);
 }
 
@@ -361,7 +361,14 @@ typedef struct x68_segment_selector {
 #define RFLAGS(cpu) (cpu->rflags.rflags)
 #define EFLAGS(cpu) (cpu->rflags.eflags)
 
-#define RRX(cpu, reg) (cpu->regs[reg].rrx)
+/*
+ * GPRs are fetched from the vcpu on first use after load_regs(), see
+ * x86_load_reg(). Every access has to go through X86_REG().
+ */
+#define X86_REG(cpu, reg) \
+    (((cpu)->regs_valid & (1u << (reg))) ? &(cpu)->regs[reg] : x86_load_reg(cpu, reg))
+
+#define RRX(cpu, reg) (X86_REG(cpu, reg)->rrx)
 #define RAX(cpu)        RRX(cpu, REG_RAX)
 #define RCX(cpu)        RRX(cpu, REG_RCX)
 #define RDX(cpu)        RRX(cpu, REG_RDX)
@@ -379,7 +386,7 @@ typedef struct x68_segment_selector {
 #define R14(cpu)        RRX(cpu, REG_R14)
 #define R15(cpu)        RRX(cpu, REG_R15)
 
-#define ERX(cpu, reg)   (cpu->regs[reg].erx)
+#define ERX(cpu, reg)   (X86_REG(cpu, reg)->erx)
 #define EAX(cpu)        ERX(cpu, REG_RAX)
 #define ECX(cpu)        ERX(cpu, REG_RCX)
 #define EDX(cpu)        ERX(cpu, REG_RDX)
@@ -389,7 +396,7 @@ typedef struct x68_segment_selector {
 #define ESI(cpu)        ERX(cpu, REG_RSI)
 #define EDI(cpu)        ERX(cpu, REG_RDI)
 
-#define RX(cpu, reg)   (cpu->regs[reg].rx)
+#define RX(cpu, reg)   (X86_REG(cpu, reg)->rx)
 #define AX(cpu)        RX(cpu, REG_RAX)
 #define CX(cpu)        RX(cpu, REG_RCX)
 #define DX(cpu)        RX(cpu, REG_RDX)
@@ -399,13 +406,13 @@ typedef struct x68_segment_selector {
 #define SI(cpu)        RX(cpu, REG_RSI)
 #define DI(cpu)        RX(cpu, REG_RDI)
 
-#define RL(cpu, reg)   (cpu->regs[reg].lx)
+#define RL(cpu, reg)   (X86_REG(cpu, reg)->lx)
 #define AL(cpu)        RL(cpu, REG_RAX)
 #define CL(cpu)        RL(cpu, REG_RCX)
 #define DL(cpu)        RL(cpu, REG_RDX)
 #define BL(cpu)        RL(cpu, REG_RBX)
 
-#define RH(cpu, reg)   (cpu->regs[reg].hx)
+#define RH(cpu, reg)   (X86_REG(cpu, reg)->hx)
 #define AH(cpu)        RH(cpu, REG_RAX)
 #define CH(cpu)        RH(cpu, REG_RCX)
 #define DH(cpu)        RH(cpu, REG_RDX)
@@ -413,6 +420,8 @@ typedef struct x68_segment_selector {
 
 struct CPUState;
 
+struct x86_register *x86_load_reg(struct CPUState *cpu, int reg);
+
 // deal with GDT/LDT descriptors in memory
 bool x86_read_segment_descriptor(struct CPUState *cpu, struct x86_segment_descriptor *desc, x68_segment_selector sel);
 bool x86_write_segment_descriptor(struct CPUState *cpu, struct x86_segment_descriptor *desc, x68_segment_selector sel);
@@ -29,7 +29,7 @@
 
 static void decode_invalid(CPUState *cpu, struct x86_decode *decode)
 {
-    printf("%llx: failed to decode instruction ", cpu->fetch_rip - decode->len);
+    printf("%" PRIx64 ": failed to decode instruction ", cpu->fetch_rip - decode->len);
     for (int i = 0; i < decode->opcode_len; i++)
         printf("%x ", decode->opcode[i]);
     printf("\n");
@@ -482,7 +482,7 @@ static void decode_sldtgroup(CPUState *cpu, struct x86_decode *decode)
         X86_DECODE_CMD_INVL
     };
     decode->cmd = group[decode->modrm.reg];
-    printf("%llx: decode_sldtgroup: %d\n", cpu->fetch_rip, decode->modrm.reg);
+    printf("%" PRIx64 ": decode_sldtgroup: %d\n", cpu->fetch_rip, decode->modrm.reg);
 }
 
 static void decode_lidtgroup(CPUState *cpu, struct x86_decode *decode)
@@ -1568,7 +1568,7 @@ static void decode_opcodes(CPUState *cpu, struct x86_decode *decode)
     }
 }
 
-uint32_t decode_instruction(CPUState *cpu, struct x86_decode *decode)
+static uint32_t __decode_instruction(CPUState *cpu, struct x86_decode *decode)
 {
     ZERO_INIT(*decode);
 
@@ -1581,10 +1581,106 @@ uint32_t decode_instruction(CPUState *cpu, struct x86_decode *decode)
     return decode->len;
 }
 
+/*
+ * Per-vcpu cache of decoded instructions. Guest drivers keep hitting the
+ * same MMIO/PIO instructions, so the decoded form is kept keyed by CR3,
+ * linear RIP and the CPU mode bits the decoder depends on. Operands that
+ * depend on register values (modrm memory operands) are only resolved at
+ * exec time, so a cached decode can be reused as is. The instruction bytes
+ * are kept too and compared against guest memory on a hit, which costs one
+ * fetch instead of one page walk per decoded byte and keeps us safe from
+ * code being replaced behind a stale entry.
+ */
+#define DECODE_CACHE_SIZE   256
+#define MAX_INSTRUCTION_LEN 16
+
+struct x86_decode_cache_entry {
+    bool valid;
+    addr_t cr3;
+    addr_t linear_rip;
+    uint64_t mode;
+    uint8_t bytes[MAX_INSTRUCTION_LEN];
+    struct x86_decode decode;
+};
+
+struct x86_decode_cache {
+    struct x86_decode_cache_entry entries[DECODE_CACHE_SIZE];
+};
+
+static uint64_t decode_cache_mode(CPUState *cpu)
+{
+    uint64_t cr0 = rvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_CR0);
+    uint64_t efer = rvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_IA32_EFER);
+    uint64_t cs_ar = rvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_CS_ACCESS_RIGHTS);
+
+    /* PE, VM, LMA and CS.L/CS.D select addressing and operand sizes */
+    return (cr0 & CR0_PE) | (RFLAGS(cpu) & RFLAGS_VM) | (efer & EFER_LMA) | ((cs_ar & 0x6000) << 32);
+}
+
+static inline unsigned decode_cache_hash(addr_t va)
+{
+    return (va ^ (va >> 12)) & (DECODE_CACHE_SIZE - 1);
+}
+
+void decode_cache_flush(CPUState *cpu)
+{
+    int i;
+
+    if (!cpu->decode_cache)
+        return;
+    for (i = 0; i < DECODE_CACHE_SIZE; i++)
+        cpu->decode_cache->entries[i].valid = false;
+}
+
+uint32_t decode_instruction(CPUState *cpu, struct x86_decode *decode)
+{
+    struct x86_decode_cache_entry *entry;
+    uint8_t bytes[MAX_INSTRUCTION_LEN];
+    addr_t va;
+    addr_t cr3;
+    uint64_t mode;
+
+    if (!cpu->decode_cache)
+        return __decode_instruction(cpu, decode);
+
+    va = linear_rip(cpu, RIP(cpu));
+    cr3 = rvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_CR3);
+    mode = decode_cache_mode(cpu);
+    entry = &cpu->decode_cache->entries[decode_cache_hash(va)];
+
+    if (entry->valid && entry->linear_rip == va && entry->cr3 == cr3 && entry->mode == mode) {
+        vmx_read_mem(cpu, bytes, va, entry->decode.len);
+        if (!memcmp(bytes, entry->bytes, entry->decode.len)) {
+            *decode = entry->decode;
+            cpu->decode_cache_hits++;
+            return decode->len;
+        }
+    }
+
+    cpu->decode_cache_misses++;
+    __decode_instruction(cpu, decode);
+    if (decode->len > MAX_INSTRUCTION_LEN) {
+        entry->valid = false;
+        return decode->len;
+    }
+
+    vmx_read_mem(cpu, entry->bytes, va, decode->len);
+    entry->decode = *decode;
+    entry->linear_rip = va;
+    entry->cr3 = cr3;
+    entry->mode = mode;
+    entry->valid = true;
+
+    return decode->len;
+}
+
 void init_decoder(CPUState *cpu)
 {
     int i;
     
+    if (!cpu->decode_cache)
+        cpu->decode_cache = g_malloc0(sizeof(struct x86_decode_cache));
+
     for (i = 0; i < ARRAY_SIZE(_decode_tbl2); i++)
         memcpy(_decode_tbl1, &invl_inst, sizeof(invl_inst));
     for (i = 0; i < ARRAY_SIZE(_decode_tbl2); i++)
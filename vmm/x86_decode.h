@@ -304,7 +304,9 @@ typedef struct x86_decode {
 
 uint64_t sign(uint64_t val, int size);
 
+void init_decoder(CPUState *cpu);
 uint32_t decode_instruction(CPUState *cpu, struct x86_decode *decode);
+void decode_cache_flush(CPUState *cpu);
 
 addr_t get_reg_ref(CPUState *cpu, int reg, int is_extended, int size);
 addr_t get_reg_val(CPUState *cpu, int reg, int is_extended, int size);
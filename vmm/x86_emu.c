@@ -133,13 +133,13 @@ addr_t read_reg(struct CPUState* cpu, int reg, int size)
 {
     switch (size) {
         case 1:
-            return cpu->regs[reg].lx;
+            return RL(cpu, reg);
         case 2:
-            return cpu->regs[reg].rx;
+            return RX(cpu, reg);
         case 4:
-            return cpu->regs[reg].erx;
+            return ERX(cpu, reg);
         case 8:
-            return cpu->regs[reg].rrx;
+            return RRX(cpu, reg);
         default:
             VM_PANIC_ON("read_reg size");
     }
@@ -150,16 +150,16 @@ void write_reg(struct CPUState* cpu, int reg, addr_t val, int size)
 {
     switch (size) {
         case 1:
-            cpu->regs[reg].lx = val;
+            RL(cpu, reg) = val;
             break;
         case 2:
-            cpu->regs[reg].rx = val;
+            RX(cpu, reg) = val;
             break;
         case 4:
-            cpu->regs[reg].rrx = (uint32_t)val;
+            RRX(cpu, reg) = (uint32_t)val;
             break;
         case 8:
-            cpu->regs[reg].rrx = val;
+            RRX(cpu, reg) = val;
             break;
         default:
             VM_PANIC_ON("write_reg size");
@@ -212,9 +212,17 @@ void write_val_to_reg(addr_t reg_ptr, addr_t val, int size)
 }
 
 
+/* register operand pointers may point at GPRs that weren't fetched yet */
+static inline void load_reg_ptr(struct CPUState *cpu, addr_t ptr)
+{
+    if (ptr >= (addr_t)cpu->regs && ptr < (addr_t)(cpu->regs + 16))
+        X86_REG(cpu, (ptr - (addr_t)cpu->regs) / sizeof(struct x86_register));
+}
+
 void write_val_ext(struct CPUState* cpu, addr_t ptr, addr_t val, int size)
 {
     if (ptr > (addr_t)cpu && ptr < (addr_t)cpu + sizeof(struct CPUState))  {
+        load_reg_ptr(cpu, ptr);
         write_val_to_reg(ptr, val, size);
         return;
     }
@@ -233,6 +241,7 @@ addr_t read_val_ext(struct CPUState* cpu, addr_t ptr, int size)
     uint8_t *mmio_ptr;
     
     if (ptr > (addr_t)cpu && ptr < (addr_t)cpu + sizeof(struct CPUState)) {
+        load_reg_ptr(cpu, ptr);
         return read_val_from_reg(ptr, size);
     }
     
@@ -268,6 +277,7 @@ static void fetch_operands(struct CPUState *cpu, struct x86_decode *decode, int
                 break;
             case X86_VAR_REG:
                 VM_PANIC_ON(!decode->op[i].ptr);
+                load_reg_ptr(cpu, decode->op[i].ptr);
                 if (calc_val[i])
                     decode->op[i].val = read_val_from_reg(decode->op[i].ptr, decode->operand_size);
                 break;
@@ -343,8 +353,8 @@ static void exec_neg(struct CPUState *cpu, struct x86_decode *decode)
     int32_t val;
     fetch_operands(cpu, decode, 2, true, true, false);
 
-    val = 0 - sign(decode->op[1].val, decode->operand_size);
-    write_val_ext(cpu, decode->op[1].ptr, val, decode->operand_size);
+    val = 0 - sign(decode->op[0].val, decode->operand_size);
+    write_val_ext(cpu, decode->op[0].ptr, val, decode->operand_size);
 
     if (4 == decode->operand_size) {
         SET_FLAGS_OSZAPC_SUB_32(0, 0 - val, val);
@@ -498,6 +508,105 @@ static inline void string_rep(struct CPUState * cpu, struct x86_decode *decode,
     }
 }
 
+/*
+ * Bulk REP string support. A chunk is the run of elements that stays within
+ * one guest page and doesn't wrap the index register, so it costs a single
+ * page walk and, for RAM, a single copy. Returns 0 if the first element
+ * straddles a page or wraps, the caller then falls back to one element.
+ */
+static addr_t string_chunk(struct CPUState *cpu, struct x86_decode *decode, int reg, addr_t addr, addr_t rcx)
+{
+    int size = decode->operand_size;
+    addr_t index = read_reg(cpu, reg, decode->addressing_size);
+    addr_t mask = decode->addressing_size == 8 ? -1llu : (1llu << (decode->addressing_size * 8)) - 1;
+    addr_t offset = addr & 0xfff;
+    addr_t n;
+
+    if (offset + size > 0x1000 || index > mask - (size - 1))
+        return 0;
+
+    if (cpu->rflags.df)
+        n = MIN(offset / size, index / size) + 1;
+    else
+        n = MIN((0x1000 - offset) / size, (mask - index - (size - 1)) / size + 1);
+
+    return MIN(n, rcx);
+}
+
+static void string_reverse(uint8_t *buf, int n, int size)
+{
+    uint8_t tmp[8];
+    int i;
+
+    for (i = 0; i < n / 2; i++) {
+        uint8_t *a = buf + i * size;
+        uint8_t *b = buf + (n - 1 - i) * size;
+
+        memcpy(tmp, a, size);
+        memcpy(a, b, size);
+        memcpy(b, tmp, size);
+    }
+}
+
+/*
+ * Access a chunk of n elements whose first element (in execution order) is
+ * at addr. buf holds the elements in execution order. MMIO keeps element
+ * sized accesses in execution order, RAM is copied in one go.
+ */
+static void string_chunk_rw(struct CPUState *cpu, struct x86_decode *decode, addr_t addr, uint8_t *buf, int n, bool is_write)
+{
+    int size = decode->operand_size;
+    bool df = cpu->rflags.df;
+    addr_t gva = df ? addr - (n - 1) * size : addr;
+    addr_t gpa;
+    int i;
+
+    if (!mmu_gva_to_gpa(cpu, gva, &gpa)) {
+        VM_PANIC_ON_EX(1, "%s: mmu_gva_to_gpa %" PRIx64 " failed\n", __FUNCTION__, gva);
+    }
+
+    if (address_space_is_direct(&address_space_memory, gpa, n * size, is_write)) {
+        if (df && is_write)
+            string_reverse(buf, n, size);
+        address_space_rw(&address_space_memory, gpa, buf, n * size, is_write);
+        if (df)
+            string_reverse(buf, n, size);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        addr_t elem_gpa = df ? gpa + (n - 1 - i) * size : gpa + i * size;
+        address_space_rw(&address_space_memory, elem_gpa, buf + i * size, size, is_write);
+    }
+}
+
+/*
+ * REP INS/OUTS only batch port accesses when the memory side of the chunk
+ * is RAM: a device behind MMIO would see all port accesses before all of
+ * its own, and for an untranslatable destination port data would be
+ * consumed before the fault.
+ */
+static bool string_chunk_is_ram(struct CPUState *cpu, struct x86_decode *decode, addr_t addr, int n, bool is_write)
+{
+    int size = decode->operand_size;
+    addr_t gva = cpu->rflags.df ? addr - (n - 1) * size : addr;
+    addr_t gpa;
+
+    return mmu_gva_to_gpa(cpu, gva, &gpa) &&
+           address_space_is_direct(&address_space_memory, gpa, n * size, is_write);
+}
+
+static inline void string_advance_reg(struct CPUState *cpu, int reg, struct x86_decode *decode, addr_t n)
+{
+    addr_t val = read_reg(cpu, reg, decode->addressing_size);
+
+    if (cpu->rflags.df)
+        val -= n * decode->operand_size;
+    else
+        val += n * decode->operand_size;
+    write_reg(cpu, reg, val, decode->addressing_size);
+}
+
 static void exec_ins_single(struct CPUState *cpu, struct x86_decode *decode)
 {
     addr_t addr = linear_addr_size(cpu, RDI(cpu), decode->addressing_size, REG_SEG_ES);
@@ -508,10 +617,31 @@ static void exec_ins_single(struct CPUState *cpu, struct x86_decode *decode)
     string_increment_reg(cpu, REG_RDI, decode);
 }
 
+static void exec_rep_ins(struct CPUState *cpu, struct x86_decode *decode)
+{
+    addr_t rcx = read_reg(cpu, REG_RCX, decode->addressing_size);
+
+    while (rcx) {
+        addr_t addr = linear_addr_size(cpu, RDI(cpu), decode->addressing_size, REG_SEG_ES);
+        addr_t n = string_chunk(cpu, decode, REG_RDI, addr, rcx);
+
+        if (n < 2 || !string_chunk_is_ram(cpu, decode, addr, n, true)) {
+            exec_ins_single(cpu, decode);
+            n = 1;
+        } else {
+            veertu_handle_io(cpu, DX(cpu), cpu->mmio_buf, 0, decode->operand_size, n);
+            string_chunk_rw(cpu, decode, addr, cpu->mmio_buf, n, true);
+            string_advance_reg(cpu, REG_RDI, decode, n);
+        }
+        rcx -= n;
+        write_reg(cpu, REG_RCX, rcx, decode->addressing_size);
+    }
+}
+
 static void exec_ins(struct CPUState *cpu, struct x86_decode *decode)
 {
     if (decode->rep)
-        string_rep(cpu, decode, exec_ins_single, 0);
+        exec_rep_ins(cpu, decode);
     else
         exec_ins_single(cpu, decode);
 
@@ -528,10 +658,31 @@ static void exec_outs_single(struct CPUState *cpu, struct x86_decode *decode)
     string_increment_reg(cpu, REG_RSI, decode);
 }
 
+static void exec_rep_outs(struct CPUState *cpu, struct x86_decode *decode)
+{
+    addr_t rcx = read_reg(cpu, REG_RCX, decode->addressing_size);
+
+    while (rcx) {
+        addr_t addr = decode_linear_addr(cpu, decode, RSI(cpu), REG_SEG_DS);
+        addr_t n = string_chunk(cpu, decode, REG_RSI, addr, rcx);
+
+        if (n < 2 || !string_chunk_is_ram(cpu, decode, addr, n, false)) {
+            exec_outs_single(cpu, decode);
+            n = 1;
+        } else {
+            string_chunk_rw(cpu, decode, addr, cpu->mmio_buf, n, false);
+            veertu_handle_io(cpu, DX(cpu), cpu->mmio_buf, 1, decode->operand_size, n);
+            string_advance_reg(cpu, REG_RSI, decode, n);
+        }
+        rcx -= n;
+        write_reg(cpu, REG_RCX, rcx, decode->addressing_size);
+    }
+}
+
 static void exec_outs(struct CPUState *cpu, struct x86_decode *decode)
 {
     if (decode->rep)
-        string_rep(cpu, decode, exec_outs_single, 0);
+        exec_rep_outs(cpu, decode);
     else
         exec_outs_single(cpu, decode);
     
@@ -554,10 +705,47 @@ static void exec_movs_single(struct CPUState *cpu, struct x86_decode *decode)
     string_increment_reg(cpu, REG_RDI, decode);
 }
 
+static void exec_rep_movs(struct CPUState *cpu, struct x86_decode *decode)
+{
+    addr_t rcx = read_reg(cpu, REG_RCX, decode->addressing_size);
+
+    while (rcx) {
+        addr_t src_addr = decode_linear_addr(cpu, decode, RSI(cpu), REG_SEG_DS);
+        addr_t dst_addr = linear_addr_size(cpu, RDI(cpu), decode->addressing_size, REG_SEG_ES);
+        addr_t n = MIN(string_chunk(cpu, decode, REG_RSI, src_addr, rcx),
+                       string_chunk(cpu, decode, REG_RDI, dst_addr, rcx));
+        addr_t src_gpa, dst_gpa;
+
+        /*
+         * Overlapping copies and MMIO to MMIO moves depend on the order of
+         * element accesses, keep those one by one.
+         */
+        if (n >= 2 && mmu_gva_to_gpa(cpu, src_addr & ~0xfffllu, &src_gpa) &&
+            mmu_gva_to_gpa(cpu, dst_addr & ~0xfffllu, &dst_gpa)) {
+            if (src_gpa == dst_gpa ||
+                (!address_space_is_direct(&address_space_memory, src_gpa, 0x1000, false) &&
+                 !address_space_is_direct(&address_space_memory, dst_gpa, 0x1000, true)))
+                n = 1;
+        }
+
+        if (n < 2) {
+            exec_movs_single(cpu, decode);
+            n = 1;
+        } else {
+            string_chunk_rw(cpu, decode, src_addr, cpu->mmio_buf, n, false);
+            string_chunk_rw(cpu, decode, dst_addr, cpu->mmio_buf, n, true);
+            string_advance_reg(cpu, REG_RSI, decode, n);
+            string_advance_reg(cpu, REG_RDI, decode, n);
+        }
+        rcx -= n;
+        write_reg(cpu, REG_RCX, rcx, decode->addressing_size);
+    }
+}
+
 static void exec_movs(struct CPUState *cpu, struct x86_decode *decode)
 {
     if (decode->rep) {
-        string_rep(cpu, decode, exec_movs_single, 0);
+        exec_rep_movs(cpu, decode);
     }
     else
         exec_movs_single(cpu, decode);
@@ -608,10 +796,36 @@ static void exec_stos_single(struct CPUState *cpu, struct x86_decode *decode)
 }
 
 
+static void exec_rep_stos(struct CPUState *cpu, struct x86_decode *decode)
+{
+    addr_t rcx = read_reg(cpu, REG_RCX, decode->addressing_size);
+    addr_t val = read_reg(cpu, REG_RAX, decode->operand_size);
+    int size = decode->operand_size;
+    int i;
+
+    for (i = 0; i < sizeof(cpu->mmio_buf) / size; i++)
+        memcpy(cpu->mmio_buf + i * size, &val, size);
+
+    while (rcx) {
+        addr_t addr = linear_addr_size(cpu, RDI(cpu), decode->addressing_size, REG_SEG_ES);
+        addr_t n = string_chunk(cpu, decode, REG_RDI, addr, rcx);
+
+        if (n < 2) {
+            exec_stos_single(cpu, decode);
+            n = 1;
+        } else {
+            string_chunk_rw(cpu, decode, addr, cpu->mmio_buf, n, true);
+            string_advance_reg(cpu, REG_RDI, decode, n);
+        }
+        rcx -= n;
+        write_reg(cpu, REG_RCX, rcx, decode->addressing_size);
+    }
+}
+
 static void exec_stos(struct CPUState *cpu, struct x86_decode *decode)
 {
     if (decode->rep) {
-        string_rep(cpu, decode, exec_stos_single, 0);
+        exec_rep_stos(cpu, decode);
     }
     else
         exec_stos_single(cpu, decode);
@@ -635,6 +849,7 @@ static void exec_scas(struct CPUState *cpu, struct x86_decode *decode)
 {
     decode->op[0].type = X86_VAR_REG;
     decode->op[0].reg = REG_RAX;
+    decode->op[0].ptr = get_reg_ref(cpu, REG_RAX, 0, decode->operand_size);
     if (decode->rep) {
         string_rep(cpu, decode, exec_scas_single, decode->rep);
     }
@@ -763,6 +978,35 @@ void simulate_rdmsr(struct CPUState *cpu)
         g_hypervisor_iface->rdmsr_handler(cpu, msr);
 }
 
+/*
+ * MSRs whose emulation only touches vcpu private state (VMCS fields and
+ * CPUX86State), so they can be handled without the iothread mutex.
+ */
+bool msr_is_vcpu_local(uint32_t msr)
+{
+    switch (msr) {
+        case MSR_IA32_TSC:
+        case MSR_IA32_UCODE_REV:
+        case MSR_IA32_MISC_ENABLE:
+        case MSR_EFER:
+        case MSR_FSBASE:
+        case MSR_GSBASE:
+        case MSR_KERNELGSBASE:
+        case MSR_MTRRfix64K_00000:
+        case MSR_MTRRfix16K_80000:
+        case MSR_MTRRfix16K_A0000:
+        case MSR_MTRRdefType:
+            return true;
+        default:
+            break;
+    }
+    if (msr >= MSR_MTRRphysBase(0) && msr <= MSR_MTRRphysMask(7))
+        return true;
+    if (msr >= MSR_MTRRfix4K_C0000 && msr <= MSR_MTRRfix4K_F8000)
+        return true;
+    return false;
+}
+
 static void exec_rdmsr(struct CPUState *cpu, struct x86_decode *decode)
 {
     simulate_rdmsr(cpu);
@@ -783,7 +1027,7 @@ void simulate_wrmsr(struct CPUState *cpu)
             //hv_vm_sync_tsc(data);
             break;
         case MSR_IA32_APICBASE:
-            printf("MSR_IA32_APICBASE %llx\n", data);
+            printf("MSR_IA32_APICBASE %" PRIx64 "\n", data);
             cpu_set_apic_base(X86_CPU(cpu)->apic_state, data);
             break;
         case MSR_FSBASE:
@@ -1396,24 +1640,36 @@ static void init_cmd_handler(CPUState *cpu)
 
 static void print_debug(struct CPUState *cpu)
 {
-    printf("%llx: eax %llx ebx %llx ecx %llx edx %llx esi %llx edi %llx ebp %llx esp %llx flags %llx\n", RIP(cpu), RAX(cpu), RBX(cpu), RCX(cpu), RDX(cpu), RSI(cpu), RDI(cpu), RBP(cpu), RSP(cpu), EFLAGS(cpu));
+    printf("%" PRIx64 ": eax %" PRIx64 " ebx %" PRIx64 " ecx %" PRIx64
+           " edx %" PRIx64 " esi %" PRIx64 " edi %" PRIx64 " ebp %" PRIx64
+           " esp %" PRIx64 " flags %x\n", RIP(cpu), RAX(cpu), RBX(cpu),
+           RCX(cpu), RDX(cpu), RSI(cpu), RDI(cpu), RBP(cpu), RSP(cpu),
+           EFLAGS(cpu));
+}
+
+static const hv_x86_reg_t hv_gpr[16] = {
+    HV_X86_RAX, HV_X86_RCX, HV_X86_RDX, HV_X86_RBX,
+    HV_X86_RSP, HV_X86_RBP, HV_X86_RSI, HV_X86_RDI,
+    HV_X86_R8, HV_X86_R9, HV_X86_R10, HV_X86_R11,
+    HV_X86_R12, HV_X86_R13, HV_X86_R14, HV_X86_R15,
+};
+
+/* fetch a GPR from the vcpu on first use, see X86_REG() */
+struct x86_register *x86_load_reg(struct CPUState *cpu, int reg)
+{
+    cpu->regs[reg].rrx = rreg(cpu->mac_vcpu_fd, hv_gpr[reg]);
+    cpu->regs_loaded[reg] = cpu->regs[reg].rrx;
+    cpu->regs_valid |= 1u << reg;
+    return &cpu->regs[reg];
 }
 
 void load_regs(struct CPUState *cpu)
 {
-    int i = 0;
-    RRX(cpu, REG_RAX) = rreg(cpu->mac_vcpu_fd, HV_X86_RAX);
-    RRX(cpu, REG_RBX) = rreg(cpu->mac_vcpu_fd, HV_X86_RBX);
-    RRX(cpu, REG_RCX) = rreg(cpu->mac_vcpu_fd, HV_X86_RCX);
-    RRX(cpu, REG_RDX) = rreg(cpu->mac_vcpu_fd, HV_X86_RDX);
-    RRX(cpu, REG_RSI) = rreg(cpu->mac_vcpu_fd, HV_X86_RSI);
-    RRX(cpu, REG_RDI) = rreg(cpu->mac_vcpu_fd, HV_X86_RDI);
-    RRX(cpu, REG_RSP) = rreg(cpu->mac_vcpu_fd, HV_X86_RSP);
-    RRX(cpu, REG_RBP) = rreg(cpu->mac_vcpu_fd, HV_X86_RBP);
-    for (i = 8; i < 16; i++)
-        RRX(cpu, i) = rreg(cpu->mac_vcpu_fd, HV_X86_RAX + i);
-    
+    /* GPRs are fetched lazily */
+    cpu->regs_valid = 0;
+
     RFLAGS(cpu) = rreg(cpu->mac_vcpu_fd, HV_X86_RFLAGS);
+    cpu->rflags_loaded = RFLAGS(cpu);
     rflags_to_lflags(cpu);
     RIP(cpu) = rreg(cpu->mac_vcpu_fd, HV_X86_RIP);
 
@@ -1422,20 +1678,21 @@ void load_regs(struct CPUState *cpu)
 
 void store_regs(struct CPUState *cpu)
 {
-    int i = 0;
-    wreg(cpu->mac_vcpu_fd, HV_X86_RAX, RAX(cpu));
-    wreg(cpu->mac_vcpu_fd, HV_X86_RBX, RBX(cpu));
-    wreg(cpu->mac_vcpu_fd, HV_X86_RCX, RCX(cpu));
-    wreg(cpu->mac_vcpu_fd, HV_X86_RDX, RDX(cpu));
-    wreg(cpu->mac_vcpu_fd, HV_X86_RSI, RSI(cpu));
-    wreg(cpu->mac_vcpu_fd, HV_X86_RDI, RDI(cpu));
-    wreg(cpu->mac_vcpu_fd, HV_X86_RBP, RBP(cpu));
-    wreg(cpu->mac_vcpu_fd, HV_X86_RSP, RSP(cpu));
-    for (i = 8; i < 16; i++)
-        wreg(cpu->mac_vcpu_fd, HV_X86_RAX + i, RRX(cpu, i));
+    int i;
+
+    /* only write back GPRs that were fetched and changed since */
+    for (i = 0; i < 16; i++) {
+        if (!(cpu->regs_valid & (1u << i)) || cpu->regs[i].rrx == cpu->regs_loaded[i])
+            continue;
+        wreg(cpu->mac_vcpu_fd, hv_gpr[i], cpu->regs[i].rrx);
+        cpu->regs_loaded[i] = cpu->regs[i].rrx;
+    }
     
     lflags_to_rflags(cpu);
-    wreg(cpu->mac_vcpu_fd, HV_X86_RFLAGS, RFLAGS(cpu));
+    if (RFLAGS(cpu) != cpu->rflags_loaded) {
+        wreg(cpu->mac_vcpu_fd, HV_X86_RFLAGS, RFLAGS(cpu));
+        cpu->rflags_loaded = RFLAGS(cpu);
+    }
     macvm_set_rip(cpu, RIP(cpu));
 
     //print_debug(cpu);
@@ -1450,13 +1707,13 @@ bool exec_instruction(struct CPUState *cpu, struct x86_decode *ins)
         VM_PANIC("emulate fpu\n");
     } else {
         if (!_cmd_handler[ins->cmd].handler) {
-            printf("Unimplemented handler (%llx) for %d (%x %x) \n", RIP(cpu), ins->cmd, ins->opcode[0],
+            printf("Unimplemented handler (%" PRIx64 ") for %d (%x %x) \n", RIP(cpu), ins->cmd, ins->opcode[0],
                    ins->opcode_len > 1 ? ins->opcode[1] : 0);
             RIP(cpu) += ins->len;
             return true;
         }
         
-        VM_PANIC_ON_EX(!_cmd_handler[ins->cmd].handler, "Unimplemented handler (%llx) for %d (%x %x) \n", RIP(cpu), ins->cmd, ins->opcode[0], ins->opcode_len > 1 ? ins->opcode[1] : 0);
+        VM_PANIC_ON_EX(!_cmd_handler[ins->cmd].handler, "Unimplemented handler (%" PRIx64 ") for %d (%x %x) \n", RIP(cpu), ins->cmd, ins->opcode[0], ins->opcode_len > 1 ? ins->opcode[1] : 0);
         _cmd_handler[ins->cmd].handler(cpu, ins);
     }
     return true;
@@ -12,5 +12,6 @@ void store_regs(struct CPUState *cpu);
 
 void simulate_rdmsr(struct CPUState *cpu);
 void simulate_wrmsr(struct CPUState *cpu);
+bool msr_is_vcpu_local(uint32_t msr);
 
 #endif
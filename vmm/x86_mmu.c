@@ -168,19 +168,73 @@ static bool walk_gpt(struct CPUState *cpu, addr_t addr, int err_code, struct gpt
 }
 
 
+/*
+ * Software TLB for emulator accesses. INVLPG and CR3 loads don't exit, so
+ * we can't tell when the guest drops a translation; entries only live
+ * until the next VM entry (mmu_flush_tlb bumps the generation). Within one
+ * exit, REP string instructions and multi-page accesses hit the same pages
+ * over and over. Entries are tagged with the full CR3, PCID included, and
+ * the paging mode, which covers task switches done by the emulator.
+ */
+#define MMU_TLB_SIZE    64
+
+struct mmu_tlb_entry {
+    uint64_t gen;
+    addr_t cr3;
+    addr_t vpn;
+    addr_t gfn;
+    int mode;
+};
+
+struct mmu_tlb {
+    uint64_t gen;
+    struct mmu_tlb_entry entries[MMU_TLB_SIZE];
+};
+
+void mmu_flush_tlb(struct CPUState *cpu)
+{
+    if (cpu->mmu_tlb)
+        cpu->mmu_tlb->gen++;
+}
+
 bool mmu_gva_to_gpa(struct CPUState *cpu, addr_t gva, addr_t *gpa)
 {
     bool res;
     struct gpt_translation pt;
+    struct mmu_tlb_entry *entry;
     int err_code = 0;
+    bool pae;
+    int mode;
+    addr_t cr3;
 
     if (!x86_is_paging_mode(cpu)) {
         *gpa = gva;
         return true;
     }
 
-    res = walk_gpt(cpu, gva, err_code, &pt, x86_is_pae_enabled(cpu));
+    if (!cpu->mmu_tlb)
+        cpu->mmu_tlb = g_malloc0(sizeof(struct mmu_tlb));
+
+    pae = x86_is_pae_enabled(cpu);
+    mode = gpt_top_level(cpu, pae);
+    cr3 = rvmcs(cpu->mac_vcpu_fd, VMCS_GUEST_CR3);
+    entry = &cpu->mmu_tlb->entries[(gva >> 12) & (MMU_TLB_SIZE - 1)];
+
+    if (entry->gen == cpu->mmu_tlb->gen && entry->vpn == gva >> 12 &&
+        entry->cr3 == cr3 && entry->mode == mode) {
+        *gpa = (entry->gfn << 12) | (gva & 0xfff);
+        cpu->mmu_tlb_hits++;
+        return true;
+    }
+
+    cpu->mmu_tlb_misses++;
+    res = walk_gpt(cpu, gva, err_code, &pt, pae);
     if (res) {
+        entry->gen = cpu->mmu_tlb->gen;
+        entry->cr3 = cr3;
+        entry->vpn = gva >> 12;
+        entry->gfn = pt.gpa >> 12;
+        entry->mode = mode;
         *gpa = pt.gpa;
         return true;
     }
@@ -198,7 +252,7 @@ void vmx_write_mem(struct CPUState* cpu, addr_t gva, void *data, int bytes)
 
         // TODO: check read/write permissions
         if (!mmu_gva_to_gpa(cpu, gva, &gpa)) {
-            VM_PANIC_ON_EX(1, "%s: mmu_gva_to_gpa %llx failed\n",  __FUNCTION__, gva);
+            VM_PANIC_ON_EX(1, "%s: mmu_gva_to_gpa %" PRIx64 " failed\n",  __FUNCTION__, gva);
         }
         address_space_rw(&address_space_memory, gpa, data, copy, 1);
 
@@ -217,7 +271,7 @@ void vmx_read_mem(struct CPUState* cpu, void *data, addr_t gva, int bytes)
         int copy = MIN(bytes, 0x1000 - (gva & 0xfff));
 
         if (!mmu_gva_to_gpa(cpu, gva, &gpa)) {
-            VM_PANIC_ON_EX(1, "%s: mmu_gva_to_gpa %llx failed\n", __FUNCTION__, gva);
+            VM_PANIC_ON_EX(1, "%s: mmu_gva_to_gpa %" PRIx64 " failed\n", __FUNCTION__, gva);
         }
         address_space_rw(&address_space_memory, gpa, data, copy, 0);
 
@@ -21,6 +21,7 @@
 #define MMU_PAGE_NX             (1 << 3)
 
 bool mmu_gva_to_gpa(struct CPUState *cpu, addr_t gva, addr_t *gpa);
+void mmu_flush_tlb(struct CPUState *cpu);
 
 void vmx_write_mem(struct CPUState* cpu, addr_t gva, void *data, int bytes);
 void vmx_read_mem(struct CPUState* cpu, void *data, addr_t gva, int bytes);
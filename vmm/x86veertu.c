@@ -154,6 +154,7 @@ void veertu_put_segments(CPUState *cpu_state)
 
     macvm_set_cr4(cpu_state->mac_vcpu_fd, env->cr[4]);
     macvm_set_cr0(cpu_state->mac_vcpu_fd, env->cr[0]);
+    decode_cache_flush(cpu_state);
 
     veertu_set_segment(cpu_state, &seg, &env->segs[R_CS], false);
     vmx_write_segment_descriptor(cpu_state, &seg, REG_SEG_CS);
@@ -25,6 +25,9 @@ typedef enum VMExportFormat {
 
 @interface VMImportExport : NSObject
 
+/* importVmFromVmdk writes the disk as a compressed qcow2 image */
+@property BOOL compressDisks;
+
 - (void) exportVm: (NSString *)vm_name toFile: (NSString *) file format:(VMExportFormat)fmt completion: (void(^)(NSError *error))completionHandler;
 - (NSError*) importVmFromVmz: (NSString *)file toFolder: (NSString *) folder withProgress:(NSProgress *)progress;
 - (NSError*) importVmFromVmdk: (NSString *)file toFolder: (NSString *) folder withProgress:(NSProgress *)progress;
@@ -653,6 +653,44 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
     return 1;
 }
 
+/* We must always write compressed clusters as a whole, so don't try to find
+ * zeroed parts in a cluster. We can only save the write of a cluster if it is
+ * completely zeroed and we're allowed to keep the target sparse. Runs of data
+ * clusters go out in one request, which qcow2 deflates on all cores. */
+static int convert_write_compressed(ImgConvertState *s, int64_t sector_num,
+                                    int nb_sectors, const uint8_t *buf)
+{
+    int start = 0, end, n;
+    int ret;
+
+    while (start < nb_sectors) {
+        for (end = start; end < nb_sectors; end += n) {
+            n = MIN((int) s->cluster_sectors, nb_sectors - end);
+            if (s->has_zero_init && s->min_sparse &&
+                buffer_is_zero(buf + end * BDRV_SECTOR_SIZE,
+                               n * BDRV_SECTOR_SIZE))
+            {
+                break;
+            }
+        }
+
+        if (end == start) {
+            assert(!s->target_has_backing);
+            start += MIN((int) s->cluster_sectors, nb_sectors - start);
+            continue;
+        }
+
+        ret = blk_write_compressed(s->target, sector_num + start,
+                                   buf + start * BDRV_SECTOR_SIZE, end - start);
+        if (ret < 0) {
+            return ret;
+        }
+        start = end;
+    }
+
+    return 0;
+}
+
 static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
                          const uint8_t *buf)
 {
@@ -670,19 +708,8 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
                 break;
                 
             case BLK_DATA:
-                /* We must always write compressed clusters as a whole, so don't
-                 * try to find zeroed parts in the buffer. We can only save the
-                 * write if the buffer is completely zeroed and we're allowed to
-                 * keep the target sparse. */
                 if (s->compressed) {
-                    if (s->has_zero_init && s->min_sparse &&
-                        buffer_is_zero(buf, n * BDRV_SECTOR_SIZE))
-                    {
-                        assert(!s->target_has_backing);
-                        break;
-                    }
-                    
-                    ret = blk_write_compressed(s->target, sector_num, buf, n);
+                    ret = convert_write_compressed(s, sector_num, n, buf);
                     if (ret < 0) {
                         return ret;
                     }
@@ -795,8 +822,8 @@ fail:
         }
     }
     
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /* Allocate buffer for copied data. For compressed images, the buffer
+     * holds whole clusters only. */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             //error_report("invalid cluster size");
@@ -804,7 +831,7 @@ fail:
             convertError = [NSError errorWithDomain:@"Conversion error" code:ret userInfo:nil];
             goto fail;
         }
-        s->buf_sectors = s->cluster_sectors;
+        s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors, s->cluster_sectors);
     }
     state.buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
@@ -883,6 +910,7 @@ fail:
     bool quiet = false;
     Error *local_err = NULL;
 
+    compress = self.compressDisks;
     out_fmt = "qcow2";
     cache = "unsafe";
     src_cache = BDRV_DEFAULT_CACHE;